@@ -191,3 +191,33 @@ bool BlockDevice::is_valid_io(uint64_t off, uint64_t len) const {
   }
   return ret;
 }
+
+void BlockDevice::dump_io_latency(ceph::Formatter *f) const
+{
+  f->open_object_section("histograms");
+  io_latency.dump(f);
+  f->close_section();
+  io_latency.dump_outliers(f);
+}
+
+unsigned BlockDevice::check_io_latency_outliers(std::string *summary)
+{
+  BlockDeviceLatency::detector_conf_t conf;
+  conf.ratio = cct->_conf.get_val<double>("bdev_latency_outlier_ratio");
+  conf.min_ios = cct->_conf.get_val<uint64_t>("bdev_latency_outlier_min_ios");
+  conf.min_latency_us =
+    cct->_conf.get_val<double>("bdev_latency_outlier_min_latency") * 1000000.0;
+  conf.window = ceph::make_timespan(
+    cct->_conf.get_val<double>("bdev_latency_outlier_window"));
+  conf.warmup_windows =
+    cct->_conf.get_val<uint64_t>("bdev_latency_outlier_warmup_windows");
+  std::string s;
+  unsigned n = io_latency.check_outliers(ceph::mono_clock::now(), conf, &s);
+  if (n) {
+    dout(1) << __func__ << " " << s << dendl;
+  }
+  if (summary) {
+    *summary = std::move(s);
+  }
+  return n;
+}
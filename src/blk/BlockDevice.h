@@ -37,6 +37,7 @@
 #include "include/ceph_assert.h"
 #include "include/buffer.h"
 #include "include/interval_set.h"
+#include "BlockDeviceLatency.h"
 #define SPDK_PREFIX "spdk:"
 
 #if defined(__linux__)
@@ -188,6 +189,8 @@ protected:
   uint64_t conventional_region_size = 0;
   uint64_t zone_size = 0;
 
+  BlockDeviceLatency io_latency;
+
 public:
   aio_callback_t aio_callback;
   void *aio_callback_priv;
@@ -286,13 +289,32 @@ public:
   virtual int flush() = 0;
   virtual bool try_discard(interval_set<uint64_t> &to_release, bool async=true) { return false; }
   virtual void discard_drain() { return; }
+  /// bytes freed by the caller but still waiting for their discard
+  virtual uint64_t get_discard_queued_bytes() { return 0; }
+  /// hand queued but not yet issued discards straight back through the
+  /// discard callback, skipping the discard; returns the bytes released
+  virtual uint64_t release_queued_discards() { return 0; }
+  virtual void dump_discard_stats(ceph::Formatter *f) {}
 
   // for managing buffered readers/writers
   virtual int invalidate_cache(uint64_t off, uint64_t len) = 0;
   virtual int open(const std::string& path) = 0;
   virtual void close() = 0;
 
+  /// account a completed io; implementations call this for every io
+  void note_io_latency(BlockDeviceLatency::op_t op, uint64_t len,
+		       ceph::timespan lat) {
+    io_latency.record(op, len, lat);
+  }
+  void dump_io_latency(ceph::Formatter *f) const;
+  /// run the tail latency detector (see bdev_latency_outlier_*); returns
+  /// the number of op/size classes flagged and describes them in *summary
+  unsigned check_io_latency_outliers(std::string *summary);
+  /// where the device's threads run and its io buffers live, if tracked
+  virtual void dump_numa_stats(ceph::Formatter *f) const {}
+
   struct hugepaged_raw_marker_t {};
+  struct numa_raw_marker_t {};
 
 protected:
   bool is_valid_io(uint64_t off, uint64_t len) const;
@@ -0,0 +1,198 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "BlockDeviceLatency.h"
+
+#include <sstream>
+
+#include "include/intarith.h"
+
+const char *BlockDeviceLatency::get_op_name(op_t op)
+{
+  switch (op) {
+  case OP_READ: return "read";
+  case OP_WRITE: return "write";
+  case OP_FLUSH: return "flush";
+  case OP_DISCARD: return "discard";
+  default: return "???";
+  }
+}
+
+const char *BlockDeviceLatency::get_size_class_name(unsigned sc)
+{
+  static const char *names[SIZE_CLASSES] = {
+    "4K", "16K", "64K", "256K", "1M", "large"
+  };
+  return sc < SIZE_CLASSES ? names[sc] : "???";
+}
+
+unsigned BlockDeviceLatency::get_size_class(uint64_t len)
+{
+  if (len <= 4096) {
+    return 0;
+  }
+  // each class is 4x the previous one
+  return std::min<unsigned>(SIZE_CLASSES - 1, (cbits(len - 1) - 11) / 2);
+}
+
+unsigned BlockDeviceLatency::get_bucket(ceph::timespan lat)
+{
+  uint64_t us =
+    std::chrono::duration_cast<std::chrono::microseconds>(lat).count();
+  return std::min<unsigned>(BUCKETS - 1, cbits(us));
+}
+
+double BlockDeviceLatency::get_quantile(
+  const std::array<uint64_t, BUCKETS>& h, double q)
+{
+  uint64_t total = 0;
+  for (auto c : h) {
+    total += c;
+  }
+  if (total == 0) {
+    return 0;
+  }
+  double rank = q * total;
+  uint64_t cum = 0;
+  for (unsigned i = 0; i < BUCKETS; ++i) {
+    if (h[i] == 0) {
+      continue;
+    }
+    if (cum + h[i] >= rank) {
+      // interpolate within the bucket
+      double lo = i == 0 ? 0 : (1ull << (i - 1));
+      double hi = 1ull << i;
+      return lo + (hi - lo) * (rank - cum) / h[i];
+    }
+    cum += h[i];
+  }
+  return 1ull << (BUCKETS - 1);
+}
+
+void BlockDeviceLatency::_snapshot(op_t op, unsigned sc,
+				   std::array<uint64_t, BUCKETS> *h) const
+{
+  for (unsigned b = 0; b < BUCKETS; ++b) {
+    (*h)[b] = hist[op][sc][b].load(std::memory_order_relaxed);
+  }
+}
+
+void BlockDeviceLatency::dump(ceph::Formatter *f) const
+{
+  f->open_array_section("bucket_upper_bound_us");
+  for (unsigned b = 0; b < BUCKETS - 1; ++b) {
+    f->dump_unsigned("us", 1ull << b);
+  }
+  f->close_section();
+  for (unsigned op = 0; op < OP_MAX; ++op) {
+    f->open_object_section(get_op_name(op_t(op)));
+    for (unsigned sc = 0; sc < SIZE_CLASSES; ++sc) {
+      std::array<uint64_t, BUCKETS> h;
+      _snapshot(op_t(op), sc, &h);
+      uint64_t count = 0;
+      for (auto c : h) {
+	count += c;
+      }
+      if (!count) {
+	continue;
+      }
+      f->open_object_section(get_size_class_name(sc));
+      f->dump_unsigned("count", count);
+      f->dump_float("avg_us",
+		    sum_ns[op][sc].load(std::memory_order_relaxed) / 1000.0 /
+		    count);
+      f->dump_float("p50_us", get_quantile(h, 0.5));
+      f->dump_float("p99_us", get_quantile(h, 0.99));
+      f->dump_float("p999_us", get_quantile(h, 0.999));
+      f->open_array_section("histogram");
+      for (auto c : h) {
+	f->dump_unsigned("count", c);
+      }
+      f->close_section();
+      f->close_section();
+    }
+    f->close_section();
+  }
+}
+
+unsigned BlockDeviceLatency::check_outliers(ceph::mono_time now,
+					    const detector_conf_t& conf,
+					    std::string *summary)
+{
+  std::lock_guard l(detector_lock);
+  std::ostringstream ss;
+  unsigned flagged = 0;
+  for (unsigned op = 0; op < OP_MAX; ++op) {
+    for (unsigned sc = 0; sc < SIZE_CLASSES; ++sc) {
+      auto& w = windows[op][sc];
+      if (w.start == ceph::mono_time()) {
+	w.start = now;
+	_snapshot(op_t(op), sc, &w.last);
+      }
+      std::array<uint64_t, BUCKETS> cur, delta;
+      _snapshot(op_t(op), sc, &cur);
+      uint64_t ios = 0;
+      for (unsigned b = 0; b < BUCKETS; ++b) {
+	delta[b] = cur[b] - w.last[b];
+	ios += delta[b];
+      }
+      // a window closes once it is both old and big enough; until then
+      // the previous verdict stands
+      if (conf.ratio > 0 && now - w.start >= conf.window &&
+	  ios >= std::max<uint64_t>(conf.min_ios, 1)) {
+	double p999 = get_quantile(delta, 0.999);
+	w.last_p999_us = p999;
+	w.last_ios = ios;
+	w.outlier = w.windows >= conf.warmup_windows &&
+	  p999 > conf.min_latency_us &&
+	  p999 > w.baseline_us * conf.ratio;
+	if (!w.outlier) {
+	  // running mean over the first windows, then a slow moving average
+	  double alpha = 1.0 / std::min(w.windows + 1, 16u);
+	  w.baseline_us = w.baseline_us * (1.0 - alpha) + p999 * alpha;
+	  ++w.windows;
+	}
+	w.start = now;
+	w.last = cur;
+      } else if (conf.ratio <= 0) {
+	w.outlier = false;
+      }
+      if (w.outlier) {
+	if (flagged++) {
+	  ss << ", ";
+	}
+	ss << get_op_name(op_t(op)) << "/" << get_size_class_name(sc)
+	   << " p99.9 " << (uint64_t)w.last_p999_us << "us vs baseline "
+	   << (uint64_t)w.baseline_us << "us";
+      }
+    }
+  }
+  if (summary) {
+    *summary = ss.str();
+  }
+  return flagged;
+}
+
+void BlockDeviceLatency::dump_outliers(ceph::Formatter *f) const
+{
+  std::lock_guard l(detector_lock);
+  f->open_array_section("tail_latency");
+  for (unsigned op = 0; op < OP_MAX; ++op) {
+    for (unsigned sc = 0; sc < SIZE_CLASSES; ++sc) {
+      auto& w = windows[op][sc];
+      if (!w.windows && !w.outlier) {
+	continue;
+      }
+      f->open_object_section("class");
+      f->dump_string("op", get_op_name(op_t(op)));
+      f->dump_string("size", get_size_class_name(sc));
+      f->dump_float("baseline_p999_us", w.baseline_us);
+      f->dump_unsigned("baseline_windows", w.windows);
+      f->dump_float("last_p999_us", w.last_p999_us);
+      f->dump_unsigned("last_ios", w.last_ios);
+      f->dump_bool("outlier", w.outlier);
+      f->close_section();
+    }
+  }
+  f->close_section();
+}
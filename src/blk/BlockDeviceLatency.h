@@ -0,0 +1,97 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_BLK_BLOCKDEVICELATENCY_H
+#define CEPH_BLK_BLOCKDEVICELATENCY_H
+
+#include <array>
+#include <atomic>
+#include <string>
+
+#include "common/ceph_mutex.h"
+#include "common/ceph_time.h"
+#include "common/Formatter.h"
+
+/**
+ * BlockDeviceLatency
+ *
+ * Completion latency histograms of a single device, per op type and io size
+ * class, with power of two microsecond buckets.  Recording is a couple of
+ * relaxed atomic increments so it can sit on every io completion path.
+ * Only io that went to the device is recorded, not buffered io the page
+ * cache may have served.
+ *
+ * The outlier detector keeps, for each (op, size class), a baseline of the
+ * device's own p99.9 latency built from past windows, and flags a window
+ * whose p99.9 has drifted more than a given ratio above it.  Flagged windows
+ * are not folded into the baseline, so a slowly dying disk does not simply
+ * become the new normal.
+ */
+class BlockDeviceLatency {
+public:
+  enum op_t {
+    OP_READ,
+    OP_WRITE,
+    OP_FLUSH,
+    OP_DISCARD,
+    OP_MAX
+  };
+  /// <=4K, <=16K, <=64K, <=256K, <=1M, >1M
+  static constexpr unsigned SIZE_CLASSES = 6;
+  /// bucket 0 is <1us, bucket i covers [2^(i-1), 2^i) us, the last one is
+  /// open ended (>=16s)
+  static constexpr unsigned BUCKETS = 26;
+
+  struct detector_conf_t {
+    double ratio = 0;           ///< flag p99.9 above ratio * baseline; 0 = off
+    uint64_t min_ios = 0;       ///< ios needed before a window is judged
+    double min_latency_us = 0;  ///< never flag a p99.9 below this
+    ceph::timespan window = ceph::make_timespan(60);
+    unsigned warmup_windows = 4; ///< windows needed to trust the baseline
+  };
+
+  static const char *get_op_name(op_t op);
+  static const char *get_size_class_name(unsigned sc);
+  static unsigned get_size_class(uint64_t len);
+  static unsigned get_bucket(ceph::timespan lat);
+  /// q-quantile, in us, of a bucket histogram; 0 if it is empty
+  static double get_quantile(const std::array<uint64_t, BUCKETS>& h,
+			     double q);
+
+  void record(op_t op, uint64_t len, ceph::timespan lat) {
+    unsigned sc = get_size_class(len);
+    hist[op][sc][get_bucket(lat)].fetch_add(1, std::memory_order_relaxed);
+    sum_ns[op][sc].fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(lat).count(),
+      std::memory_order_relaxed);
+  }
+
+  void dump(ceph::Formatter *f) const;
+
+  /// judge every (op, size class) whose window is complete; returns the
+  /// number of them currently flagged and describes them in *summary
+  unsigned check_outliers(ceph::mono_time now, const detector_conf_t& conf,
+			  std::string *summary);
+  void dump_outliers(ceph::Formatter *f) const;
+
+private:
+  std::atomic<uint64_t> hist[OP_MAX][SIZE_CLASSES][BUCKETS] = {};
+  std::atomic<uint64_t> sum_ns[OP_MAX][SIZE_CLASSES] = {};
+
+  struct window_t {
+    std::array<uint64_t, BUCKETS> last = {}; ///< counts at window start
+    ceph::mono_time start;
+    double baseline_us = 0;
+    unsigned windows = 0;        ///< windows folded into the baseline
+    double last_p999_us = 0;
+    uint64_t last_ios = 0;
+    bool outlier = false;
+  };
+  mutable ceph::mutex detector_lock =
+    ceph::make_mutex("BlockDeviceLatency::detector_lock");
+  window_t windows[OP_MAX][SIZE_CLASSES];
+
+  void _snapshot(op_t op, unsigned sc, std::array<uint64_t, BUCKETS> *h) const;
+};
+
+#endif
@@ -15,6 +15,7 @@
 #include <boost/intrusive/list.hpp>
 #include <boost/container/small_vector.hpp>
 
+#include "common/ceph_time.h"
 #include "include/buffer.h"
 #include "include/types.h"
 
@@ -34,6 +35,9 @@ struct aio_t {
   boost::container::small_vector<iovec,4> iov;
   uint64_t offset, length;
   long rval;
+  int buf_index = -1;     ///< registered (fixed) buffer backing iov[0], if any
+  bool is_write = false;
+  ceph::mono_time start;  ///< submission time, for latency accounting
   ceph::buffer::list bl;  ///< write payload (so that it remains stable for duration)
 
   boost::intrusive::list_member_hook<> queue_item;
@@ -44,6 +48,7 @@ struct aio_t {
   void pwritev(uint64_t _offset, uint64_t len) {
     offset = _offset;
     length = len;
+    is_write = true;
 #if defined(HAVE_LIBAIO)
     io_prep_pwritev(&iocb, fd, &iov[0], iov.size(), offset);
 #elif defined(HAVE_POSIXAIO)
@@ -103,6 +108,17 @@ struct io_queue_t {
   virtual int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size,
 			   void *priv, int *retries) = 0;
   virtual int get_next_completed(int timeout_ms, aio_t **paio, int max) = 0;
+
+  /// get a buffer registered with the queue, if it keeps any; *index is
+  /// to be stored in aio_t::buf_index of the io that uses it
+  virtual ceph::unique_leakable_ptr<ceph::buffer::raw> get_fixed_buffer(
+    size_t len, int *index) {
+    return nullptr;
+  }
+  /// index of the registered buffer holding [p, p+len), or -1
+  virtual int find_fixed_buffer(const void *p, size_t len) const {
+    return -1;
+  }
 };
 
 struct aio_queue_t final : public io_queue_t {
@@ -0,0 +1,95 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "DiscardThrottle.h"
+
+#include <algorithm>
+
+#include "include/intarith.h"
+
+ceph::timespan DiscardThrottle::hold_back(const conf_t& conf,
+					  ceph::mono_time now,
+					  ceph::mono_time batch_start,
+					  bool fg_busy)
+{
+  if (now < batch_start + conf.batch_delay) {
+    return batch_start + conf.batch_delay - now;
+  }
+
+  if (!fg_busy) {
+    paused_since.reset();
+  } else if (!paused_since) {
+    paused_since = now;
+  }
+  if (paused_since) {
+    if (conf.max_pause == ceph::timespan::zero() ||
+	now - *paused_since < conf.max_pause) {
+      ++latency_pauses;
+      return std::chrono::milliseconds(10);
+    }
+    // held back long enough: let a round through, then pause again
+    ++forced_rounds;
+    paused_since = now;
+  }
+
+  double elapsed =
+    std::chrono::duration<double>(now - tokens_stamp).count();
+  tokens_stamp = now;
+  // never bank more than a second worth of budget
+  byte_tokens = conf.max_bytes_per_sec ?
+    std::min<double>(conf.max_bytes_per_sec,
+		     byte_tokens + elapsed * conf.max_bytes_per_sec) : 0;
+  op_tokens = conf.max_ops_per_sec ?
+    std::min<double>(conf.max_ops_per_sec,
+		     op_tokens + elapsed * conf.max_ops_per_sec) : 0;
+  double wait = 0;
+  if (conf.max_bytes_per_sec && byte_tokens < conf.block_size) {
+    wait = (conf.block_size - byte_tokens) / conf.max_bytes_per_sec;
+  }
+  if (conf.max_ops_per_sec && op_tokens < 1) {
+    wait = std::max(wait, (1 - op_tokens) / conf.max_ops_per_sec);
+  }
+  if (wait > 0) {
+    ++throttled;
+    return ceph::make_timespan(wait);
+  }
+  return ceph::timespan::zero();
+}
+
+void DiscardThrottle::take(const conf_t& conf,
+			   interval_set<uint64_t>* queued,
+			   interval_set<uint64_t>* out)
+{
+  if (!conf.max_bytes_per_sec && !conf.max_ops_per_sec) {
+    out->swap(*queued);
+    return;
+  }
+  while (!queued->empty()) {
+    if (conf.max_ops_per_sec && op_tokens < 1) {
+      break;
+    }
+    if (conf.max_bytes_per_sec && byte_tokens < conf.block_size) {
+      break;
+    }
+    auto p = queued->begin();
+    uint64_t off = p.get_start();
+    uint64_t len = p.get_len();
+    if (conf.max_bytes_per_sec) {
+      len = std::min<uint64_t>(
+	len, p2align<uint64_t>((uint64_t)byte_tokens, conf.block_size));
+      byte_tokens -= len;
+    }
+    if (conf.max_ops_per_sec) {
+      op_tokens -= 1;
+    }
+    queued->erase(off, len);
+    out->insert(off, len);
+  }
+}
+
+void DiscardThrottle::dump(ceph::Formatter* f) const
+{
+  f->dump_unsigned("throttled", throttled);
+  f->dump_unsigned("latency_pauses", latency_pauses);
+  f->dump_unsigned("forced_rounds", forced_rounds);
+}
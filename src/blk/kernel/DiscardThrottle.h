@@ -0,0 +1,61 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include <optional>
+
+#include "common/ceph_time.h"
+#include "common/Formatter.h"
+#include "include/interval_set.h"
+
+/**
+ * DiscardThrottle
+ *
+ * Paces KernelDevice's async discards.  Queued discards wait out a
+ * batching window so that adjacent frees coalesce into fewer, larger
+ * discards; token buckets cap discard bandwidth and iops; and a rise in
+ * foreground latency holds them back until it settles, but never for
+ * longer than max_pause at a time, so that discards still trickle out
+ * under sustained load.
+ *
+ * Not thread safe; KernelDevice calls it under discard_lock.  Time is
+ * passed in rather than read, which lets tests drive it.
+ */
+class DiscardThrottle {
+public:
+  struct conf_t {
+    uint64_t block_size = 4096;       ///< the smallest discard
+    ceph::timespan batch_delay = ceph::timespan::zero();
+    ceph::timespan max_pause = ceph::timespan::zero();  ///< 0: unbounded
+    uint64_t max_bytes_per_sec = 0;  ///< 0: unlimited
+    uint64_t max_ops_per_sec = 0;    ///< 0: unlimited
+  };
+
+  /**
+   * how long the queued discards should wait before the next round
+   *
+   * @param batch_start when the queue became non-empty
+   * @param fg_busy foreground latency is above bdev_discard_pause_latency
+   */
+  ceph::timespan hold_back(const conf_t& conf, ceph::mono_time now,
+			   ceph::mono_time batch_start, bool fg_busy);
+
+  /// move the next round from *queued to *out, as much as the token
+  /// buckets allow; extents larger than the byte budget are split
+  void take(const conf_t& conf, interval_set<uint64_t>* queued,
+	    interval_set<uint64_t>* out);
+
+  void dump(ceph::Formatter* f) const;
+
+  uint64_t throttled = 0;        ///< rounds held back by the rate caps
+  uint64_t latency_pauses = 0;   ///< rounds held back by foreground latency
+  uint64_t forced_rounds = 0;    ///< rounds let through after max_pause
+
+private:
+  double byte_tokens = 0;
+  double op_tokens = 0;
+  ceph::mono_time tokens_stamp;
+  /// when foreground latency started holding discards back, if it does
+  std::optional<ceph::mono_time> paused_since;
+};
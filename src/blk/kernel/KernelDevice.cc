@@ -20,6 +20,10 @@
 #include <fcntl.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 
 #include <boost/container/flat_map.hpp>
 #include <boost/lockfree/queue.hpp>
@@ -78,7 +82,15 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv, ai
   if (use_ioring && ioring_queue_t::supported()) {
     bool use_ioring_hipri = cct->_conf.get_val<bool>("bdev_ioring_hipri");
     bool use_ioring_sqthread_poll = cct->_conf.get_val<bool>("bdev_ioring_sqthread_poll");
-    io_queue = std::make_unique<ioring_queue_t>(iodepth, use_ioring_hipri, use_ioring_sqthread_poll);
+    auto q = std::make_unique<ioring_queue_t>(iodepth, use_ioring_hipri, use_ioring_sqthread_poll);
+    q->sq_thread_idle_ms = cct->_conf.get_val<uint64_t>("bdev_ioring_sqthread_idle_ms");
+    q->sq_thread_cpu = cct->_conf.get_val<int64_t>("bdev_ioring_sqthread_cpu");
+    q->fixed_buffers = cct->_conf.get_val<uint64_t>("bdev_ioring_fixed_buffers");
+    q->fixed_buffer_size = cct->_conf.get_val<Option::size_t>("bdev_ioring_fixed_buffer_size");
+    io_queue = std::move(q);
+#if defined(HAVE_LIBAIO)
+    queue_sync_io = cct->_conf.get_val<bool>("bdev_ioring_sync_io");
+#endif
   } else {
     static bool once;
     if (use_ioring && !once) {
@@ -281,6 +293,8 @@ int KernelDevice::open(const string& p)
     goto out_fail;
   }
 
+  _numa_setup();
+
   r = _aio_start();
   if (r < 0) {
     goto out_fail;
@@ -340,6 +354,8 @@ void KernelDevice::close()
     _discard_stop();
   }
   _pre_close();
+  // buffers still referenced elsewhere keep their pool
+  numa_buffers.reset();
 
   extblkdev::release_device(ebd_impl);
 
@@ -497,6 +513,7 @@ int KernelDevice::flush()
   int r = ::fdatasync(fd_directs[WRITE_LIFE_NOT_SET]);
   utime_t end = ceph_clock_now();
   utime_t dur = end - start;
+  note_io_latency(BlockDeviceLatency::OP_FLUSH, 0, make_timespan(dur));
   if (r < 0) {
     r = -errno;
     derr << __func__ << " fdatasync got: " << cpp_strerror(r) << dendl;
@@ -506,6 +523,225 @@ int KernelDevice::flush()
   return r;
 }
 
+/**
+ * Read buffers on the NUMA node of a device, see bdev_numa_affinity.
+ *
+ * A single mapping is bound to the node when the pool is created and
+ * faulted in right away, so every buffer sits on the node before its first
+ * io and the policy stays out of memory that malloc hands out for other
+ * uses.  Like ExplicitHugePagePool's, buffers are recycled rather than
+ * freed; they keep the pool alive, as a cache may hold them past close().
+ */
+class NumaBufferPool : public std::enable_shared_from_this<NumaBufferPool> {
+  using slot_queue_t = boost::lockfree::queue<char*>;
+  using instrumented_raw = ceph::buffer_instrumentation::instrumented_raw<
+    BlockDevice::numa_raw_marker_t>;
+
+  struct numa_buffer_raw : public instrumented_raw {
+    std::shared_ptr<NumaBufferPool> pool;
+
+    numa_buffer_raw(char* slot, unsigned len,
+		    std::shared_ptr<NumaBufferPool> pool)
+      : instrumented_raw(slot, len), pool(std::move(pool)) {}
+    ~numa_buffer_raw() override {
+      pool->slot_q.push(data);
+    }
+  };
+
+public:
+  NumaBufferPool(char* region, size_t region_len, size_t buffer_size,
+		 size_t buffers)
+    : region(region), region_len(region_len), buffer_size(buffer_size),
+      buffers(buffers), slot_q(buffers) {}
+  ~NumaBufferPool() {
+    ::munmap(region, region_len);
+  }
+
+  static int create(int node, size_t buffer_size, size_t buffers,
+		    size_t alignment, std::shared_ptr<NumaBufferPool>* pool) {
+#if defined(__linux__) && defined(SYS_mbind)
+    alignment = std::max<size_t>(alignment, CEPH_PAGE_SIZE);
+    const size_t stride = p2roundup(buffer_size, alignment);
+    const size_t region_len = stride * buffers + alignment - CEPH_PAGE_SIZE;
+    void* region = ::mmap(nullptr, region_len, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+      return -errno;
+    }
+    constexpr unsigned bits = 8 * sizeof(unsigned long);
+    unsigned long mask[KernelDevice::NUMA_NODES_MAX / bits] = {};
+    mask[node / bits] = 1ul << (node % bits);
+    // preferred, so a full node falls back rather than failing the fault
+    if (syscall(SYS_mbind, region, region_len, MPOL_PREFERRED, mask,
+		KernelDevice::NUMA_NODES_MAX + 1, MPOL_MF_MOVE) < 0) {
+      int r = -errno;
+      ::munmap(region, region_len);
+      return r;
+    }
+    // fault the pages in now, under the policy
+    ::memset(region, 0, region_len);
+    *pool = std::make_shared<NumaBufferPool>(
+      static_cast<char*>(region), region_len, buffer_size, buffers);
+    char* slot = reinterpret_cast<char*>(
+      p2roundup<uintptr_t>((uintptr_t)region, alignment));
+    for (size_t i = 0; i < buffers; ++i, slot += stride) {
+      (*pool)->slot_q.push(slot);
+    }
+    return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
+  }
+
+  ceph::unique_leakable_ptr<buffer::raw> try_create(const size_t len) {
+    if (len > buffer_size) {
+      return nullptr;
+    }
+    if (char* slot; slot_q.pop(slot)) {
+      return ceph::unique_leakable_ptr<buffer::raw> {
+	new numa_buffer_raw(slot, len, shared_from_this())
+      };
+    }
+    return nullptr;
+  }
+
+  size_t get_buffer_size() const {
+    return buffer_size;
+  }
+  size_t get_buffers() const {
+    return buffers;
+  }
+
+private:
+  char* const region;
+  const size_t region_len;
+  const size_t buffer_size;
+  const size_t buffers;
+  slot_queue_t slot_q;
+};
+
+void KernelDevice::_numa_setup()
+{
+  device_numa_node = -1;
+  numa_node = -1;
+  int node = -1;
+  if (BlkDev{fd_buffereds[WRITE_LIFE_NOT_SET]}.get_numa_node(&node) == 0) {
+    device_numa_node = node;
+  }
+  if (!cct->_conf.get_val<bool>("bdev_numa_affinity")) {
+    return;
+  }
+  node = cct->_conf.get_val<int64_t>("bdev_numa_node");
+  if (node < 0) {
+    node = device_numa_node;
+  }
+  if (node < 0 || node >= (int)NUMA_NODES_MAX) {
+    dout(1) << __func__ << " numa node of " << path << " unknown, not placing"
+	    << dendl;
+    return;
+  }
+  int r = get_numa_node_cpu_set(node, &numa_cpu_set_size, &numa_cpu_set);
+  if (r < 0) {
+    derr << __func__ << " unable to get cpus of numa node " << node << ": "
+	 << cpp_strerror(r) << dendl;
+    return;
+  }
+  numa_node = node;
+  dout(1) << __func__ << " placing threads and buffers on numa node "
+	  << numa_node << " (cpus "
+	  << cpu_set_to_str_list(numa_cpu_set_size, &numa_cpu_set) << ")"
+	  << dendl;
+  if (auto buffers = cct->_conf.get_val<uint64_t>("bdev_numa_read_buffers");
+      buffers > 0) {
+    auto buffer_size = std::max<uint64_t>(
+      CEPH_PAGE_SIZE,
+      cct->_conf.get_val<Option::size_t>("bdev_numa_read_buffer_size"));
+    r = NumaBufferPool::create(numa_node, buffer_size, buffers,
+			       cct->_conf->bdev_read_buffer_alignment,
+			       &numa_buffers);
+    if (r < 0) {
+      derr << __func__ << " unable to set up read buffers on numa node "
+	   << numa_node << ": " << cpp_strerror(r) << dendl;
+    }
+  }
+  // let the io_uring polling thread follow, unless it was pinned explicitly
+  if (auto ioring = dynamic_cast<ioring_queue_t*>(io_queue.get());
+      ioring && ioring->sq_thread && ioring->sq_thread_cpu < 0) {
+    auto cpus = cpu_set_to_set(numa_cpu_set_size, &numa_cpu_set);
+    if (!cpus.empty()) {
+      ioring->sq_thread_cpu = *cpus.begin();
+    }
+  }
+}
+
+void KernelDevice::_numa_pin_thread()
+{
+  if (numa_node < 0) {
+    return;
+  }
+  if (sched_setaffinity(0, numa_cpu_set_size, &numa_cpu_set) < 0) {
+    int r = -errno;
+    derr << __func__ << " failed to pin to numa node " << numa_node << ": "
+	 << cpp_strerror(r) << dendl;
+  }
+}
+
+void KernelDevice::_numa_note_completions(aio_t **aio, int n)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 &&
+      node < NUMA_NODES_MAX) {
+    numa_stats.completions[node] += n;
+  }
+#endif
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+  // look up where a read buffer page actually landed, now and then
+  for (int i = 0; i < n; ++i) {
+    if (aio[i]->is_write || aio[i]->iov.empty() ||
+	numa_stats.read_samples++ % 64) {
+      continue;
+    }
+    int page_node = -1;
+    if (syscall(SYS_get_mempolicy, &page_node, nullptr, 0,
+		aio[i]->iov[0].iov_base, MPOL_F_NODE | MPOL_F_ADDR) == 0 &&
+	page_node >= 0 && page_node < (int)NUMA_NODES_MAX) {
+      ++numa_stats.read_pages[page_node];
+    }
+  }
+#endif
+}
+
+void KernelDevice::dump_numa_stats(ceph::Formatter *f) const
+{
+  f->dump_int("device_numa_node", device_numa_node);
+  f->dump_int("numa_node", numa_node);
+  if (numa_node >= 0) {
+    f->dump_string("cpus",
+		   cpu_set_to_str_list(numa_cpu_set_size, &numa_cpu_set));
+  }
+  if (numa_buffers) {
+    f->dump_unsigned("read_buffers", numa_buffers->get_buffers());
+    f->dump_unsigned("read_buffer_size", numa_buffers->get_buffer_size());
+  }
+  f->dump_unsigned("pool_reads", numa_stats.pool_reads);
+  f->dump_unsigned("pool_misses", numa_stats.pool_misses);
+  f->open_array_section("nodes");
+  for (unsigned i = 0; i < NUMA_NODES_MAX; ++i) {
+    uint64_t c = numa_stats.completions[i];
+    uint64_t p = numa_stats.read_pages[i];
+    if (!c && !p) {
+      continue;
+    }
+    f->open_object_section("node");
+    f->dump_unsigned("node", i);
+    f->dump_unsigned("completions", c);
+    f->dump_unsigned("sampled_read_pages", p);
+    f->close_section();
+  }
+  f->close_section();
+}
+
 int KernelDevice::_aio_start()
 {
   if (aio) {
@@ -520,6 +756,18 @@ int KernelDevice::_aio_start()
       }
       return r;
     }
+    if (auto ioring = dynamic_cast<ioring_queue_t*>(io_queue.get()); ioring) {
+      dout(1) << __func__ << " io_uring with "
+	      << ioring->get_num_fixed_buffers() << "/"
+	      << ioring->fixed_buffers << " registered buffers of 0x"
+	      << std::hex << ioring->fixed_buffer_size << std::dec
+	      << (ioring->sq_thread ? ", sq polling" : "")
+	      << (queue_sync_io ? ", sync io queued" : "") << dendl;
+      if (ioring->get_num_fixed_buffers() < ioring->fixed_buffers) {
+	derr << __func__ << " failed to register io_uring buffers;"
+	     << " try raising RLIMIT_MEMLOCK or vm.nr_hugepages" << dendl;
+      }
+    }
     aio_thread.create("bstore_aio");
   }
   return 0;
@@ -591,9 +839,12 @@ void KernelDevice::discard_drain()
 {
   dout(10) << __func__ << dendl;
   std::unique_lock l(discard_lock);
+  ++discard_draining;
+  discard_cond.notify_all();
   while (!discard_queued.empty() || discard_running) {
     discard_cond.wait(l);
   }
+  --discard_draining;
 }
 
 static bool is_expected_ioerr(const int r)
@@ -613,6 +864,7 @@ static bool is_expected_ioerr(const int r)
 void KernelDevice::_aio_thread()
 {
   dout(10) << __func__ << " start" << dendl;
+  _numa_pin_thread();
   int inject_crash_count = 0;
   while (!aio_stop) {
     dout(40) << __func__ << " polling" << dendl;
@@ -626,9 +878,23 @@ void KernelDevice::_aio_thread()
     }
     if (r > 0) {
       dout(30) << __func__ << " got " << r << " completed aios" << dendl;
+      if (numa_node >= 0) {
+	_numa_note_completions(aio, r);
+      }
+      auto now = mono_clock::now();
+      fg_latency_stamp.store(now, std::memory_order_relaxed);
       for (int i = 0; i < r; ++i) {
 	IOContext *ioc = static_cast<IOContext*>(aio[i]->priv);
 	_aio_log_finish(ioc, aio[i]->offset, aio[i]->length);
+	note_io_latency(aio[i]->is_write ? BlockDeviceLatency::OP_WRITE :
+			BlockDeviceLatency::OP_READ,
+			aio[i]->length, now - aio[i]->start);
+	// only this thread updates the average, see bdev_discard_pause_latency
+	uint64_t lat_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	  now - aio[i]->start).count();
+	uint64_t avg = fg_latency_avg_ns.load(std::memory_order_relaxed);
+	fg_latency_avg_ns.store(avg - avg / 16 + lat_ns / 16,
+				std::memory_order_relaxed);
 	if (aio[i]->queue_item.is_linked()) {
 	  std::lock_guard l(debug_queue_lock);
 	  debug_aio_unlink(*aio[i]);
@@ -734,6 +1000,7 @@ void KernelDevice::_aio_thread()
 void KernelDevice::_discard_thread(uint64_t tid)
 {
   dout(10) << __func__ << " thread " << tid << " start" << dendl;
+  _numa_pin_thread();
 
   // Thread-local list of processing discards
   interval_set<uint64_t> discard_processing;
@@ -754,30 +1021,80 @@ void KernelDevice::_discard_thread(uint64_t tid)
       discard_cond.notify_all(); // for the thread trying to drain...
       discard_cond.wait(l);
       dout(20) << __func__ << " wake" << dendl;
-    } else {
-      // Swap the queued discards for a local list we'll process here
-      // without caring about thread fairness.  This allows the current
-      // thread to wait on the discard running while other threads pick
-      // up the next-in-queue, and do the same, ultimately issuing more
-      // discards in parallel, which is the goal.
-      discard_processing.swap(discard_queued);
-      discard_running = true;
-      l.unlock();
-      dout(20) << __func__ << " finishing" << dendl;
-      for (auto p = discard_processing.begin(); p != discard_processing.end(); ++p) {
-        _discard(p.get_start(), p.get_len());
+      continue;
+    }
+    // nobody waits on a stopping or draining device
+    bool unthrottled = thr->stop || discard_draining;
+    auto conf = _discard_throttle_conf();
+    if (!unthrottled) {
+      auto now = mono_clock::now();
+      auto hold = discard_throttle.hold_back(conf, now, discard_batch_start,
+					     _foreground_busy(now));
+      if (hold > ceph::timespan::zero()) {
+	dout(20) << __func__ << " holding back " << hold << dendl;
+	discard_cond.wait_for(l, hold);
+	continue;
       }
-
-      discard_callback(discard_callback_priv, static_cast<void*>(&discard_processing));
-      discard_processing.clear();
-      l.lock();
-      discard_running = false;
     }
+    // Take the queued discards (or as much of them as the caps allow)
+    // into a local list we'll process here without caring about thread
+    // fairness.  This allows the current thread to wait on the discard
+    // running while other threads pick up the next-in-queue, and do the
+    // same, ultimately issuing more discards in parallel, which is the goal.
+    if (unthrottled) {
+      discard_processing.swap(discard_queued);
+    } else {
+      discard_throttle.take(conf, &discard_queued, &discard_processing);
+    }
+    ++discard_running;
+    discard_inflight_bytes += discard_processing.size();
+    l.unlock();
+    dout(20) << __func__ << " finishing 0x" << std::hex
+	     << discard_processing.size() << std::dec << " in "
+	     << discard_processing.num_intervals() << " extents" << dendl;
+    for (auto p = discard_processing.begin(); p != discard_processing.end(); ++p) {
+      _discard(p.get_start(), p.get_len());
+    }
+
+    discard_callback(discard_callback_priv, static_cast<void*>(&discard_processing));
+    l.lock();
+    discard_stats.issued_ops += discard_processing.num_intervals();
+    discard_stats.issued_bytes += discard_processing.size();
+    discard_inflight_bytes -= discard_processing.size();
+    discard_processing.clear();
+    --discard_running;
   }
 
   dout(10) << __func__ << " thread " << tid << " finish" << dendl;
 }
 
+DiscardThrottle::conf_t KernelDevice::_discard_throttle_conf() const
+{
+  DiscardThrottle::conf_t conf;
+  conf.block_size = block_size;
+  conf.batch_delay = make_timespan(
+    cct->_conf.get_val<double>("bdev_discard_batch_delay"));
+  conf.max_pause = make_timespan(
+    cct->_conf.get_val<double>("bdev_discard_max_pause"));
+  conf.max_bytes_per_sec =
+    cct->_conf.get_val<Option::size_t>("bdev_discard_max_bytes_per_sec");
+  conf.max_ops_per_sec =
+    cct->_conf.get_val<uint64_t>("bdev_discard_max_ops_per_sec");
+  return conf;
+}
+
+// Whether foreground latency is above bdev_discard_pause_latency.  A
+// stale average means the foreground went quiet, which is the best time
+// to discard.
+bool KernelDevice::_foreground_busy(ceph::mono_time now) const
+{
+  double pause = cct->_conf.get_val<double>("bdev_discard_pause_latency");
+  return pause > 0 &&
+    now - fg_latency_stamp.load(std::memory_order_relaxed) <
+      std::chrono::seconds(1) &&
+    fg_latency_avg_ns.load(std::memory_order_relaxed) > pause * 1e9;
+}
+
 // this is private and is expected that the caller checks that discard
 // threads are running via _discard_started()
 void KernelDevice::_queue_discard(interval_set<uint64_t> &to_release)
@@ -786,10 +1103,56 @@ void KernelDevice::_queue_discard(interval_set<uint64_t> &to_release)
     return;
 
   std::lock_guard l(discard_lock);
+  if (discard_queued.empty()) {
+    discard_batch_start = mono_clock::now();
+  }
   discard_queued.insert(to_release);
+  discard_stats.queued_extents += to_release.num_intervals();
   discard_cond.notify_one();
 }
 
+uint64_t KernelDevice::get_discard_queued_bytes()
+{
+  std::lock_guard l(discard_lock);
+  return discard_queued.size() + discard_inflight_bytes;
+}
+
+uint64_t KernelDevice::release_queued_discards()
+{
+  interval_set<uint64_t> to_release;
+  {
+    std::lock_guard l(discard_lock);
+    to_release.swap(discard_queued);
+    discard_stats.released_bytes += to_release.size();
+  }
+  if (to_release.empty()) {
+    return 0;
+  }
+  uint64_t released = to_release.size();
+  dout(10) << __func__ << " 0x" << std::hex << released << std::dec
+	   << " in " << to_release.num_intervals() << " extents" << dendl;
+  discard_callback(discard_callback_priv, static_cast<void*>(&to_release));
+  std::lock_guard l(discard_lock);
+  discard_cond.notify_all(); // for the thread trying to drain...
+  return released;
+}
+
+void KernelDevice::dump_discard_stats(ceph::Formatter *f)
+{
+  std::lock_guard l(discard_lock);
+  f->dump_unsigned("threads", discard_threads.size());
+  f->dump_unsigned("queued_bytes", discard_queued.size());
+  f->dump_unsigned("queued_extents", discard_queued.num_intervals());
+  f->dump_unsigned("inflight_bytes", discard_inflight_bytes);
+  f->dump_unsigned("total_queued_extents", discard_stats.queued_extents);
+  f->dump_unsigned("issued_ops", discard_stats.issued_ops);
+  f->dump_unsigned("issued_bytes", discard_stats.issued_bytes);
+  discard_throttle.dump(f);
+  f->dump_unsigned("released_bytes", discard_stats.released_bytes);
+  f->dump_float("foreground_latency_ms",
+		fg_latency_avg_ns.load(std::memory_order_relaxed) / 1000000.0);
+}
+
 // return true only if discard was queued, so caller won't have to do
 // alloc->release, otherwise return false
 bool KernelDevice::try_discard(interval_set<uint64_t> &to_release, bool async)
@@ -908,6 +1271,12 @@ void KernelDevice::aio_submit(IOContext *ioc)
     }
   }
 
+  // stamp before submitting; the aios may complete right away
+  auto now = mono_clock::now();
+  for (auto p = ioc->running_aios.begin(); p != e; ++p) {
+    p->start = now;
+  }
+
   void *priv = static_cast<void*>(ioc);
   int r, retries = 0;
   // num of pending aios should not overflow when passed to submit_batch()
@@ -935,9 +1304,13 @@ int KernelDevice::_sync_write(uint64_t off, bufferlist &bl, bool buffered, int w
     ++injecting_crash;
     return 0;
   }
+  if (_use_queued_sync_io(buffered, len)) {
+    return _queued_sync_io(true, off, bl, write_hint, false);
+  }
   vector<iovec> iov;
   bl.prepare_iov(&iov);
 
+  auto start = mono_clock::now();
   auto left = len;
   auto o = off;
   size_t idx = 0;
@@ -981,11 +1354,56 @@ int KernelDevice::_sync_write(uint64_t off, bufferlist &bl, bool buffered, int w
   }
 #endif
 
+  // only direct io says how the device is doing; buffered writes may not
+  // have reached it
+  if (!buffered) {
+    note_io_latency(BlockDeviceLatency::OP_WRITE, len,
+		    mono_clock::now() - start);
+  }
   io_since_flush.store(true);
 
   return 0;
 }
 
+int KernelDevice::_queued_sync_io(bool write, uint64_t off, bufferlist& bl,
+				  int write_hint, bool allow_eio,
+				  int buf_index)
+{
+  // Push a synchronous, direct io through the io queue and wait for it.
+  // With io_uring this gets the registered files and buffers, and with
+  // SQ polling there is no syscall on the submission side at all.
+  uint64_t len = bl.length();
+  IOContext ioc(cct, nullptr, allow_eio);
+  _aio_log_start(&ioc, off, len);
+  ioc.pending_aios.push_back(
+    aio_t(&ioc, write ? choose_fd(false, write_hint) :
+	  fd_directs[WRITE_LIFE_NOT_SET]));
+  ++ioc.num_pending;
+  auto& aio = ioc.pending_aios.back();
+  bl.prepare_iov(&aio.iov);
+  if (buf_index >= 0) {
+    aio.buf_index = buf_index;
+  } else if (aio.iov.size() == 1) {
+    aio.buf_index = io_queue->find_fixed_buffer(aio.iov[0].iov_base, len);
+  }
+  aio.bl.append(bl);
+  if (write) {
+    aio.pwritev(off, len);
+  } else {
+    aio.preadv(off, len);
+  }
+  dout(30) << aio << dendl;
+  aio_submit(&ioc);
+  ioc.aio_wait();
+  int r = ioc.get_return_value();
+  if (r < 0) {
+    derr << __func__ << (write ? " write" : " read") << " 0x" << std::hex
+	 << off << "~" << len << std::dec << " error: " << cpp_strerror(r)
+	 << dendl;
+  }
+  return r;
+}
+
 int KernelDevice::write(
   uint64_t off,
   bufferlist &bl,
@@ -1066,6 +1484,9 @@ int KernelDevice::aio_write(
 	++ioc->num_pending;
 	auto& aio = ioc->pending_aios.back();
 	bl.prepare_iov(&aio.iov);
+	if (aio.iov.size() == 1) {
+	  aio.buf_index = io_queue->find_fixed_buffer(aio.iov[0].iov_base, len);
+	}
 	aio.bl.claim_append(bl);
 	aio.pwritev(off, len);
 	dout(30) << aio << dendl;
@@ -1118,7 +1539,10 @@ int KernelDevice::_discard(uint64_t offset, uint64_t len)
   dout(10) << __func__
 	   << " 0x" << std::hex << offset << "~" << len << std::dec
 	   << dendl;
+  auto start = mono_clock::now();
   r = BlkDev{fd_directs[WRITE_LIFE_NOT_SET]}.discard((int64_t)offset, (int64_t)len);
+  note_io_latency(BlockDeviceLatency::OP_DISCARD, len,
+		  mono_clock::now() - start);
   return r;
 }
 
@@ -1283,9 +1707,37 @@ ceph::unique_leakable_ptr<buffer::raw> KernelDevice::create_custom_aligned(
            << " len=" << len
            << " custom_alignment=" << custom_alignment
            << dendl;
+  if (numa_buffers) {
+    if (auto raw = numa_buffers->try_create(len); raw) {
+      ++numa_stats.pool_reads;
+      // the pool is small; don't let the caller's cache drain it
+      ioc->flags |= IOContext::FLAG_DONT_CACHE;
+      return raw;
+    }
+    ++numa_stats.pool_misses;
+  }
   return ceph::buffer::create_aligned(len, custom_alignment);
 }
 
+// prefer a buffer registered with the io queue, if it keeps any, so the
+// kernel does not have to pin the pages for every io.
+ceph::unique_leakable_ptr<buffer::raw> KernelDevice::create_read_buffer(
+  const size_t len,
+  IOContext* const ioc,
+  int* const buf_index) const
+{
+  if (len >= CEPH_PAGE_SIZE) {
+    if (auto raw = io_queue->get_fixed_buffer(len, buf_index); raw) {
+      dout(20) << __func__ << " registered buffer " << *buf_index << dendl;
+      // like the huge page pool, the buffers are few; don't let the
+      // caller's cache hold on to them.
+      ioc->flags |= IOContext::FLAG_DONT_CACHE;
+      return raw;
+    }
+  }
+  return create_custom_aligned(len, ioc);
+}
+
 int KernelDevice::read(uint64_t off, uint64_t len, bufferlist *pbl,
 		      IOContext *ioc,
 		      bool buffered)
@@ -1295,6 +1747,20 @@ int KernelDevice::read(uint64_t off, uint64_t len, bufferlist *pbl,
 	  << dendl;
   ceph_assert(is_valid_io(off, len));
 
+  if (_use_queued_sync_io(buffered, len)) {
+    int buf_index = -1;
+    bufferlist bl;
+    bl.push_back(
+      ceph::buffer::ptr_node::create(create_read_buffer(len, ioc, &buf_index)));
+    int r = _queued_sync_io(false, off, bl, WRITE_LIFE_NOT_SET,
+			    ioc->allow_eio, buf_index);
+    if (r < 0) {
+      return r;
+    }
+    pbl->claim_append(bl);
+    return 0;
+  }
+
   _aio_log_start(ioc, off, len);
 
   auto start1 = mono_clock::now();
@@ -1322,6 +1788,11 @@ int KernelDevice::read(uint64_t off, uint64_t len, bufferlist *pbl,
     goto out;
   }
   ceph_assert((uint64_t)r == len);
+  if (!buffered) {
+    // page cache hits would drag the device's baseline down
+    note_io_latency(BlockDeviceLatency::OP_READ, len,
+		    mono_clock::now() - start1);
+  }
   pbl->push_back(std::move(p));
 
   dout(40) << "data:\n"; 
@@ -1351,7 +1822,8 @@ int KernelDevice::aio_read(
     ++ioc->num_pending;
     aio_t& aio = ioc->pending_aios.back();
     aio.bl.push_back(
-      ceph::buffer::ptr_node::create(create_custom_aligned(len, ioc)));
+      ceph::buffer::ptr_node::create(
+	create_read_buffer(len, ioc, &aio.buf_index)));
     aio.bl.prepare_iov(&aio.iov);
     aio.preadv(off, len);
     dout(30) << aio << dendl;
@@ -1392,6 +1864,8 @@ int KernelDevice::direct_read_unaligned(uint64_t off, uint64_t len, char *buf)
     goto out;
   }
   ceph_assert((uint64_t)r == aligned_len);
+  note_io_latency(BlockDeviceLatency::OP_READ, aligned_len,
+		  mono_clock::now() - start1);
   memcpy(buf, p.c_str() + (off - aligned_off), len);
 
   dout(40) << __func__ << " data:\n";
@@ -1440,6 +1914,7 @@ int KernelDevice::read_random(uint64_t off, uint64_t len, char *buf,
       t += r;
       left -= r;
     }
+    // not noted as device latency: it may have come from the page cache
     if (mono_clock::now() - start1 >= make_timespan(age)) {
       derr << __func__ << " stalled read "
 	   << " 0x" << std::hex << off0 << "~" << len << std::dec
@@ -1447,6 +1922,13 @@ int KernelDevice::read_random(uint64_t off, uint64_t len, char *buf,
 	   << age
 	   << "s" << dendl;
     }
+  } else if (_use_queued_sync_io(buffered, len)) {
+    bufferlist bl;
+    bl.append(ceph::buffer::create_static(len, buf));
+    r = _queued_sync_io(false, off, bl, WRITE_LIFE_NOT_SET, false);
+    if (r < 0) {
+      goto out;
+    }
   } else {
     //direct and aligned read
     r = ::pread(fd_directs[WRITE_LIFE_NOT_SET], buf, len, off);
@@ -1465,6 +1947,8 @@ int KernelDevice::read_random(uint64_t off, uint64_t len, char *buf,
       goto out;
     }
     ceph_assert((uint64_t)r == len);
+    note_io_latency(BlockDeviceLatency::OP_READ, len,
+		    mono_clock::now() - start1);
   }
 
   dout(40) << __func__ << " data:\n";
@@ -1496,6 +1980,11 @@ const char** KernelDevice::get_tracked_conf_keys() const
 {
   static const char* KEYS[] = {
     "bdev_async_discard_threads",
+    "bdev_discard_batch_delay",
+    "bdev_discard_max_pause",
+    "bdev_discard_max_bytes_per_sec",
+    "bdev_discard_max_ops_per_sec",
+    "bdev_discard_pause_latency",
     NULL
   };
   return KEYS;
@@ -1544,4 +2033,13 @@ void KernelDevice::handle_conf_change(const ConfigProxy& conf,
       discard_cond.notify_all();
     }
   }
+  if (changed.count("bdev_discard_batch_delay") ||
+      changed.count("bdev_discard_max_pause") ||
+      changed.count("bdev_discard_max_bytes_per_sec") ||
+      changed.count("bdev_discard_max_ops_per_sec") ||
+      changed.count("bdev_discard_pause_latency")) {
+    // let held back threads look at the new limits
+    std::lock_guard l(discard_lock);
+    discard_cond.notify_all();
+  }
 }
@@ -16,6 +16,8 @@
 #define CEPH_BLK_KERNELDEVICE_H
 
 #include <atomic>
+#include <memory>
+#include <sched.h>
 
 #include "include/types.h"
 #include "include/interval_set.h"
@@ -25,10 +27,13 @@
 
 #include "aio/aio.h"
 #include "BlockDevice.h"
+#include "DiscardThrottle.h"
 #include "extblkdev/ExtBlkDevPlugin.h"
 
 #define RW_IO_MAX (INT_MAX & CEPH_PAGE_MASK)
 
+class NumaBufferPool;
+
 class KernelDevice : public BlockDevice,
                      public md_config_obs_t {
 protected:
@@ -42,6 +47,23 @@ private:
 
   std::string devname;  ///< kernel dev name (/sys/block/$devname), if any
 
+  // numa placement, see bdev_numa_affinity
+  friend class NumaBufferPool;
+  static constexpr unsigned NUMA_NODES_MAX = 64;
+  int device_numa_node = -1;  ///< node the device hangs off, -1 if unknown
+  int numa_node = -1;         ///< node we place threads and buffers on
+  size_t numa_cpu_set_size = 0;
+  cpu_set_t numa_cpu_set;
+  std::shared_ptr<NumaBufferPool> numa_buffers;  ///< read buffers on numa_node
+  struct numa_stats_t {
+    std::atomic<uint64_t> pool_reads = {0};   ///< reads into numa_buffers
+    std::atomic<uint64_t> pool_misses = {0};  ///< too large, or the pool was empty
+    std::atomic<uint64_t> read_samples = {0};
+    std::atomic<uint64_t> completions[NUMA_NODES_MAX] = {}; ///< by reaping cpu node
+    std::atomic<uint64_t> read_pages[NUMA_NODES_MAX] = {};  ///< sampled read buffer pages
+  };
+  mutable numa_stats_t numa_stats;
+
   ceph::mutex debug_lock = ceph::make_mutex("KernelDevice::debug_lock");
   interval_set<uint64_t> debug_inflight;
 
@@ -49,14 +71,30 @@ private:
   ceph::mutex flush_mutex = ceph::make_mutex("KernelDevice::flush_mutex");
 
   std::unique_ptr<io_queue_t> io_queue;
+  bool queue_sync_io = false;  ///< route sync direct io through io_queue too
   aio_callback_t discard_callback;
   void *discard_callback_priv;
   bool aio_stop;
 
   ceph::mutex discard_lock = ceph::make_mutex("KernelDevice::discard_lock");
   ceph::condition_variable discard_cond;
-  bool discard_running = false;
+  unsigned discard_running = 0;     ///< threads with discards in flight
+  unsigned discard_draining = 0;    ///< discard_drain() callers waiting
   interval_set<uint64_t> discard_queued;
+  ceph::mono_time discard_batch_start; ///< when discard_queued became non-empty
+
+  DiscardThrottle discard_throttle;  ///< see bdev_discard_*; under discard_lock
+  /// moving average of foreground aio completion latency
+  std::atomic<uint64_t> fg_latency_avg_ns = {0};
+  std::atomic<ceph::mono_time> fg_latency_stamp;
+  uint64_t discard_inflight_bytes = 0;
+
+  struct discard_stats_t {
+    uint64_t queued_extents = 0;   ///< extents handed to _queue_discard
+    uint64_t issued_ops = 0;       ///< discards actually sent to the device
+    uint64_t issued_bytes = 0;
+    uint64_t released_bytes = 0;   ///< handed back undiscarded on demand
+  } discard_stats;
 
   struct AioCompletionThread : public Thread {
     KernelDevice *bdev;
@@ -88,6 +126,8 @@ private:
   void _aio_thread();
   void _discard_thread(uint64_t tid);
   void _queue_discard(interval_set<uint64_t> &to_release);
+  DiscardThrottle::conf_t _discard_throttle_conf() const;
+  bool _foreground_busy(ceph::mono_time now) const;
   bool try_discard(interval_set<uint64_t> &to_release, bool async = true) override;
 
   int _aio_start();
@@ -97,10 +137,22 @@ private:
   void _discard_stop();
   bool _discard_started();
 
+  void _numa_setup();
+  void _numa_pin_thread();
+  void _numa_note_completions(aio_t **aio, int n);
+
   void _aio_log_start(IOContext *ioc, uint64_t offset, uint64_t length);
   void _aio_log_finish(IOContext *ioc, uint64_t offset, uint64_t length);
 
   int _sync_write(uint64_t off, ceph::buffer::list& bl, bool buffered, int write_hint);
+  /// buf_index: the registered buffer bl is in, if the caller knows it
+  int _queued_sync_io(bool write, uint64_t off, ceph::buffer::list& bl,
+		      int write_hint, bool allow_eio, int buf_index = -1);
+  bool _use_queued_sync_io(bool buffered, uint64_t len) const {
+    // never from the completion thread; it would wait on itself
+    return queue_sync_io && aio && dio && !buffered && len <= RW_IO_MAX &&
+      !aio_thread.am_self();
+  }
 
   int _lock();
 
@@ -117,6 +169,7 @@ private:
   int choose_fd(bool buffered, int write_hint) const;
 
   ceph::unique_leakable_ptr<buffer::raw> create_custom_aligned(size_t len, IOContext* ioc) const;
+  ceph::unique_leakable_ptr<buffer::raw> create_read_buffer(size_t len, IOContext* ioc, int* buf_index) const;
 
 public:
   KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv, aio_callback_t d_cb, void *d_cbpriv);
@@ -124,6 +177,9 @@ public:
 
   void aio_submit(IOContext *ioc) override;
   void discard_drain() override;
+  uint64_t get_discard_queued_bytes() override;
+  uint64_t release_queued_discards() override;
+  void dump_discard_stats(ceph::Formatter *f) override;
 
   int collect_metadata(const std::string& prefix, std::map<std::string,std::string> *pm) const override;
   int get_devname(std::string *s) const override {
@@ -134,6 +190,14 @@ public:
     return 0;
   }
   int get_devices(std::set<std::string> *ls) const override;
+  int get_numa_node(int *node) const override {
+    if (device_numa_node < 0) {
+      return -ENOENT;
+    }
+    *node = device_numa_node;
+    return 0;
+  }
+  void dump_numa_stats(ceph::Formatter *f) const override;
 
   int get_ebd_state(ExtBlkDevState &state) const override;
 
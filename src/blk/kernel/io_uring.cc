@@ -7,16 +7,101 @@
 
 #include "liburing.h"
 #include <sys/epoll.h>
+#include <sys/mman.h>
+
+#include "common/ceph_mutex.h"
+#include "include/buffer_raw.h"
 
 using std::list;
 using std::make_unique;
 
+/*
+ * A slab of equally sized buffers registered with the ring, so that reads
+ * and writes into them skip the per-io page pinning in the kernel.  The slab
+ * is backed by explicit huge pages when the system has them reserved and by
+ * THP-advised anonymous memory otherwise.
+ *
+ * Buffers are handed out as buffer::raw and go back on the free list when
+ * the last bufferptr to them is dropped, which may be after the ring has
+ * been torn down; the slab is unmapped only once both are gone.
+ */
+struct ioring_buffer_pool {
+  char *base = nullptr;
+  size_t mapped = 0;
+  const size_t buffer_size;
+  const size_t count;
+  ceph::mutex lock = ceph::make_mutex("ioring_buffer_pool::lock");
+  std::vector<int> free_list;
+
+  ioring_buffer_pool(size_t buffer_size, size_t count)
+    : buffer_size(buffer_size), count(count) {
+    mapped = buffer_size * count;
+    void *p = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB,
+		     -1, 0);
+    if (p == MAP_FAILED) {
+      p = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+	return;
+      }
+      ::madvise(p, mapped, MADV_HUGEPAGE);
+    }
+    base = static_cast<char*>(p);
+    free_list.reserve(count);
+    for (int i = count - 1; i >= 0; --i) {
+      free_list.push_back(i);
+    }
+  }
+  ~ioring_buffer_pool() {
+    if (base) {
+      ::munmap(base, mapped);
+    }
+  }
+
+  char *get_buffer(int index) const {
+    return base + index * buffer_size;
+  }
+  int get() {
+    std::lock_guard l(lock);
+    if (free_list.empty()) {
+      return -1;
+    }
+    int index = free_list.back();
+    free_list.pop_back();
+    return index;
+  }
+  void put(int index) {
+    std::lock_guard l(lock);
+    free_list.push_back(index);
+  }
+};
+
+struct fixed_buffer_raw : public ceph::buffer::raw {
+  std::shared_ptr<ioring_buffer_pool> pool;
+  const int index;
+
+  fixed_buffer_raw(std::shared_ptr<ioring_buffer_pool> p, int index,
+		   unsigned len)
+    : raw(p->get_buffer(index), len),
+      pool(std::move(p)),
+      index(index) {
+  }
+  ~fixed_buffer_raw() override {
+    // don't free; recycle the buffer instead
+    pool->put(index);
+  }
+};
+
 struct ioring_data {
   struct io_uring io_uring;
   pthread_mutex_t cq_mutex;
   pthread_mutex_t sq_mutex;
   int epoll_fd = -1;
+  bool wait_with_timeout = false;  ///< kernel takes cqe wait timeouts directly
+  bool single_segment_ops = false; ///< kernel has IORING_OP_READ/WRITE
   std::map<int, int> fixed_fds_map;
+  std::shared_ptr<ioring_buffer_pool> buffers;
 };
 
 static int ioring_get_cqe(struct ioring_data *d, unsigned int max,
@@ -57,44 +142,89 @@ static void init_sqe(struct ioring_data *d, struct io_uring_sqe *sqe,
 
   ceph_assert(fixed_fd != -1);
 
-  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV)
+  bool write = io->iocb.aio_lio_opcode == IO_CMD_PWRITEV;
+  ceph_assert(write || io->iocb.aio_lio_opcode == IO_CMD_PREADV);
+
+  if (io->buf_index >= 0) {
+    ceph_assert(io->iov.size() == 1);
+    if (write)
+      io_uring_prep_write_fixed(sqe, fixed_fd, io->iov[0].iov_base,
+				io->iov[0].iov_len, io->offset,
+				io->buf_index);
+    else
+      io_uring_prep_read_fixed(sqe, fixed_fd, io->iov[0].iov_base,
+			       io->iov[0].iov_len, io->offset,
+			       io->buf_index);
+  } else if (io->iov.size() == 1 && d->single_segment_ops) {
+    // saves the kernel from importing an iovec array
+    if (write)
+      io_uring_prep_write(sqe, fixed_fd, io->iov[0].iov_base,
+			  io->iov[0].iov_len, io->offset);
+    else
+      io_uring_prep_read(sqe, fixed_fd, io->iov[0].iov_base,
+			 io->iov[0].iov_len, io->offset);
+  } else if (write) {
     io_uring_prep_writev(sqe, fixed_fd, &io->iov[0],
 			 io->iov.size(), io->offset);
-  else if (io->iocb.aio_lio_opcode == IO_CMD_PREADV)
+  } else {
     io_uring_prep_readv(sqe, fixed_fd, &io->iov[0],
 			io->iov.size(), io->offset);
-  else
-    ceph_assert(0);
+  }
 
   io_uring_sqe_set_data(sqe, io);
   io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
 }
 
 static int ioring_queue(struct ioring_data *d, void *priv,
-			list<aio_t>::iterator beg, list<aio_t>::iterator end)
+			list<aio_t>::iterator beg, list<aio_t>::iterator end,
+			int *retries)
 {
   struct io_uring *ring = &d->io_uring;
-  struct aio_t *io = nullptr;
+  // same backoff as aio_queue_t::submit_batch
+  int attempts = 16;
+  int delay = 125;
+  int submitted = 0;
 
   ceph_assert(beg != end);
 
-  do {
+  while (beg != end) {
     struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
-    if (!sqe)
-      break;
-
-    io = &*beg;
+    if (!sqe) {
+      // The SQ ring is full.  Hand what we have queued to the kernel (or
+      // the SQPOLL thread) and keep going instead of dropping the rest of
+      // the batch on the floor.
+      int r = io_uring_submit(ring);
+      if (r > 0) {
+	submitted += r;
+	continue;
+      }
+      if ((r == 0 || r == -EAGAIN || r == -EBUSY) && attempts-- > 0) {
+	usleep(delay);
+	delay *= 2;
+	(*retries)++;
+	continue;
+      }
+      return r < 0 ? r : -EAGAIN;
+    }
+
+    struct aio_t *io = &*beg;
     io->priv = priv;
 
     init_sqe(d, sqe, io);
+    ++beg;
+  }
 
-  } while (++beg != end);
-
-  if (!io)
-    /* Queue is full, go and reap something first */
-    return 0;
-
-  return io_uring_submit(ring);
+  int r;
+  while ((r = io_uring_submit(ring)) < 0) {
+    if ((r == -EAGAIN || r == -EBUSY) && attempts-- > 0) {
+      usleep(delay);
+      delay *= 2;
+      (*retries)++;
+      continue;
+    }
+    return r;
+  }
+  return submitted + r;
 }
 
 static void build_fixed_fds_map(struct ioring_data *d,
@@ -118,22 +248,59 @@ ioring_queue_t::~ioring_queue_t()
 {
 }
 
+static void register_fixed_buffers(struct ioring_data *d,
+				   size_t count, size_t size)
+{
+  if (!count || !size)
+    return;
+
+  auto pool = std::make_shared<ioring_buffer_pool>(size, count);
+  if (!pool->base)
+    return;
+
+  std::vector<iovec> iovs(count);
+  for (size_t i = 0; i < count; ++i) {
+    iovs[i].iov_base = pool->get_buffer(i);
+    iovs[i].iov_len = size;
+  }
+  // this fails if RLIMIT_MEMLOCK is too small; we simply do without
+  if (io_uring_register_buffers(&d->io_uring, &iovs[0], iovs.size()) == 0)
+    d->buffers = std::move(pool);
+}
+
 int ioring_queue_t::init(std::vector<int> &fds)
 {
-  unsigned flags = 0;
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
 
   pthread_mutex_init(&d->cq_mutex, NULL);
   pthread_mutex_init(&d->sq_mutex, NULL);
 
   if (hipri)
-    flags |= IORING_SETUP_IOPOLL;
-  if (sq_thread)
-    flags |= IORING_SETUP_SQPOLL;
+    params.flags |= IORING_SETUP_IOPOLL;
+  if (sq_thread) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = sq_thread_idle_ms;
+    if (sq_thread_cpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = sq_thread_cpu;
+    }
+  }
 
-  int ret = io_uring_queue_init(iodepth, &d->io_uring, flags);
+  int ret = io_uring_queue_init_params(iodepth, &d->io_uring, &params);
   if (ret < 0)
     return ret;
 
+#if defined(IORING_FEAT_EXT_ARG)
+  d->wait_with_timeout = params.features & IORING_FEAT_EXT_ARG;
+#endif
+  if (struct io_uring_probe *probe = io_uring_get_probe_ring(&d->io_uring)) {
+    d->single_segment_ops =
+      io_uring_opcode_supported(probe, IORING_OP_READ) &&
+      io_uring_opcode_supported(probe, IORING_OP_WRITE);
+    io_uring_free_probe(probe);
+  }
+
   ret = io_uring_register_files(&d->io_uring,
 			  &fds[0], fds.size());
   if (ret < 0) {
@@ -142,6 +309,7 @@ int ioring_queue_t::init(std::vector<int> &fds)
   }
 
   build_fixed_fds_map(d.get(), fds);
+  register_fixed_buffers(d.get(), fixed_buffers, fixed_buffer_size);
 
   d->epoll_fd = epoll_create1(0);
   if (d->epoll_fd < 0) {
@@ -162,6 +330,7 @@ int ioring_queue_t::init(std::vector<int> &fds)
 close_epoll_fd:
   close(d->epoll_fd);
 close_ring_fd:
+  d->buffers.reset();
   io_uring_queue_exit(&d->io_uring);
 
   return ret;
@@ -173,6 +342,8 @@ void ioring_queue_t::shutdown()
   close(d->epoll_fd);
   d->epoll_fd = -1;
   io_uring_queue_exit(&d->io_uring);
+  // buffers still referenced by bufferlists keep the slab mapped
+  d->buffers.reset();
 }
 
 int ioring_queue_t::submit_batch(aio_iter beg, aio_iter end,
@@ -180,10 +351,9 @@ int ioring_queue_t::submit_batch(aio_iter beg, aio_iter end,
                                  int *retries)
 {
   (void)aios_size;
-  (void)retries;
 
   pthread_mutex_lock(&d->sq_mutex);
-  int rc = ioring_queue(d.get(), priv, beg, end);
+  int rc = ioring_queue(d.get(), priv, beg, end, retries);
   pthread_mutex_unlock(&d->sq_mutex);
 
   return rc;
@@ -197,18 +367,66 @@ get_cqe:
   pthread_mutex_unlock(&d->cq_mutex);
 
   if (events == 0) {
-    struct epoll_event ev;
-    int ret = TEMP_FAILURE_RETRY(epoll_wait(d->epoll_fd, &ev, 1, timeout_ms));
-    if (ret < 0)
-      events = -errno;
-    else if (ret > 0)
-      /* Time to reap */
-      goto get_cqe;
+    if (d->wait_with_timeout) {
+      // Wait in io_uring_enter(2) itself.  This is the only way to see
+      // completions of a polled (IOPOLL) ring, and it does not touch the SQ
+      // ring, so it is safe against concurrent submitters.
+      struct __kernel_timespec ts;
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+      struct io_uring_cqe *cqe;
+      int ret = io_uring_wait_cqes(&d->io_uring, &cqe, 1, &ts, nullptr);
+      if (ret == 0)
+	goto get_cqe;
+      if (ret != -ETIME && ret != -EINTR)
+	events = ret;
+    } else {
+      struct epoll_event ev;
+      int ret = TEMP_FAILURE_RETRY(epoll_wait(d->epoll_fd, &ev, 1, timeout_ms));
+      if (ret < 0)
+	events = -errno;
+      else if (ret > 0)
+	/* Time to reap */
+	goto get_cqe;
+    }
   }
 
   return events;
 }
 
+ceph::unique_leakable_ptr<ceph::buffer::raw> ioring_queue_t::get_fixed_buffer(
+  size_t len, int *index)
+{
+  auto& pool = d->buffers;
+  if (!pool || len > pool->buffer_size)
+    return nullptr;
+  int i = pool->get();
+  if (i < 0)
+    return nullptr;
+  *index = i;
+  return ceph::unique_leakable_ptr<ceph::buffer::raw>(
+    new fixed_buffer_raw(pool, i, len));
+}
+
+int ioring_queue_t::find_fixed_buffer(const void *p, size_t len) const
+{
+  auto& pool = d->buffers;
+  if (!pool)
+    return -1;
+  auto c = static_cast<const char*>(p);
+  if (c < pool->base || c + len > pool->base + pool->mapped)
+    return -1;
+  size_t i = (c - pool->base) / pool->buffer_size;
+  if (c + len > pool->get_buffer(i) + pool->buffer_size)
+    return -1;
+  return i;
+}
+
+size_t ioring_queue_t::get_num_fixed_buffers() const
+{
+  return d->buffers ? d->buffers->count : 0;
+}
+
 bool ioring_queue_t::supported()
 {
   struct io_uring ring;
@@ -256,6 +474,22 @@ int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
   ceph_assert(0);
 }
 
+ceph::unique_leakable_ptr<ceph::buffer::raw> ioring_queue_t::get_fixed_buffer(
+  size_t len, int *index)
+{
+  ceph_assert(0);
+}
+
+int ioring_queue_t::find_fixed_buffer(const void *p, size_t len) const
+{
+  ceph_assert(0);
+}
+
+size_t ioring_queue_t::get_num_fixed_buffers() const
+{
+  ceph_assert(0);
+}
+
 bool ioring_queue_t::supported()
 {
   return false;
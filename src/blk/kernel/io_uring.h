@@ -16,6 +16,12 @@ struct ioring_queue_t final : public io_queue_t {
   bool hipri = false;
   bool sq_thread = false;
 
+  // tunables, set before init()
+  unsigned sq_thread_idle_ms = 0;    ///< 0 = kernel default
+  int sq_thread_cpu = -1;            ///< pin the SQPOLL thread, -1 = don't
+  size_t fixed_buffers = 0;          ///< number of registered buffers
+  size_t fixed_buffer_size = 0;      ///< size of each registered buffer
+
   typedef std::list<aio_t>::iterator aio_iter;
 
   // Returns true if arch is x86-64 and kernel supports io_uring
@@ -30,4 +36,11 @@ struct ioring_queue_t final : public io_queue_t {
   int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size,
                    void *priv, int *retries) final;
   int get_next_completed(int timeout_ms, aio_t **paio, int max) final;
+
+  ceph::unique_leakable_ptr<ceph::buffer::raw> get_fixed_buffer(
+    size_t len, int *index) final;
+  int find_fixed_buffer(const void *p, size_t len) const final;
+
+  /// number of buffers registered with the ring, 0 if registration failed
+  size_t get_num_fixed_buffers() const;
 };
@@ -291,6 +291,7 @@ int PMEMDevice::write(uint64_t off, bufferlist& bl, bool buffered, int write_hin
     return 0;
   }
 
+  auto start = ceph::mono_clock::now();
   bufferlist::iterator p = bl.begin();
   uint64_t off1 = off;
   while (len) {
@@ -307,6 +308,8 @@ int PMEMDevice::write(uint64_t off, bufferlist& bl, bool buffered, int write_hin
     len -= l;
     off1 += l;
   }
+  note_io_latency(BlockDeviceLatency::OP_WRITE, bl.length(),
+		  ceph::mono_clock::now() - start);
   return 0;
 }
 
@@ -330,12 +333,14 @@ int PMEMDevice::read(uint64_t off, uint64_t len, bufferlist *pbl,
 
   bufferptr p = buffer::create_small_page_aligned(len);
 
+  auto start = ceph::mono_clock::now();
 #if defined(HAVE_LIBDML)
   auto result = dml::execute<execution_path>(dml::mem_move, dml::make_view(addr + off, len), dml::make_view(p.c_str(), len));
   ceph_assert(result.status == dml::status_code::ok);
 #else
   memcpy(p.c_str(), addr + off, len);
 #endif
+  note_io_latency(BlockDeviceLatency::OP_READ, len, ceph::mono_clock::now() - start);
 
   pbl->clear();
   pbl->push_back(std::move(p));
@@ -358,13 +363,14 @@ int PMEMDevice::read_random(uint64_t off, uint64_t len, char *buf, bool buffered
   dout(5) << __func__ << " " << off << "~" << len << dendl;
   ceph_assert(is_valid_io(off, len));
 
-
+  auto start = ceph::mono_clock::now();
 #if defined(HAVE_LIBDML)
   auto result = dml::execute<execution_path>(dml::mem_move, dml::make_view(addr + off, len), dml::make_view(buf, len));
   ceph_assert(result.status == dml::status_code::ok);
 #else
   memcpy(buf, addr + off, len);
 #endif
+  note_io_latency(BlockDeviceLatency::OP_READ, len, ceph::mono_clock::now() - start);
   return 0;
 }
 
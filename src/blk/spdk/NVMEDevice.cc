@@ -206,6 +206,7 @@ struct Task {
   Task *primary = nullptr;
   IORequest io_request = {};
   SharedDriverQueueData *queue = nullptr;
+  ceph::mono_time start = ceph::mono_clock::now();
   // reference count by subtasks.
   int ref = 0;
   Task(NVMEDevice *dev, IOCommand c, uint64_t off, uint64_t l, int64_t rc = 0,
@@ -654,6 +655,11 @@ void io_complete(void *t, const struct spdk_nvme_cpl *completion)
   ceph_assert(queue != NULL);
   ceph_assert(ctx != NULL);
   --queue->current_queue_depth;
+  task->device->note_io_latency(
+    task->command == IOCommand::WRITE_COMMAND ? BlockDeviceLatency::OP_WRITE :
+    task->command == IOCommand::READ_COMMAND ? BlockDeviceLatency::OP_READ :
+    BlockDeviceLatency::OP_FLUSH,
+    task->len, ceph::mono_clock::now() - task->start);
   if (task->command == IOCommand::WRITE_COMMAND) {
     ceph_assert(!spdk_nvme_cpl_is_error(completion));
     dout(20) << __func__ << " write/zero op successfully, left "
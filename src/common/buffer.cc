@@ -488,6 +488,10 @@ static ceph::spinlock debug_lock;
   const char *buffer::ptr::raw_c_str() const { ceph_assert(_raw); return _raw->get_data(); }
   unsigned buffer::ptr::raw_length() const { ceph_assert(_raw); return _raw->get_len(); }
   int buffer::ptr::raw_nref() const { ceph_assert(_raw); return _raw->nref; }
+  void buffer::ptr::set_crc32c(uint32_t base, uint32_t crc) const {
+    ceph_assert(_raw);
+    _raw->set_crc(make_pair(_off, _off + _len), make_pair(base, crc));
+  }
 
   void buffer::ptr::copy_out(unsigned o, unsigned l, char *dest) const {
     ceph_assert(_raw);
@@ -298,6 +298,9 @@ struct error_code;
     const char *raw_c_str() const;
     unsigned raw_length() const;
     int raw_nref() const;
+    /// seed the crc32c cache for this ptr's range, for callers that
+    /// already know crc32c(base) of the content (e.g. verified checksums)
+    void set_crc32c(uint32_t base, uint32_t crc) const;
 
     void copy_out(unsigned o, unsigned l, char *dest) const;
 
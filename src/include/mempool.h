@@ -169,6 +169,7 @@ namespace mempool {
   f(bluefs)			      \
   f(bluefs_file_reader)              \
   f(bluefs_file_writer)              \
+  f(bluefs_block_cache)              \
   f(buffer_anon)		      \
   f(buffer_meta)		      \
   f(osd)			      \
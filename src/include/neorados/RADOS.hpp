@@ -181,6 +181,11 @@ public:
   void set_full_try(bool full_try) &;
   IOContext&& set_full_try(bool full_try) &&;
 
+  /// client tag under which the OSDs' mClock schedulers queue our ops
+  const std::string& get_qos_tag() const;
+  void set_qos_tag(std::string qos_tag) &;
+  IOContext&& set_qos_tag(std::string qos_tag) &&;
+
   friend std::ostream& operator <<(std::ostream& m, const IOContext& o);
   friend bool operator <(const IOContext& lhs, const IOContext& rhs);
   friend bool operator <=(const IOContext& lhs, const IOContext& rhs);
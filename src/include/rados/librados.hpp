@@ -1357,6 +1357,20 @@ inline namespace v14_2_0 {
     void set_pool_full_try();
     void unset_pool_full_try();
 
+    /**
+     * Tag this IoCtx's ops for per-client QoS
+     *
+     * OSDs running the mClock scheduler look the tag up in
+     * osd_mclock_scheduler_client_qos_profiles to pick the reservation,
+     * weight and limit the ops get.  An empty tag (the default) leaves
+     * the ops with the default client profile.  Like set_namespace(),
+     * this must not race with ops being issued on this IoCtx.
+     *
+     * @param tag the QoS tag
+     */
+    void set_qos_tag(const std::string& tag);
+    std::string get_qos_tag() const;
+
     int application_enable(const std::string& app_name, bool force);
     int application_enable_async(const std::string& app_name,
                                  bool force, PoolAsyncCompletion *c);
@@ -162,6 +162,24 @@ public:
   virtual int submit_transaction_sync(Transaction t) {
     return submit_transaction(t);
   }
+  /**
+   * Submit a group of transactions, in order.
+   *
+   * Backends may merge them into fewer, larger writes; each transaction is
+   * still applied atomically, but the group as a whole need not be.  The
+   * transactions must not be used again afterwards.
+   */
+  virtual int submit_transactions(std::vector<Transaction>& tl) {
+    for (auto& t : tl) {
+      int r = submit_transaction(t);
+      if (r < 0) {
+	return r;
+      }
+    }
+    return 0;
+  }
+  /// dump batch size and bytes per sync histograms of the write path
+  virtual void dump_write_histogram(ceph::Formatter *f) {}
 
   /// Retrieve Keys
   virtual int get(
@@ -397,6 +415,12 @@ public:
   virtual void compact_range_async(const std::string& prefix,
 				   const std::string& start, const std::string& end) {}
 
+  /// change the sharding of a single column while the db stays in use
+  virtual int start_online_reshard(const std::string& new_sharding) {
+    return -EOPNOTSUPP;
+  }
+  virtual void dump_online_reshard(ceph::Formatter *f) {}
+
   // See RocksDB merge operator definition, we support the basic
   // associative merge only right now.
   class MergeOperator {
@@ -1,6 +1,7 @@
 // -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
 // vim: ts=8 sw=2 smarttab
 
+#include "include/intarith.h"
 #include "include/stringify.h"
 #include "KeyValueHistogram.h"
 using std::map;
@@ -36,6 +37,22 @@ string KeyValueHistogram::get_value_slab_to_range(int slab)
   return ret;
 }
 
+// slab 0 holds 0, slab n holds [2^(n-1), 2^n)
+int KeyValueHistogram::get_pow2_slab(uint64_t v)
+{
+  return cbits(v);
+}
+
+string KeyValueHistogram::get_pow2_slab_to_range(int slab)
+{
+  if (slab == 0) {
+    return "[0,1)";
+  }
+  uint64_t lower_bound = 1ull << (slab - 1);
+  string upper_bound = slab < 64 ? stringify(1ull << slab) : "inf";
+  return "[" + stringify(lower_bound) + "," + upper_bound + ")";
+}
+
 void KeyValueHistogram::update_hist_entry(map<string, map<int, struct key_dist> >& key_hist,
   const string& prefix, size_t key_size, size_t value_size)
 {
@@ -76,3 +93,18 @@ void KeyValueHistogram::dump(Formatter* f)
   }
   f->close_section();
 }
+
+void KeyValueHistogram::dump_write_hist(Formatter* f)
+{
+  f->open_object_section("batch_size_histogram");
+  for (auto i : batch_size_hist) {
+    f->dump_unsigned(get_pow2_slab_to_range(i.first).data(), i.second);
+  }
+  f->close_section();
+
+  f->open_object_section("bytes_per_sync_histogram");
+  for (auto i : sync_bytes_hist) {
+    f->dump_unsigned(get_pow2_slab_to_range(i.first).data(), i.second);
+  }
+  f->close_section();
+}
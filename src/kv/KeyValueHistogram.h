@@ -26,13 +26,18 @@ struct KeyValueHistogram {
 
   std::map<std::string, std::map<int, struct key_dist> > key_hist;
   std::map<int, uint64_t> value_hist;
+  std::map<int, uint64_t> batch_size_hist; ///< transactions per coalesced write batch
+  std::map<int, uint64_t> sync_bytes_hist; ///< bytes written between WAL syncs
   int get_key_slab(size_t sz);
   std::string get_key_slab_to_range(int slab);
   int get_value_slab(size_t sz);
   std::string get_value_slab_to_range(int slab);
+  int get_pow2_slab(uint64_t v);
+  std::string get_pow2_slab_to_range(int slab);
   void update_hist_entry(std::map<std::string, std::map<int, struct key_dist> >& key_hist,
     const std::string& prefix, size_t key_size, size_t value_size);
   void dump(ceph::Formatter* f);
+  void dump_write_hist(ceph::Formatter* f);
 };
 
 #endif
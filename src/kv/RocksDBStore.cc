@@ -2,6 +2,7 @@
 // vim: ts=8 sw=2 smarttab
 
 #include <filesystem>
+#include <list>
 #include <map>
 #include <memory>
 #include <set>
@@ -20,6 +21,7 @@
 #include "rocksdb/utilities/convenience.h"
 #include "rocksdb/utilities/table_properties_collectors.h"
 #include "rocksdb/merge_operator.h"
+#include "rocksdb/slice_transform.h"
 
 #include "common/perf_counters.h"
 #include "common/PriorityCache.h"
@@ -58,6 +60,15 @@ static const char* sharding_def_dir = "sharding";
 static const char* sharding_def_file = "sharding/def";
 static const char* sharding_recreate = "sharding/recreate_columns";
 static const char* resharding_column_lock = "reshardingXcommencingXlocked";
+static const char* online_reshard_file = "sharding/online_reshard";
+
+static std::string shard_cf_name(const RocksDBStore::ColumnFamily& column,
+				 size_t idx) {
+  if (column.shard_cnt == 1) {
+    return column.name;
+  }
+  return column.name + "-" + std::to_string(idx);
+}
 
 static bufferlist to_bufferlist(rocksdb::Slice in) {
   bufferlist bl;
@@ -492,6 +503,16 @@ int RocksDBStore::load_rocksdb_options(bool create_if_missing, rocksdb::Options&
   }
 
   opt.create_if_missing = create_if_missing;
+  cf_filters.clear();
+  if (auto p = kv_options.find("cf_filters");
+      p != kv_options.end() && !p->second.empty()) {
+    rocksdb::Status status = rocksdb::StringToMap(p->second, &cf_filters);
+    if (!status.ok()) {
+      derr << __func__ << " invalid cf_filters '" << p->second << "': "
+	   << status.ToString() << dendl;
+      return -EINVAL;
+    }
+  }
   if (kv_options.count("separate_wal_dir")) {
     opt.wal_dir = path + ".wal";
   }
@@ -625,6 +646,7 @@ void RocksDBStore::add_column_family(const std::string& cf_name, uint32_t hash_l
     column.handles.resize(shard_idx + 1);
   column.handles[shard_idx] = handle;
   cf_ids_to_prefix.emplace(handle->GetID(), cf_name);
+  cf_ids_to_handle[handle->GetID()] = handle;
 }
 
 bool RocksDBStore::is_column_family(const std::string& prefix) {
@@ -881,9 +903,11 @@ extern rocksdb::Status rocksdb::StringToMap(const std::string& opts_str,
 // The split is done using RocksDB parser that understands "{" and "}", so it
 // properly extracts compound options.
 // If non-RocksDB option "block_cache" is defined it is extracted to block_cache_opt.
+// Same for non-RocksDB option "filter" and filter_opt.
 int RocksDBStore::split_column_family_options(const std::string& options,
 					      std::unordered_map<std::string, std::string>* opt_map,
-					      std::string* block_cache_opt)
+					      std::string* block_cache_opt,
+					      std::string* filter_opt)
 {
   dout(20) << __func__ << " options=" << options << dendl;
   rocksdb::Status status = rocksdb::StringToMap(options, opt_map);
@@ -899,6 +923,12 @@ int RocksDBStore::split_column_family_options(const std::string& options,
   } else {
     block_cache_opt->clear();
   }
+  if (auto it = opt_map->find("filter"); it != opt_map->end()) {
+    *filter_opt = it->second;
+    opt_map->erase(it);
+  } else {
+    filter_opt->clear();
+  }
   return 0;
 }
 
@@ -907,6 +937,8 @@ int RocksDBStore::split_column_family_options(const std::string& options,
 // Allowed options are exactly the same as allowed for column families in RocksDB.
 // Ceph addition is "block_cache" option that is translated to block_cache and
 // allows to specialize separate block cache for O column family.
+// Another Ceph addition is "filter", see apply_filter_options(); a column
+// without it takes its filter options from kv_options "cf_filters".
 //
 // base_name - name of column without shard suffix: "-"+number
 // options - additional options to apply
@@ -917,8 +949,10 @@ int RocksDBStore::update_column_family_options(const std::string& base_name,
 {
   std::unordered_map<std::string, std::string> options_map;
   std::string block_cache_opt;
+  std::string filter_opt;
   rocksdb::Status status;
-  int r = split_column_family_options(more_options, &options_map, &block_cache_opt);
+  int r = split_column_family_options(more_options, &options_map,
+				      &block_cache_opt, &filter_opt);
   if (r != 0) {
     dout(5) << __func__ << " failed to parse options; column family=" << base_name
 	    << " options=" << more_options << dendl;
@@ -942,6 +976,97 @@ int RocksDBStore::update_column_family_options(const std::string& base_name,
       return r;
     }
   }
+  if (filter_opt.empty()) {
+    if (auto p = cf_filters.find(base_name); p != cf_filters.end()) {
+      filter_opt = p->second;
+    }
+  }
+  if (!filter_opt.empty()) {
+    // a column with its own block cache keeps its table options in
+    // cf_bbt_opts; the others only get their own table factory
+    rocksdb::BlockBasedTableOptions column_bbt_opts = bbt_opts;
+    r = apply_filter_options(
+      base_name, filter_opt,
+      block_cache_opt.empty() ? &column_bbt_opts : &cf_bbt_opts[base_name],
+      cf_opt);
+    if (r != 0) {
+      return r;
+    }
+  }
+  return 0;
+}
+
+// Filter options of a column, all optional:
+//   type=bloom|ribbon|none   filter kind, bloom by default
+//   bits_per_key=<n>         defaults to rocksdb_bloom_bits_per_key
+//   prefix_len=<n>           also filter on the first n bytes of a key, so
+//                            that seeks within a key prefix can skip files
+//   whole_key=true|false     filter on whole keys, for point lookups
+int RocksDBStore::apply_filter_options(const std::string& column_name,
+				       const std::string& filter_opt,
+				       rocksdb::BlockBasedTableOptions* column_bbt_opts,
+				       rocksdb::ColumnFamilyOptions* cf_opt)
+{
+  std::unordered_map<std::string, std::string> filter_options_map;
+  rocksdb::Status status = rocksdb::StringToMap(filter_opt, &filter_options_map);
+  if (!status.ok()) {
+    dout(5) << __func__ << " invalid filter options; column=" << column_name
+	    << " options=" << filter_opt << dendl;
+    dout(5) << __func__ << " RocksDB error='" << status.getState() << "'" << dendl;
+    return -EINVAL;
+  }
+  std::string type = "bloom";
+  double bits_per_key = cct->_conf.get_val<uint64_t>("rocksdb_bloom_bits_per_key");
+  uint64_t prefix_len = 0;
+  bool whole_key = true;
+  for (auto& [k, v] : filter_options_map) {
+    std::string error;
+    if (k == "type") {
+      type = v;
+    } else if (k == "bits_per_key") {
+      bits_per_key = strict_strtod(v, &error);
+    } else if (k == "prefix_len") {
+      prefix_len = strict_strtoll(v, 10, &error);
+    } else if (k == "whole_key") {
+      whole_key = strict_strtob(v.c_str(), &error);
+    } else {
+      error = "unknown option";
+    }
+    if (!error.empty()) {
+      dout(5) << __func__ << " invalid filter option " << k << "=" << v
+	      << " for column " << column_name << ": " << error << dendl;
+      return -EINVAL;
+    }
+  }
+  if (type == "bloom") {
+    column_bbt_opts->filter_policy.reset(
+      rocksdb::NewBloomFilterPolicy(bits_per_key));
+  } else if (type == "ribbon") {
+    column_bbt_opts->filter_policy.reset(
+      rocksdb::NewRibbonFilterPolicy(bits_per_key));
+  } else if (type == "none") {
+    column_bbt_opts->filter_policy.reset();
+  } else {
+    dout(5) << __func__ << " invalid filter type " << type
+	    << " for column " << column_name << dendl;
+    return -EINVAL;
+  }
+  if (column_bbt_opts->filter_policy && !whole_key && !prefix_len) {
+    dout(5) << __func__ << " filter of column " << column_name
+	    << " has neither whole keys nor a prefix to filter on" << dendl;
+    return -EINVAL;
+  }
+  column_bbt_opts->whole_key_filtering = whole_key;
+  if (prefix_len) {
+    // SSTs written with another extractor just don't use their prefix filter
+    cf_opt->prefix_extractor.reset(rocksdb::NewFixedPrefixTransform(prefix_len));
+  } else {
+    cf_opt->prefix_extractor.reset();
+  }
+  cf_opt->table_factory.reset(NewBlockBasedTableFactory(*column_bbt_opts));
+  dout(10) << __func__ << " column " << column_name << " filter " << type
+	   << " bits_per_key " << bits_per_key << " prefix_len " << prefix_len
+	   << " whole_key " << whole_key << dendl;
   return 0;
 }
 
@@ -1023,7 +1148,9 @@ int RocksDBStore::verify_sharding(const rocksdb::Options& opt,
 				  std::vector<rocksdb::ColumnFamilyDescriptor>& existing_cfs,
 				  std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& existing_cfs_shard,
 				  std::vector<rocksdb::ColumnFamilyDescriptor>& missing_cfs,
-				  std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& missing_cfs_shard)
+				  std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& missing_cfs_shard,
+				  const ColumnFamily* other_column,
+				  std::vector<rocksdb::ColumnFamilyDescriptor>* other_cfs)
 {
   rocksdb::Status status;
   std::string stored_sharding_text;
@@ -1084,10 +1211,25 @@ int RocksDBStore::verify_sharding(const rocksdb::Options& opt,
 	emplace_cf(column, i, cf_name, cf_opt);
       }
     }
+    if (other_column && other_column->name == column.name) {
+      // shards of the other layout of a column being resharded online;
+      // both layouts share the column's options
+      std::set<std::string> names;
+      for (size_t i = 0; i < column.shard_cnt; i++) {
+	names.insert(shard_cf_name(column, i));
+      }
+      for (size_t i = 0; i < other_column->shard_cnt; i++) {
+	std::string cf_name = shard_cf_name(*other_column, i);
+	if (names.count(cf_name) == 0 &&
+	    std::find(rocksdb_cfs.begin(), rocksdb_cfs.end(), cf_name) != rocksdb_cfs.end()) {
+	  other_cfs->emplace_back(cf_name, cf_opt);
+	}
+      }
+    }
   }
   existing_cfs.emplace_back("default", opt);
 
- if (existing_cfs.size() != rocksdb_cfs.size()) {
+ if (existing_cfs.size() + (other_cfs ? other_cfs->size() : 0) != rocksdb_cfs.size()) {
    std::vector<std::string> columns_from_stored;
    sharding_def_to_columns(stored_sharding_def, columns_from_stored);
    derr << __func__ << " extra columns in rocksdb. rocksdb columns = " << rocksdb_cfs
@@ -1145,9 +1287,52 @@ int RocksDBStore::do_open(ostream &out,
     std::vector<rocksdb::ColumnFamilyDescriptor> missing_cfs;
     std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> > missing_cfs_shard;
 
+    // an online reshard that did not finish before the store was closed
+    std::string online_reshard_text;
+    std::string online_from_text;
+    std::string online_to_text;
+    std::optional<std::pair<ColumnFamily, ColumnFamily>> online_columns;
+    bool online_reshard_done = false;
+    std::vector<rocksdb::ColumnFamilyDescriptor> online_reshard_cfs;
+    status = rocksdb::ReadFileToString(opt.env, online_reshard_file,
+				       &online_reshard_text);
+    if (status.ok()) {
+      std::string stored_sharding_text;
+      rocksdb::ReadFileToString(opt.env, sharding_def_file,
+				&stored_sharding_text);
+      auto pos = online_reshard_text.find('\n');
+      ColumnFamily from_column("", 1, "", 0, 0);
+      ColumnFamily to_column("", 1, "", 0, 0);
+      if (pos != std::string::npos) {
+	online_from_text = online_reshard_text.substr(0, pos);
+	online_to_text = online_reshard_text.substr(pos + 1);
+      }
+      if (pos == std::string::npos ||
+	  find_online_reshard_column(online_from_text, online_to_text,
+				     &from_column, &to_column) < 0) {
+	derr << __func__ << " cannot parse " << online_reshard_file << dendl;
+	return -EIO;
+      }
+      if (stored_sharding_text == online_to_text) {
+	online_reshard_done = true;
+      } else if (stored_sharding_text != online_from_text) {
+	derr << __func__ << " " << online_reshard_file
+	     << " does not match sharding " << stored_sharding_text << dendl;
+	return -EIO;
+      }
+      online_columns.emplace(from_column, to_column);
+      dout(1) << __func__ << " online reshard " << online_from_text
+	      << " -> " << online_to_text
+	      << (online_reshard_done ? " finished" : " interrupted") << dendl;
+    }
+
     r = verify_sharding(opt,
 			existing_cfs, existing_cfs_shard,
-			missing_cfs, missing_cfs_shard);
+			missing_cfs, missing_cfs_shard,
+			!online_columns ? nullptr :
+			online_reshard_done ? &online_columns->first :
+			&online_columns->second,
+			&online_reshard_cfs);
     if (r < 0) {
       return r;
     }
@@ -1185,20 +1370,23 @@ int RocksDBStore::do_open(ostream &out,
       default_cf = db->DefaultColumnFamily();
     } else {
       std::vector<rocksdb::ColumnFamilyHandle*> handles;
+      std::vector<rocksdb::ColumnFamilyDescriptor> open_cfs(existing_cfs);
+      open_cfs.insert(open_cfs.end(),
+		      online_reshard_cfs.begin(), online_reshard_cfs.end());
       if (open_readonly) {
         status = rocksdb::DB::OpenForReadOnly(rocksdb::DBOptions(opt),
-				              path, existing_cfs,
+				              path, open_cfs,
 					      &handles, &db);
       } else {
         status = rocksdb::DB::Open(rocksdb::DBOptions(opt),
-				   path, existing_cfs, &handles, &db);
+				   path, open_cfs, &handles, &db);
       }
       if (!status.ok()) {
 	derr << status.ToString() << dendl;
 	return -EINVAL;
       }
       ceph_assert(existing_cfs.size() == existing_cfs_shard.size() + 1);
-      ceph_assert(handles.size() == existing_cfs.size());
+      ceph_assert(handles.size() == open_cfs.size());
       dout(10) << __func__ << " existing_cfs=" << existing_cfs.size() << dendl;
       for (size_t i = 0; i < existing_cfs_shard.size(); i++) {
 	add_column_family(existing_cfs_shard[i].second.name,
@@ -1207,7 +1395,7 @@ int RocksDBStore::do_open(ostream &out,
 			  existing_cfs_shard[i].first,
 			  handles[i]);
       }
-      default_cf = handles[handles.size() - 1];
+      default_cf = handles[existing_cfs.size() - 1];
       must_close_default_cf = true;
 
       if (missing_cfs.size() > 0 &&
@@ -1234,6 +1422,19 @@ int RocksDBStore::do_open(ostream &out,
 	}
 	opt.env->DeleteFile(sharding_recreate);
       }
+
+      if (online_columns) {
+	std::map<std::string, rocksdb::ColumnFamilyHandle*> opened;
+	for (size_t i = 0; i < online_reshard_cfs.size(); i++) {
+	  opened[online_reshard_cfs[i].name] = handles[existing_cfs.size() + i];
+	}
+	r = online_reshard_resume(online_columns->first, online_columns->second,
+				  online_from_text, online_to_text,
+				  online_reshard_done, opened, open_readonly);
+	if (r < 0) {
+	  return r;
+	}
+      }
     }
   }
   ceph_assert(default_cf != nullptr);
@@ -1251,9 +1452,34 @@ int RocksDBStore::do_open(ostream &out,
   plb.add_time_avg(l_rocksdb_write_delay_time, "rocksdb_write_delay_time", "Rocksdb write delay time");
   plb.add_time_avg(l_rocksdb_write_pre_and_post_process_time, 
       "rocksdb_write_pre_and_post_time", "total time spent on writing a record, excluding write process");
+  plb.add_u64_counter(l_rocksdb_multiget_keys, "multiget_keys", "Keys read via batched MultiGet");
+  plb.add_u64_counter(l_rocksdb_online_reshard_keys, "online_reshard_keys",
+		      "Keys moved by online resharding");
+  plb.add_u64_counter(l_rocksdb_online_reshard_bytes, "online_reshard_bytes",
+		      "Bytes moved by online resharding", NULL, 0,
+		      unit_t(UNIT_BYTES));
+  plb.add_time_avg(l_rocksdb_online_reshard_lat, "online_reshard_lat",
+		   "Online resharding batch latency");
+  plb.add_u64_counter(l_rocksdb_coalesce_batches, "coalesce_batches",
+		      "Write batches merged from several transactions");
+  plb.add_u64_counter(l_rocksdb_coalesce_txns, "coalesce_txns",
+		      "Transactions written as part of a merged write batch");
+  plb.add_u64_counter(l_rocksdb_coalesce_dedup_keys, "coalesce_dedup_keys",
+		      "Puts dropped in favour of a later put of the same key "
+		      "in a merged write batch");
+  plb.add_time_avg(l_rocksdb_coalesce_lat, "coalesce_lat",
+		   "Merged write batch latency");
+  plb.add_u64(l_rocksdb_coalesce_bytes_limit, "coalesce_bytes_limit",
+	      "Current size limit of a merged write batch", NULL, 0,
+	      unit_t(UNIT_BYTES));
   logger = plb.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 
+  if (!open_readonly && is_online_resharding()) {
+    online_reshard_stop = false;
+    online_reshard_thread.create("rocksdb_reshard");
+  }
+
   if (compact_on_mount) {
     derr << "Compacting rocksdb store..." << dendl;
     compact();
@@ -1296,6 +1522,16 @@ void RocksDBStore::close()
     compact_queue_lock.unlock();
   }
 
+  // stop online resharding; open() resumes it
+  if (online_reshard_thread.is_started()) {
+    {
+      std::lock_guard l(online_reshard_stop_lock);
+      online_reshard_stop = true;
+      online_reshard_cond.notify_all();
+    }
+    online_reshard_thread.join();
+  }
+
   if (logger) {
     cct->get_perfcounters_collection()->remove(logger);
     delete logger;
@@ -1303,12 +1539,20 @@ void RocksDBStore::close()
   }
 
   // Ensure db is destroyed before dependent db_cache and filterpolicy
+  if (online_reshard_state) {
+    for (auto cf : online_reshard_state->owned) {
+      db->DestroyColumnFamilyHandle(cf);
+    }
+    online_reshard = nullptr;
+    online_reshard_state.reset();
+  }
   for (auto& p : cf_handles) {
     for (size_t i = 0; i < p.second.handles.size(); i++) {
       db->DestroyColumnFamilyHandle(p.second.handles[i]);
     }
   }
   cf_handles.clear();
+  cf_ids_to_handle.clear();
   if (must_close_default_cf) {
     db->DestroyColumnFamilyHandle(default_cf);
     must_close_default_cf = false;
@@ -1395,7 +1639,7 @@ int64_t RocksDBStore::estimate_prefix_size(const string& prefix,
   uint64_t size = 0;
   auto p_iter = cf_handles.find(prefix);
   if (p_iter != cf_handles.end()) {
-    for (auto cf : p_iter->second.handles) {
+    for (auto cf : get_column_handles(prefix, p_iter->second.handles)) {
       uint64_t s = 0;
       string start = key_prefix + string(1, '\x00');
       string limit = key_prefix + string("\xff\xff\xff\xff");
@@ -1489,8 +1733,14 @@ struct RocksDBStore::RocksWBHandler: public rocksdb::WriteBatch::Handler {
       db.split_key(key_in, &prefix, &key);
     } else {
       auto it = db.cf_ids_to_prefix.find(column_family_id);
-      ceph_assert(it != db.cf_ids_to_prefix.end());
-      prefix = it->second;
+      if (it != db.cf_ids_to_prefix.end()) {
+	prefix = it->second;
+      } else {
+	// created by online resharding
+	auto rs = db.online_reshard.load();
+	ceph_assert(rs && rs->ids.count(column_family_id));
+	prefix = rs->prefix;
+      }
       key = key_in.ToString();
     }
     seen << " prefix = " << prefix;
@@ -1535,7 +1785,334 @@ struct RocksDBStore::RocksWBHandler: public rocksdb::WriteBatch::Handler {
   bool Continue() override { return num_seen < 50; }
 };
 
-int RocksDBStore::submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Transaction t) 
+/**
+ * Re-routes a batch whose ops for the column being resharded online were
+ * routed for an earlier online_reshard_t::state than the current one.
+ *
+ * A batch built before resharding started only knows the old layout, so each
+ * of its ops on the column is replayed by key against the current layout.  A
+ * batch built while COPYING already wrote to the new layout and evicted from
+ * the old one; once DONE only its ops on the dropped surplus column families
+ * have to go.
+ */
+struct RocksDBStore::OnlineReshardWBHandler : public rocksdb::WriteBatch::Handler {
+  RocksDBStore& db;
+  online_reshard_t& rs;
+  int built_state;
+  rocksdb::WriteBatch& out;
+
+  OnlineReshardWBHandler(RocksDBStore& db, online_reshard_t& rs,
+			 int built_state, rocksdb::WriteBatch& out)
+    : db(db), rs(rs), built_state(built_state), out(out) {}
+
+  rocksdb::ColumnFamilyHandle* get_cf(uint32_t column_family_id) {
+    auto p = rs.handles_by_id.find(column_family_id);
+    ceph_assert(p != rs.handles_by_id.end());
+    return p->second;
+  }
+  // true if the op is to be copied unchanged
+  bool keep(uint32_t column_family_id) {
+    return rs.ids.count(column_family_id) == 0 ||
+      (built_state != 0 && rs.surplus_ids.count(column_family_id) == 0);
+  }
+
+  rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice& key,
+			const rocksdb::Slice& value) override {
+    if (keep(column_family_id)) {
+      out.Put(get_cf(column_family_id), key, value);
+    } else if (built_state == 0) {
+      rocksdb::ColumnFamilyHandle *to, *from;
+      db.get_online_reshard_cfs(rs, rs.state, key.data(), key.size(), &to, &from);
+      out.Put(to, key, value);
+      if (from) {
+	out.Delete(from, key);
+      }
+    }
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status DeleteCF(uint32_t column_family_id,
+			   const rocksdb::Slice& key) override {
+    if (keep(column_family_id)) {
+      out.Delete(get_cf(column_family_id), key);
+    } else if (built_state == 0) {
+      rocksdb::ColumnFamilyHandle *to, *from;
+      db.get_online_reshard_cfs(rs, rs.state, key.data(), key.size(), &to, &from);
+      out.Delete(to, key);
+      if (from) {
+	out.Delete(from, key);
+      }
+    }
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status SingleDeleteCF(uint32_t column_family_id,
+				 const rocksdb::Slice& key) override {
+    if (rs.ids.count(column_family_id) == 0) {
+      out.SingleDelete(get_cf(column_family_id), key);
+      return rocksdb::Status::OK();
+    }
+    return DeleteCF(column_family_id, key);
+  }
+  rocksdb::Status DeleteRangeCF(uint32_t column_family_id,
+				const rocksdb::Slice& begin_key,
+				const rocksdb::Slice& end_key) override {
+    if (keep(column_family_id)) {
+      out.DeleteRange(get_cf(column_family_id), begin_key, end_key);
+    } else if (built_state == 0) {
+      auto& handles = rs.state == online_reshard_t::DONE ? rs.to.handles : rs.all;
+      for (auto cf : handles) {
+	out.DeleteRange(cf, begin_key, end_key);
+      }
+    }
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status MergeCF(uint32_t column_family_id, const rocksdb::Slice& key,
+			  const rocksdb::Slice& value) override {
+    // columns with a merge operator are never resharded online
+    ceph_assert(rs.ids.count(column_family_id) == 0);
+    out.Merge(get_cf(column_family_id), key, value);
+    return rocksdb::Status::OK();
+  }
+  void LogData(const rocksdb::Slice& blob) override {
+    out.PutLogData(blob);
+  }
+};
+
+/**
+ * Notes the keys of the column being resharded online that a batch wrote,
+ * so that online_reshard_move_batch() does not move a value it read before.
+ */
+struct OnlineReshardTouchHandler : public rocksdb::WriteBatch::Handler {
+  const std::unordered_set<uint32_t>& ids;
+  std::vector<std::string> keys;
+  bool range = false;
+
+  explicit OnlineReshardTouchHandler(const std::unordered_set<uint32_t>& ids)
+    : ids(ids) {}
+
+  void note(uint32_t column_family_id, const rocksdb::Slice& key) {
+    if (ids.count(column_family_id)) {
+      keys.emplace_back(key.ToString());
+    }
+  }
+  rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice& key,
+			const rocksdb::Slice& value) override {
+    note(column_family_id, key);
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status DeleteCF(uint32_t column_family_id,
+			   const rocksdb::Slice& key) override {
+    note(column_family_id, key);
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status SingleDeleteCF(uint32_t column_family_id,
+				 const rocksdb::Slice& key) override {
+    note(column_family_id, key);
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status DeleteRangeCF(uint32_t column_family_id,
+				const rocksdb::Slice& begin_key,
+				const rocksdb::Slice& end_key) override {
+    range |= ids.count(column_family_id) > 0;
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status MergeCF(uint32_t column_family_id, const rocksdb::Slice& key,
+			  const rocksdb::Slice& value) override {
+    return rocksdb::Status::OK();
+  }
+};
+
+void RocksDBStore::online_reshard_unlocked_write_done()
+{
+  // only online_reshard_publish() waits, and only once it has published
+  if (online_reshard_unlocked_writes.fetch_sub(1) == 1 &&
+      online_reshard.load()) {
+    std::lock_guard l(online_reshard_writes_lock);
+    online_reshard_writes_cond.notify_all();
+  }
+}
+
+RocksDBStore::OnlineReshardWriteGuard::OnlineReshardWriteGuard(RocksDBStore& db)
+  : db(db)
+{
+  // pairs with online_reshard_publish(): either it sees this submit counted,
+  // or this submit sees the reshard
+  db.online_reshard_unlocked_writes.fetch_add(1);
+  rs = db.online_reshard.load();
+  if (!rs) {
+    unlocked = true;
+    return;
+  }
+  db.online_reshard_unlocked_write_done();
+  if (rs->state != online_reshard_t::DONE) {
+    // DONE is final, COPYING may end under us
+    l = std::shared_lock(db.online_reshard_lock);
+  }
+}
+
+void RocksDBStore::OnlineReshardWriteGuard::release()
+{
+  if (unlocked) {
+    db.online_reshard_unlocked_write_done();
+    unlocked = false;
+  }
+  if (!l.owns_lock()) {
+    return;
+  }
+  if (bat && rs->tracking) {
+    // noted after the write, which online_reshard_move_batch() relies on
+    OnlineReshardTouchHandler h(rs->ids);
+    bat->Iterate(&h);
+    if (h.range || !h.keys.empty()) {
+      std::lock_guard tl(rs->touched_lock);
+      if (rs->tracking) {
+	rs->touched_range |= h.range;
+	for (auto& k : h.keys) {
+	  rs->touched.emplace(std::move(k));
+	}
+      }
+    }
+  }
+  l.unlock();
+}
+
+/**
+ * Merges the batches of several transactions into one.
+ *
+ * Ops are collected first and written out once the last batch was seen, so
+ * that a put superseded by a later put of the same key can be left out.  Only
+ * puts are dropped, and only in favour of a put: a (single) delete or merge in
+ * between keeps the earlier put, as SingleDelete and merge operands depend on
+ * it.  Slices point into the source batches, which must outlive the handler.
+ */
+struct RocksDBStore::CoalesceWBHandler : public rocksdb::WriteBatch::Handler {
+  enum op_type_t {
+    OP_PUT,
+    OP_DELETE,
+    OP_SINGLE_DELETE,
+    OP_DELETE_RANGE,
+    OP_MERGE,
+    OP_LOG_DATA,
+  };
+  struct op_t {
+    op_type_t type;
+    uint32_t column_family_id;
+    rocksdb::Slice key;
+    rocksdb::Slice value;  ///< value, range end or log blob
+    bool dropped = false;
+  };
+  struct cf_key_hash {
+    size_t operator()(const std::pair<uint32_t, std::string_view>& k) const {
+      return std::hash<std::string_view>()(k.second) ^ k.first;
+    }
+  };
+
+  RocksDBStore& db;
+  std::vector<op_t> ops;
+  /// (column family, key) -> index of the latest put a later put may replace
+  std::unordered_map<std::pair<uint32_t, std::string_view>, size_t,
+		     cf_key_hash> last_put;
+  uint64_t dropped = 0;
+
+  explicit CoalesceWBHandler(RocksDBStore& db) : db(db) {}
+
+  static std::pair<uint32_t, std::string_view> cf_key(
+    uint32_t column_family_id, const rocksdb::Slice& key) {
+    return {column_family_id, std::string_view(key.data(), key.size())};
+  }
+
+  rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice& key,
+			const rocksdb::Slice& value) override {
+    auto [p, inserted] = last_put.try_emplace(cf_key(column_family_id, key),
+					      ops.size());
+    if (!inserted) {
+      ops[p->second].dropped = true;
+      ++dropped;
+      p->second = ops.size();
+    }
+    ops.push_back({OP_PUT, column_family_id, key, value});
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status DeleteCF(uint32_t column_family_id,
+			   const rocksdb::Slice& key) override {
+    last_put.erase(cf_key(column_family_id, key));
+    ops.push_back({OP_DELETE, column_family_id, key, {}});
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status SingleDeleteCF(uint32_t column_family_id,
+				 const rocksdb::Slice& key) override {
+    last_put.erase(cf_key(column_family_id, key));
+    ops.push_back({OP_SINGLE_DELETE, column_family_id, key, {}});
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status DeleteRangeCF(uint32_t column_family_id,
+				const rocksdb::Slice& begin_key,
+				const rocksdb::Slice& end_key) override {
+    // a later put of a key in the range still supersedes an earlier one
+    ops.push_back({OP_DELETE_RANGE, column_family_id, begin_key, end_key});
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status MergeCF(uint32_t column_family_id, const rocksdb::Slice& key,
+			  const rocksdb::Slice& value) override {
+    last_put.erase(cf_key(column_family_id, key));
+    ops.push_back({OP_MERGE, column_family_id, key, value});
+    return rocksdb::Status::OK();
+  }
+  void LogData(const rocksdb::Slice& blob) override {
+    ops.push_back({OP_LOG_DATA, 0, {}, blob});
+  }
+
+  void build(rocksdb::WriteBatch& out) {
+    for (auto& op : ops) {
+      if (op.dropped) {
+	continue;
+      }
+      if (op.type == OP_LOG_DATA) {
+	out.PutLogData(op.value);
+	continue;
+      }
+      auto cf = db.get_cf_by_id(op.column_family_id);
+      switch (op.type) {
+      case OP_PUT:
+	out.Put(cf, op.key, op.value);
+	break;
+      case OP_DELETE:
+	out.Delete(cf, op.key);
+	break;
+      case OP_SINGLE_DELETE:
+	out.SingleDelete(cf, op.key);
+	break;
+      case OP_DELETE_RANGE:
+	out.DeleteRange(cf, op.key, op.value);
+	break;
+      case OP_MERGE:
+	out.Merge(cf, op.key, op.value);
+	break;
+      default:
+	ceph_abort();
+      }
+    }
+  }
+};
+
+rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_by_id(uint32_t column_family_id)
+{
+  if (auto rs = online_reshard.load()) {
+    auto p = rs->handles_by_id.find(column_family_id);
+    if (p != rs->handles_by_id.end()) {
+      return p->second;
+    }
+  }
+  if (column_family_id == default_cf->GetID()) {
+    return default_cf;
+  }
+  auto p = cf_ids_to_handle.find(column_family_id);
+  ceph_assert(p != cf_ids_to_handle.end());
+  return p->second;
+}
+
+int RocksDBStore::do_write(rocksdb::WriteOptions& woptions,
+			   rocksdb::WriteBatch* bat,
+			   OnlineReshardWriteGuard& reshard_guard)
 {
   // enable rocksdb breakdown
   // considering performance overhead, default is disabled
@@ -1544,21 +2121,23 @@ int RocksDBStore::submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Tra
     rocksdb::get_perf_context()->Reset();
   }
 
-  RocksDBTransactionImpl * _t =
-    static_cast<RocksDBTransactionImpl *>(t.get());
   woptions.disableWAL = disableWAL;
+
   lgeneric_subdout(cct, rocksdb, 30) << __func__;
   RocksWBHandler bat_txc(*this);
-  _t->bat.Iterate(&bat_txc);
+  bat->Iterate(&bat_txc);
   *_dout << " Rocksdb transaction: " << bat_txc.seen.str() << dendl;
   
-  rocksdb::Status s = db->Write(woptions, &_t->bat);
+  reshard_guard.set_batch(bat);
+  rocksdb::Status s = db->Write(woptions, bat);
+  reshard_guard.release();
   if (!s.ok()) {
     RocksWBHandler rocks_txc(*this);
-    _t->bat.Iterate(&rocks_txc);
+    bat->Iterate(&rocks_txc);
     derr << __func__ << " error: " << s.ToString() << " code = " << s.code()
          << " Rocksdb transaction: " << rocks_txc.seen.str() << dendl;
   }
+  bytes_since_sync += bat->GetDataSize();
 
   if (cct->_conf->rocksdb_perf) {
     utime_t write_memtable_time;
@@ -1582,6 +2161,24 @@ int RocksDBStore::submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Tra
   return s.ok() ? 0 : -1;
 }
 
+int RocksDBStore::submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Transaction t) 
+{
+  RocksDBTransactionImpl * _t =
+    static_cast<RocksDBTransactionImpl *>(t.get());
+
+  // keeps online resharding from moving keys or switching layouts under us
+  OnlineReshardWriteGuard reshard_guard(*this);
+  rocksdb::WriteBatch* bat = &_t->bat;
+  rocksdb::WriteBatch rerouted;
+  if (auto rs = reshard_guard.rs;
+      rs && _t->reshard_state != rs->state) {
+    OnlineReshardWBHandler h(*this, *rs, _t->reshard_state, rerouted);
+    _t->bat.Iterate(&h);
+    bat = &rerouted;
+  }
+  return do_write(woptions, bat, reshard_guard);
+}
+
 int RocksDBStore::submit_transaction(KeyValueDB::Transaction t) 
 {
   utime_t start = ceph_clock_now();
@@ -1608,12 +2205,120 @@ int RocksDBStore::submit_transaction_sync(KeyValueDB::Transaction t)
   utime_t lat = ceph_clock_now() - start;
   logger->tinc(l_rocksdb_submit_sync_latency, lat);
 
+  uint64_t synced = bytes_since_sync.exchange(0);
+  {
+    std::lock_guard l(write_hist_lock);
+    write_hist.sync_bytes_hist[write_hist.get_pow2_slab(synced)]++;
+  }
   return result;
 }
 
+int RocksDBStore::submit_coalesced(std::vector<KeyValueDB::Transaction>& tl,
+				   size_t begin, size_t end)
+{
+  rocksdb::WriteOptions woptions;
+  woptions.sync = false;
+
+  OnlineReshardWriteGuard reshard_guard(*this);
+  auto rs = reshard_guard.rs;
+  std::list<rocksdb::WriteBatch> rerouted;
+  CoalesceWBHandler h(*this);
+  for (size_t i = begin; i < end; ++i) {
+    auto _t = static_cast<RocksDBTransactionImpl *>(tl[i].get());
+    rocksdb::WriteBatch* bat = &_t->bat;
+    if (rs && _t->reshard_state != rs->state) {
+      OnlineReshardWBHandler rh(*this, *rs, _t->reshard_state,
+				rerouted.emplace_back());
+      _t->bat.Iterate(&rh);
+      bat = &rerouted.back();
+    }
+    bat->Iterate(&h);
+  }
+  rocksdb::WriteBatch merged;
+  h.build(merged);
+  dout(20) << __func__ << " " << (end - begin) << " transactions, "
+	   << h.ops.size() << " ops, " << h.dropped << " superseded puts, "
+	   << merged.GetDataSize() << " bytes" << dendl;
+  logger->inc(l_rocksdb_coalesce_batches);
+  logger->inc(l_rocksdb_coalesce_txns, end - begin);
+  logger->inc(l_rocksdb_coalesce_dedup_keys, h.dropped);
+  return do_write(woptions, &merged, reshard_guard);
+}
+
+/*
+ * Transactions are packed, in order, into write batches of up to
+ * coalesce_bytes.  That limit follows the observed write latency: it is
+ * halved whenever a write takes longer than the target, which is mostly WAL
+ * append time, and grows by an eighth while writes stay below it.
+ */
+int RocksDBStore::submit_transactions(std::vector<KeyValueDB::Transaction>& tl)
+{
+  uint64_t max_bytes =
+    cct->_conf.get_val<Option::size_t>("rocksdb_write_coalesce_max_bytes");
+  if (max_bytes == 0 || tl.size() < 2) {
+    return KeyValueDB::submit_transactions(tl);
+  }
+  uint64_t min_bytes = std::min<uint64_t>(
+    max_bytes,
+    cct->_conf.get_val<Option::size_t>("rocksdb_write_coalesce_min_bytes"));
+  double target =
+    cct->_conf.get_val<double>("rocksdb_write_coalesce_target_latency");
+  uint64_t limit = coalesce_bytes;
+  limit = limit ? std::clamp(limit, min_bytes, max_bytes) : max_bytes;
+
+  auto bat_size = [&](size_t i) {
+    return static_cast<RocksDBTransactionImpl *>(tl[i].get())->bat.GetDataSize();
+  };
+  int r = 0;
+  size_t pos = 0;
+  while (pos < tl.size()) {
+    size_t end = pos + 1;
+    uint64_t bytes = bat_size(pos);
+    while (end < tl.size() && bytes + bat_size(end) <= limit) {
+      bytes += bat_size(end++);
+    }
+    utime_t start = ceph_clock_now();
+    if (end - pos == 1) {
+      r = submit_transaction(tl[pos]);
+    } else {
+      r = submit_coalesced(tl, pos, end);
+    }
+    if (r < 0) {
+      break;
+    }
+    utime_t lat = ceph_clock_now() - start;
+    if (end - pos > 1) {
+      logger->tinc(l_rocksdb_coalesce_lat, lat);
+    }
+    if ((double)lat > target) {
+      limit = std::max(min_bytes, limit / 2);
+    } else {
+      limit = std::min(max_bytes, limit + limit / 8);
+    }
+    {
+      std::lock_guard l(write_hist_lock);
+      write_hist.batch_size_hist[write_hist.get_pow2_slab(end - pos)]++;
+    }
+    pos = end;
+  }
+  coalesce_bytes = limit;
+  logger->set(l_rocksdb_coalesce_bytes_limit, limit);
+  return r;
+}
+
+void RocksDBStore::dump_write_histogram(Formatter *f)
+{
+  f->dump_unsigned("coalesce_bytes_limit", coalesce_bytes);
+  std::lock_guard l(write_hist_lock);
+  write_hist.dump_write_hist(f);
+}
+
 RocksDBStore::RocksDBTransactionImpl::RocksDBTransactionImpl(RocksDBStore *_db)
 {
   db = _db;
+  if (auto rs = db->online_reshard.load()) {
+    reshard_state = rs->state;
+  }
 }
 
 void RocksDBStore::RocksDBTransactionImpl::put_bat(
@@ -1642,6 +2347,15 @@ void RocksDBStore::RocksDBTransactionImpl::set(
   const string &k,
   const bufferlist &to_set_bl)
 {
+  if (auto rs = reshard_state ? db->get_online_reshard(prefix) : nullptr) {
+    rocksdb::ColumnFamilyHandle *to, *from;
+    db->get_online_reshard_cfs(*rs, reshard_state, k.data(), k.size(), &to, &from);
+    put_bat(bat, to, k, to_set_bl);
+    if (from) {
+      bat.Delete(from, rocksdb::Slice(k));
+    }
+    return;
+  }
   auto cf = db->get_cf_handle(prefix, k);
   if (cf) {
     put_bat(bat, cf, k, to_set_bl);
@@ -1656,6 +2370,16 @@ void RocksDBStore::RocksDBTransactionImpl::set(
   const char *k, size_t keylen,
   const bufferlist &to_set_bl)
 {
+  if (auto rs = reshard_state ? db->get_online_reshard(prefix) : nullptr) {
+    rocksdb::ColumnFamilyHandle *to, *from;
+    db->get_online_reshard_cfs(*rs, reshard_state, k, keylen, &to, &from);
+    string key(k, keylen);
+    put_bat(bat, to, key, to_set_bl);
+    if (from) {
+      bat.Delete(from, rocksdb::Slice(key));
+    }
+    return;
+  }
   auto cf = db->get_cf_handle(prefix, k, keylen);
   if (cf) {
     string key(k, keylen);  // fixme?
@@ -1670,6 +2394,15 @@ void RocksDBStore::RocksDBTransactionImpl::set(
 void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 					         const string &k)
 {
+  if (auto rs = reshard_state ? db->get_online_reshard(prefix) : nullptr) {
+    rocksdb::ColumnFamilyHandle *to, *from;
+    db->get_online_reshard_cfs(*rs, reshard_state, k.data(), k.size(), &to, &from);
+    bat.Delete(to, rocksdb::Slice(k));
+    if (from) {
+      bat.Delete(from, rocksdb::Slice(k));
+    }
+    return;
+  }
   auto cf = db->get_cf_handle(prefix, k);
   if (cf) {
     bat.Delete(cf, rocksdb::Slice(k));
@@ -1682,6 +2415,15 @@ void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 					         const char *k,
 						 size_t keylen)
 {
+  if (auto rs = reshard_state ? db->get_online_reshard(prefix) : nullptr) {
+    rocksdb::ColumnFamilyHandle *to, *from;
+    db->get_online_reshard_cfs(*rs, reshard_state, k, keylen, &to, &from);
+    bat.Delete(to, rocksdb::Slice(k, keylen));
+    if (from) {
+      bat.Delete(from, rocksdb::Slice(k, keylen));
+    }
+    return;
+  }
   auto cf = db->get_cf_handle(prefix, k, keylen);
   if (cf) {
     bat.Delete(cf, rocksdb::Slice(k, keylen));
@@ -1695,6 +2437,12 @@ void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 void RocksDBStore::RocksDBTransactionImpl::rm_single_key(const string &prefix,
 					                 const string &k)
 {
+  if (reshard_state && db->get_online_reshard(prefix)) {
+    // the key may have been put to both layouts since its last delete,
+    // which SingleDelete does not cope with
+    rmkey(prefix, k);
+    return;
+  }
   auto cf = db->get_cf_handle(prefix, k);
   if (cf) {
     bat.SingleDelete(cf, k);
@@ -1724,8 +2472,20 @@ void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix
       bat.PopSavePoint();
     }
   } else {
-    ceph_assert(p_iter->second.handles.size() >= 1);
-    for (auto cf : p_iter->second.handles) {
+    auto handles = &p_iter->second.handles;
+    if (auto rs = reshard_state ? db->get_online_reshard(prefix) : nullptr) {
+      if (reshard_state == online_reshard_t::COPYING) {
+	// keys may move between the layouts before this is submitted, so
+	// a listing taken now can miss some
+	for (auto cf : rs->all) {
+	  bat.DeleteRange(cf, string(), "\xff\xff\xff\xff");
+	}
+	return;
+      }
+      handles = &rs->to.handles;
+    }
+    ceph_assert(handles->size() >= 1);
+    for (auto cf : *handles) {
       uint64_t cnt = db->get_delete_range_threshold();
       bat.SetSavePoint();
       auto it = db->new_shard_iterator(cf);
@@ -1753,6 +2513,19 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
 		     << " end=" << pretty_binary_string(end) << dendl;
   auto p_iter = db->cf_handles.find(prefix);
   uint64_t cnt = db->get_delete_range_threshold();
+  const std::vector<rocksdb::ColumnFamilyHandle*>* handles = nullptr;
+  if (p_iter != db->cf_handles.end()) {
+    handles = &p_iter->second.handles;
+    if (auto rs = reshard_state ? db->get_online_reshard(prefix) : nullptr) {
+      if (reshard_state == online_reshard_t::COPYING) {
+	// same as rmkeys_by_prefix
+	handles = &rs->all;
+	cnt = 0;
+      } else {
+	handles = &rs->to.handles;
+      }
+    }
+  }
   if (p_iter == db->cf_handles.end()) {
     uint64_t cnt0 = cnt;
     bat.SetSavePoint();
@@ -1776,8 +2549,8 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
       bat.PopSavePoint();
     }
   } else if (cnt == 0) {
-    ceph_assert(p_iter->second.handles.size() >= 1);
-    for (auto cf : p_iter->second.handles) {
+    ceph_assert(handles->size() >= 1);
+    for (auto cf : *handles) {
       ldout(db->cct, 10) << __func__ << " p_iter != end(), resorting to DeleteRange"
 			   << dendl;
 	bat.DeleteRange(cf, rocksdb::Slice(start), rocksdb::Slice(end));
@@ -1786,8 +2559,8 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
     auto bounds = KeyValueDB::IteratorBounds();
     bounds.lower_bound = start;
     bounds.upper_bound = end;
-    ceph_assert(p_iter->second.handles.size() >= 1);
-    for (auto cf : p_iter->second.handles) {
+    ceph_assert(handles->size() >= 1);
+    for (auto cf : *handles) {
       cnt = db->get_delete_range_threshold();
       uint64_t cnt0 = cnt;
       bat.SetSavePoint();
@@ -1858,8 +2631,59 @@ int RocksDBStore::get(
     const std::set<string> &keys,
     std::map<string, bufferlist> *out)
 {
-  rocksdb::PinnableSlice value;
   utime_t start = ceph_clock_now();
+#if (ROCKSDB_MAJOR >= 7 || (ROCKSDB_MAJOR == 6 && ROCKSDB_MINOR >= 22))
+  // one batched lookup: MultiGet shares the memtable/version references
+  // and coalesces block reads for keys that land in the same SST block
+  const size_t n = keys.size();
+  if (n == 0) {
+    return 0;
+  }
+  const bool sharded = cf_handles.count(prefix) > 0;
+  std::vector<rocksdb::ColumnFamilyHandle*> cfs(n, default_cf);
+  std::vector<string> combined;
+  std::vector<rocksdb::Slice> slices(n);
+  std::vector<rocksdb::PinnableSlice> values(n);
+  std::vector<rocksdb::Status> statuses(n);
+  if (!sharded) {
+    combined.reserve(n);
+  }
+  size_t i = 0;
+  for (auto& key : keys) {
+    if (sharded) {
+      cfs[i] = get_cf_handle(prefix, key);
+      slices[i] = rocksdb::Slice(key);
+    } else {
+      combined.push_back(combine_strings(prefix, key));
+      slices[i] = rocksdb::Slice(combined.back());
+    }
+    ++i;
+  }
+  // keys come from a std::set, so with a single prefix they stay sorted
+  db->MultiGet(rocksdb::ReadOptions(), n, cfs.data(), slices.data(),
+	       values.data(), statuses.data(), !sharded);
+  if (sharded && online_reshard.load()) {
+    for (i = 0; i < n; ++i) {
+      if (statuses[i].IsNotFound()) {
+	statuses[i] = get_moved_key(prefix, slices[i].data(), slices[i].size(),
+				    cfs[i], &values[i]);
+      }
+    }
+  }
+  i = 0;
+  for (auto& key : keys) {
+    if (statuses[i].ok()) {
+      (*out)[key].append(values[i].data(), values[i].size());
+    } else if (!statuses[i].IsNotFound()) {
+      // as the single key get(): anything but a miss is fatal, a batch
+      // must not silently lose e.g. a corruption or an incomplete read
+      ceph_abort_msg(statuses[i].getState());
+    }
+    ++i;
+  }
+  logger->inc(l_rocksdb_multiget_keys, n);
+#else
+  rocksdb::PinnableSlice value;
   if (cf_handles.count(prefix) > 0) {
     for (auto& key : keys) {
       auto cf_handle = get_cf_handle(prefix, key);
@@ -1867,6 +2691,9 @@ int RocksDBStore::get(
 			    cf_handle,
 			    rocksdb::Slice(key),
 			    &value);
+      if (status.IsNotFound()) {
+	status = get_moved_key(prefix, key.data(), key.size(), cf_handle, &value);
+      }
       if (status.ok()) {
 	(*out)[key].append(value.data(), value.size());
       } else if (status.IsIOError()) {
@@ -1889,6 +2716,7 @@ int RocksDBStore::get(
       value.Reset();
     }
   }
+#endif
   utime_t lat = ceph_clock_now() - start;
   logger->tinc(l_rocksdb_get_latency, lat);
   return 0;
@@ -1910,6 +2738,9 @@ int RocksDBStore::get(
 		cf,
 		rocksdb::Slice(key),
 		&value);
+    if (s.IsNotFound()) {
+      s = get_moved_key(prefix, key.data(), key.size(), cf, &value);
+    }
   } else {
     string k = combine_strings(prefix, key);
     s = db->Get(rocksdb::ReadOptions(),
@@ -1946,6 +2777,9 @@ int RocksDBStore::get(
 		cf,
 		rocksdb::Slice(key, keylen),
 		&value);
+    if (s.IsNotFound()) {
+      s = get_moved_key(prefix, key, keylen, cf, &value);
+    }
   } else {
     string k;
     combine_strings(prefix, key, keylen, &k);
@@ -1991,8 +2825,8 @@ void RocksDBStore::compact()
   logger->inc(l_rocksdb_compact);
   rocksdb::CompactRangeOptions options;
   db->CompactRange(options, default_cf, nullptr, nullptr);
-  for (auto cf : cf_handles) {
-    for (auto shard_cf : cf.second.handles) {
+  for (auto& cf : cf_handles) {
+    for (auto shard_cf : get_column_handles(cf.first, cf.second.handles)) {
       db->CompactRange(
 	options,
 	shard_cf,
@@ -2094,7 +2928,8 @@ void RocksDBStore::compact_range(const string& start, const string& end)
 			    const std::string& end) {
     rocksdb::Slice cstart(start);
     rocksdb::Slice cend(end);
-    for (const auto& shard_it : column_it->second.handles) {
+    for (const auto& shard_it : get_column_handles(column_it->first,
+						   column_it->second.handles)) {
       db->CompactRange(options, shard_it, &cstart, &cend);
     }
   };
@@ -2269,6 +3104,7 @@ public:
       iterate_upper_bound(make_slice(bounds.upper_bound))
       {
       auto options = rocksdb::ReadOptions();
+      options.auto_prefix_mode = true;
       if (db->cct->_conf->osd_rocksdb_iterator_bounds_enabled) {
         if (bounds.lower_bound) {
           options.iterate_lower_bound = &iterate_lower_bound;
@@ -2825,6 +3661,7 @@ public:
   {
     iters.reserve(shards.size());
     auto options = rocksdb::ReadOptions();
+    options.auto_prefix_mode = true;
     if (db->cct->_conf->osd_rocksdb_iterator_bounds_enabled) {
       if (bounds.lower_bound) {
         options.iterate_lower_bound = &iterate_lower_bound;
@@ -2833,9 +3670,10 @@ public:
         options.iterate_upper_bound = &iterate_upper_bound;
       }
     }
-    for (auto& s : shards) {
-      iters.push_back(db->db->NewIterator(options, s));
-    }
+    // one consistent view over all shards, so that a key moved between
+    // them by online resharding is seen exactly once
+    auto status = db->db->NewIterators(options, shards, &iters);
+    ceph_assert(status.ok());
   }
   ~ShardMergeIteratorImpl() {
     for (auto& it : iters) {
@@ -3009,6 +3847,17 @@ KeyValueDB::Iterator RocksDBStore::get_iterator(const std::string& prefix, Itera
 {
   auto cf_it = cf_handles.find(prefix);
   if (cf_it != cf_handles.end()) {
+    if (auto rs = get_online_reshard(prefix)) {
+      return std::make_shared<ShardMergeIteratorImpl>(
+        this,
+        prefix,
+        rs->state == online_reshard_t::DONE ? rs->to.handles : rs->all,
+        std::move(bounds));
+    }
+    // if resharding starts while the iterator is created, keys may have
+    // moved out of its view
+    KeyValueDB::Iterator it;
+    IteratorBounds b = bounds;
     rocksdb::ColumnFamilyHandle* cf = nullptr;
     if (cf_it->second.handles.size() == 1) {
       cf = cf_it->second.handles[0];
@@ -3016,18 +3865,22 @@ KeyValueDB::Iterator RocksDBStore::get_iterator(const std::string& prefix, Itera
       cf = check_cf_handle_bounds(cf_it, bounds);
     }
     if (cf) {
-      return std::make_shared<CFIteratorImpl>(
+      it = std::make_shared<CFIteratorImpl>(
               this,
               prefix,
               cf,
               std::move(bounds));
     } else {
-      return std::make_shared<ShardMergeIteratorImpl>(
+      it = std::make_shared<ShardMergeIteratorImpl>(
         this,
         prefix,
         cf_it->second.handles,
         std::move(bounds));
     }
+    if (get_online_reshard(prefix)) {
+      return get_iterator(prefix, opts, std::move(b));
+    }
+    return it;
   } else {
     // use wholespace engine if no cfs are configured
     // or use default cf otherwise as there is no
@@ -3098,6 +3951,12 @@ int RocksDBStore::prepare_for_reshard(const std::string& new_sharding,
     return -EINVAL;
   }
 
+  if (env->FileExists(online_reshard_file).ok()) {
+    derr << __func__ << " online resharding has not finished;"
+	 << " open the store to let it complete" << dendl;
+    return -EBUSY;
+  }
+
   //0. lock db from opening
   std::string stored_sharding_text;
   rocksdb::ReadFileToString(env,
@@ -3345,8 +4204,10 @@ int RocksDBStore::reshard(const std::string& new_sharding, const RocksDBStore::r
 			    const std::string& fixed_prefix)
   {
     dout(5) << " column=" << (void*)handle << " prefix=" << fixed_prefix << dendl;
+    rocksdb::ReadOptions read_options;
+    read_options.total_order_seek = true;
     std::unique_ptr<rocksdb::Iterator> it{
-      db->NewIterator(rocksdb::ReadOptions(), handle)};
+      db->NewIterator(read_options, handle)};
     ceph_assert(it);
 
     rocksdb::WriteBatch bat;
@@ -3360,7 +4221,7 @@ int RocksDBStore::reshard(const std::string& new_sharding, const RocksDBStore::r
 	bytes_per_iterator = 0;
 	keys_per_iterator = 0;
 	std::string raw_key_str = raw_key.ToString();
-	it.reset(db->NewIterator(rocksdb::ReadOptions(), handle));
+	it.reset(db->NewIterator(read_options, handle));
 	ceph_assert(it);
 	it->Seek(raw_key_str);
 	ceph_assert(it->Valid());
@@ -3486,3 +4347,482 @@ bool RocksDBStore::get_sharding(std::string& sharding) {
   }
   return result;
 }
+
+// Online resharding
+//
+// Moves the keys of a single column to a new shard count or hash range while
+// the store stays in use.  The intent is recorded in online_reshard_file as
+// "<sharding before>\n<sharding after>" before the first column family is
+// created; sharding_def_file switches to the new sharding once every key has
+// moved, and the marker goes away once the surplus column families are
+// dropped.  open() uses the two files to resume or finish the job.
+
+void RocksDBStore::get_online_reshard_cfs(online_reshard_t& rs, int state,
+					  const char* key, size_t keylen,
+					  rocksdb::ColumnFamilyHandle** to,
+					  rocksdb::ColumnFamilyHandle** from)
+{
+  *to = get_key_cf(rs.to, key, keylen);
+  *from = nullptr;
+  if (state == online_reshard_t::COPYING) {
+    auto cf = get_key_cf(rs.from, key, keylen);
+    if (cf != *to) {
+      *from = cf;
+    }
+  }
+}
+
+rocksdb::Status RocksDBStore::get_moved_key(const std::string& prefix,
+					    const char* key, size_t keylen,
+					    rocksdb::ColumnFamilyHandle* tried,
+					    rocksdb::PinnableSlice* value)
+{
+  // looked up after the old location missed: keys only move from the old
+  // layout to the new one, so the key is either here or gone
+  if (auto rs = get_online_reshard(prefix)) {
+    auto cf = get_key_cf(rs->to, key, keylen);
+    if (cf != tried) {
+      value->Reset();
+      return db->Get(rocksdb::ReadOptions(), cf,
+		     rocksdb::Slice(key, keylen), value);
+    }
+  }
+  return rocksdb::Status::NotFound();
+}
+
+int RocksDBStore::find_online_reshard_column(const std::string& from_text,
+					     const std::string& to_text,
+					     ColumnFamily* from_column,
+					     ColumnFamily* to_column)
+{
+  std::vector<ColumnFamily> from_def;
+  std::vector<ColumnFamily> to_def;
+  if (!parse_sharding_def(from_text, from_def) ||
+      !parse_sharding_def(to_text, to_def) ||
+      from_def.size() != to_def.size()) {
+    return -EINVAL;
+  }
+  auto by_name = [](const ColumnFamily& a, const ColumnFamily& b) {
+    return a.name < b.name;
+  };
+  std::sort(from_def.begin(), from_def.end(), by_name);
+  std::sort(to_def.begin(), to_def.end(), by_name);
+  std::optional<size_t> changed;
+  for (size_t i = 0; i < from_def.size(); i++) {
+    auto& a = from_def[i];
+    auto& b = to_def[i];
+    if (a.name != b.name || a.options != b.options) {
+      return -EINVAL;
+    }
+    if (a.shard_cnt != b.shard_cnt || a.hash_l != b.hash_l || a.hash_h != b.hash_h) {
+      if (changed) {
+	return -EINVAL;
+      }
+      changed = i;
+    }
+  }
+  if (!changed) {
+    return -EINVAL;
+  }
+  *from_column = from_def[*changed];
+  *to_column = to_def[*changed];
+  return 0;
+}
+
+int RocksDBStore::online_reshard_setup(
+  online_reshard_t& rs,
+  const ColumnFamily& from_column,
+  const ColumnFamily& to_column,
+  const std::map<std::string, rocksdb::ColumnFamilyHandle*>& opened,
+  bool create)
+{
+  auto p = cf_handles.find(from_column.name);
+  ceph_assert(p != cf_handles.end());
+  rs.prefix = from_column.name;
+  rs.from = p->second;
+  rs.to.hash_l = to_column.hash_l;
+  rs.to.hash_h = to_column.hash_h;
+  rs.to.handles.resize(to_column.shard_cnt, nullptr);
+  rs.all = rs.from.handles;
+  for (auto& i : opened) {
+    rs.owned.push_back(i.second);
+  }
+
+  std::map<std::string, rocksdb::ColumnFamilyHandle*> from_by_name;
+  for (size_t i = 0; i < rs.from.handles.size(); i++) {
+    from_by_name[shard_cf_name(from_column, i)] = rs.from.handles[i];
+  }
+  // new shards share the options, and so the block cache, of the old ones
+  rocksdb::ColumnFamilyOptions cf_opt(db->GetOptions(rs.from.handles[0]));
+  std::set<std::string> to_names;
+  for (size_t i = 0; i < to_column.shard_cnt; i++) {
+    std::string name = shard_cf_name(to_column, i);
+    to_names.insert(name);
+    if (auto q = from_by_name.find(name); q != from_by_name.end()) {
+      rs.to.handles[i] = q->second;
+      continue;
+    }
+    rocksdb::ColumnFamilyHandle* cf = nullptr;
+    if (auto q = opened.find(name); q != opened.end()) {
+      cf = q->second;
+    } else if (create) {
+      auto status = db->CreateColumnFamily(cf_opt, name, &cf);
+      if (!status.ok()) {
+	derr << __func__ << " failed to create column family " << name
+	     << ": " << status.ToString() << dendl;
+	return -EIO;
+      }
+      dout(10) << __func__ << " created column family " << name << dendl;
+      rs.owned.push_back(cf);
+    } else {
+      dout(1) << __func__ << " column family " << name
+	      << " was not created yet" << dendl;
+      return -ENOENT;
+    }
+    rs.to.handles[i] = cf;
+    rs.all.push_back(cf);
+  }
+  for (auto& [name, cf] : from_by_name) {
+    if (to_names.count(name) == 0) {
+      rs.surplus.push_back(cf);
+      rs.surplus_ids.insert(cf->GetID());
+    }
+  }
+  for (auto cf : rs.all) {
+    rs.ids.insert(cf->GetID());
+  }
+  rs.handles_by_id[default_cf->GetID()] = default_cf;
+  for (auto& [name, shards] : cf_handles) {
+    for (auto cf : shards.handles) {
+      rs.handles_by_id[cf->GetID()] = cf;
+    }
+  }
+  for (auto cf : rs.owned) {
+    rs.handles_by_id[cf->GetID()] = cf;
+  }
+  rs.started = ceph_clock_now();
+  return 0;
+}
+
+int RocksDBStore::online_reshard_resume(
+  const ColumnFamily& from_column,
+  const ColumnFamily& to_column,
+  const std::string& from_text,
+  const std::string& to_text,
+  bool done,
+  const std::map<std::string, rocksdb::ColumnFamilyHandle*>& opened,
+  bool read_only)
+{
+  if (done) {
+    // switched over, but the old shards were not all dropped yet
+    for (auto& [name, cf] : opened) {
+      if (!read_only) {
+	dout(1) << __func__ << " dropping column family " << name << dendl;
+	auto status = db->DropColumnFamily(cf);
+	if (!status.ok()) {
+	  derr << __func__ << " failed to drop column family " << name
+	       << ": " << status.ToString() << dendl;
+	  return -EIO;
+	}
+      }
+      db->DestroyColumnFamilyHandle(cf);
+    }
+    if (!read_only) {
+      env->DeleteFile(online_reshard_file);
+    }
+    return 0;
+  }
+  auto rs = std::make_unique<online_reshard_t>();
+  rs->from_text = from_text;
+  rs->to_text = to_text;
+  int r = online_reshard_setup(*rs, from_column, to_column, opened, !read_only);
+  if (r < 0) {
+    // close() still has to release the handles
+    online_reshard_state = std::move(rs);
+    // the new layout was never complete, so no key has moved yet
+    return r == -ENOENT ? 0 : r;
+  }
+  online_reshard_publish(std::move(rs));
+  return 0;
+}
+
+void RocksDBStore::online_reshard_publish(std::unique_ptr<online_reshard_t> rs)
+{
+  {
+    std::unique_lock l(online_reshard_lock);
+    online_reshard_state = std::move(rs);
+    online_reshard = online_reshard_state.get();
+  }
+  // submits that did not see it yet were routed for the old layout, and
+  // have to land before any key moves; those that do see it go ahead
+  // under the shared lock meanwhile
+  std::unique_lock l(online_reshard_writes_lock);
+  online_reshard_writes_cond.wait(l, [this] {
+    return online_reshard_unlocked_writes.load() == 0;
+  });
+}
+
+int RocksDBStore::start_online_reshard(const std::string& new_sharding)
+{
+  std::lock_guard l(online_reshard_stop_lock);
+  if (online_reshard_state) {
+    dout(1) << __func__ << " column " << online_reshard_state->prefix
+	    << " was already resharded; reopen the store first" << dendl;
+    return -EBUSY;
+  }
+  std::string current;
+  get_sharding(current);
+  ColumnFamily from_column("", 1, "", 0, 0);
+  ColumnFamily to_column("", 1, "", 0, 0);
+  if (find_online_reshard_column(current, new_sharding,
+				 &from_column, &to_column) < 0) {
+    derr << __func__ << " cannot go from '" << current << "' to '"
+	 << new_sharding << "' online; only the shard count or hash range of a"
+	 << " single column may change" << dendl;
+    return -EINVAL;
+  }
+  for (auto& p : merge_ops) {
+    if (p.first == from_column.name) {
+      derr << __func__ << " column " << from_column.name
+	   << " has a merge operator; reshard it offline" << dendl;
+      return -EOPNOTSUPP;
+    }
+  }
+
+  env->CreateDir(sharding_def_dir);
+  auto status = rocksdb::WriteStringToFile(env, current + "\n" + new_sharding,
+					   online_reshard_file, true);
+  if (!status.ok()) {
+    derr << __func__ << " cannot write to " << online_reshard_file << dendl;
+    return -EIO;
+  }
+  auto rs = std::make_unique<online_reshard_t>();
+  rs->from_text = current;
+  rs->to_text = new_sharding;
+  int r = online_reshard_setup(*rs, from_column, to_column, {}, true);
+  if (r < 0) {
+    // open() takes it from here
+    online_reshard_state = std::move(rs);
+    return r;
+  }
+  dout(1) << __func__ << " " << from_column << " -> " << to_column << dendl;
+  online_reshard_publish(std::move(rs));
+  online_reshard_stop = false;
+  online_reshard_thread.create("rocksdb_reshard");
+  return 0;
+}
+
+int RocksDBStore::online_reshard_move_batch(online_reshard_t& rs,
+					    rocksdb::ColumnFamilyHandle* cf,
+					    std::optional<std::string>& cursor,
+					    uint64_t keys_per_batch,
+					    uint64_t* bytes)
+{
+  // from here on submits note the keys they write, so that none of them is
+  // overwritten below with the stale value read now
+  {
+    std::lock_guard tl(rs.touched_lock);
+    rs.touched.clear();
+    rs.touched_range = false;
+    rs.tracking = true;
+  }
+  auto stop_tracking = make_scope_guard([&rs] {
+    std::lock_guard tl(rs.touched_lock);
+    rs.tracking = false;
+    rs.touched.clear();
+  });
+
+  // pick the keys that belong elsewhere, and their values, without holding
+  // up writers
+  auto start_cursor = cursor;
+  std::vector<std::pair<std::string, std::string>> kvs;
+  bool drained;
+  {
+    rocksdb::ReadOptions options;
+    options.fill_cache = false;
+    options.total_order_seek = true;
+    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(options, cf));
+    if (cursor) {
+      it->Seek(*cursor);
+      if (it->Valid() && it->key() == rocksdb::Slice(*cursor)) {
+	it->Next();
+      }
+    } else {
+      it->SeekToFirst();
+    }
+    uint64_t scanned = 0;
+    while (it->Valid() && kvs.size() < keys_per_batch &&
+	   scanned < keys_per_batch * 16) {
+      auto k = it->key();
+      if (get_key_cf(rs.to, k.data(), k.size()) != cf) {
+	kvs.emplace_back(k.ToString(), it->value().ToString());
+      }
+      cursor = k.ToString();
+      ++scanned;
+      it->Next();
+    }
+    if (!it->status().ok()) {
+      derr << __func__ << " iterator error: " << it->status().ToString() << dendl;
+      return -EIO;
+    }
+    drained = !it->Valid();
+  }
+  if (kvs.empty()) {
+    return drained ? 1 : 0;
+  }
+
+  // writers are only held off to drop the keys written since, and to write
+  utime_t start = ceph_clock_now();
+  uint64_t moved = 0;
+  {
+    std::unique_lock l(online_reshard_lock);
+    std::lock_guard tl(rs.touched_lock);
+    if (rs.touched_range) {
+      // keys read above may have been deleted since; read them again
+      dout(20) << __func__ << " range deleted, rescanning" << dendl;
+      cursor = start_cursor;
+      return 0;
+    }
+    rocksdb::WriteBatch bat;
+    for (auto& [k, v] : kvs) {
+      if (rs.touched.count(k)) {
+	// moved or removed by a writer
+	continue;
+      }
+      bat.Put(get_key_cf(rs.to, k.data(), k.size()), k, v);
+      bat.Delete(cf, k);
+      *bytes += k.size() + v.size();
+      ++moved;
+    }
+    rocksdb::WriteOptions woptions;
+    woptions.disableWAL = disableWAL;
+    auto status = db->Write(woptions, &bat);
+    if (!status.ok()) {
+      derr << __func__ << " write error: " << status.ToString() << dendl;
+      return -EIO;
+    }
+  }
+  rs.keys_moved += moved;
+  rs.bytes_moved += *bytes;
+  logger->inc(l_rocksdb_online_reshard_keys, moved);
+  logger->inc(l_rocksdb_online_reshard_bytes, *bytes);
+  logger->tinc(l_rocksdb_online_reshard_lat, ceph_clock_now() - start);
+  dout(20) << __func__ << " moved " << moved << " keys, " << *bytes
+	   << " bytes" << dendl;
+  return drained ? 1 : 0;
+}
+
+int RocksDBStore::online_reshard_finish(online_reshard_t& rs)
+{
+  // every move must be durable before the store opens with the new layout
+  rocksdb::Status status;
+  if (disableWAL) {
+    for (auto cf : rs.all) {
+      status = db->Flush(rocksdb::FlushOptions(), cf);
+      if (!status.ok()) {
+	break;
+      }
+    }
+  } else {
+    status = db->FlushWAL(true);
+  }
+  if (!status.ok()) {
+    derr << __func__ << " cannot persist moved keys: " << status.ToString() << dendl;
+    return -EIO;
+  }
+  env->CreateDir(sharding_def_dir);
+  status = rocksdb::WriteStringToFile(env, rs.to_text, sharding_def_file, true);
+  if (!status.ok()) {
+    derr << __func__ << " cannot write to " << sharding_def_file << dendl;
+    return -EIO;
+  }
+  {
+    std::unique_lock l(online_reshard_lock);
+    rs.state = online_reshard_t::DONE;
+  }
+  // nothing routes to the surplus shards anymore; their handles stay valid
+  // for readers that still hold them until close()
+  for (auto cf : rs.surplus) {
+    status = db->DropColumnFamily(cf);
+    if (!status.ok()) {
+      derr << __func__ << " failed to drop column family " << cf->GetName()
+	   << ": " << status.ToString() << dendl;
+      return -EIO;
+    }
+  }
+  env->DeleteFile(online_reshard_file);
+  dout(1) << __func__ << " column " << rs.prefix << " now " << rs.to_text
+	  << ", moved " << rs.keys_moved << " keys, "
+	  << byte_u_t(rs.bytes_moved) << dendl;
+  return 0;
+}
+
+void RocksDBStore::online_reshard_thread_entry()
+{
+  auto rs = online_reshard.load();
+  ceph_assert(rs);
+  dout(1) << __func__ << " moving column " << rs->prefix << " to "
+	  << rs->to_text << dendl;
+  std::optional<std::string> cursor;
+  std::unique_lock l(online_reshard_stop_lock);
+  while (!online_reshard_stop && rs->shard_pos < rs->from.handles.size()) {
+    l.unlock();
+    auto keys_per_batch = std::max<uint64_t>(
+      1, cct->_conf.get_val<uint64_t>("rocksdb_online_reshard_keys_per_batch"));
+    uint64_t bytes = 0;
+    int r = online_reshard_move_batch(*rs, rs->from.handles[rs->shard_pos],
+				      cursor, keys_per_batch, &bytes);
+    l.lock();
+    if (r < 0) {
+      derr << __func__ << " stopped: " << cpp_strerror(r)
+	   << "; resharding resumes on next open" << dendl;
+      rs->error = r;
+      return;
+    }
+    if (r > 0) {
+      dout(5) << __func__ << " shard " << rs->shard_pos << " done" << dendl;
+      ++rs->shard_pos;
+      cursor.reset();
+      continue;
+    }
+    auto rate = cct->_conf.get_val<Option::size_t>(
+      "rocksdb_online_reshard_bytes_per_sec");
+    if (rate && bytes) {
+      online_reshard_cond.wait_for(l, ceph::make_timespan((double)bytes / rate));
+    }
+  }
+  if (online_reshard_stop) {
+    dout(1) << __func__ << " interrupted at shard " << rs->shard_pos << dendl;
+    return;
+  }
+  l.unlock();
+  int r = online_reshard_finish(*rs);
+  if (r < 0) {
+    rs->error = r;
+  }
+}
+
+void RocksDBStore::dump_online_reshard(Formatter *f)
+{
+  f->open_object_section("online_reshard");
+  auto rs = online_reshard.load();
+  if (!rs) {
+    f->dump_string("state", "none");
+  } else {
+    f->dump_string("state", rs->error ? "failed" :
+		   rs->state == online_reshard_t::DONE ? "done" : "copying");
+    f->dump_string("column", rs->prefix);
+    f->dump_string("from", rs->from_text);
+    f->dump_string("to", rs->to_text);
+    f->dump_unsigned("shards_done",
+		     std::min<size_t>(rs->shard_pos, rs->from.handles.size()));
+    f->dump_unsigned("shards_total", rs->from.handles.size());
+    f->dump_unsigned("keys_moved", rs->keys_moved);
+    f->dump_unsigned("bytes_moved", rs->bytes_moved);
+    f->dump_stream("started") << rs->started;
+    if (rs->error) {
+      f->dump_int("error", rs->error);
+    }
+  }
+  f->close_section();
+}
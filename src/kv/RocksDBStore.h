@@ -6,10 +6,13 @@
 #include "include/types.h"
 #include "include/buffer_fwd.h"
 #include "KeyValueDB.h"
+#include "KeyValueHistogram.h"
 #include <set>
 #include <map>
 #include <string>
 #include <memory>
+#include <atomic>
+#include <unordered_set>
 #include <boost/scoped_ptr.hpp>
 #include "rocksdb/write_batch.h"
 #include "rocksdb/perf_context.h"
@@ -25,6 +28,7 @@
 #include "include/common_fwd.h"
 #include "common/Formatter.h"
 #include "common/Cond.h"
+#include "common/ceph_mutex.h"
 #include "common/ceph_context.h"
 #include "common/PriorityCache.h"
 #include "common/pretty_binary.h"
@@ -42,6 +46,15 @@ enum {
   l_rocksdb_write_memtable_time,
   l_rocksdb_write_delay_time,
   l_rocksdb_write_pre_and_post_process_time,
+  l_rocksdb_multiget_keys,
+  l_rocksdb_online_reshard_keys,
+  l_rocksdb_online_reshard_bytes,
+  l_rocksdb_online_reshard_lat,
+  l_rocksdb_coalesce_batches,
+  l_rocksdb_coalesce_txns,
+  l_rocksdb_coalesce_dedup_keys,
+  l_rocksdb_coalesce_lat,
+  l_rocksdb_coalesce_bytes_limit,
   l_rocksdb_last,
 };
 
@@ -124,7 +137,153 @@ private:
   std::unordered_map<std::string, prefix_shards> cf_handles;
   typedef decltype(cf_handles)::iterator cf_handles_iterator;
   std::unordered_map<uint32_t, std::string> cf_ids_to_prefix;
+  std::unordered_map<uint32_t, rocksdb::ColumnFamilyHandle*> cf_ids_to_handle;
   std::unordered_map<std::string, rocksdb::BlockBasedTableOptions> cf_bbt_opts;
+  /// column name -> filter options, from kv_options "cf_filters"
+  std::unordered_map<std::string, std::string> cf_filters;
+
+  /**
+   * Online resharding of a single column, see start_online_reshard().
+   *
+   * While COPYING a key of the column lives either at its old location
+   * (from) or at its new one (to), never both.  Writers put to the new
+   * location and delete the old one in the same batch; readers look at the
+   * old location first and then at the new one, which is race free because
+   * keys only ever move from old to new.  Shards keep their names, so a
+   * column family that exists in both layouts is reused in place.
+   */
+  struct online_reshard_t {
+    enum {
+      COPYING = 1,  ///< keys may still be in the old layout
+      DONE = 2,     ///< every key is in the new layout
+    };
+    std::string prefix;
+    std::string from_text;  ///< sharding the store was opened with
+    std::string to_text;    ///< sharding being moved to
+    prefix_shards from;
+    prefix_shards to;
+    std::vector<rocksdb::ColumnFamilyHandle*> all;      ///< from and to, no duplicates
+    std::vector<rocksdb::ColumnFamilyHandle*> surplus;  ///< only in from; dropped when done
+    std::vector<rocksdb::ColumnFamilyHandle*> owned;    ///< not in cf_handles; destroyed at close
+    std::unordered_set<uint32_t> ids;          ///< ids of all
+    std::unordered_set<uint32_t> surplus_ids;  ///< ids of surplus
+    std::unordered_map<uint32_t, rocksdb::ColumnFamilyHandle*> handles_by_id;
+    std::atomic<int> state = {COPYING};   ///< changed under online_reshard_lock
+    std::atomic<size_t> shard_pos = {0};  ///< shard of from being emptied
+    std::atomic<uint64_t> keys_moved = {0};
+    std::atomic<uint64_t> bytes_moved = {0};
+    std::atomic<int> error = {0};
+    utime_t started;
+    /// keys of the column written while a batch of moves was read, see
+    /// online_reshard_move_batch()
+    ceph::mutex touched_lock =
+      ceph::make_mutex("RocksDBStore::online_reshard_t::touched_lock");
+    std::atomic<bool> tracking = {false};
+    std::unordered_set<std::string> touched;
+    bool touched_range = false;  ///< a range of the column was deleted
+  };
+  std::unique_ptr<online_reshard_t> online_reshard_state;
+  /// published once per open and never freed before close()
+  std::atomic<online_reshard_t*> online_reshard = {nullptr};
+  /// shared by submits while COPYING, exclusive while keys are moved or the
+  /// layout switches
+  ceph::shared_mutex online_reshard_lock =
+    ceph::make_shared_mutex("RocksDBStore::online_reshard_lock");
+  /// submits that saw no online reshard and went ahead without the lock;
+  /// online_reshard_publish() waits for them on online_reshard_writes_cond
+  std::atomic<uint64_t> online_reshard_unlocked_writes = {0};
+  ceph::mutex online_reshard_writes_lock =
+    ceph::make_mutex("RocksDBStore::online_reshard_writes_lock");
+  ceph::condition_variable online_reshard_writes_cond;
+  void online_reshard_unlocked_write_done();
+  /**
+   * Holds online resharding off for the duration of a submit.
+   *
+   * online_reshard_lock is only taken while a reshard is COPYING.  Before
+   * one is published, and once it is DONE, nothing moves keys or changes
+   * the layout under a submit.
+   */
+  class OnlineReshardWriteGuard {
+    RocksDBStore& db;
+    std::shared_lock<ceph::shared_mutex> l;
+    bool unlocked = false;
+    rocksdb::WriteBatch* bat = nullptr;
+  public:
+    online_reshard_t* rs = nullptr;
+
+    explicit OnlineReshardWriteGuard(RocksDBStore& db);
+    ~OnlineReshardWriteGuard() {
+      release();
+    }
+    /// the batch is about to be written
+    void set_batch(rocksdb::WriteBatch* b) {
+      bat = b;
+    }
+    /// the batch was written
+    void release();
+  };
+  ceph::mutex online_reshard_stop_lock =
+    ceph::make_mutex("RocksDBStore::online_reshard_stop_lock");
+  ceph::condition_variable online_reshard_cond;
+  bool online_reshard_stop = false;
+  class OnlineReshardThread : public Thread {
+    RocksDBStore *db;
+  public:
+    explicit OnlineReshardThread(RocksDBStore *d) : db(d) {}
+    void *entry() override {
+      db->online_reshard_thread_entry();
+      return NULL;
+    }
+  } online_reshard_thread;
+
+  online_reshard_t* get_online_reshard(const std::string& prefix) {
+    auto rs = online_reshard.load();
+    return rs && rs->prefix == prefix ? rs : nullptr;
+  }
+  /// the column families of a column, including those an online reshard
+  /// is moving its keys between
+  const std::vector<rocksdb::ColumnFamilyHandle*>& get_column_handles(
+    const std::string& prefix,
+    const std::vector<rocksdb::ColumnFamilyHandle*>& handles) {
+    if (auto rs = get_online_reshard(prefix)) {
+      return rs->state == online_reshard_t::DONE ? rs->to.handles : rs->all;
+    }
+    return handles;
+  }
+  void get_online_reshard_cfs(online_reshard_t& rs, int state,
+			      const char* key, size_t keylen,
+			      rocksdb::ColumnFamilyHandle** to,
+			      rocksdb::ColumnFamilyHandle** from);
+  rocksdb::Status get_moved_key(const std::string& prefix,
+				const char* key, size_t keylen,
+				rocksdb::ColumnFamilyHandle* tried,
+				rocksdb::PinnableSlice* value);
+  static int find_online_reshard_column(const std::string& from_text,
+					const std::string& to_text,
+					ColumnFamily* from_column,
+					ColumnFamily* to_column);
+  int online_reshard_setup(
+    online_reshard_t& rs,
+    const ColumnFamily& from_column,
+    const ColumnFamily& to_column,
+    const std::map<std::string, rocksdb::ColumnFamilyHandle*>& opened,
+    bool create);
+  int online_reshard_resume(
+    const ColumnFamily& from_column,
+    const ColumnFamily& to_column,
+    const std::string& from_text,
+    const std::string& to_text,
+    bool done,
+    const std::map<std::string, rocksdb::ColumnFamilyHandle*>& opened,
+    bool read_only);
+  void online_reshard_publish(std::unique_ptr<online_reshard_t> rs);
+  int online_reshard_move_batch(online_reshard_t& rs,
+				rocksdb::ColumnFamilyHandle* cf,
+				std::optional<std::string>& cursor,
+				uint64_t keys_per_batch,
+				uint64_t* bytes);
+  int online_reshard_finish(online_reshard_t& rs);
+  void online_reshard_thread_entry();
   
   void add_column_family(const std::string& cf_name, uint32_t hash_l, uint32_t hash_h,
 			 size_t shard_idx, rocksdb::ColumnFamilyHandle *handle);
@@ -135,7 +294,19 @@ private:
   rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& prefix, const char* key, size_t keylen);
   rocksdb::ColumnFamilyHandle *check_cf_handle_bounds(const cf_handles_iterator& it, const IteratorBounds& bounds);
 
+  /// current size limit of a coalesced write batch, 0 until first used
+  std::atomic<uint64_t> coalesce_bytes = {0};
+  /// bytes written since the last synchronous submit
+  std::atomic<uint64_t> bytes_since_sync = {0};
+  ceph::mutex write_hist_lock = ceph::make_mutex("RocksDBStore::write_hist_lock");
+  KeyValueHistogram write_hist;
+
+  rocksdb::ColumnFamilyHandle *get_cf_by_id(uint32_t column_family_id);
+  int do_write(rocksdb::WriteOptions& woptions, rocksdb::WriteBatch* bat,
+	       OnlineReshardWriteGuard& reshard_guard);
   int submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Transaction t);
+  int submit_coalesced(std::vector<KeyValueDB::Transaction>& tl,
+		       size_t begin, size_t end);
   int install_cf_mergeop(const std::string &cf_name, rocksdb::ColumnFamilyOptions *cf_opt);
   int create_db_dir();
   int do_open(std::ostream &out, bool create_if_missing, bool open_readonly,
@@ -161,14 +332,21 @@ private:
 		      std::vector<rocksdb::ColumnFamilyDescriptor>& existing_cfs,
 		      std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& existing_cfs_shard,
 		      std::vector<rocksdb::ColumnFamilyDescriptor>& missing_cfs,
-		      std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& missing_cfs_shard);
+		      std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& missing_cfs_shard,
+		      const ColumnFamily* other_column = nullptr,
+		      std::vector<rocksdb::ColumnFamilyDescriptor>* other_cfs = nullptr);
   std::shared_ptr<rocksdb::Cache> create_block_cache(const std::string& cache_type, size_t cache_size, double cache_prio_high = 0.0);
   int split_column_family_options(const std::string& opts_str,
 				  std::unordered_map<std::string, std::string>* column_opts_map,
-				  std::string* block_cache_opt);
+				  std::string* block_cache_opt,
+				  std::string* filter_opt);
   int apply_block_cache_options(const std::string& column_name,
 				const std::string& block_cache_opt,
 				rocksdb::ColumnFamilyOptions* cf_opt);
+  int apply_filter_options(const std::string& column_name,
+			   const std::string& filter_opt,
+			   rocksdb::BlockBasedTableOptions* column_bbt_opts,
+			   rocksdb::ColumnFamilyOptions* cf_opt);
   int update_column_family_options(const std::string& base_name,
 				   const std::string& more_options,
 				   rocksdb::ColumnFamilyOptions* cf_opt);
@@ -245,6 +423,7 @@ public:
     env(static_cast<rocksdb::Env*>(p)),
     comparator(nullptr),
     dbstats(NULL),
+    online_reshard_thread(this),
     compact_queue_stop(false),
     compact_thread(this),
     compact_on_mount(false),
@@ -284,10 +463,14 @@ public:
   int64_t estimate_prefix_size(const std::string& prefix,
 			       const std::string& key_prefix) override;
   struct RocksWBHandler;
+  struct OnlineReshardWBHandler;
+  struct CoalesceWBHandler;
   class RocksDBTransactionImpl : public KeyValueDB::TransactionImpl {
   public:
     rocksdb::WriteBatch bat;
     RocksDBStore *db;
+    /// online_reshard_t::state the batch was routed for, 0 if none
+    int reshard_state = 0;
 
     explicit RocksDBTransactionImpl(RocksDBStore *_db);
   private:
@@ -335,6 +518,8 @@ public:
 
   int submit_transaction(KeyValueDB::Transaction t) override;
   int submit_transaction_sync(KeyValueDB::Transaction t) override;
+  int submit_transactions(std::vector<KeyValueDB::Transaction>& tl) override;
+  void dump_write_histogram(ceph::Formatter *f) override;
   int get(
     const std::string &prefix,
     const std::set<std::string> &key,
@@ -364,6 +549,8 @@ public:
         rocksdb::ReadOptions options = rocksdb::ReadOptions();
         if (opts & ITERATOR_NOCACHE)
           options.fill_cache=false;
+        // columns with a prefix extractor must still be seen in total order
+        options.auto_prefix_mode = true;
         dbiter = db->db->NewIterator(options, cf);
     }
     ~RocksDBWholeSpaceIteratorImpl() override;
@@ -546,6 +733,14 @@ public:
   int reshard(const std::string& new_sharding, const resharding_ctrl* ctrl = nullptr);
   bool get_sharding(std::string& sharding);
 
+  int start_online_reshard(const std::string& new_sharding) override;
+  void dump_online_reshard(ceph::Formatter *f) override;
+  /// true while an online reshard still has keys to move
+  bool is_online_resharding() {
+    auto rs = online_reshard.load();
+    return rs && rs->state == online_reshard_t::COPYING && rs->error == 0;
+  }
+
 };
 
 #endif
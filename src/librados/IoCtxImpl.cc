@@ -665,6 +665,7 @@ int librados::IoCtxImpl::operate(const object_t& oid, ::ObjectOperation *o,
     *o, snapc, ut,
     flags | extra_op_flags,
     oncommit, &ver, osd_reqid_t(), nullptr, otel_trace);
+  objecter_op->qos_tag = qos_tag;
   objecter->op_submit(objecter_op);
 
   {
@@ -702,6 +703,7 @@ int librados::IoCtxImpl::operate_read(const object_t& oid,
     *o, snap_seq, pbl,
     flags | extra_op_flags,
     onack, &ver);
+  objecter_op->qos_tag = qos_tag;
   objecter->op_submit(objecter_op);
 
   {
@@ -743,6 +745,7 @@ int librados::IoCtxImpl::aio_operate_read(const object_t &oid,
     oid, oloc,
     *o, snap_seq, pbl, flags | extra_op_flags,
     oncomplete, &c->objver, nullptr, 0, &trace);
+  objecter_op->qos_tag = qos_tag;
   objecter->op_submit(objecter_op, &c->tid);
   trace.event("rados operate read submitted");
 
@@ -780,6 +783,7 @@ int librados::IoCtxImpl::aio_operate(const object_t& oid,
   Objecter::Op *op = objecter->prepare_mutate_op(
     oid, oloc, *o, snap_context, ut, flags | extra_op_flags,
     oncomplete, &c->objver, osd_reqid_t(), &trace, otel_trace);
+  op->qos_tag = qos_tag;
   objecter->op_submit(op, &c->tid);
   trace.event("rados operate op submitted");
 
@@ -812,6 +816,7 @@ int librados::IoCtxImpl::aio_read(const object_t oid, AioCompletionImpl *c,
     oid, oloc,
     off, len, snapid, pbl, extra_op_flags,
     oncomplete, &c->objver, nullptr, 0, &trace);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
   return 0;
 }
@@ -845,6 +850,7 @@ int librados::IoCtxImpl::aio_read(const object_t oid, AioCompletionImpl *c,
     oid, oloc,
     off, len, snapid, &c->bl, extra_op_flags,
     oncomplete, &c->objver, nullptr, 0, &trace);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
   return 0;
 }
@@ -885,6 +891,7 @@ int librados::IoCtxImpl::aio_sparse_read(const object_t oid,
     oid, oloc,
     onack->m_ops, snapid, NULL, extra_op_flags,
     onack, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
   return 0;
 }
@@ -905,6 +912,7 @@ int librados::IoCtxImpl::aio_cmpext(const object_t& oid,
   Objecter::Op *o = objecter->prepare_cmpext_op(
     oid, oloc, off, cmp_bl, snap_seq, extra_op_flags,
     onack, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
 
   return 0;
@@ -933,6 +941,7 @@ int librados::IoCtxImpl::aio_cmpext(const object_t& oid,
 
   Objecter::Op *o = objecter->prepare_read_op(
     oid, oloc, onack->m_ops, snap_seq, NULL, extra_op_flags, onack, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
   return 0;
 }
@@ -968,6 +977,7 @@ int librados::IoCtxImpl::aio_write(const object_t &oid, AioCompletionImpl *c,
     oid, oloc,
     off, len, snapc, bl, ut, extra_op_flags,
     oncomplete, &c->objver, nullptr, 0, &trace);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
 
   return 0;
@@ -997,6 +1007,7 @@ int librados::IoCtxImpl::aio_append(const object_t &oid, AioCompletionImpl *c,
     oid, oloc,
     len, snapc, bl, ut, extra_op_flags,
     oncomplete, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
 
   return 0;
@@ -1027,6 +1038,7 @@ int librados::IoCtxImpl::aio_write_full(const object_t &oid,
     oid, oloc,
     snapc, bl, ut, extra_op_flags,
     oncomplete, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
 
   return 0;
@@ -1062,6 +1074,7 @@ int librados::IoCtxImpl::aio_writesame(const object_t &oid,
     write_len, off,
     snapc, bl, ut, extra_op_flags,
     oncomplete, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
 
   return 0;
@@ -1088,6 +1101,7 @@ int librados::IoCtxImpl::aio_remove(const object_t &oid, AioCompletionImpl *c, i
     oid, oloc,
     snapc, ut, flags | extra_op_flags,
     oncomplete, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
 
   return 0;
@@ -1104,6 +1118,7 @@ int librados::IoCtxImpl::aio_stat(const object_t& oid, AioCompletionImpl *c,
     oid, oloc,
     snap_seq, psize, &onack->mtime, extra_op_flags,
     onack, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
   return 0;
 }
@@ -1118,6 +1133,7 @@ int librados::IoCtxImpl::aio_stat2(const object_t& oid, AioCompletionImpl *c,
     oid, oloc,
     snap_seq, psize, &onack->mtime, extra_op_flags,
     onack, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
   return 0;
 }
@@ -1332,6 +1348,7 @@ int librados::IoCtxImpl::aio_exec(const object_t& oid, AioCompletionImpl *c,
   rd.call(cls, method, inbl);
   Objecter::Op *o = objecter->prepare_read_op(
     oid, oloc, rd, snap_seq, outbl, extra_op_flags, oncomplete, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
   return 0;
 }
@@ -1358,6 +1375,7 @@ int librados::IoCtxImpl::aio_exec(const object_t& oid, AioCompletionImpl *c,
   rd.call(cls, method, inbl);
   Objecter::Op *o = objecter->prepare_read_op(
     oid, oloc, rd, snap_seq, &c->bl, extra_op_flags, oncomplete, &c->objver);
+  o->qos_tag = qos_tag;
   objecter->op_submit(o, &c->tid);
   return 0;
 }
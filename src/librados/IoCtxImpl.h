@@ -41,6 +41,7 @@ struct librados::IoCtxImpl {
   uint32_t notify_timeout = 30;
   object_locator_t oloc;
   int extra_op_flags = 0;
+  std::string qos_tag;
 
   ceph::mutex aio_write_list_lock =
     ceph::make_mutex("librados::IoCtxImpl::aio_write_list_lock");
@@ -66,6 +67,7 @@ struct librados::IoCtxImpl {
     notify_timeout = rhs.notify_timeout;
     oloc = rhs.oloc;
     extra_op_flags = rhs.extra_op_flags;
+    qos_tag = rhs.qos_tag;
     objecter = rhs.objecter;
   }
 
@@ -2344,6 +2344,16 @@ void librados::IoCtx::unset_pool_full_try()
   io_ctx_impl->extra_op_flags &= ~CEPH_OSD_FLAG_FULL_TRY;
 }
 
+void librados::IoCtx::set_qos_tag(const std::string& tag)
+{
+  io_ctx_impl->qos_tag = tag;
+}
+
+std::string librados::IoCtx::get_qos_tag() const
+{
+  return io_ctx_impl->qos_tag;
+}
+
 ///////////////////////////// Rados //////////////////////////////
 void librados::Rados::version(int *major, int *minor, int *extra)
 {
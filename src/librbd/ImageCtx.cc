@@ -201,6 +201,17 @@ librados::IoCtx duplicate_io_ctx(librados::IoCtx& io_ctx) {
     trace_endpoint.copy_name(pname);
     perf_start(pname);
 
+    // lets the OSDs apply a per-image mClock QoS profile
+    if (config.get_val<bool>("rbd_mclock_qos_tag")) {
+      std::string qos_tag = "rbd/" + std::to_string(md_ctx.get_id()) + "/" +
+        (old_format ? name : id);
+      md_ctx.set_qos_tag(qos_tag);
+      if (data_ctx.is_valid()) {
+        data_ctx.set_qos_tag(qos_tag);
+        rebuild_data_io_context();
+      }
+    }
+
     ceph_assert(image_watcher == NULL);
     image_watcher = new ImageWatcher<>(*this);
   }
@@ -1012,6 +1023,9 @@ librados::IoCtx duplicate_io_ctx(librados::IoCtx& io_ctx) {
     if (data_ctx.get_pool_full_try()) {
       ctx->set_full_try(true);
     }
+    if (auto qos_tag = data_ctx.get_qos_tag(); !qos_tag.empty()) {
+      ctx->set_qos_tag(std::move(qos_tag));
+    }
 
     // atomically reset the data IOContext to new version
     atomic_store(&data_io_context, ctx);
@@ -36,7 +36,7 @@ namespace _mosdop {
 template<typename V>
 class MOSDOp final : public MOSDFastDispatchOp {
 private:
-  static constexpr int HEAD_VERSION = 9;
+  static constexpr int HEAD_VERSION = 10;
   static constexpr int COMPAT_VERSION = 3;
 
 private:
@@ -65,6 +65,16 @@ private:
   bool bdata_encode;
   osd_reqid_t reqid; // reqid explicitly set by sender
 
+  // client QoS: the tag selects a mClock profile on the OSD, delta and
+  // rho are dmclock's distributed request params
+  std::string qos_tag;
+  uint32_t qos_delta = 0;
+  uint32_t qos_rho = 0;
+  // not encoded; set when mClockScheduler dequeues the op and passed
+  // back to the client in MOSDOpReply
+  uint32_t qos_cost = 0;
+  bool qos_reservation = false;
+
 public:
   friend MOSDOpReply;
 
@@ -117,6 +127,19 @@ public:
     }
   }
 
+  const std::string& get_qos_tag() const {
+    ceph_assert(!partial_decode_needed);
+    return qos_tag;
+  }
+  uint32_t get_qos_delta() const {
+    ceph_assert(!partial_decode_needed);
+    return qos_delta;
+  }
+  uint32_t get_qos_rho() const {
+    ceph_assert(!partial_decode_needed);
+    return qos_rho;
+  }
+
   // Fields decoded in final decoding
   int get_client_inc() const {
     ceph_assert(!final_decode_needed);
@@ -242,6 +265,17 @@ public:
 
   bool has_flag(__u32 flag) const { return flags & flag; };
 
+  void set_qos(const std::string& tag, uint32_t delta, uint32_t rho) {
+    qos_tag = tag;
+    qos_delta = delta;
+    qos_rho = rho;
+  }
+  /// note the scaled cost mClock charged and whether reservation served it
+  void set_qos_served(uint32_t cost, bool reservation) {
+    qos_cost = cost;
+    qos_reservation = reservation;
+  }
+
   bool is_retry_attempt() const { return flags & CEPH_OSD_FLAG_RETRY; }
   void set_retry_attempt(unsigned a) { 
     if (a)
@@ -392,10 +426,40 @@ struct ceph_osd_request_head {
       encode(snap_seq, payload);
       encode(snaps, payload);
 
+      encode(retry_attempt, payload);
+      encode(features, payload);
+    } else if (!HAVE_FEATURE(features, OSD_OP_QOS)) {
+      // v9 opentelemetry trace
+      header.version = 9;
+
+      encode(pgid, payload);
+      encode(hobj.get_hash(), payload);
+      encode(osdmap_epoch, payload);
+      encode(flags, payload);
+      encode(reqid, payload);
+      encode_trace(payload, features);
+      encode_otel_trace(payload, features);
+
+      // -- above decoded up front; below decoded post-dispatch thread --
+
+      encode(client_inc, payload);
+      encode(mtime, payload);
+      encode(get_object_locator(), payload);
+      encode(hobj.oid, payload);
+
+      __u16 num_ops = ops.size();
+      encode(num_ops, payload);
+      for (unsigned i = 0; i < ops.size(); i++)
+	encode(ops[i].op, payload);
+
+      encode(hobj.snap, payload);
+      encode(snap_seq, payload);
+      encode(snaps, payload);
+
       encode(retry_attempt, payload);
       encode(features, payload);
     } else {
-      // latest v9 opentelemetry trace
+      // latest v10 client QoS
       header.version = HEAD_VERSION;
 
       encode(pgid, payload);
@@ -405,6 +469,9 @@ struct ceph_osd_request_head {
       encode(reqid, payload);
       encode_trace(payload, features);
       encode_otel_trace(payload, features);
+      encode(qos_tag, payload);
+      encode(qos_delta, payload);
+      encode(qos_rho, payload);
 
       // -- above decoded up front; below decoded post-dispatch thread --
 
@@ -443,6 +510,19 @@ struct ceph_osd_request_head {
       decode(reqid, p);
       decode_trace(p);
       decode_otel_trace(p);
+      decode(qos_tag, p);
+      decode(qos_delta, p);
+      decode(qos_rho, p);
+    } else if (header.version == 9) {
+      decode(pgid, p);
+      uint32_t hash;
+      decode(hash, p);
+      hobj.set_hash(hash);
+      decode(osdmap_epoch, p);
+      decode(flags, p);
+      decode(reqid, p);
+      decode_trace(p);
+      decode_otel_trace(p);
     } else if (header.version == 8) {
       decode(pgid, p);      // actual pgid
       uint32_t hash;
@@ -635,6 +715,8 @@ struct ceph_osd_request_head {
 	out << " " << get_raw_pg() << " (undecoded)";
       }
       out << " " << ceph_osd_flag_string(get_flags());
+      if (!qos_tag.empty())
+	out << " qos " << qos_tag;
       out << " e" << osdmap_epoch;
     }
     out << ")";
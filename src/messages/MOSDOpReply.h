@@ -31,7 +31,7 @@
 
 class MOSDOpReply final : public Message {
 private:
-  static constexpr int HEAD_VERSION = 8;
+  static constexpr int HEAD_VERSION = 9;
   static constexpr int COMPAT_VERSION = 2;
 
   object_t oid;
@@ -47,6 +47,10 @@ private:
   int32_t retry_attempt = -1;
   bool do_redirect;
   request_redirect_t redirect;
+  // mClock cost charged for the op (0 if it bypassed mClock) and whether
+  // it was served in the reservation phase; see MOSDOp::set_qos_served()
+  uint32_t qos_cost = 0;
+  bool qos_reservation = false;
 
 public:
   const object_t& get_oid() const { return oid; }
@@ -94,6 +98,9 @@ public:
   const request_redirect_t& get_redirect() const { return redirect; }
   bool is_redirect_reply() const { return do_redirect; }
 
+  uint32_t get_qos_cost() const { return qos_cost; }
+  bool is_qos_reservation() const { return qos_reservation; }
+
   void add_flags(int f) { flags |= f; }
 
   void claim_op_out_data(std::vector<OSDOp>& o) {
@@ -154,6 +161,8 @@ public:
     user_version = 0;
     retry_attempt = req->get_retry_attempt();
     do_redirect = false;
+    qos_cost = req->qos_cost;
+    qos_reservation = req->qos_reservation;
 
     for (unsigned i = 0; i < ops.size(); i++) {
       // zero out input data
@@ -223,6 +232,8 @@ public:
         }
       }
       encode_trace(payload, features);
+      encode(qos_cost, payload);
+      encode(qos_reservation, payload);
     }
   }
   void decode_payload() override {
@@ -256,6 +267,8 @@ public:
       if (do_redirect)
 	decode(redirect, p);
       decode_trace(p);
+      decode(qos_cost, p);
+      decode(qos_reservation, p);
     } else if (header.version < 2) {
       ceph_osd_reply_head head;
       decode(head, p);
@@ -318,6 +331,10 @@ public:
       if (header.version >= 8) {
         decode_trace(p);
       }
+      if (header.version >= 9) {
+	decode(qos_cost, p);
+	decode(qos_reservation, p);
+      }
     }
   }
 
@@ -3238,6 +3238,8 @@ void PGMap::get_health_checks(
 	summary += " reporting legacy (not per-pool) BlueStore omap usage stats";
       } else if (asum.first == "BLUESTORE_SPURIOUS_READ_ERRORS") {
         summary += " have spurious read errors";
+      } else if (asum.first == "BLOCK_DEVICE_TAIL_LATENCY") {
+        summary += " have block devices with drifting tail latency";
       }
 
       auto& d = checks->add(asum.first, HEALTH_WARN, summary, asum.second.first);
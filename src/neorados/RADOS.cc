@@ -18,6 +18,7 @@
 #include <string_view>
 
 #include <boost/intrusive_ptr.hpp>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
 
 #include <fmt/format.h>
 
@@ -131,11 +132,32 @@ std::ostream& operator <<(std::ostream& m, const Object& o) {
 
 // IOContext
 
+// What IOContext carries beyond the locator and snaps lives out of line,
+// shared between copies and copied on write, so that IOContextImpl still
+// fits in IOContext::impl.
+struct IOContextExtra : boost::intrusive_ref_counter<IOContextExtra> {
+  int extra_op_flags = 0;
+  std::string qos_tag;
+};
+
 struct IOContextImpl {
   object_locator_t oloc;
   snapid_t snap_seq = CEPH_NOSNAP;
   SnapContext snapc;
-  int extra_op_flags = 0;
+  boost::intrusive_ptr<const IOContextExtra> extra;
+
+  int extra_op_flags() const {
+    return extra ? extra->extra_op_flags : 0;
+  }
+  const std::string& qos_tag() const {
+    static const std::string none;
+    return extra ? extra->qos_tag : none;
+  }
+  IOContextExtra& mutable_extra() {
+    auto e = extra ? new IOContextExtra(*extra) : new IOContextExtra;
+    extra.reset(e);
+    return *e;
+  }
 };
 
 IOContext::IOContext() {
@@ -289,15 +311,15 @@ IOContext&& IOContext::set_write_snap_context(
 
 bool IOContext::get_full_try() const {
   const auto ioc = reinterpret_cast<const IOContextImpl*>(&impl);
-  return (ioc->extra_op_flags & CEPH_OSD_FLAG_FULL_TRY) != 0;
+  return (ioc->extra_op_flags() & CEPH_OSD_FLAG_FULL_TRY) != 0;
 }
 
 void IOContext::set_full_try(bool full_try) & {
   auto ioc = reinterpret_cast<IOContextImpl*>(&impl);
   if (full_try) {
-    ioc->extra_op_flags |= CEPH_OSD_FLAG_FULL_TRY;
-  } else {
-    ioc->extra_op_flags &= ~CEPH_OSD_FLAG_FULL_TRY;
+    ioc->mutable_extra().extra_op_flags |= CEPH_OSD_FLAG_FULL_TRY;
+  } else if (ioc->extra_op_flags() & CEPH_OSD_FLAG_FULL_TRY) {
+    ioc->mutable_extra().extra_op_flags &= ~CEPH_OSD_FLAG_FULL_TRY;
   }
 }
 
@@ -306,52 +328,69 @@ IOContext&& IOContext::set_full_try(bool full_try) && {
   return std::move(*this);
 }
 
+const std::string& IOContext::get_qos_tag() const {
+  const auto ioc = reinterpret_cast<const IOContextImpl*>(&impl);
+  return ioc->qos_tag();
+}
+
+void IOContext::set_qos_tag(std::string qos_tag) & {
+  auto ioc = reinterpret_cast<IOContextImpl*>(&impl);
+  if (qos_tag != ioc->qos_tag()) {
+    ioc->mutable_extra().qos_tag = std::move(qos_tag);
+  }
+}
+
+IOContext&& IOContext::set_qos_tag(std::string qos_tag) && {
+  set_qos_tag(std::move(qos_tag));
+  return std::move(*this);
+}
+
 bool operator <(const IOContext& lhs, const IOContext& rhs) {
   const auto l = reinterpret_cast<const IOContextImpl*>(&lhs.impl);
   const auto r = reinterpret_cast<const IOContextImpl*>(&rhs.impl);
 
-  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key) <
-	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key));
+  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key, l->qos_tag()) <
+	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key, r->qos_tag()));
 }
 
 bool operator <=(const IOContext& lhs, const IOContext& rhs) {
   const auto l = reinterpret_cast<const IOContextImpl*>(&lhs.impl);
   const auto r = reinterpret_cast<const IOContextImpl*>(&rhs.impl);
 
-  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key) <=
-	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key));
+  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key, l->qos_tag()) <=
+	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key, r->qos_tag()));
 }
 
 bool operator >=(const IOContext& lhs, const IOContext& rhs) {
   const auto l = reinterpret_cast<const IOContextImpl*>(&lhs.impl);
   const auto r = reinterpret_cast<const IOContextImpl*>(&rhs.impl);
 
-  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key) >=
-	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key));
+  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key, l->qos_tag()) >=
+	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key, r->qos_tag()));
 }
 
 bool operator >(const IOContext& lhs, const IOContext& rhs) {
   const auto l = reinterpret_cast<const IOContextImpl*>(&lhs.impl);
   const auto r = reinterpret_cast<const IOContextImpl*>(&rhs.impl);
 
-  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key) >
-	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key));
+  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key, l->qos_tag()) >
+	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key, r->qos_tag()));
 }
 
 bool operator ==(const IOContext& lhs, const IOContext& rhs) {
   const auto l = reinterpret_cast<const IOContextImpl*>(&lhs.impl);
   const auto r = reinterpret_cast<const IOContextImpl*>(&rhs.impl);
 
-  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key) ==
-	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key));
+  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key, l->qos_tag()) ==
+	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key, r->qos_tag()));
 }
 
 bool operator !=(const IOContext& lhs, const IOContext& rhs) {
   const auto l = reinterpret_cast<const IOContextImpl*>(&lhs.impl);
   const auto r = reinterpret_cast<const IOContextImpl*>(&rhs.impl);
 
-  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key) !=
-	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key));
+  return (std::tie(l->oloc.pool, l->oloc.nspace, l->oloc.key, l->qos_tag()) !=
+	  std::tie(r->oloc.pool, r->oloc.nspace, r->oloc.key, r->qos_tag()));
 }
 
 std::ostream& operator <<(std::ostream& m, const IOContext& o) {
@@ -912,7 +951,7 @@ void RADOS::execute_(Object o, IOContext _ioc, ReadOp _op,
   auto oid = reinterpret_cast<const object_t*>(&o.impl);
   auto ioc = reinterpret_cast<const IOContextImpl*>(&_ioc.impl);
   auto op = reinterpret_cast<OpImpl*>(&_op.impl);
-  auto flags = op->op.flags | ioc->extra_op_flags;
+  auto flags = op->op.flags | ioc->extra_op_flags();
 
   ZTracer::Trace trace;
   if (trace_info) {
@@ -923,7 +962,8 @@ void RADOS::execute_(Object o, IOContext _ioc, ReadOp _op,
   trace.event("init");
   impl->objecter->read(
     *oid, ioc->oloc, std::move(op->op), ioc->snap_seq, bl, flags,
-    std::move(c), objver, nullptr /* data_offset */, 0 /* features */, &trace);
+    std::move(c), objver, nullptr /* data_offset */, 0 /* features */, &trace,
+    ioc->qos_tag());
 
   trace.event("submitted");
 }
@@ -938,7 +978,7 @@ void RADOS::execute_(Object o, IOContext _ioc, WriteOp _op,
   auto oid = reinterpret_cast<const object_t*>(&o.impl);
   auto ioc = reinterpret_cast<const IOContextImpl*>(&_ioc.impl);
   auto op = reinterpret_cast<OpImpl*>(&_op.impl);
-  auto flags = op->op.flags | ioc->extra_op_flags;
+  auto flags = op->op.flags | ioc->extra_op_flags();
   ceph::real_time mtime;
   if (op->mtime)
     mtime = *op->mtime;
@@ -955,7 +995,7 @@ void RADOS::execute_(Object o, IOContext _ioc, WriteOp _op,
   impl->objecter->mutate(
     *oid, ioc->oloc, std::move(op->op), ioc->snapc,
     mtime, flags,
-    std::move(c), objver, osd_reqid_t{}, &trace);
+    std::move(c), objver, osd_reqid_t{}, &trace, ioc->qos_tag());
   trace.event("submitted");
 }
 
@@ -1343,7 +1383,7 @@ void RADOS::watch_(Object o, IOContext _ioc,
   ObjectOperation op;
 
   auto linger_op = impl->objecter->linger_register(*oid, ioc->oloc,
-                                                   ioc->extra_op_flags);
+                                                   ioc->extra_op_flags());
   uint64_t cookie = linger_op->get_cookie();
   linger_op->handle = std::move(cb);
   op.watch(cookie, CEPH_OSD_WATCH_OP_WATCH, timeout.value_or(0s).count());
@@ -1372,7 +1412,7 @@ void RADOS::notify_ack_(Object o, IOContext _ioc,
   op.notify_ack(notify_id, cookie, bl);
 
   impl->objecter->read(*oid, ioc->oloc, std::move(op), ioc->snap_seq,
-		       nullptr, ioc->extra_op_flags, std::move(c));
+		       nullptr, ioc->extra_op_flags(), std::move(c));
 }
 
 tl::expected<ceph::timespan, bs::error_code> RADOS::check_watch(uint64_t cookie)
@@ -1397,7 +1437,7 @@ void RADOS::unwatch_(uint64_t cookie, IOContext _ioc,
   auto e = asio::prefer(get_executor(),
 			asio::execution::outstanding_work.tracked);
   impl->objecter->mutate(linger_op->target.base_oid, ioc->oloc, std::move(op),
-			 ioc->snapc, ceph::real_clock::now(), ioc->extra_op_flags,
+			 ioc->snapc, ceph::real_clock::now(), ioc->extra_op_flags(),
 			 asio::bind_executor(
 			   std::move(e),
 			   [objecter = impl->objecter,
@@ -1477,7 +1517,7 @@ void RADOS::notify_(Object o, IOContext _ioc, bufferlist bl,
   auto oid = reinterpret_cast<const object_t*>(&o.impl);
   auto ioc = reinterpret_cast<const IOContextImpl*>(&_ioc.impl);
   auto linger_op = impl->objecter->linger_register(*oid, ioc->oloc,
-                                                   ioc->extra_op_flags);
+                                                   ioc->extra_op_flags());
 
   auto cb = std::make_shared<NotifyHandler>(impl->ioctx, impl->objecter,
                                             linger_op, std::move(c));
@@ -1837,6 +1877,7 @@ size_t hash<neorados::IOContext>::operator ()(
   static constexpr const hash<int64_t> H;
   static constexpr const hash<std::string> G;
   const auto l = reinterpret_cast<const neorados::IOContextImpl*>(&r.impl);
-  return H(l->oloc.pool) ^ (G(l->oloc.nspace) << 1) ^ (G(l->oloc.key) << 2);
+  return H(l->oloc.pool) ^ (G(l->oloc.nspace) << 1) ^ (G(l->oloc.key) << 2) ^
+    (G(l->qos_tag()) << 3);
 }
 }
@@ -8,8 +8,11 @@
 #include "AvlAllocator.h"
 #include "BtreeAllocator.h"
 #include "HybridAllocator.h"
+#include "SizeClassAllocator.h"
+#include "AllocatorTrace.h"
 #include "common/debug.h"
 #include "common/admin_socket.h"
+#include "common/errno.h"
 #define dout_subsys ceph_subsys_bluestore
 using TOPNSPC::common::cmd_getval;
 
@@ -57,6 +60,13 @@ public:
 	  this,
 	  "build allocator free regions state histogram");
         ceph_assert(r == 0);
+        r = admin_socket->register_command(
+	  ("bluestore allocator trace " + name +
+	   " name=action,type=CephChoices,strings=start|stop|status" +
+	   " name=path,type=CephString,req=false").c_str(),
+	  this,
+	  "record allocator calls to a file for ceph_test_alloc_trace_replay");
+        ceph_assert(r == 0);
       }
     }
   }
@@ -138,6 +148,35 @@ public:
         f->close_section();
       }
       f->close_section();
+    } else if (command == "bluestore allocator trace " + name) {
+      std::string action, path;
+      cmd_getval(cmdmap, "action", action);
+      if (action == "start") {
+	if (!cmd_getval(cmdmap, "path", path)) {
+	  ss << "path is required" << std::endl;
+	  return -EINVAL;
+	}
+	r = alloc->start_trace(
+	  g_ceph_context, path,
+	  g_conf().get_val<Option::size_t>("bluestore_allocator_trace_max_bytes"));
+	if (r < 0) {
+	  ss << "failed to start trace: " << cpp_strerror(r) << std::endl;
+	  return r;
+	}
+      } else if (action == "stop") {
+	r = alloc->stop_trace();
+	if (r == -ENOENT) {
+	  ss << "no trace running" << std::endl;
+	  return r;
+	}
+      }
+      f->open_object_section("trace");
+      if (auto w = alloc->trace_writer.load()) {
+	w->dump(f);
+      } else {
+	f->dump_bool("active", false);
+      }
+      f->close_section();
     } else {
       ss << "Invalid command" << std::endl;
       r = -ENOSYS;
@@ -159,6 +198,53 @@ Allocator::Allocator(std::string_view name,
 Allocator::~Allocator()
 {
   delete asok_hook;
+  tracing = false;
+  delete trace_writer.load();
+}
+
+int Allocator::start_trace(CephContext* cct, const std::string& path,
+			   uint64_t max_bytes)
+{
+  auto w = trace_writer.load();
+  if (!w) {
+    // kept until the allocator goes away so that racing allocate() and
+    // release() calls never see it freed
+    w = new AllocatorTraceWriter(cct);
+    trace_writer = w;
+  }
+  int r = w->start(this, path, max_bytes);
+  if (r == 0) {
+    tracing = true;
+  }
+  return r;
+}
+
+int Allocator::stop_trace()
+{
+  auto w = trace_writer.load();
+  if (!w) {
+    return -ENOENT;
+  }
+  tracing = false;
+  return w->stop();
+}
+
+void Allocator::_trace_allocate(
+  uint64_t want, uint64_t unit, uint64_t max_alloc_size, int64_t hint,
+  int64_t r, const PExtentVector& extents, size_t first)
+{
+  auto w = trace_writer.load();
+  if (w && w->is_active()) {
+    w->note_allocate(want, unit, max_alloc_size, hint, r, extents, first);
+  }
+}
+
+void Allocator::_trace_release(const interval_set<uint64_t>& release_set)
+{
+  auto w = trace_writer.load();
+  if (w && w->is_active()) {
+    w->note_release(release_set);
+  }
 }
 
 const string& Allocator::get_name() const {
@@ -185,6 +271,10 @@ Allocator *Allocator::create(
     return new HybridAllocator(cct, size, block_size,
       cct->_conf.get_val<uint64_t>("bluestore_hybrid_alloc_mem_cap"),
       name);
+  } else if (type == "sizeclass") {
+    return new SizeClassAllocator(cct, size, block_size,
+      cct->_conf.get_val<uint64_t>("bluestore_sizeclass_alloc_shards"),
+      name);
   }
   if (alloc == nullptr) {
     lderr(cct) << "Allocator::" << __func__ << " unknown alloc type "
@@ -12,11 +12,14 @@
 #ifndef CEPH_OS_BLUESTORE_ALLOCATOR_H
 #define CEPH_OS_BLUESTORE_ALLOCATOR_H
 
+#include <atomic>
 #include <functional>
 #include <ostream>
 #include "include/ceph_assert.h"
 #include "bluestore_types.h"
 
+class AllocatorTraceWriter;
+
 class Allocator {
 public:
   Allocator(std::string_view name,
@@ -117,12 +120,40 @@ public:
   typedef std::vector<free_state_hist_bucket> FreeStateHistogram;
   void build_free_state_histogram(size_t alloc_unit, FreeStateHistogram& hist);
 
+  /// record every allocate() and release() to path, see AllocatorTrace.h
+  int start_trace(CephContext* cct, const std::string& path,
+		  uint64_t max_bytes);
+  int stop_trace();
+
 private:
   class SocketHook;
   SocketHook* asok_hook = nullptr;
+
+  std::atomic<bool> tracing = {false};
+  std::atomic<AllocatorTraceWriter*> trace_writer = {nullptr};
+  void _trace_allocate(uint64_t want, uint64_t unit, uint64_t max_alloc_size,
+		       int64_t hint, int64_t r, const PExtentVector& extents,
+		       size_t first);
+  void _trace_release(const interval_set<uint64_t>& release_set);
+
 protected:
   const int64_t device_size = 0;
   const int64_t block_size = 0;
+
+  // implementations report their allocate() and release() calls here;
+  // a single relaxed load unless a trace is running
+  void trace_allocate(uint64_t want, uint64_t unit, uint64_t max_alloc_size,
+		      int64_t hint, int64_t r, const PExtentVector& extents,
+		      size_t first) {
+    if (tracing.load(std::memory_order_relaxed)) {
+      _trace_allocate(want, unit, max_alloc_size, hint, r, extents, first);
+    }
+  }
+  void trace_release(const interval_set<uint64_t>& release_set) {
+    if (tracing.load(std::memory_order_relaxed)) {
+      _trace_release(release_set);
+    }
+  }
 };
 
 #endif
@@ -0,0 +1,253 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "AllocatorTrace.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Allocator.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "common/Formatter.h"
+#include "common/Thread.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef dout_prefix
+#define dout_prefix *_dout << "AllocatorTrace " << path << " "
+
+/// records are written out in batches of about this size
+static constexpr uint64_t FLUSH_BYTES = 1 << 20;
+
+AllocatorTraceWriter::~AllocatorTraceWriter()
+{
+  std::lock_guard l(ctl_lock);
+  _stop();
+}
+
+int AllocatorTraceWriter::start(Allocator* a, const std::string& _path,
+				uint64_t _max_bytes)
+{
+  std::lock_guard cl(ctl_lock);
+  if (active) {
+    return -EBUSY;
+  }
+  // reap a trace that stopped by itself at max_bytes
+  _stop();
+
+  // a->foreach() takes the allocator's lock, under which records are
+  // noted; snapshot first
+  alloc_trace_header_t h;
+  h.capacity = a->get_capacity();
+  h.block_size = a->get_block_size();
+  h.alloc_type = a->get_type();
+  h.alloc_name = a->get_name();
+  h.start = ceph_clock_now();
+  // calls racing with the snapshot may be missing from both it and the
+  // records; replays tolerate that
+  a->foreach([&](uint64_t offset, uint64_t length) {
+    h.free_extents.emplace_back(offset, length);
+  });
+
+  path = _path;
+  int r = ::open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (r < 0) {
+    r = -errno;
+    derr << __func__ << " open failed: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  ceph::buffer::list bl;
+  encode(alloc_trace_header_t::MAGIC, bl);
+  encode(h, bl);
+  int fd_ = r;
+  r = bl.write_fd(fd_);
+  if (r < 0) {
+    derr << __func__ << " write failed: " << cpp_strerror(r) << dendl;
+    ::close(fd_);
+    return r;
+  }
+
+  std::lock_guard l(lock);
+  fd = fd_;
+  error = 0;
+  stopping = false;
+  pending.clear();
+  start_stamp = ceph::mono_clock::now();
+  bytes = written = bl.length();
+  max_bytes = _max_bytes;
+  records = 0;
+  dropped = 0;
+  active = true;
+  flusher = make_named_thread("bstore_alloc_tr", [this] { _flush_thread(); });
+  dout(1) << __func__ << " " << h.alloc_type << " with "
+	  << h.free_extents.size() << " free extents" << dendl;
+  return 0;
+}
+
+int AllocatorTraceWriter::stop()
+{
+  std::lock_guard cl(ctl_lock);
+  if (!active) {
+    _stop();
+    return -ENOENT;
+  }
+  return _stop();
+}
+
+int AllocatorTraceWriter::_stop()
+{
+  if (!flusher.joinable()) {
+    return 0;
+  }
+  {
+    std::lock_guard l(lock);
+    active = false;
+    stopping = true;
+    cond.notify_all();
+  }
+  flusher.join();
+  ::close(fd);
+  fd = -1;
+  dout(1) << __func__ << " " << records << " records, " << written
+	  << " bytes, " << dropped << " dropped" << dendl;
+  return error;
+}
+
+void AllocatorTraceWriter::_flush_thread()
+{
+  std::unique_lock l(lock);
+  while (true) {
+    cond.wait(l, [this] {
+      return stopping || pending.length() >= FLUSH_BYTES;
+    });
+    bool last = stopping;
+    ceph::buffer::list bl;
+    bl.swap(pending);
+    l.unlock();
+    int r = bl.length() ? bl.write_fd(fd) : 0;
+    l.lock();
+    if (r < 0) {
+      derr << __func__ << " write failed: " << cpp_strerror(r) << dendl;
+      error = r;
+      active = false;
+      stopping = true;
+      pending.clear();
+      break;
+    }
+    written += bl.length();
+    if (last) {
+      break;
+    }
+  }
+}
+
+void AllocatorTraceWriter::_append(const alloc_trace_record_t& rec)
+{
+  if (!active) {
+    return;
+  }
+  if (max_bytes && bytes >= max_bytes) {
+    ++dropped;
+    dout(1) << __func__ << " reached " << max_bytes << " bytes, stopping"
+	    << dendl;
+    // the flusher writes out the rest; stop() or start() reaps it
+    active = false;
+    stopping = true;
+    cond.notify_all();
+    return;
+  }
+  auto before = pending.length();
+  encode(rec, pending);
+  bytes += pending.length() - before;
+  ++records;
+  if (pending.length() >= FLUSH_BYTES && before < FLUSH_BYTES) {
+    cond.notify_all();
+  }
+}
+
+void AllocatorTraceWriter::note_allocate(
+  uint64_t want, uint64_t unit, uint64_t max_alloc_size, int64_t hint,
+  int64_t result, const PExtentVector& extents, size_t first)
+{
+  alloc_trace_record_t rec;
+  rec.op = alloc_trace_record_t::OP_ALLOCATE;
+  rec.want = want;
+  rec.unit = unit;
+  rec.max_alloc_size = max_alloc_size;
+  rec.hint = hint;
+  rec.result = result;
+  for (size_t i = first; i < extents.size(); ++i) {
+    rec.extents.emplace_back(extents[i].offset, extents[i].length);
+  }
+  std::lock_guard l(lock);
+  rec.stamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    ceph::mono_clock::now() - start_stamp).count();
+  _append(rec);
+}
+
+void AllocatorTraceWriter::note_release(
+  const interval_set<uint64_t>& release_set)
+{
+  alloc_trace_record_t rec;
+  rec.op = alloc_trace_record_t::OP_RELEASE;
+  for (auto p = release_set.begin(); p != release_set.end(); ++p) {
+    rec.extents.emplace_back(p.get_start(), p.get_len());
+  }
+  std::lock_guard l(lock);
+  rec.stamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    ceph::mono_clock::now() - start_stamp).count();
+  _append(rec);
+}
+
+void AllocatorTraceWriter::dump(ceph::Formatter* f) const
+{
+  std::lock_guard l(lock);
+  f->dump_bool("active", active);
+  f->dump_string("path", path);
+  f->dump_unsigned("records", records);
+  f->dump_unsigned("bytes", bytes);
+  f->dump_unsigned("written", written);
+  f->dump_unsigned("max_bytes", max_bytes);
+  f->dump_unsigned("dropped", dropped);
+}
+
+int read_alloc_trace(
+  const std::string& path,
+  alloc_trace_header_t* header,
+  std::function<void(const alloc_trace_record_t&)> fn,
+  std::string* err)
+{
+  ceph::buffer::list bl;
+  int r = bl.read_file(path.c_str(), err);
+  if (r < 0) {
+    return r;
+  }
+  if (bl.length() == 0) {
+    *err = "empty trace";
+    return -EINVAL;
+  }
+  bl.rebuild();
+  ceph::buffer::ptr bp = bl.front();
+  auto p = std::as_const(bp).begin();
+  try {
+    uint32_t magic;
+    denc(magic, p);
+    if (magic != alloc_trace_header_t::MAGIC) {
+      *err = "not an allocator trace";
+      return -EINVAL;
+    }
+    denc(*header, p);
+    while (!p.end()) {
+      alloc_trace_record_t rec;
+      denc(rec, p);
+      fn(rec);
+    }
+  } catch (ceph::buffer::error& e) {
+    // the records before the damage have been delivered; a trace cut
+    // short by a crash is still worth replaying
+    *err = std::string("truncated trace: ") + e.what();
+    return -EINVAL;
+  }
+  return 0;
+}
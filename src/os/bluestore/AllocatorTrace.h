@@ -0,0 +1,193 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_OS_BLUESTORE_ALLOCATORTRACE_H
+#define CEPH_OS_BLUESTORE_ALLOCATORTRACE_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/buffer.h"
+#include "include/denc.h"
+#include "include/interval_set.h"
+#include "common/ceph_mutex.h"
+#include "common/ceph_time.h"
+#include "os/bluestore/bluestore_types.h"
+
+class Allocator;
+
+/**
+ * Allocator traces
+ *
+ * A trace file starts with a header describing the allocator and its free
+ * extents at the moment tracing started, followed by one record per
+ * allocate() or release() call, in call order.  Records are varint
+ * encoded and carry the time since the trace started, which keeps a busy
+ * OSD's trace at a few bytes per call.
+ *
+ * ceph_test_alloc_trace_replay loads the initial free space into any
+ * allocator and replays the calls against it.
+ */
+struct alloc_trace_header_t {
+  static constexpr uint32_t MAGIC = 0x54434c41; ///< "ALCT"
+
+  uint64_t capacity = 0;
+  uint64_t block_size = 0;
+  std::string alloc_type;
+  std::string alloc_name;
+  utime_t start;
+  std::vector<std::pair<uint64_t, uint64_t>> free_extents;
+
+  DENC(alloc_trace_header_t, v, p) {
+    DENC_START(1, 1, p);
+    denc(v.capacity, p);
+    denc(v.block_size, p);
+    denc(v.alloc_type, p);
+    denc(v.alloc_name, p);
+    denc(v.start, p);
+    denc(v.free_extents, p);
+    DENC_FINISH(p);
+  }
+};
+WRITE_CLASS_DENC(alloc_trace_header_t)
+
+struct alloc_trace_record_t {
+  enum op_t : uint8_t {
+    OP_ALLOCATE = 1,
+    OP_RELEASE = 2,
+  };
+  uint8_t op = 0;
+  uint64_t stamp_ns = 0;  ///< since the trace started
+  // allocate() arguments and result
+  uint64_t want = 0;
+  uint64_t unit = 0;
+  uint64_t max_alloc_size = 0;
+  int64_t hint = 0;
+  int64_t result = 0;
+  /// extents handed out by allocate(), or given back to release()
+  std::vector<std::pair<uint64_t, uint64_t>> extents;
+
+  void bound_encode(size_t& p) const {
+    p += 1;
+    denc_varint((uint64_t)0, p);
+    if (op == OP_ALLOCATE) {
+      denc_varint_lowz((uint64_t)0, p);
+      denc_varint_lowz((uint64_t)0, p);
+      denc_varint_lowz((uint64_t)0, p);
+      denc_signed_varint_lowz((int64_t)0, p);
+      denc_signed_varint_lowz((int64_t)0, p);
+    }
+    denc_varint((uint32_t)0, p);
+    size_t elem_size = 0;
+    denc_varint_lowz((uint64_t)0, elem_size);
+    denc_varint_lowz((uint64_t)0, elem_size);
+    p += elem_size * extents.size();
+  }
+  void encode(ceph::buffer::list::contiguous_appender& p) const {
+    denc(op, p);
+    denc_varint(stamp_ns, p);
+    if (op == OP_ALLOCATE) {
+      denc_varint_lowz(want, p);
+      denc_varint_lowz(unit, p);
+      denc_varint_lowz(max_alloc_size, p);
+      denc_signed_varint_lowz(hint, p);
+      denc_signed_varint_lowz(result, p);
+    }
+    denc_varint((uint32_t)extents.size(), p);
+    for (auto& [offset, length] : extents) {
+      denc_varint_lowz(offset, p);
+      denc_varint_lowz(length, p);
+    }
+  }
+  void decode(ceph::buffer::ptr::const_iterator& p) {
+    denc(op, p);
+    denc_varint(stamp_ns, p);
+    if (op == OP_ALLOCATE) {
+      denc_varint_lowz(want, p);
+      denc_varint_lowz(unit, p);
+      denc_varint_lowz(max_alloc_size, p);
+      denc_signed_varint_lowz(hint, p);
+      denc_signed_varint_lowz(result, p);
+    }
+    uint32_t n;
+    denc_varint(n, p);
+    extents.resize(n);
+    for (auto& [offset, length] : extents) {
+      denc_varint_lowz(offset, p);
+      denc_varint_lowz(length, p);
+    }
+  }
+};
+WRITE_CLASS_DENC(alloc_trace_record_t)
+
+/**
+ * AllocatorTraceWriter
+ *
+ * Owned by an Allocator and kept for its lifetime; start() and stop() may
+ * come and go while allocate() and release() run in other threads.
+ *
+ * note_allocate() and note_release() may be called with allocator locks
+ * held, so they only encode into memory; a flusher thread writes the
+ * records out.  Not every allocator calls them under one lock for the
+ * whole call (BitmapAllocator and SizeClassAllocator do not), so records
+ * are kept in causal order instead: a release is noted before its space
+ * can be allocated again and an allocation after its space was taken.
+ * Calls that do not depend on each other may be recorded in either order,
+ * which replay does not mind.
+ */
+class AllocatorTraceWriter {
+public:
+  explicit AllocatorTraceWriter(CephContext* cct) : cct(cct) {}
+  ~AllocatorTraceWriter();
+
+  /// open path and write the header from a's current free extents
+  int start(Allocator* a, const std::string& path, uint64_t max_bytes);
+  int stop();
+  bool is_active() const {
+    return active.load(std::memory_order_relaxed);
+  }
+
+  void note_allocate(uint64_t want, uint64_t unit, uint64_t max_alloc_size,
+		     int64_t hint, int64_t result,
+		     const PExtentVector& extents, size_t first);
+  void note_release(const interval_set<uint64_t>& release_set);
+
+  void dump(ceph::Formatter* f) const;
+
+private:
+  CephContext* cct;
+  /// serializes start() and stop(); never taken under the allocator's lock
+  ceph::mutex ctl_lock = ceph::make_mutex("AllocatorTraceWriter::ctl_lock");
+  /// protects the records queued for the flusher
+  mutable ceph::mutex lock = ceph::make_mutex("AllocatorTraceWriter::lock");
+  ceph::condition_variable cond;
+  std::atomic<bool> active = {false};
+  bool stopping = false;  ///< no more records; the flusher drains and exits
+  int fd = -1;            ///< only written to by the flusher once started
+  int error = 0;          ///< first write error
+  std::thread flusher;
+  std::string path;
+  ceph::mono_time start_stamp;
+  ceph::buffer::list pending;
+  uint64_t bytes = 0;     ///< encoded, written or not
+  uint64_t written = 0;
+  uint64_t max_bytes = 0;
+  uint64_t records = 0;
+  uint64_t dropped = 0;  ///< records lost to max_bytes
+
+  void _append(const alloc_trace_record_t& r);
+  void _flush_thread();
+  int _stop();
+};
+
+/// read a trace, calling fn for every record in order; -EINVAL if malformed
+int read_alloc_trace(
+  const std::string& path,
+  alloc_trace_header_t* header,
+  std::function<void(const alloc_trace_record_t&)> fn,
+  std::string* err);
+
+#endif
@@ -406,6 +406,8 @@ int64_t AvlAllocator::allocate(
   ceph_assert(std::has_single_bit(unit));
   ceph_assert(want % unit == 0);
 
+  const uint64_t orig_max_alloc_size = max_alloc_size;
+  const size_t first = extents->size();
   if (max_alloc_size == 0) {
     max_alloc_size = want;
   }
@@ -414,12 +416,15 @@ int64_t AvlAllocator::allocate(
     max_alloc_size = p2align(uint64_t(cap), (uint64_t)block_size);
   }
   std::lock_guard l(lock);
-  return _allocate(want, unit, max_alloc_size, hint, extents);
+  int64_t r = _allocate(want, unit, max_alloc_size, hint, extents);
+  trace_allocate(want, unit, orig_max_alloc_size, hint, r, *extents, first);
+  return r;
 }
 
 void AvlAllocator::release(const interval_set<uint64_t>& release_set) {
   std::lock_guard l(lock);
   _release(release_set);
+  trace_release(release_set);
 }
 
 uint64_t AvlAllocator::get_free()
@@ -33,6 +33,8 @@ int64_t BitmapAllocator::allocate(
     
   _allocate_l2(want_size, alloc_unit, max_alloc_size, hint,
     &allocated, extents);
+  trace_allocate(want_size, alloc_unit, max_alloc_size, hint,
+		 allocated ? int64_t(allocated) : -ENOSPC, *extents, old_size);
   if (!allocated) {
     return -ENOSPC;
   }
@@ -58,6 +60,8 @@ void BitmapAllocator::release(
       ceph_assert(offset + len <= (uint64_t)device_size);
     }
   }
+  // before the space can be handed out again, see AllocatorTraceWriter
+  trace_release(release_set);
   _free_l2(release_set);
   ldout(cct, 10) << __func__ << " done" << dendl;
 }
@@ -11,6 +11,7 @@
 #include "Allocator.h"
 #include "include/ceph_assert.h"
 #include "common/admin_socket.h"
+#include "common/Thread.h"
 
 #define dout_context cct
 #define dout_subsys ceph_subsys_bluefs
@@ -93,6 +94,9 @@ public:
 	r = admin_socket->register_command("bluefs debug_inject_read_zeros", hook,
 					   "Injects 8K zeros into next BlueFS read. Debug only.");
 	ceph_assert(r == 0);
+	r = admin_socket->register_command("bluefs mount stats", hook,
+					   "Show where time went during the last mount");
+	ceph_assert(r == 0);
       }
     }
     return hook;
@@ -145,6 +149,7 @@ private:
       std::stringstream ss;
       bluefs->dump_block_extents(ss);
       bluefs->dump_volume_selector(ss);
+      bluefs->dump_tier_stats(ss);
       out.append(ss);
     } else if (command == "bluefs files list") {
       const char* devnames[3] = {"wal","db","slow"};
@@ -175,6 +180,8 @@ private:
       f->flush(out);
     } else if (command == "bluefs debug_inject_read_zeros") {
       bluefs->inject_read_zeros++;
+    } else if (command == "bluefs mount stats") {
+      bluefs->mount_stats.dump(f);
     } else {
       errss << "Invalid command" << std::endl;
       return -ENOSYS;
@@ -200,6 +207,8 @@ BlueFS::BlueFS(CephContext* cct)
 
 BlueFS::~BlueFS()
 {
+  _stop_tier_thread();
+  _stop_log_compact_thread();
   delete asok_hook;
   for (auto p : ioc) {
     if (p)
@@ -342,6 +351,18 @@ void BlueFS::_init_logger()
 		    "Bytes read from prefetch buffer in random read mode",
 		    NULL,
 		    PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluefs_read_random_cache_count, "read_random_cache_count",
+		    "random read requests served from the block cache",
+		    NULL,
+		    PerfCountersBuilder::PRIO_USEFUL);
+  b.add_u64_counter(l_bluefs_read_random_cache_bytes, "read_random_cache_bytes",
+		    "Bytes read from the block cache in random read mode",
+		    NULL,
+		    PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluefs_read_random_cache_admit_count, "read_random_cache_admit_count",
+		    "blocks read from disk and added to the block cache",
+		    NULL,
+		    PerfCountersBuilder::PRIO_USEFUL);
   b.add_time_avg   (l_bluefs_read_lat, "read_lat",
                     "Average bluefs read latency",
                     "rd_t",
@@ -451,6 +472,15 @@ void BlueFS::_init_logger()
              "Max allocation latency for primary/shared device",
              "asxt",
              PerfCountersBuilder::PRIO_INTERESTING);
+  b.add_u64_counter(l_bluefs_tier_migrate_count, "tier_migrate_count",
+		    "Files moved off the slow device because they were read hot");
+  b.add_u64_counter(l_bluefs_tier_migrate_bytes, "tier_migrate_bytes",
+		    "Bytes moved off the slow device because they were read hot",
+		    NULL, PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  b.add_time_avg(l_bluefs_tier_migrate_lat, "tier_migrate_lat",
+		 "Average time to move a hot file off the slow device");
+  b.add_u64_counter(l_bluefs_tier_migrate_aborted, "tier_migrate_aborted",
+		    "Tier migrations abandoned because the file changed or space ran out");
 
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
@@ -974,12 +1004,16 @@ int BlueFS::mount()
 {
   dout(1) << __func__ << dendl;
 
+  auto start = mono_clock::now();
+  auto t0 = start;
+  mount_stats = mount_stats_t();
   _init_logger();
   int r = _open_super();
   if (r < 0) {
     derr << __func__ << " failed to open super: " << cpp_strerror(r) << dendl;
     goto out;
   }
+  mount_stats.open_super = mono_clock::now() - t0;
 
   // set volume selector if not provided before/outside
   if (vselector == nullptr) {
@@ -992,14 +1026,32 @@ int BlueFS::mount()
 
   _init_alloc();
 
+  t0 = mono_clock::now();
   r = _replay(false, false);
   if (r < 0) {
     derr << __func__ << " failed to replay log: " << cpp_strerror(r) << dendl;
     _stop_alloc();
     goto out;
   }
+  mount_stats.replay = mono_clock::now() - t0;
+
+  if (cct->_conf->bluefs_block_cache_size) {
+    uint64_t block_size = std::max<uint64_t>(
+      p2roundup<uint64_t>(cct->_conf->bluefs_block_cache_block_size,
+			  super.block_size),
+      super.block_size);
+    block_cache.reset(new BlueFSBlockCache(
+      cct, block_size,
+      cct->_conf->bluefs_block_cache_admit_threshold,
+      BLOCK_CACHE_SHARDS));
+    block_cache->set_max(cct->_conf->bluefs_block_cache_size);
+    dout(1) << __func__ << " block cache size 0x" << std::hex
+	    << cct->_conf->bluefs_block_cache_size << " block size 0x"
+	    << block_size << std::dec << dendl;
+  }
 
   // init freelist
+  t0 = mono_clock::now();
   for (auto& p : nodes.file_map) {
     dout(30) << __func__ << " noting alloc for " << p.second->fnode << dendl;
     for (auto& q : p.second->fnode.extents) {
@@ -1013,6 +1065,7 @@ int BlueFS::mount()
       }
     }
   }
+  mount_stats.init_alloc = mono_clock::now() - t0;
   if (shared_alloc) {
     shared_alloc->need_init = false;
     dout(1) << __func__ << " shared_bdev_used = "
@@ -1032,6 +1085,19 @@ int BlueFS::mount()
            << dendl;
   // update log size
   logger->set(l_bluefs_log_bytes, log.writer->file->fnode.size);
+
+  if (!cct->_conf->bluefs_compact_log_sync &&
+      cct->_conf->bluefs_compact_log_background) {
+    _start_log_compact_thread();
+  }
+  if (cct->_conf->bluefs_tier_enable && bdev[BDEV_SLOW]) {
+    _start_tier_thread();
+  }
+  mount_stats.total = mono_clock::now() - start;
+  dout(1) << __func__ << " took " << mount_stats.total
+	  << " (replay " << mount_stats.replay
+	  << ", " << mount_stats.txns << " txns, 0x" << std::hex
+	  << mount_stats.log_bytes << std::dec << " log bytes)" << dendl;
   return 0;
 
  out:
@@ -1060,6 +1126,8 @@ void BlueFS::umount(bool avoid_compact)
 {
   dout(1) << __func__ << dendl;
 
+  _stop_tier_thread();
+  _stop_log_compact_thread();
   sync_metadata(avoid_compact);
   if (cct->_conf->bluefs_check_volume_selector_on_umount) {
     _check_vselector_LNF();
@@ -1069,6 +1137,7 @@ void BlueFS::umount(bool avoid_compact)
   log.t.clear();
 
   vselector.reset(nullptr);
+  block_cache.reset();
   _stop_alloc();
   nodes.file_map.clear();
   nodes.dir_map.clear();
@@ -1076,6 +1145,23 @@ void BlueFS::umount(bool avoid_compact)
   _shutdown_logger();
 }
 
+void BlueFS::mount_stats_t::dump(ceph::Formatter *f) const
+{
+  f->open_object_section("bluefs_mount_stats");
+  f->dump_float("open_super_sec", ceph::to_seconds<double>(open_super));
+  f->dump_float("replay_sec", ceph::to_seconds<double>(replay));
+  f->dump_float("replay_read_sec", ceph::to_seconds<double>(replay_read));
+  f->dump_float("replay_apply_sec", ceph::to_seconds<double>(replay_apply));
+  f->dump_float("replay_wait_sec", ceph::to_seconds<double>(replay_wait));
+  f->dump_float("init_alloc_sec", ceph::to_seconds<double>(init_alloc));
+  f->dump_float("total_sec", ceph::to_seconds<double>(total));
+  f->dump_unsigned("log_bytes", log_bytes);
+  f->dump_unsigned("txns", txns);
+  f->dump_unsigned("ops", ops);
+  f->dump_unsigned("pipeline_depth", pipeline_depth);
+  f->close_section();
+}
+
 int BlueFS::prepare_new_device(int id, const bluefs_layout_t& layout)
 {
   dout(1) << __func__ << dendl;
@@ -1244,7 +1330,6 @@ int BlueFS::_replay(bool noop, bool to_stdout)
 {
   dout(10) << __func__ << (noop ? " NO-OP" : "") << dendl;
   ino_last = 1;  // by the log
-  uint64_t log_seq = 0;
 
   FileRef log_file;
   log_file = _get_file(1);
@@ -1259,12 +1344,13 @@ int BlueFS::_replay(bool noop, bool to_stdout)
     std::cout << " log_fnode " << super.log_fnode << std::endl;
   } 
 
-  FileReader *log_reader = new FileReader(
-    log_file, cct->_conf->bluefs_max_prefetch,
+  replay_reader_t rr;
+  rr.log_file = ceph::make_ref<File>();
+  rr.log_file->fnode = super.log_fnode;
+  rr.reader.reset(new FileReader(
+    rr.log_file, cct->_conf->bluefs_max_prefetch,
     false,  // !random
-    true);  // ignore eof
-
-  bool seen_recs = false;
+    true));  // ignore eof
 
   boost::dynamic_bitset<uint64_t> used_blocks[MAX_BDEV];
 
@@ -1286,486 +1372,641 @@ int BlueFS::_replay(bool noop, bool to_stdout)
       }
     }
   }
-  
-  while (true) {
-    ceph_assert((log_reader->buf.pos & ~super.block_mask()) == 0);
-    uint64_t pos = log_reader->buf.pos;
-    uint64_t read_pos = pos;
-    bufferlist bl;
-    {
-      int r = _read(log_reader, read_pos, super.block_size,
-		    &bl, NULL);
-      if (r != (int)super.block_size && cct->_conf->bluefs_replay_recovery) {
-	r += _do_replay_recovery_read(log_reader, pos, read_pos + r, super.block_size - r, &bl);
-      }
-      assert(r == (int)super.block_size);
-      read_pos += r;
+
+  // Reading, crc checking and decoding the log is done by a separate
+  // thread that runs up to bluefs_replay_pipeline_depth transactions ahead
+  // of this one, which applies them strictly in order.  Recovery reads may
+  // extend the log as they go, so they stay on the simple path.
+  unsigned depth = cct->_conf->bluefs_replay_pipeline_depth;
+  if (cct->_conf->bluefs_replay_recovery) {
+    depth = 0;
+  }
+  mount_stats.pipeline_depth = depth;
+  mount_stats.replay_read = mount_stats.replay_apply =
+    mount_stats.replay_wait = ceph::make_timespan(0);
+  mount_stats.txns = mount_stats.ops = 0;
+
+  auto apply = [&](replay_txn_t& txn) {
+    auto t0 = mono_clock::now();
+    int r = _replay_apply_txn(txn, noop, to_stdout, used_blocks);
+    if (r == 0) {
+      // we successfully replayed the transaction; bump the log size
+      log_file->fnode.size = txn.log_size;
+      ++mount_stats.txns;
+      mount_stats.ops += txn.ops.size();
     }
-    uint64_t more = 0;
-    uint64_t seq;
-    uuid_d uuid;
-    {
-      auto p = bl.cbegin();
-      __u8 a, b;
-      uint32_t len;
-      decode(a, p);
-      decode(b, p);
-      decode(len, p);
-      decode(uuid, p);
-      decode(seq, p);
-      if (len + 6 > bl.length()) {
-	more = round_up_to(len + 6 - bl.length(), super.block_size);
+    mount_stats.replay_apply += mono_clock::now() - t0;
+    return r;
+  };
+
+  int r = 0;
+  if (depth == 0) {
+    while (true) {
+      replay_txn_t txn;
+      auto t0 = mono_clock::now();
+      r = _replay_read_txn(rr, &txn);
+      mount_stats.replay_read += mono_clock::now() - t0;
+      if (r <= 0) {
+	break;
+      }
+      r = apply(txn);
+      if (r < 0) {
+	break;
       }
     }
-    if (uuid != super.uuid) {
-      if (seen_recs) {
-	dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
-		 << ": stop: uuid " << uuid << " != super.uuid " << super.uuid
-		 << dendl;
-      } else {
-	derr << __func__ << " 0x" << std::hex << pos << std::dec
-		 << ": stop: uuid " << uuid << " != super.uuid " << super.uuid
-		 << ", block dump: \n";
-	bufferlist t;
-	t.substr_of(bl, 0, super.block_size);
-	t.hexdump(*_dout);
-	*_dout << dendl;
+  } else {
+    ceph::mutex qlock = ceph::make_mutex("BlueFS::_replay::qlock");
+    ceph::condition_variable qcond;
+    std::deque<replay_txn_t> q;
+    bool reader_done = false;
+    bool applier_failed = false;
+    int reader_r = 0;
+    ceph::timespan reader_busy = ceph::make_timespan(0);
+
+    std::thread reader = make_named_thread("bfs_replay", [&] {
+      while (true) {
+	replay_txn_t txn;
+	auto t0 = mono_clock::now();
+	int r = _replay_read_txn(rr, &txn);
+	reader_busy += mono_clock::now() - t0;
+	std::unique_lock l(qlock);
+	if (r <= 0) {
+	  reader_r = r;
+	  reader_done = true;
+	  qcond.notify_all();
+	  return;
+	}
+	qcond.wait(l, [&] { return q.size() < depth || applier_failed; });
+	if (applier_failed) {
+	  return;
+	}
+	q.push_back(std::move(txn));
+	qcond.notify_all();
+      }
+    });
+    while (true) {
+      replay_txn_t txn;
+      {
+	auto t0 = mono_clock::now();
+	std::unique_lock l(qlock);
+	qcond.wait(l, [&] { return !q.empty() || reader_done; });
+	mount_stats.replay_wait += mono_clock::now() - t0;
+	if (q.empty()) {
+	  r = reader_r;
+	  break;
+	}
+	txn = std::move(q.front());
+	q.pop_front();
+	qcond.notify_all();
+      }
+      r = apply(txn);
+      if (r < 0) {
+	std::lock_guard l(qlock);
+	applier_failed = true;
+	qcond.notify_all();
+	break;
       }
-      break;
     }
-    if (seq != log_seq + 1) {
-      if (seen_recs) {
-	dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
-		 << ": stop: seq " << seq << " != expected " << log_seq + 1
-		 << dendl;;
-      } else {
-	derr << __func__ << " 0x" << std::hex << pos << std::dec
-	     << ": stop: seq " << seq << " != expected " << log_seq + 1
-	     << dendl;;
+    reader.join();
+    mount_stats.replay_read = reader_busy;
+  }
+  if (r < 0) {
+    return r;
+  }
+  if (cct->_conf->bluefs_replay_recovery) {
+    // pick up any extents recovery found beyond the recorded log
+    uint64_t size = log_file->fnode.size;
+    log_file->fnode = rr.log_file->fnode;
+    log_file->fnode.size = size;
+  }
+  mount_stats.log_bytes = log_file->fnode.size;
+
+  uint64_t log_seq = rr.log_seq;
+  if (!noop) {
+    vselector->add_usage(log_file->vselector_hint, log_file->fnode);
+    log.seq_live = log_seq + 1;
+    dirty.seq_live = log_seq + 1;
+    log.t.seq = log.seq_live;
+    dirty.seq_stable = log_seq;
+  }
+
+  dout(10) << __func__ << " log file size was 0x"
+           << std::hex << log_file->fnode.size << std::dec << dendl;
+  if (unlikely(to_stdout)) {
+    std::cout << " log file size was 0x"
+              << std::hex << log_file->fnode.size << std::dec << std::endl;
+  }
+
+  if (!noop) {
+    // verify file link counts are all >0
+    for (auto& p : nodes.file_map) {
+      if (p.second->refs == 0 &&
+	  p.second->fnode.ino > 1) {
+	derr << __func__ << " file with link count 0: " << p.second->fnode
+	     << dendl;
+	return -EIO;
       }
-      break;
     }
-    if (more) {
-      dout(20) << __func__ << " need 0x" << std::hex << more << std::dec
-               << " more bytes" << dendl;
+  }
+  // reflect file count in logger
+  logger->set(l_bluefs_num_files, nodes.file_map.size());
+
+  dout(10) << __func__ << " done" << dendl;
+  return 0;
+}
+
+int BlueFS::_replay_read_txn(replay_reader_t& rr, replay_txn_t *txn)
+{
+  FileReader *log_reader = rr.reader.get();
+  ceph_assert((log_reader->buf.pos & ~super.block_mask()) == 0);
+  uint64_t pos = log_reader->buf.pos;
+  uint64_t read_pos = pos;
+  bufferlist bl;
+  {
+    int r = _read(log_reader, read_pos, super.block_size,
+		  &bl, NULL);
+    if (r != (int)super.block_size && cct->_conf->bluefs_replay_recovery) {
+      r += _do_replay_recovery_read(log_reader, pos, read_pos + r, super.block_size - r, &bl);
+    }
+    assert(r == (int)super.block_size);
+    read_pos += r;
+  }
+  uint64_t more = 0;
+  uint64_t seq;
+  uuid_d uuid;
+  {
+    auto p = bl.cbegin();
+    __u8 a, b;
+    uint32_t len;
+    decode(a, p);
+    decode(b, p);
+    decode(len, p);
+    decode(uuid, p);
+    decode(seq, p);
+    if (len + 6 > bl.length()) {
+      more = round_up_to(len + 6 - bl.length(), super.block_size);
+    }
+  }
+  if (uuid != super.uuid) {
+    if (rr.seen_recs) {
+      dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
+	       << ": stop: uuid " << uuid << " != super.uuid " << super.uuid
+	       << dendl;
+    } else {
+      derr << __func__ << " 0x" << std::hex << pos << std::dec
+	       << ": stop: uuid " << uuid << " != super.uuid " << super.uuid
+	       << ", block dump: \n";
       bufferlist t;
-      int r = _read(log_reader, read_pos, more, &t, NULL);
-      if (r < (int)more) {
-	dout(10) << __func__ << " 0x" << std::hex << pos
-                 << ": stop: len is 0x" << bl.length() + more << std::dec
-                 << ", which is past eof" << dendl;
-	if (cct->_conf->bluefs_replay_recovery) {
-	  //try to search for more data
-	  r += _do_replay_recovery_read(log_reader, pos, read_pos + r, more - r, &t);
-	  if (r < (int)more) {
-	    //in normal mode we must read r==more, for recovery it is too strict
-	    break;
-	  }
+      t.substr_of(bl, 0, super.block_size);
+      t.hexdump(*_dout);
+      *_dout << dendl;
+    }
+    return 0;
+  }
+  if (seq != rr.log_seq + 1) {
+    if (rr.seen_recs) {
+      dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
+	       << ": stop: seq " << seq << " != expected " << rr.log_seq + 1
+	       << dendl;;
+    } else {
+      derr << __func__ << " 0x" << std::hex << pos << std::dec
+	   << ": stop: seq " << seq << " != expected " << rr.log_seq + 1
+	   << dendl;;
+    }
+    return 0;
+  }
+  if (more) {
+    dout(20) << __func__ << " need 0x" << std::hex << more << std::dec
+	     << " more bytes" << dendl;
+    bufferlist t;
+    int r = _read(log_reader, read_pos, more, &t, NULL);
+    if (r < (int)more) {
+      dout(10) << __func__ << " 0x" << std::hex << pos
+	       << ": stop: len is 0x" << bl.length() + more << std::dec
+	       << ", which is past eof" << dendl;
+      if (cct->_conf->bluefs_replay_recovery) {
+	//try to search for more data
+	r += _do_replay_recovery_read(log_reader, pos, read_pos + r, more - r, &t);
+	if (r < (int)more) {
+	  //in normal mode we must read r==more, for recovery it is too strict
+	  return 0;
 	}
       }
-      ceph_assert(r == (int)more);
-      bl.claim_append(t);
-      read_pos += r;
     }
-    bluefs_transaction_t t;
-    try {
-      auto p = bl.cbegin();
-      decode(t, p);
-      seen_recs = true;
+    ceph_assert(r == (int)more);
+    bl.claim_append(t);
+    read_pos += r;
+  }
+  bluefs_transaction_t& t = txn->t;
+  try {
+    auto p = bl.cbegin();
+    decode(t, p);
+    rr.seen_recs = true;
+  }
+  catch (ceph::buffer::error& e) {
+    // Multi-block transactions might be incomplete due to unexpected
+    // power off. Hence let's treat that as a regular stop condition.
+    if (rr.seen_recs && more) {
+      dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
+	       << ": stop: failed to decode: " << e.what()
+	       << dendl;
+    } else {
+      derr << __func__ << " 0x" << std::hex << pos << std::dec
+	   << ": stop: failed to decode: " << e.what()
+	   << dendl;
+      return -EIO;
     }
-    catch (ceph::buffer::error& e) {
-      // Multi-block transactions might be incomplete due to unexpected
-      // power off. Hence let's treat that as a regular stop condition.
-      if (seen_recs && more) {
-        dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
-                 << ": stop: failed to decode: " << e.what()
-                 << dendl;
-      } else {
-        derr << __func__ << " 0x" << std::hex << pos << std::dec
-             << ": stop: failed to decode: " << e.what()
-             << dendl;
-        delete log_reader;
-        return -EIO;
+    return 0;
+  }
+  ceph_assert(seq == t.seq);
+  txn->pos = pos;
+
+  // Decode the ops for the applier.  Those that move the log itself are
+  // tracked here as well, since the next transaction can't be found
+  // without them.
+  auto p = t.op_bl.cbegin();
+  while (!p.end()) {
+    replay_op_t& o = txn->ops.emplace_back();
+    o.pos = pos + p.get_off();
+    decode(o.op, p);
+    switch (o.op) {
+
+    case bluefs_transaction_t::OP_INIT:
+      break;
+
+    case bluefs_transaction_t::OP_JUMP:
+      {
+	decode(o.seq, p);
+	decode(o.offset, p);
+	ceph_assert(o.seq > rr.log_seq);
+	rr.log_seq = o.seq - 1; // we will increment it below
+	uint64_t skip = o.offset - read_pos;
+	if (skip) {
+	  bufferlist junk;
+	  int r = _read(log_reader, read_pos, skip, &junk,
+			NULL);
+	  if (r != (int)skip) {
+	    dout(10) << __func__ << " 0x" << std::hex << read_pos
+		     << ": stop: failed to skip to " << o.offset
+		     << std::dec << dendl;
+	    ceph_abort_msg("problem with op_jump");
+	  }
+	}
       }
       break;
-    }
-    ceph_assert(seq == t.seq);
-    dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
-             << ": " << t << dendl;
-    if (unlikely(to_stdout)) {
-      std::cout << " 0x" << std::hex << pos << std::dec
-                << ": " << t << std::endl;
-    }
 
-    auto p = t.op_bl.cbegin();
-    auto pos0 = pos;
-    while (!p.end()) {
-      pos = pos0 + p.get_off();
-      __u8 op;
-      decode(op, p);
-      switch (op) {
+    case bluefs_transaction_t::OP_JUMP_SEQ:
+      decode(o.seq, p);
+      ceph_assert(o.seq > rr.log_seq);
+      rr.log_seq = o.seq - 1; // we will increment it below
+      break;
 
-      case bluefs_transaction_t::OP_INIT:
-	dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-                 << ":  op_init" << dendl;
-        if (unlikely(to_stdout)) {
-          std::cout << " 0x" << std::hex << pos << std::dec
-                    << ":  op_init" << std::endl;
-        }
+    case bluefs_transaction_t::OP_ALLOC_ADD:
+    case bluefs_transaction_t::OP_ALLOC_RM:
+      // LEGACY, do nothing but read params
+      {
+	__u8 id;
+	uint64_t offset, length;
+	decode(id, p);
+	decode(offset, p);
+	decode(length, p);
+      }
+      break;
 
-	ceph_assert(t.seq == 1);
-	break;
+    case bluefs_transaction_t::OP_DIR_LINK:
+      decode(o.dirname, p);
+      decode(o.filename, p);
+      decode(o.ino, p);
+      break;
 
-      case bluefs_transaction_t::OP_JUMP:
-        {
-	  uint64_t next_seq;
-	  uint64_t offset;
-	  decode(next_seq, p);
-	  decode(offset, p);
-	  dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-		   << ":  op_jump seq " << next_seq
-		   << " offset 0x" << std::hex << offset << std::dec << dendl;
-          if (unlikely(to_stdout)) {
-            std::cout << " 0x" << std::hex << pos << std::dec
-                      << ":  op_jump seq " << next_seq
-                      << " offset 0x" << std::hex << offset << std::dec
-                      << std::endl;
-          }
+    case bluefs_transaction_t::OP_DIR_UNLINK:
+      decode(o.dirname, p);
+      decode(o.filename, p);
+      break;
 
-	  ceph_assert(next_seq > log_seq);
-	  log_seq = next_seq - 1; // we will increment it below
-	  uint64_t skip = offset - read_pos;
-	  if (skip) {
-	    bufferlist junk;
-	    int r = _read(log_reader, read_pos, skip, &junk,
-			  NULL);
-	    if (r != (int)skip) {
-	      dout(10) << __func__ << " 0x" << std::hex << read_pos
-		       << ": stop: failed to skip to " << offset
-		       << std::dec << dendl;
-	      ceph_abort_msg("problem with op_jump");
-	    }
-	  }
-	}
-	break;
+    case bluefs_transaction_t::OP_DIR_CREATE:
+    case bluefs_transaction_t::OP_DIR_REMOVE:
+      decode(o.dirname, p);
+      break;
 
-      case bluefs_transaction_t::OP_JUMP_SEQ:
-        {
-	  uint64_t next_seq;
-	  decode(next_seq, p);
-	  dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-                   << ":  op_jump_seq " << next_seq << dendl;
-          if (unlikely(to_stdout)) {
-            std::cout << " 0x" << std::hex << pos << std::dec
-                      << ":  op_jump_seq " << next_seq << std::endl;
-          }
+    case bluefs_transaction_t::OP_FILE_UPDATE:
+      decode(o.fnode, p);
+      if (o.fnode.ino == 1) {
+	rr.log_file->fnode = o.fnode;
+      }
+      break;
 
-	  ceph_assert(next_seq > log_seq);
-	  log_seq = next_seq - 1; // we will increment it below
-	}
-	break;
+    case bluefs_transaction_t::OP_FILE_UPDATE_INC:
+      decode(o.delta, p);
+      if (o.delta.ino == 1) {
+	bluefs_fnode_delta_t delta = o.delta;
+	bluefs_fnode_t& fnode = rr.log_file->fnode;
+	fnode.ino = delta.ino;
+	fnode.mtime = delta.mtime;
+	fnode.size = delta.size;
+	fnode.claim_extents(delta.extents);
+      }
+      break;
 
-      case bluefs_transaction_t::OP_ALLOC_ADD:
-	// LEGACY, do nothing but read params
-        {
-          __u8 id;
-          uint64_t offset, length;
-          decode(id, p);
-          decode(offset, p);
-          decode(length, p);
-        }
-	break;
+    case bluefs_transaction_t::OP_FILE_REMOVE:
+      decode(o.ino, p);
+      break;
 
-      case bluefs_transaction_t::OP_ALLOC_RM:
-	// LEGACY, do nothing but read params
-        {
-          __u8 id;
-          uint64_t offset, length;
-          decode(id, p);
-          decode(offset, p);
-          decode(length, p);
-        }
-        break;
+    default:
+      derr << __func__ << " 0x" << std::hex << o.pos << std::dec
+	   << ": stop: unrecognized op " << (int)o.op << dendl;
+      return -EIO;
+    }
+  }
+  ceph_assert(p.end());
 
-      case bluefs_transaction_t::OP_DIR_LINK:
-        {
-	  string dirname, filename;
-	  uint64_t ino;
-	  decode(dirname, p);
-	  decode(filename, p);
-	  decode(ino, p);
-	  dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-                   << ":  op_dir_link " << " " << dirname << "/" << filename
-                   << " to " << ino
-		   << dendl;
-          if (unlikely(to_stdout)) {
-            std::cout << " 0x" << std::hex << pos << std::dec
-                      << ":  op_dir_link " << " " << dirname << "/" << filename
-                      << " to " << ino
-                      << std::endl;
-          }
+  ++rr.log_seq;
+  txn->log_size = log_reader->buf.pos;
+  return 1;
+}
 
-	  if (!noop) {
-	    FileRef file = _get_file(ino);
-	    ceph_assert(file->fnode.ino);
-	    map<string,DirRef>::iterator q = nodes.dir_map.find(dirname);
-	    ceph_assert(q != nodes.dir_map.end());
-	    map<string,FileRef>::iterator r = q->second->file_map.find(filename);
-	    ceph_assert(r == q->second->file_map.end());
-
-            vselector->sub_usage(file->vselector_hint, file->fnode);
-            file->vselector_hint =
-              vselector->get_hint_by_dir(dirname);
-            vselector->add_usage(file->vselector_hint, file->fnode);
-
-	    q->second->file_map[filename] = file;
-	    ++file->refs;
-	  }
+int BlueFS::_replay_apply_txn(replay_txn_t& txn, bool noop, bool to_stdout,
+			      boost::dynamic_bitset<uint64_t>* used_blocks)
+{
+  bluefs_transaction_t& t = txn.t;
+  dout(10) << __func__ << " 0x" << std::hex << txn.pos << std::dec
+	   << ": " << t << dendl;
+  if (unlikely(to_stdout)) {
+    std::cout << " 0x" << std::hex << txn.pos << std::dec
+	      << ": " << t << std::endl;
+  }
+
+  for (auto& o : txn.ops) {
+    uint64_t pos = o.pos;
+    switch (o.op) {
+
+    case bluefs_transaction_t::OP_INIT:
+      dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+	       << ":  op_init" << dendl;
+      if (unlikely(to_stdout)) {
+	std::cout << " 0x" << std::hex << pos << std::dec
+		  << ":  op_init" << std::endl;
+      }
+
+      ceph_assert(t.seq == 1);
+      break;
+
+    case bluefs_transaction_t::OP_JUMP:
+      dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+	       << ":  op_jump seq " << o.seq
+	       << " offset 0x" << std::hex << o.offset << std::dec << dendl;
+      if (unlikely(to_stdout)) {
+	std::cout << " 0x" << std::hex << pos << std::dec
+		  << ":  op_jump seq " << o.seq
+		  << " offset 0x" << std::hex << o.offset << std::dec
+		  << std::endl;
+      }
+      break;
+
+    case bluefs_transaction_t::OP_JUMP_SEQ:
+      dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+	       << ":  op_jump_seq " << o.seq << dendl;
+      if (unlikely(to_stdout)) {
+	std::cout << " 0x" << std::hex << pos << std::dec
+		  << ":  op_jump_seq " << o.seq << std::endl;
+      }
+      break;
+
+    case bluefs_transaction_t::OP_ALLOC_ADD:
+    case bluefs_transaction_t::OP_ALLOC_RM:
+      break;
+
+    case bluefs_transaction_t::OP_DIR_LINK:
+      {
+	const string& dirname = o.dirname;
+	const string& filename = o.filename;
+	uint64_t ino = o.ino;
+	dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+		 << ":  op_dir_link " << " " << dirname << "/" << filename
+		 << " to " << ino
+		 << dendl;
+	if (unlikely(to_stdout)) {
+	  std::cout << " 0x" << std::hex << pos << std::dec
+		    << ":  op_dir_link " << " " << dirname << "/" << filename
+		    << " to " << ino
+		    << std::endl;
 	}
-	break;
 
-      case bluefs_transaction_t::OP_DIR_UNLINK:
-        {
-	  string dirname, filename;
-	  decode(dirname, p);
-	  decode(filename, p);
-	  dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-                   << ":  op_dir_unlink " << " " << dirname << "/" << filename
-                   << dendl;
-          if (unlikely(to_stdout)) {
-            std::cout << " 0x" << std::hex << pos << std::dec
-                      << ":  op_dir_unlink " << " " << dirname << "/" << filename
-                      << std::endl;
-          }
- 
-	  if (!noop) {
-	    map<string,DirRef>::iterator q = nodes.dir_map.find(dirname);
-	    ceph_assert(q != nodes.dir_map.end());
-	    map<string,FileRef>::iterator r = q->second->file_map.find(filename);
-	    ceph_assert(r != q->second->file_map.end());
-            ceph_assert(r->second->refs > 0); 
-	    --r->second->refs;
-	    q->second->file_map.erase(r);
-	  }
+	if (!noop) {
+	  FileRef file = _get_file(ino);
+	  ceph_assert(file->fnode.ino);
+	  map<string,DirRef>::iterator q = nodes.dir_map.find(dirname);
+	  ceph_assert(q != nodes.dir_map.end());
+	  map<string,FileRef>::iterator r = q->second->file_map.find(filename);
+	  ceph_assert(r == q->second->file_map.end());
+
+	  vselector->sub_usage(file->vselector_hint, file->fnode);
+	  file->vselector_hint =
+	    vselector->get_hint_by_dir(dirname);
+	  vselector->add_usage(file->vselector_hint, file->fnode);
+
+	  q->second->file_map[filename] = file;
+	  ++file->refs;
 	}
-	break;
+      }
+      break;
 
-      case bluefs_transaction_t::OP_DIR_CREATE:
-        {
-	  string dirname;
-	  decode(dirname, p);
-	  dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-                   << ":  op_dir_create " << dirname << dendl;
-          if (unlikely(to_stdout)) {
-            std::cout << " 0x" << std::hex << pos << std::dec
-                      << ":  op_dir_create " << dirname << std::endl;
-          }
+    case bluefs_transaction_t::OP_DIR_UNLINK:
+      {
+	const string& dirname = o.dirname;
+	const string& filename = o.filename;
+	dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+		 << ":  op_dir_unlink " << " " << dirname << "/" << filename
+		 << dendl;
+	if (unlikely(to_stdout)) {
+	  std::cout << " 0x" << std::hex << pos << std::dec
+		    << ":  op_dir_unlink " << " " << dirname << "/" << filename
+		    << std::endl;
+	}
 
-	  if (!noop) {
-	    map<string,DirRef>::iterator q = nodes.dir_map.find(dirname);
-	    ceph_assert(q == nodes.dir_map.end());
-	    nodes.dir_map[dirname] = ceph::make_ref<Dir>();
-	  }
+	if (!noop) {
+	  map<string,DirRef>::iterator q = nodes.dir_map.find(dirname);
+	  ceph_assert(q != nodes.dir_map.end());
+	  map<string,FileRef>::iterator r = q->second->file_map.find(filename);
+	  ceph_assert(r != q->second->file_map.end());
+	  ceph_assert(r->second->refs > 0);
+	  --r->second->refs;
+	  q->second->file_map.erase(r);
 	}
-	break;
+      }
+      break;
 
-      case bluefs_transaction_t::OP_DIR_REMOVE:
-        {
-	  string dirname;
-	  decode(dirname, p);
-	  dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-                   << ":  op_dir_remove " << dirname << dendl;
-          if (unlikely(to_stdout)) {
-            std::cout << " 0x" << std::hex << pos << std::dec
-                      << ":  op_dir_remove " << dirname << std::endl;
-          }
+    case bluefs_transaction_t::OP_DIR_CREATE:
+      {
+	const string& dirname = o.dirname;
+	dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+		 << ":  op_dir_create " << dirname << dendl;
+	if (unlikely(to_stdout)) {
+	  std::cout << " 0x" << std::hex << pos << std::dec
+		    << ":  op_dir_create " << dirname << std::endl;
+	}
 
-	  if (!noop) {
-	    map<string,DirRef>::iterator q = nodes.dir_map.find(dirname);
-	    ceph_assert(q != nodes.dir_map.end());
-	    ceph_assert(q->second->file_map.empty());
-	    nodes.dir_map.erase(q);
-	  }
+	if (!noop) {
+	  map<string,DirRef>::iterator q = nodes.dir_map.find(dirname);
+	  ceph_assert(q == nodes.dir_map.end());
+	  nodes.dir_map[dirname] = ceph::make_ref<Dir>();
 	}
-	break;
+      }
+      break;
 
-      case bluefs_transaction_t::OP_FILE_UPDATE:
-        {
-	  bluefs_fnode_t fnode;
-	  decode(fnode, p);
-	  dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-                   << ":  op_file_update " << " " << fnode << " " << dendl;
-          if (unlikely(to_stdout)) {
-            std::cout << " 0x" << std::hex << pos << std::dec
-                      << ":  op_file_update " << " " << fnode << std::endl;
-          }
-          if (!noop) {
-	    FileRef f = _get_file(fnode.ino);
-	    if (cct->_conf->bluefs_log_replay_check_allocations) {
-              int r = _check_allocations(f->fnode,
-		used_blocks, false, "OP_FILE_UPDATE");
-              if (r < 0) {
-                return r;
-              }
-            }
-            if (fnode.ino != 1) {
-              vselector->sub_usage(f->vselector_hint, f->fnode);
-	      vselector->add_usage(f->vselector_hint, fnode);
-	    }
-            f->fnode = fnode;
+    case bluefs_transaction_t::OP_DIR_REMOVE:
+      {
+	const string& dirname = o.dirname;
+	dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+		 << ":  op_dir_remove " << dirname << dendl;
+	if (unlikely(to_stdout)) {
+	  std::cout << " 0x" << std::hex << pos << std::dec
+		    << ":  op_dir_remove " << dirname << std::endl;
+	}
 
-	    if (fnode.ino > ino_last) {
-	      ino_last = fnode.ino;
+	if (!noop) {
+	  map<string,DirRef>::iterator q = nodes.dir_map.find(dirname);
+	  ceph_assert(q != nodes.dir_map.end());
+	  ceph_assert(q->second->file_map.empty());
+	  nodes.dir_map.erase(q);
+	}
+      }
+      break;
+
+    case bluefs_transaction_t::OP_FILE_UPDATE:
+      {
+	bluefs_fnode_t& fnode = o.fnode;
+	dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+		 << ":  op_file_update " << " " << fnode << " " << dendl;
+	if (unlikely(to_stdout)) {
+	  std::cout << " 0x" << std::hex << pos << std::dec
+		    << ":  op_file_update " << " " << fnode << std::endl;
+	}
+	if (!noop) {
+	  FileRef f = _get_file(fnode.ino);
+	  if (cct->_conf->bluefs_log_replay_check_allocations) {
+	    int r = _check_allocations(f->fnode,
+	      used_blocks, false, "OP_FILE_UPDATE");
+	    if (r < 0) {
+	      return r;
 	    }
-            if (cct->_conf->bluefs_log_replay_check_allocations) {
-              int r = _check_allocations(f->fnode,
-		used_blocks, true, "OP_FILE_UPDATE");
-              if (r < 0) {
-                return r;
-              }
-            }
-	  } else if (noop && fnode.ino == 1) {
-	    FileRef f = _get_file(fnode.ino);
-	    f->fnode = fnode;
 	  }
-        }
-	break;
-      case bluefs_transaction_t::OP_FILE_UPDATE_INC:
-	{
-	  bluefs_fnode_delta_t delta;
-	  decode(delta, p);
-	  dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-	    << ":  op_file_update_inc " << " " << delta << " " << dendl;
-	  if (unlikely(to_stdout)) {
-	    std::cout << " 0x" << std::hex << pos << std::dec
-	      << ":  op_file_update_inc " << " " << delta << std::endl;
+	  if (fnode.ino != 1) {
+	    vselector->sub_usage(f->vselector_hint, f->fnode);
+	    vselector->add_usage(f->vselector_hint, fnode);
 	  }
-	  if (!noop) {
-	    FileRef f = _get_file(delta.ino);
-	    bluefs_fnode_t& fnode = f->fnode;
-	    if (delta.offset != fnode.allocated) {
-	      derr << __func__ << " invalid op_file_update_inc, new extents miss end of file"
-		   << " fnode=" << fnode
-		   << " delta=" << delta
-		   << dendl;
-	      ceph_assert(delta.offset == fnode.allocated);
-	    }
-	    if (cct->_conf->bluefs_log_replay_check_allocations) {
-              int r = _check_allocations(fnode,
-		used_blocks, false, "OP_FILE_UPDATE_INC");
-              if (r < 0) {
-                return r;
-              }
-            }
-
-	    fnode.ino = delta.ino;
-	    fnode.mtime = delta.mtime;
-	    if (fnode.ino != 1) {
-	      vselector->sub_usage(f->vselector_hint, fnode);
-	    }
-	    fnode.size = delta.size;
-	    fnode.claim_extents(delta.extents);
-	    dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-		     << ":  op_file_update_inc produced " << " " << fnode << " " << dendl;
+	  f->fnode = fnode;
 
-	    if (fnode.ino != 1) {
-	      vselector->add_usage(f->vselector_hint, fnode);
-	    }
-
-	    if (fnode.ino > ino_last) {
-	      ino_last = fnode.ino;
-	    }
-	    if (cct->_conf->bluefs_log_replay_check_allocations) {
-              int r = _check_allocations(f->fnode,
-		used_blocks, true, "OP_FILE_UPDATE_INC");
-              if (r < 0) {
-                return r;
-              }
+	  if (fnode.ino > ino_last) {
+	    ino_last = fnode.ino;
+	  }
+	  if (cct->_conf->bluefs_log_replay_check_allocations) {
+	    int r = _check_allocations(f->fnode,
+	      used_blocks, true, "OP_FILE_UPDATE");
+	    if (r < 0) {
+	      return r;
 	    }
-	  } else if (noop && delta.ino == 1) {
-	    // we need to track bluefs log, even in noop mode
-	    FileRef f = _get_file(1);
-	    bluefs_fnode_t& fnode = f->fnode;
-	    fnode.ino = delta.ino;
-	    fnode.mtime = delta.mtime;
-	    fnode.size = delta.size;
-	    fnode.claim_extents(delta.extents);
 	  }
+	} else if (noop && fnode.ino == 1) {
+	  FileRef f = _get_file(fnode.ino);
+	  f->fnode = fnode;
 	}
+      }
       break;
 
-      case bluefs_transaction_t::OP_FILE_REMOVE:
-        {
-	  uint64_t ino;
-	  decode(ino, p);
+    case bluefs_transaction_t::OP_FILE_UPDATE_INC:
+      {
+	bluefs_fnode_delta_t& delta = o.delta;
+	dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+		 << ":  op_file_update_inc " << " " << delta << " " << dendl;
+	if (unlikely(to_stdout)) {
+	  std::cout << " 0x" << std::hex << pos << std::dec
+		    << ":  op_file_update_inc " << " " << delta << std::endl;
+	}
+	if (!noop) {
+	  FileRef f = _get_file(delta.ino);
+	  bluefs_fnode_t& fnode = f->fnode;
+	  if (delta.offset != fnode.allocated) {
+	    derr << __func__ << " invalid op_file_update_inc, new extents miss end of file"
+		 << " fnode=" << fnode
+		 << " delta=" << delta
+		 << dendl;
+	    ceph_assert(delta.offset == fnode.allocated);
+	  }
+	  if (cct->_conf->bluefs_log_replay_check_allocations) {
+	    int r = _check_allocations(fnode,
+	      used_blocks, false, "OP_FILE_UPDATE_INC");
+	    if (r < 0) {
+	      return r;
+	    }
+	  }
+
+	  fnode.ino = delta.ino;
+	  fnode.mtime = delta.mtime;
+	  if (fnode.ino != 1) {
+	    vselector->sub_usage(f->vselector_hint, fnode);
+	  }
+	  fnode.size = delta.size;
+	  fnode.claim_extents(delta.extents);
 	  dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
-                   << ":  op_file_remove " << ino << dendl;
-          if (unlikely(to_stdout)) {
-            std::cout << " 0x" << std::hex << pos << std::dec
-                      << ":  op_file_remove " << ino << std::endl;
-          }
+		   << ":  op_file_update_inc produced " << " " << fnode << " " << dendl;
 
-          if (!noop) {
-            auto p = nodes.file_map.find(ino);
-            ceph_assert(p != nodes.file_map.end());
-            vselector->sub_usage(p->second->vselector_hint, p->second->fnode);
-            if (cct->_conf->bluefs_log_replay_check_allocations) {
-	      int r = _check_allocations(p->second->fnode,
-		used_blocks, false, "OP_FILE_REMOVE");
-              if (r < 0) {
-		return r;
-              }
-            }
-            nodes.file_map.erase(p);
-          }
-        }
-	break;
+	  if (fnode.ino != 1) {
+	    vselector->add_usage(f->vselector_hint, fnode);
+	  }
 
-      default:
-	derr << __func__ << " 0x" << std::hex << pos << std::dec
-             << ": stop: unrecognized op " << (int)op << dendl;
-	delete log_reader;
-        return -EIO;
+	  if (fnode.ino > ino_last) {
+	    ino_last = fnode.ino;
+	  }
+	  if (cct->_conf->bluefs_log_replay_check_allocations) {
+	    int r = _check_allocations(f->fnode,
+	      used_blocks, true, "OP_FILE_UPDATE_INC");
+	    if (r < 0) {
+	      return r;
+	    }
+	  }
+	} else if (noop && delta.ino == 1) {
+	  // we need to track bluefs log, even in noop mode
+	  FileRef f = _get_file(1);
+	  bluefs_fnode_t& fnode = f->fnode;
+	  fnode.ino = delta.ino;
+	  fnode.mtime = delta.mtime;
+	  fnode.size = delta.size;
+	  fnode.claim_extents(delta.extents);
+	}
       }
-    }
-    ceph_assert(p.end());
-
-    // we successfully replayed the transaction; bump the seq and log size
-    ++log_seq;
-    log_file->fnode.size = log_reader->buf.pos;
-  }
-  if (!noop) {
-    vselector->add_usage(log_file->vselector_hint, log_file->fnode);
-    log.seq_live = log_seq + 1;
-    dirty.seq_live = log_seq + 1;
-    log.t.seq = log.seq_live;
-    dirty.seq_stable = log_seq;
-  }
-
-  dout(10) << __func__ << " log file size was 0x"
-           << std::hex << log_file->fnode.size << std::dec << dendl;
-  if (unlikely(to_stdout)) {
-    std::cout << " log file size was 0x"
-              << std::hex << log_file->fnode.size << std::dec << std::endl;
-  }
+      break;
 
-  delete log_reader;
+    case bluefs_transaction_t::OP_FILE_REMOVE:
+      {
+	uint64_t ino = o.ino;
+	dout(20) << __func__ << " 0x" << std::hex << pos << std::dec
+		 << ":  op_file_remove " << ino << dendl;
+	if (unlikely(to_stdout)) {
+	  std::cout << " 0x" << std::hex << pos << std::dec
+		    << ":  op_file_remove " << ino << std::endl;
+	}
 
-  if (!noop) {
-    // verify file link counts are all >0
-    for (auto& p : nodes.file_map) {
-      if (p.second->refs == 0 &&
-	  p.second->fnode.ino > 1) {
-	derr << __func__ << " file with link count 0: " << p.second->fnode
-	     << dendl;
-	return -EIO;
+	if (!noop) {
+	  auto p = nodes.file_map.find(ino);
+	  ceph_assert(p != nodes.file_map.end());
+	  vselector->sub_usage(p->second->vselector_hint, p->second->fnode);
+	  if (cct->_conf->bluefs_log_replay_check_allocations) {
+	    int r = _check_allocations(p->second->fnode,
+	      used_blocks, false, "OP_FILE_REMOVE");
+	    if (r < 0) {
+	      return r;
+	    }
+	  }
+	  nodes.file_map.erase(p);
+	}
       }
+      break;
+
+    default:
+      ceph_abort_msg("op was validated by _replay_read_txn");
     }
   }
-  // reflect file count in logger
-  logger->set(l_bluefs_num_files, nodes.file_map.size());
-
-  dout(10) << __func__ << " done" << dendl;
   return 0;
 }
 
@@ -2118,6 +2359,7 @@ void BlueFS::_drop_link_D(FileRef file)
     nodes.file_map.erase(file->fnode.ino);
     logger->set(l_bluefs_num_files, nodes.file_map.size());
     file->deleted = true;
+    _invalidate_block_cache(file.get(), 0, file->fnode.size);
 
     std::lock_guard dl(dirty.lock);
     for (auto& r : file->fnode.extents) {
@@ -2148,6 +2390,10 @@ int64_t BlueFS::_read_random(
 	   << " from " << lock_fnode_print(h->file) << dendl;
 
   ++h->file->num_reading;
+  std::shared_lock e_lock(h->file->extents_lock, std::defer_lock);
+  if (tier.enabled) {
+    e_lock.lock();
+  }
 
   if (!h->ignore_eof &&
       off + len > h->file->fnode.size) {
@@ -2172,6 +2418,28 @@ int64_t BlueFS::_read_random(
       uint64_t l = std::min(p->length - x_off, len);
       //hard cap to 1GB
       l = std::min(l, uint64_t(1) << 30);
+      if (block_cache &&
+	  l <= block_cache->get_block_size() &&
+	  !cct->_conf->bluefs_check_for_zeros) {
+	// small reads are what RocksDB issues for individual SST blocks;
+	// larger ones are iterator/compaction readahead, let them bypass
+	uint64_t cl = _read_random_cached(h->file.get(), *p, x_off, off, l, out);
+	if (cl > 0) {
+	  // hits and fills alike: the cache absorbs the io, not the demand,
+	  // and a hot file on the slow device still wants promoting
+	  if (p->bdev == BDEV_SLOW && tier.enabled) {
+	    h->file->tier_heat += cl;
+	  }
+	  off += cl;
+	  len -= cl;
+	  ret += cl;
+	  out += cl;
+	  if (len > 0) {
+	    s_lock.lock();
+	  }
+	  continue;
+	}
+      }
       dout(20) << __func__ << " read random 0x"
 	       << std::hex << x_off << "~" << l << std::dec
 	       << " of " << *p << dendl;
@@ -2184,6 +2452,9 @@ int64_t BlueFS::_read_random(
 			cct->_conf->bluefs_buffered_io);
       }
       ceph_assert(r == 0);
+      if (p->bdev == BDEV_SLOW && tier.enabled) {
+	h->file->tier_heat += l;
+      }
       off += l;
       len -= l;
       ret += l;
@@ -2229,6 +2500,65 @@ int64_t BlueFS::_read_random(
   return ret;
 }
 
+uint64_t BlueFS::_read_random_cached(
+  File *file,                ///< [in] read from here
+  const bluefs_extent_t& e,  ///< [in] extent holding offset
+  uint64_t x_off,            ///< [in] offset within e
+  uint64_t off,              ///< [in] file offset
+  uint64_t len,              ///< [in] at most this many bytes
+  char *out)                 ///< [out] copy it here
+{
+  uint64_t block_size = block_cache->get_block_size();
+  uint64_t block_off = off - off % block_size;
+  uint64_t block_end = block_off + block_size;
+  uint64_t e_start = off - x_off;  // file offset e starts at
+
+  // Only whole blocks that are already written and sit in a single extent
+  // are cached: nothing below fnode.size changes without passing through
+  // _invalidate_block_cache, and writers never coexist with readers.
+  if (block_off < e_start ||
+      block_end > e_start + e.length ||
+      block_end > file->fnode.size) {
+    return 0;
+  }
+  uint64_t l = std::min(len, block_end - off);
+  uint64_t ino = file->fnode.ino;
+  if (block_cache->read(ino, off, l, out)) {
+    dout(20) << __func__ << " cached 0x" << std::hex << off << "~" << l
+	     << std::dec << " of ino " << ino << dendl;
+    logger->inc(l_bluefs_read_random_cache_count, 1);
+    logger->inc(l_bluefs_read_random_cache_bytes, l);
+    return l;
+  }
+  if (!block_cache->note_miss(ino, block_off)) {
+    return 0;
+  }
+
+  dout(20) << __func__ << " fill 0x" << std::hex << block_off << "~"
+	   << block_size << std::dec << " of ino " << ino << dendl;
+  bufferptr bp(buffer::create_aligned_in_mempool(
+    block_size, CEPH_PAGE_SIZE, mempool::mempool_bluefs_block_cache));
+  int r = _bdev_read_random(e.bdev, e.offset + (block_off - e_start),
+			    block_size, bp.c_str(),
+			    cct->_conf->bluefs_buffered_io);
+  ceph_assert(r == 0);
+  logger->inc(l_bluefs_read_random_disk_count, 1);
+  logger->inc(l_bluefs_read_random_disk_bytes, block_size);
+  logger->inc(l_bluefs_read_random_cache_admit_count, 1);
+
+  memcpy(out, bp.c_str() + (off - block_off), l);
+  file->block_cached = true;
+  block_cache->insert(ino, block_off, std::move(bp));
+  return l;
+}
+
+void BlueFS::_invalidate_block_cache(File *file, uint64_t offset, uint64_t len)
+{
+  if (block_cache && file->block_cached) {
+    block_cache->invalidate(file->fnode.ino, offset, len);
+  }
+}
+
 int64_t BlueFS::_read(
   FileReader *h,         ///< [in] read from here
   uint64_t off,          ///< [in] offset
@@ -2247,6 +2577,10 @@ int64_t BlueFS::_read(
 	   << dendl;
 
   ++h->file->num_reading;
+  std::shared_lock e_lock(h->file->extents_lock, std::defer_lock);
+  if (tier.enabled) {
+    e_lock.lock();
+  }
 
   if (!h->ignore_eof &&
       off + len > h->file->fnode.size) {
@@ -2315,6 +2649,9 @@ int64_t BlueFS::_read(
 	}
 	logger->inc(l_bluefs_read_disk_count, 1);
 	logger->inc(l_bluefs_read_disk_bytes, l);
+	if (p->bdev == BDEV_SLOW && tier.enabled) {
+	  h->file->tier_heat += l;
+	}
 
         ceph_assert(r == 0);
       }
@@ -3455,6 +3792,11 @@ int BlueFS::_flush_range_F(FileWriter *h, uint64_t offset, uint64_t length)
   }
   std::lock_guard file_lock(h->file->lock);
   ceph_assert(offset <= h->file->fnode.size);
+  if (offset < h->file->fnode.size) {
+    // overwriting previously written data
+    _invalidate_block_cache(h->file.get(), offset,
+			    h->file->fnode.size - offset);
+  }
 
   uint64_t allocated = h->file->fnode.get_allocated();
   // do not bother to dirty the file if we are overwriting
@@ -3742,6 +4084,8 @@ int BlueFS::truncate(FileWriter *h, uint64_t offset)/*_WF_L*/
 
   std::lock_guard ll(log.lock);
   vselector->sub_usage(h->file->vselector_hint, h->file->fnode.size - offset);
+  _invalidate_block_cache(h->file.get(), offset,
+			  h->file->fnode.size - offset);
   h->file->fnode.size = offset;
   h->file->is_dirty = true;
   log.t.op_file_update_inc(h->file->fnode);
@@ -3910,6 +4254,15 @@ int BlueFS::_allocate(uint8_t id, uint64_t len,
     extents.reserve(4);  // 4 should be (more than) enough for most allocations
     auto t0 = mono_clock::now();
     alloc_len = alloc[id]->allocate(need, alloc_unit, hint, &extents);
+    if ((alloc_len < 0 || alloc_len < need) && bdev[id] &&
+        bdev[id]->release_queued_discards()) {
+      // some of the space was only waiting for its discard
+      if (alloc_len > 0) {
+        alloc[id]->release(extents);
+        extents.clear();
+      }
+      alloc_len = alloc[id]->allocate(need, alloc_unit, hint, &extents);
+    }
     _update_allocate_stats(id, mono_clock::now() - t0);
   }
   if (alloc_len < 0 || alloc_len < need) {
@@ -4054,6 +4407,15 @@ void BlueFS::_maybe_compact_log_LNF_NF_LD_D()
 {
   if (!cct->_conf->bluefs_replay_recovery_disable_compact &&
       _should_start_compact_log_L_N()) {
+    if (!cct->_conf->bluefs_compact_log_sync) {
+      std::lock_guard l(log_compact.lock);
+      if (log_compact.thread.joinable()) {
+	// hand it off; the caller came here to fsync, not to compact
+	log_compact.requested = true;
+	log_compact.cond.notify_one();
+	return;
+      }
+    }
     auto t0 = mono_clock::now();
     if (cct->_conf->bluefs_compact_log_sync) {
       _compact_log_sync_LNF_LD();
@@ -4064,6 +4426,318 @@ void BlueFS::_maybe_compact_log_LNF_NF_LD_D()
   }
 }
 
+void BlueFS::_start_log_compact_thread()
+{
+  std::lock_guard l(log_compact.lock);
+  ceph_assert(!log_compact.thread.joinable());
+  log_compact.stop = false;
+  log_compact.requested = false;
+  log_compact.thread = make_named_thread("bfs_log_compact",
+					 &BlueFS::_log_compact_thread_entry,
+					 this);
+}
+
+void BlueFS::_stop_log_compact_thread()
+{
+  {
+    std::lock_guard l(log_compact.lock);
+    if (!log_compact.thread.joinable()) {
+      return;
+    }
+    log_compact.stop = true;
+    log_compact.cond.notify_one();
+  }
+  log_compact.thread.join();
+}
+
+void BlueFS::_log_compact_thread_entry()
+{
+  std::unique_lock l(log_compact.lock);
+  while (true) {
+    log_compact.cond.wait(l, [this] {
+      return log_compact.requested || log_compact.stop;
+    });
+    if (log_compact.stop) {
+      break;
+    }
+    log_compact.requested = false;
+    l.unlock();
+    dout(10) << __func__ << " compacting" << dendl;
+    auto t0 = mono_clock::now();
+    _compact_log_async_LD_LNF_D();
+    logger->tinc(l_bluefs_compaction_lat, mono_clock::now() - t0);
+    l.lock();
+  }
+}
+
+void BlueFS::dump_tier_stats(ostream& out)
+{
+  std::lock_guard l(tier.lock);
+  out << "tiering: " << (tier.enabled ? "on" : "off")
+      << ", migrated " << tier.migrated_files << " files, "
+      << byte_u_t(tier.migrated_bytes)
+      << ", aborted " << tier.aborted << "\n";
+  for (auto& m : tier.recent) {
+    out << "  " << m.stamp << " ino " << m.ino
+	<< " " << byte_u_t(m.bytes) << " to " << get_device_name(m.to)
+	<< ", heat " << byte_u_t(m.heat)
+	<< ", took " << m.lat << "\n";
+  }
+}
+
+void BlueFS::_start_tier_thread()
+{
+  std::lock_guard l(tier.lock);
+  ceph_assert(!tier.thread.joinable());
+  tier.stop = false;
+  // readers must start taking extents_lock before the first migration
+  tier.enabled = true;
+  tier.thread = make_named_thread("bfs_tier",
+				  &BlueFS::_tier_thread_entry,
+				  this);
+}
+
+void BlueFS::_stop_tier_thread()
+{
+  {
+    std::lock_guard l(tier.lock);
+    if (!tier.thread.joinable()) {
+      return;
+    }
+    tier.stop = true;
+    tier.cond.notify_one();
+  }
+  tier.thread.join();
+  tier.enabled = false;
+}
+
+void BlueFS::_tier_thread_entry()
+{
+  std::unique_lock l(tier.lock);
+  while (true) {
+    auto interval = ceph::make_timespan(cct->_conf->bluefs_tier_interval);
+    tier.cond.wait_for(l, interval, [this] { return tier.stop; });
+    if (tier.stop) {
+      break;
+    }
+    l.unlock();
+    _tier_migrate_N_LNF_LD();
+    l.lock();
+  }
+}
+
+/*
+ * Files end up on the slow device either by level (db.slow) or because
+ * the DB device was full when they were written (spillover).  Once there
+ * they stay, however hot they turn out to be.  Each pass picks files that
+ * the volume selector would place on a faster device now, ranks them by
+ * how much has recently been read from their slow extents and moves the
+ * hottest ones, as long as that leaves bluefs_tier_min_free_ratio of the
+ * target device free.
+ */
+uint64_t BlueFS::_tier_migrate_N_LNF_LD()
+{
+  struct candidate_t {
+    FileRef file;
+    uint64_t heat;
+    uint8_t target;
+  };
+  std::vector<candidate_t> candidates;
+  uint64_t min_heat = cct->_conf->bluefs_tier_min_heat;
+  {
+    std::lock_guard nl(nodes.lock);
+    for (auto& [ino, f] : nodes.file_map) {
+      if (ino <= 1) {
+	continue;
+      }
+      // halve on every pass, so heat reflects recent reads only
+      uint64_t heat = f->tier_heat.load();
+      f->tier_heat -= heat / 2;
+      if (heat < min_heat || f->num_writers.load() > 0) {
+	continue;
+      }
+      uint8_t target = vselector->select_prefer_bdev(f->vselector_hint);
+      if (target >= BDEV_SLOW || !alloc[target]) {
+	continue;
+      }
+      std::lock_guard fl(f->lock);
+      for (auto& e : f->fnode.extents) {
+	if (e.bdev == BDEV_SLOW) {
+	  candidates.push_back({f, heat, target});
+	  break;
+	}
+      }
+    }
+  }
+  if (candidates.empty()) {
+    return 0;
+  }
+  std::sort(candidates.begin(), candidates.end(),
+	    [](const candidate_t& a, const candidate_t& b) {
+	      return a.heat > b.heat;
+	    });
+  dout(10) << __func__ << " " << candidates.size() << " candidates" << dendl;
+
+  double min_free_ratio = cct->_conf->bluefs_tier_min_free_ratio;
+  uint64_t bytes_per_sec = cct->_conf->bluefs_tier_max_bytes_per_sec;
+  uint64_t migrated = 0;
+  for (auto& c : candidates) {
+    uint64_t need = c.file->fnode.get_allocated();
+    uint64_t free = alloc[c.target]->get_free();
+    uint64_t reserve = alloc[c.target]->get_capacity() * min_free_ratio;
+    if (free < need + reserve) {
+      dout(10) << __func__ << " not enough room on " << get_device_name(c.target)
+	       << " for ino " << c.file->fnode.ino << ", free 0x" << std::hex
+	       << free << " need 0x" << need << " + 0x" << reserve << std::dec
+	       << dendl;
+      continue;
+    }
+    auto t0 = mono_clock::now();
+    int64_t r = _tier_migrate_file_LNF_LD(c.file, c.target);
+    auto lat = mono_clock::now() - t0;
+    std::unique_lock l(tier.lock);
+    if (r <= 0) {
+      if (r < 0) {
+	++tier.aborted;
+	logger->inc(l_bluefs_tier_migrate_aborted);
+      }
+    } else {
+      ++migrated;
+      ++tier.migrated_files;
+      tier.migrated_bytes += r;
+      tier.recent.push_back(
+	{ceph_clock_now(), c.file->fnode.ino, (uint64_t)r, c.heat, c.target, lat});
+      if (tier.recent.size() > 16) {
+	tier.recent.pop_front();
+      }
+      logger->inc(l_bluefs_tier_migrate_count);
+      logger->inc(l_bluefs_tier_migrate_bytes, r);
+      logger->tinc(l_bluefs_tier_migrate_lat, lat);
+      if (bytes_per_sec) {
+	auto budget = ceph::make_timespan((double)r / bytes_per_sec);
+	if (budget > lat) {
+	  tier.cond.wait_for(l, budget - lat, [this] { return tier.stop; });
+	}
+      }
+    }
+    if (tier.stop) {
+      break;
+    }
+  }
+  return migrated;
+}
+
+/*
+ * Copy everything from the first slow extent onwards to freshly allocated
+ * space on target, then swap the extents in under the full lock chain plus
+ * extents_lock so that no reader is half way through a lookup.  The old
+ * extents are released through the log like any other freed space.
+ * Returns bytes moved, 0 if there was nothing to do, or <0 on abort.
+ */
+int64_t BlueFS::_tier_migrate_file_LNF_LD(FileRef f, uint8_t target)
+{
+  std::unique_lock fl(f->lock);
+  if (f->deleted || f->num_writers.load() > 0) {
+    return 0;
+  }
+  bluefs_fnode_t old(f->fnode);
+  fl.unlock();
+
+  size_t first = 0;
+  uint64_t start = 0;
+  for (; first < old.extents.size(); ++first) {
+    if (old.extents[first].bdev == BDEV_SLOW) {
+      break;
+    }
+    start += old.extents[first].length;
+  }
+  if (first == old.extents.size()) {
+    return 0;
+  }
+  dout(10) << __func__ << " " << old << " from 0x" << std::hex << start
+	   << std::dec << " to " << get_device_name(target) << dendl;
+
+  bluefs_fnode_t nf(old.ino, old.size, old.mtime);
+  for (size_t i = 0; i < first; ++i) {
+    nf.append_extent(old.extents[i]);
+  }
+  vector<interval_set<uint64_t>> fresh(MAX_BDEV);
+  int r = _allocate(target, old.get_allocated() - start, 0, &nf,
+    [&](const bluefs_extent_t& e) {
+      fresh[e.bdev].insert(e.offset, e.length);
+    }, 0, false);
+  if (r < 0) {
+    dout(10) << __func__ << " unable to allocate on "
+	     << get_device_name(target) << dendl;
+    return r;
+  }
+
+  uint64_t end = round_up_to(old.size, super.block_size);
+  uint64_t off = start;
+  while (off < end) {
+    uint64_t s_off = 0, d_off = 0;
+    auto s = old.seek(off, &s_off);
+    auto d = nf.seek(off, &d_off);
+    ceph_assert(s != old.extents.end() && d != nf.extents.end());
+    uint64_t l = std::min({s->length - s_off, d->length - d_off, end - off,
+			   uint64_t(1) << 20});
+    bufferlist bl;
+    r = _bdev_read(s->bdev, s->offset + s_off, l, &bl, ioc[s->bdev], false);
+    if (r == 0) {
+      r = bdev[d->bdev]->write(d->offset + d_off, bl, false);
+    }
+    if (r < 0) {
+      derr << __func__ << " copy of ino " << old.ino << " failed at 0x"
+	   << std::hex << off << std::dec << ": " << cpp_strerror(r) << dendl;
+      break;
+    }
+    off += l;
+    std::lock_guard tl(tier.lock);
+    if (tier.stop) {
+      r = -EINTR;
+      break;
+    }
+  }
+  if (r == 0) {
+    bdev[target]->flush();
+
+    std::lock_guard ll(log.lock);
+    std::lock_guard nl(nodes.lock);
+    std::lock_guard fl(f->lock);
+    auto same_extent = [](const bluefs_extent_t& a, const bluefs_extent_t& b) {
+      return a.bdev == b.bdev && a.offset == b.offset && a.length == b.length;
+    };
+    if (f->deleted || f->num_writers.load() > 0 ||
+	f->fnode.size != old.size ||
+	!std::equal(f->fnode.extents.begin(), f->fnode.extents.end(),
+		    old.extents.begin(), old.extents.end(), same_extent)) {
+      dout(10) << __func__ << " ino " << old.ino << " changed while copying"
+	       << dendl;
+      r = -EAGAIN;
+    } else {
+      std::unique_lock el(f->extents_lock);
+      vselector->sub_usage(f->vselector_hint, f->fnode);
+      f->fnode.swap_extents(nf);
+      vselector->add_usage(f->vselector_hint, f->fnode);
+      el.unlock();
+      log.t.op_file_update(f->fnode);
+
+      std::lock_guard dl(dirty.lock);
+      for (size_t i = first; i < old.extents.size(); ++i) {
+	auto& e = old.extents[i];
+	dirty.pending_release[e.bdev].insert(e.offset, e.length);
+      }
+    }
+  }
+  if (r < 0) {
+    _release_pending_allocations(fresh);
+    return r;
+  }
+  _flush_and_sync_log_LD();
+  dout(10) << __func__ << " moved " << lock_fnode_print(f) << dendl;
+  return end > start ? end - start : 0;
+}
+
 int BlueFS::open_for_write(
   std::string_view dirname,
   std::string_view filename,
@@ -4123,6 +4797,8 @@ int BlueFS::open_for_write(
       pending_release_extents.swap(file->fnode.extents);
 
       file->fnode.clear_extents();
+      _invalidate_block_cache(file.get(), 0,
+			      std::numeric_limits<uint64_t>::max());
     }
   }
   ceph_assert(file->fnode.ino > 1);
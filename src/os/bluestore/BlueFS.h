@@ -4,10 +4,13 @@
 #define CEPH_OS_BLUESTORE_BLUEFS_H
 
 #include <atomic>
+#include <deque>
 #include <mutex>
 #include <limits>
+#include <thread>
 
 #include "bluefs_types.h"
+#include "BlueFSBlockCache.h"
 #include "blk/BlockDevice.h"
 
 #include "common/RefCountedObj.h"
@@ -56,6 +59,9 @@ enum {
   l_bluefs_read_random_disk_bytes_slow,
   l_bluefs_read_random_buffer_count,
   l_bluefs_read_random_buffer_bytes,
+  l_bluefs_read_random_cache_count,
+  l_bluefs_read_random_cache_bytes,
+  l_bluefs_read_random_cache_admit_count,
   l_bluefs_read_lat,
   l_bluefs_read_count,
   l_bluefs_read_bytes,
@@ -85,6 +91,10 @@ enum {
   l_bluefs_wal_alloc_max_lat,
   l_bluefs_db_alloc_max_lat,
   l_bluefs_slow_alloc_max_lat,
+  l_bluefs_tier_migrate_count,
+  l_bluefs_tier_migrate_bytes,
+  l_bluefs_tier_migrate_lat,
+  l_bluefs_tier_migrate_aborted,
   l_bluefs_last,
 };
 
@@ -245,6 +255,8 @@ public:
 
     std::atomic_int num_readers, num_writers;
     std::atomic_int num_reading;
+    std::atomic_bool block_cached = false;  ///< may have blocks in block_cache
+    std::atomic<uint64_t> tier_heat = 0;    ///< decaying count of bytes read from slow device, cache hits included
 
     void* vselector_hint = nullptr;
     /* lock protects fnode and other the parts that can be modified during read & write operations.
@@ -252,6 +264,10 @@ public:
        Does not need to be taken when doing one-time operations:
        _replay, device_migrate_to_existing, device_migrate_to_new */
     ceph::mutex lock = ceph::make_mutex("BlueFS::File::lock");
+    /* held shared by readers and exclusively by tier migration while it
+       swaps fnode.extents; only taken while tiering is enabled */
+    ceph::shared_mutex extents_lock =
+      ceph::make_shared_mutex("BlueFS::File::extents_lock");
 
   private:
     FRIEND_MAKE_REF(File);
@@ -479,6 +495,53 @@ private:
   } dirty;
 
   ceph::condition_variable log_cond;                             ///< used for state control between log flush / log compaction
+
+  /// runs async log compaction so that it never holds up fsync callers
+  struct {
+    ceph::mutex lock = ceph::make_mutex("BlueFS::log_compact.lock");
+    ceph::condition_variable cond;
+    bool requested = false;
+    bool stop = false;
+    std::thread thread;
+  } log_compact;
+
+  /// moves read-hot files off the slow device, see _tier_migrate_N_LNF_LD
+  struct tier_migration_t {
+    utime_t stamp;
+    uint64_t ino = 0;
+    uint64_t bytes = 0;
+    uint64_t heat = 0;
+    uint8_t to = 0;
+    ceph::timespan lat;
+  };
+  struct {
+    ceph::mutex lock = ceph::make_mutex("BlueFS::tier.lock");
+    ceph::condition_variable cond;
+    bool stop = false;
+    std::thread thread;
+    std::atomic<bool> enabled = false;      ///< readers track heat and take extents_lock
+    uint64_t migrated_files = 0;
+    uint64_t migrated_bytes = 0;
+    uint64_t aborted = 0;
+    std::deque<tier_migration_t> recent;    ///< last few migrations
+  } tier;
+
+  /// where the last mount spent its time, for "bluefs mount stats"
+  struct mount_stats_t {
+    ceph::timespan open_super = ceph::make_timespan(0);
+    ceph::timespan replay = ceph::make_timespan(0);       ///< wall time of _replay
+    ceph::timespan replay_read = ceph::make_timespan(0);  ///< reading and decoding the log
+    ceph::timespan replay_apply = ceph::make_timespan(0); ///< applying decoded transactions
+    ceph::timespan replay_wait = ceph::make_timespan(0);  ///< applier starved by the reader
+    ceph::timespan init_alloc = ceph::make_timespan(0);   ///< marking file extents in use
+    ceph::timespan total = ceph::make_timespan(0);
+    uint64_t log_bytes = 0;
+    uint64_t txns = 0;
+    uint64_t ops = 0;
+    unsigned pipeline_depth = 0;
+
+    void dump(ceph::Formatter *f) const;
+  } mount_stats;
   std::atomic<bool> log_is_compacting{false};                    ///< signals that bluefs log is already ongoing compaction
   std::atomic<bool> log_forbidden_to_expand{false};              ///< used to signal that async compaction is in state
                                                                  ///  that prohibits expansion of bluefs log
@@ -500,6 +563,8 @@ private:
   BlockDevice::aio_callback_t discard_cb[3]; //discard callbacks for each dev
 
   std::unique_ptr<BlueFSVolumeSelector> vselector;
+  static constexpr size_t BLOCK_CACHE_SHARDS = 8;
+  std::unique_ptr<BlueFSBlockCache> block_cache;
 
   bluefs_shared_alloc_context_t* shared_alloc = nullptr;
   unsigned shared_alloc_id = unsigned(-1);
@@ -588,6 +653,14 @@ private:
 
   void _compact_log_sync_LNF_LD();
   void _compact_log_async_LD_LNF_D();
+  void _start_tier_thread();
+  void _stop_tier_thread();
+  void _tier_thread_entry();
+  uint64_t _tier_migrate_N_LNF_LD();
+  int64_t _tier_migrate_file_LNF_LD(FileRef f, uint8_t target);
+  void _start_log_compact_thread();
+  void _stop_log_compact_thread();
+  void _log_compact_thread_entry();
 
   void _rewrite_log_and_layout_sync_LNF_LD(bool permit_dev_fallback,
 				    int super_dev,
@@ -616,6 +689,14 @@ private:
     uint64_t offset, ///< [in] offset
     uint64_t len,    ///< [in] this many bytes
     char *out);      ///< [out] optional: or copy it here
+  uint64_t _read_random_cached(
+    File *file,                ///< [in] read from here
+    const bluefs_extent_t& e,  ///< [in] extent holding offset
+    uint64_t x_off,            ///< [in] offset within e
+    uint64_t offset,           ///< [in] file offset
+    uint64_t len,              ///< [in] at most this many bytes
+    char *out);                ///< [out] copy it here
+  void _invalidate_block_cache(File *file, uint64_t offset, uint64_t len);
 
   int _open_super();
   int _write_super(int dev);
@@ -629,6 +710,35 @@ private:
     const char *op);
   int _replay(bool noop, bool to_stdout = false); ///< replay journal
 
+  /// a log op decoded by the reader half of _replay
+  struct replay_op_t {
+    uint64_t pos = 0;
+    __u8 op = 0;
+    uint64_t ino = 0;               ///< OP_DIR_LINK, OP_FILE_REMOVE
+    uint64_t seq = 0;               ///< OP_JUMP, OP_JUMP_SEQ
+    uint64_t offset = 0;            ///< OP_JUMP
+    std::string dirname, filename;  ///< OP_DIR_*
+    bluefs_fnode_t fnode;           ///< OP_FILE_UPDATE
+    bluefs_fnode_delta_t delta;     ///< OP_FILE_UPDATE_INC
+  };
+  /// a validated log transaction waiting to be applied in order
+  struct replay_txn_t {
+    uint64_t pos = 0;       ///< log offset of the transaction
+    uint64_t log_size = 0;  ///< log size once it is applied
+    bluefs_transaction_t t;
+    std::vector<replay_op_t> ops;
+  };
+  /// state of the reader half of _replay
+  struct replay_reader_t {
+    FileRef log_file;  ///< private copy, tracks the log's own layout
+    std::unique_ptr<FileReader> reader;
+    uint64_t log_seq = 0;  ///< seq of the last transaction read
+    bool seen_recs = false;
+  };
+  int _replay_read_txn(replay_reader_t& rr, replay_txn_t *txn);
+  int _replay_apply_txn(replay_txn_t& txn, bool noop, bool to_stdout,
+			boost::dynamic_bitset<uint64_t>* used_blocks);
+
   FileWriter *_create_writer(FileRef f);
   void _drain_writer(FileWriter *h);
   void _close_writer(FileWriter *h);
@@ -684,6 +794,7 @@ public:
   void dump_perf_counters(ceph::Formatter *f);
 
   void dump_block_extents(std::ostream& out);
+  void dump_tier_stats(std::ostream& out);
 
   /// get current extents that we own for given block device
   void foreach_block_extents(
@@ -743,6 +854,9 @@ public:
 		       bluefs_shared_alloc_context_t* _shared_alloc = nullptr);
   bool bdev_support_label(unsigned id);
   uint64_t get_block_device_size(unsigned bdev) const;
+  BlockDevice* get_block_device(unsigned id) const {
+    return id < bdev.size() ? bdev[id] : nullptr;
+  }
 
   // handler for discard event
   void handle_discard(unsigned dev, interval_set<uint64_t>& to_release);
@@ -767,6 +881,9 @@ public:
     return _read_random(h, offset, len, out);
   }
   void invalidate_cache(FileRef f, uint64_t offset, uint64_t len);
+  BlueFSBlockCache* get_block_cache() {
+    return block_cache.get();
+  }
   int preallocate(FileRef f, uint64_t offset, uint64_t len);
   int truncate(FileWriter *h, uint64_t offset);
 
@@ -776,6 +893,13 @@ public:
   const PerfCounters* get_perf_counters() const {
     return logger;
   }
+  const mount_stats_t& get_mount_stats() const {
+    return mount_stats;
+  }
+  uint64_t debug_tier_migrate() {
+    ceph_assert(tier.enabled);
+    return _tier_migrate_N_LNF_LD();
+  }
   uint64_t debug_get_dirty_seq(FileWriter *h);
   bool debug_get_is_dev_dirty(FileWriter *h, uint8_t dev);
 
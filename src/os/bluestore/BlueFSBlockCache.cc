@@ -0,0 +1,232 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+#include "BlueFSBlockCache.h"
+
+#include <cstring>
+
+#include "common/debug.h"
+#include "include/ceph_assert.h"
+#include "include/hash.h"
+#include "include/mempool.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluefs
+#undef dout_prefix
+#define dout_prefix *_dout << "bluefs block_cache "
+
+// miss counters per shard; a power of two so the modulo is cheap
+static constexpr size_t HEAT_SLOTS = 4096;
+static constexpr uint8_t HEAT_MAX = 15;
+
+BlueFSBlockCache::BlueFSBlockCache(CephContext* cct, uint64_t block_size,
+				   uint32_t admit_threshold, size_t num_shards)
+  : cct(cct), block_size(block_size), admit_threshold(admit_threshold)
+{
+  ceph_assert(block_size > 0);
+  ceph_assert(num_shards > 0);
+  for (size_t i = 0; i < num_shards; ++i) {
+    shards.emplace_back(std::make_unique<Shard>());
+    shards.back()->heat.resize(HEAT_SLOTS, 0);
+  }
+}
+
+BlueFSBlockCache::~BlueFSBlockCache()
+{
+  clear();
+}
+
+uint64_t BlueFSBlockCache::hash(uint64_t ino, uint64_t offset)
+{
+  return rjhash64(ino ^ rjhash64(offset));
+}
+
+void BlueFSBlockCache::_rm(Shard& s, block_map_t::iterator p)
+{
+  Block& b = p->second;
+  s.lru.erase(s.lru.iterator_to(b));
+  s.bytes -= b.data.length();
+  *(b.cache_age_bin) -= b.data.length();
+  s.blocks.erase(p);
+}
+
+void BlueFSBlockCache::_trim(Shard& s)
+{
+  uint64_t shard_max = max / shards.size();
+  while (s.bytes > shard_max && !s.lru.empty()) {
+    Block& b = s.lru.back();
+    dout(30) << __func__ << " evict " << b.ino << ":0x" << std::hex << b.offset
+	     << std::dec << dendl;
+    _rm(s, s.blocks.find({b.ino, b.offset}));
+  }
+}
+
+bool BlueFSBlockCache::read(uint64_t ino, uint64_t offset, uint64_t len,
+			    char* out)
+{
+  uint64_t block_off = offset - offset % block_size;
+  ceph_assert(offset + len <= block_off + block_size);
+  Shard& s = get_shard(ino, block_off);
+  std::lock_guard l(s.lock);
+  auto p = s.blocks.find({ino, block_off});
+  if (p == s.blocks.end()) {
+    return false;
+  }
+  Block& b = p->second;
+  memcpy(out, b.data.c_str() + (offset - block_off), len);
+  s.lru.erase(s.lru.iterator_to(b));
+  s.lru.push_front(b);
+  if (b.cache_age_bin != s.age_bins.front()) {
+    *(b.cache_age_bin) -= b.data.length();
+    b.cache_age_bin = s.age_bins.front();
+    *(b.cache_age_bin) += b.data.length();
+  }
+  return true;
+}
+
+bool BlueFSBlockCache::note_miss(uint64_t ino, uint64_t block_off)
+{
+  if (admit_threshold <= 1) {
+    return max > 0;
+  }
+  uint64_t h = hash(ino, block_off);
+  Shard& s = *shards[h % shards.size()];
+  std::lock_guard l(s.lock);
+  uint8_t& heat = s.heat[(h >> 32) % HEAT_SLOTS];
+  if (heat < HEAT_MAX) {
+    ++heat;
+  }
+  if (++s.heat_events >= HEAT_SLOTS * 4) {
+    // age the counters so that blocks that used to be hot cool down
+    for (auto& i : s.heat) {
+      i >>= 1;
+    }
+    s.heat_events = 0;
+  }
+  return max > 0 && heat >= admit_threshold;
+}
+
+void BlueFSBlockCache::insert(uint64_t ino, uint64_t block_off,
+			      ceph::bufferptr&& data)
+{
+  ceph_assert(data.length() == block_size);
+  ceph_assert(block_off % block_size == 0);
+  Shard& s = get_shard(ino, block_off);
+  std::lock_guard l(s.lock);
+  auto [p, inserted] = s.blocks.try_emplace({ino, block_off},
+					    ino, block_off, std::move(data));
+  if (!inserted) {
+    // another reader raced us to it
+    return;
+  }
+  Block& b = p->second;
+  s.lru.push_front(b);
+  s.bytes += block_size;
+  b.cache_age_bin = s.age_bins.front();
+  *(b.cache_age_bin) += block_size;
+  _trim(s);
+}
+
+void BlueFSBlockCache::invalidate(uint64_t ino, uint64_t offset, uint64_t len)
+{
+  uint64_t start = offset - offset % block_size;
+  uint64_t end = len > std::numeric_limits<uint64_t>::max() - offset ?
+    std::numeric_limits<uint64_t>::max() : offset + len;
+  dout(20) << __func__ << " " << ino << " 0x" << std::hex << offset
+	   << "~" << len << std::dec << dendl;
+  // a short range maps to a few shards; only a range that spans many
+  // blocks has to visit them all
+  std::vector<bool> touched(shards.size(), shards.size() == 1);
+  uint64_t num_blocks = (end - start) / block_size + 1;
+  if (shards.size() > 1 && num_blocks <= shards.size() * 4) {
+    for (uint64_t i = 0; i < num_blocks; ++i) {
+      touched[hash(ino, start + i * block_size) % shards.size()] = true;
+    }
+  } else {
+    touched.assign(shards.size(), true);
+  }
+  for (size_t i = 0; i < shards.size(); ++i) {
+    if (!touched[i]) {
+      continue;
+    }
+    Shard& s = *shards[i];
+    std::lock_guard l(s.lock);
+    auto p = s.blocks.lower_bound({ino, start});
+    while (p != s.blocks.end() &&
+	   p->first.first == ino &&
+	   p->first.second < end) {
+      auto q = p++;
+      _rm(s, q);
+    }
+  }
+}
+
+void BlueFSBlockCache::clear()
+{
+  for (auto& i : shards) {
+    Shard& s = *i;
+    std::lock_guard l(s.lock);
+    while (!s.blocks.empty()) {
+      _rm(s, s.blocks.begin());
+    }
+  }
+}
+
+void BlueFSBlockCache::set_max(uint64_t m)
+{
+  uint64_t old = max.exchange(m);
+  if (m < old) {
+    for (auto& i : shards) {
+      std::lock_guard l(i->lock);
+      _trim(*i);
+    }
+  }
+}
+
+uint64_t BlueFSBlockCache::get_bytes()
+{
+  uint64_t bytes = 0;
+  for (auto& i : shards) {
+    std::lock_guard l(i->lock);
+    bytes += i->bytes;
+  }
+  return bytes;
+}
+
+void BlueFSBlockCache::shift_bins()
+{
+  for (auto& i : shards) {
+    std::lock_guard l(i->lock);
+    i->age_bins.push_front(std::make_shared<int64_t>(0));
+  }
+}
+
+uint32_t BlueFSBlockCache::get_bin_count()
+{
+  std::lock_guard l(shards[0]->lock);
+  return shards[0]->age_bins.capacity();
+}
+
+void BlueFSBlockCache::set_bin_count(uint32_t count)
+{
+  for (auto& i : shards) {
+    std::lock_guard l(i->lock);
+    i->age_bins.set_capacity(count);
+  }
+}
+
+uint64_t BlueFSBlockCache::sum_bins(uint32_t start, uint32_t end)
+{
+  uint64_t bytes = 0;
+  for (auto& i : shards) {
+    std::lock_guard l(i->lock);
+    auto size = i->age_bins.size();
+    if (size < start) {
+      continue;
+    }
+    uint32_t e = (size < end) ? size : end;
+    for (auto j = start; j < e; j++) {
+      bytes += *(i->age_bins[j]);
+    }
+  }
+  return bytes;
+}
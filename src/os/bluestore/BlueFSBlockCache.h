@@ -0,0 +1,108 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+#ifndef CEPH_OS_BLUESTORE_BLUEFSBLOCKCACHE_H
+#define CEPH_OS_BLUESTORE_BLUEFSBLOCKCACHE_H
+
+#include <atomic>
+#include <limits>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "boost/circular_buffer.hpp"
+#include "boost/intrusive/list.hpp"
+
+#include "common/ceph_mutex.h"
+#include "include/buffer.h"
+#include "include/common_fwd.h"
+
+/**
+ * BlueFSBlockCache
+ *
+ * Memory bounded cache of fixed size, block aligned chunks of BlueFS file
+ * data, keyed by (ino, file offset).  It sits below the per-reader prefetch
+ * buffer and catches the small random reads RocksDB issues for SST blocks
+ * that miss its own block cache.
+ *
+ * A block is only admitted once it has missed admit_threshold times within
+ * the recent past, so a one-off scan does not wash out the hot set.  Miss
+ * frequency is tracked in a small, periodically halved counter table per
+ * shard rather than per block, so it costs no memory per uncached block.
+ *
+ * Age bins follow BlueStore::CacheShard so that BlueStore can hand the cache
+ * to its PriorityCache::Manager next to the onode, buffer and kv caches.
+ */
+class BlueFSBlockCache {
+  struct Block : public boost::intrusive::list_base_hook<> {
+    uint64_t ino;
+    uint64_t offset;
+    ceph::bufferptr data;
+    std::shared_ptr<int64_t> cache_age_bin;  ///< cache age bin
+
+    Block(uint64_t ino, uint64_t offset, ceph::bufferptr&& data)
+      : ino(ino), offset(offset), data(std::move(data)) {}
+  };
+  typedef std::map<std::pair<uint64_t, uint64_t>, Block> block_map_t;
+
+  struct Shard {
+    ceph::mutex lock = ceph::make_mutex("BlueFSBlockCache::Shard::lock");
+    block_map_t blocks;
+    boost::intrusive::list<Block> lru;
+    uint64_t bytes = 0;
+    boost::circular_buffer<std::shared_ptr<int64_t>> age_bins;
+
+    std::vector<uint8_t> heat;   ///< hashed miss counters
+    uint64_t heat_events = 0;    ///< misses since counters were last halved
+
+    Shard() : age_bins(1) {
+      age_bins.push_front(std::make_shared<int64_t>(0));
+    }
+  };
+
+  CephContext* cct;
+  const uint64_t block_size;
+  const uint32_t admit_threshold;
+  std::vector<std::unique_ptr<Shard>> shards;
+  std::atomic<uint64_t> max = {0};
+
+  Shard& get_shard(uint64_t ino, uint64_t offset) {
+    return *shards[hash(ino, offset) % shards.size()];
+  }
+  static uint64_t hash(uint64_t ino, uint64_t offset);
+  void _rm(Shard& s, block_map_t::iterator p);
+  void _trim(Shard& s);
+
+public:
+  BlueFSBlockCache(CephContext* cct, uint64_t block_size,
+		   uint32_t admit_threshold, size_t num_shards);
+  ~BlueFSBlockCache();
+
+  uint64_t get_block_size() const {
+    return block_size;
+  }
+
+  /// copy [offset, offset+len) out of the cached block holding it, if any
+  bool read(uint64_t ino, uint64_t offset, uint64_t len, char* out);
+  /// note a miss on the block at block_off; true if it is hot enough to cache
+  bool note_miss(uint64_t ino, uint64_t block_off);
+  /// add a full block; data must be exactly block_size bytes
+  void insert(uint64_t ino, uint64_t block_off, ceph::bufferptr&& data);
+  /// drop every block that overlaps [offset, offset+len)
+  void invalidate(uint64_t ino, uint64_t offset = 0,
+		  uint64_t len = std::numeric_limits<uint64_t>::max());
+  void clear();
+
+  /// evicts right away when the limit is lowered
+  void set_max(uint64_t m);
+  uint64_t get_max() const {
+    return max;
+  }
+  uint64_t get_bytes();
+
+  void shift_bins();
+  uint32_t get_bin_count();
+  void set_bin_count(uint32_t count);
+  uint64_t sum_bins(uint32_t start, uint32_t end);
+};
+
+#endif
@@ -32,10 +32,12 @@
 #include "simple_bitmap.h"
 #include "os/kv.h"
 #include "include/compat.h"
+#include "include/crc32c.h"
 #include "include/intarith.h"
 #include "include/stringify.h"
 #include "include/str_map.h"
 #include "include/util.h"
+#include "common/admin_socket.h"
 #include "common/errno.h"
 #include "common/safe_io.h"
 #include "common/PriorityCache.h"
@@ -128,6 +130,7 @@ const string PREFIX_DEFERRED = "L";    // id -> deferred_transaction_t
 const string PREFIX_ALLOC = "B";       // u64 offset -> u64 length (freelist)
 const string PREFIX_ALLOC_BITMAP = "b";// (see BitmapFreelistManager)
 const string PREFIX_SHARED_BLOB = "X"; // u64 SB id -> shared_blob_t
+const string PREFIX_ALLOC_DELTA = "D"; // u64 seq -> allocated, released (NCB checkpoints)
 
 const string BLUESTORE_GLOBAL_STATFS_KEY = "bluestore_statfs";
 
@@ -538,11 +541,24 @@ static bool is_extent_shard_key(const string& key)
   return *key.rbegin() == EXTENT_SHARD_KEY_SUFFIX;
 }
 
+// cheap moving average (weight 1/8) for latencies sampled from many threads;
+// losing the odd sample to a racing update is fine here
+static void _ewma_update(std::atomic<uint64_t>& avg, uint64_t sample)
+{
+  uint64_t cur = avg.load(std::memory_order_relaxed);
+  avg.store(cur ? (cur * 7 + sample) / 8 : sample, std::memory_order_relaxed);
+}
+
 static void get_deferred_key(uint64_t seq, string *out)
 {
   _key_encode_u64(seq, out);
 }
 
+static void get_alloc_delta_key(uint64_t seq, string *out)
+{
+  _key_encode_u64(seq, out);
+}
+
 static void get_pool_stat_key(int64_t pool_id, string *key)
 {
   key->clear();
@@ -1191,6 +1207,236 @@ struct LruOnodeCacheShard : public BlueStore::OnodeCacheShard {
 #endif
 };
 
+// TwoQOnodeCacheShard
+//
+// A scan resistant variant of the onode cache.  Newly loaded onodes land
+// in warm_in and are evicted from there without ever reaching the hot
+// list; only the hashes of evicted oids are remembered in the ghost
+// (A1out) list.  An onode that is loaded again while its hash is still
+// in the ghost list is considered hot and goes straight to the hot (Am)
+// LRU, so one-off sweeps (scrub, backfill, listing) can't push it out.
+struct TwoQOnodeCacheShard : public BlueStore::OnodeCacheShard {
+  typedef boost::intrusive::list<
+    BlueStore::Onode,
+    boost::intrusive::member_hook<
+      BlueStore::Onode,
+      boost::intrusive::list_member_hook<>,
+      &BlueStore::Onode::lru_item> > list_t;
+  list_t hot;      ///< "Am" hot onodes
+  list_t warm_in;  ///< "A1in" newly loaded onodes
+
+  /// "A1out" hashes of oids recently evicted from warm_in, oldest at front
+  std::deque<size_t> ghost;
+  mempool::bluestore_cache_onode::unordered_map<size_t, uint32_t> ghost_refs;
+
+  enum {
+    ONODE_NEW = 0,
+    ONODE_WARM_IN,   ///< in (or headed to) warm_in
+    ONODE_HOT,       ///< in (or headed to) hot
+  };
+
+  explicit TwoQOnodeCacheShard(CephContext *cct)
+    : BlueStore::OnodeCacheShard(cct) {}
+
+  static size_t _ghost_key(const BlueStore::Onode* o) {
+    return std::hash<ghobject_t>()(o->oid);
+  }
+  void _ghost_add(const BlueStore::Onode* o) {
+    auto k = _ghost_key(o);
+    ghost.push_back(k);
+    ++ghost_refs[k];
+  }
+  void _ghost_pop() {
+    auto p = ghost_refs.find(ghost.front());
+    // the entry may have been consumed by a ghost hit already
+    if (p != ghost_refs.end() && --p->second == 0) {
+      ghost_refs.erase(p);
+    }
+    ghost.pop_front();
+  }
+  bool _ghost_remove(const BlueStore::Onode* o) {
+    // leave the deque entry alone, it ages out in _ghost_pop()
+    auto p = ghost_refs.find(_ghost_key(o));
+    if (p == ghost_refs.end()) {
+      return false;
+    }
+    if (--p->second == 0) {
+      ghost_refs.erase(p);
+    }
+    return true;
+  }
+  list_t& _list_for(const BlueStore::Onode* o) {
+    return o->cache_private == ONODE_HOT ? hot : warm_in;
+  }
+  void _link(BlueStore::Onode* o) {
+    _list_for(o).push_front(*o);
+    o->cache_age_bin = age_bins.front();
+    *(o->cache_age_bin) += 1;
+  }
+  void _unlink(BlueStore::Onode* o) {
+    *(o->cache_age_bin) -= 1;
+    auto& l = _list_for(o);
+    l.erase(l.iterator_to(*o));
+  }
+
+  void _add(BlueStore::Onode* o, int level) override
+  {
+    o->set_cached();
+    if (o->cache_private == ONODE_NEW) {
+      if (_ghost_remove(o)) {
+        o->cache_private = ONODE_HOT;
+        if (logger) {
+          logger->inc(l_bluestore_onode_ghost_hits);
+        }
+      } else {
+        o->cache_private = ONODE_WARM_IN;
+      }
+    }
+    if (o->pin_nref == 1) {
+      auto& l = _list_for(o);
+      (level > 0) ? l.push_front(*o) : l.push_back(*o);
+      o->cache_age_bin = age_bins.front();
+      *(o->cache_age_bin) += 1;
+    }
+    ++num; // we count both pinned and unpinned entries
+    dout(20) << __func__ << " " << this << " " << o->oid << " added to "
+             << (o->cache_private == ONODE_HOT ? "hot" : "warm_in")
+             << ", num=" << num << dendl;
+  }
+  void _rm(BlueStore::Onode* o) override
+  {
+    o->clear_cached();
+    if (o->lru_item.is_linked()) {
+      _unlink(o);
+    }
+    ceph_assert(num);
+    --num;
+    dout(20) << __func__ << " " << this << " " << " " << o->oid << " removed, num=" << num << dendl;
+  }
+
+  void maybe_unpin(BlueStore::Onode* o) override
+  {
+    OnodeCacheShard* ocs = this;
+    ocs->lock.lock();
+    // It is possible that during waiting split_cache moved us to different OnodeCacheShard.
+    while (ocs != o->c->get_onode_cache()) {
+      ocs->lock.unlock();
+      ocs = o->c->get_onode_cache();
+      ocs->lock.lock();
+    }
+    // ocs may be a shard of ours only, make sure to act on it
+    auto* q = static_cast<TwoQOnodeCacheShard*>(ocs);
+    if (o->is_cached() && o->pin_nref == 1) {
+      if(!o->lru_item.is_linked()) {
+        if (o->exists) {
+          q->_link(o);
+          dout(20) << __func__ << " " << q << " " << o->oid << " unpinned"
+                   << dendl;
+        } else {
+          ceph_assert(q->num);
+          --q->num;
+          o->clear_cached();
+          dout(20) << __func__ << " " << q << " " << o->oid << " removed"
+                   << dendl;
+          // remove will also decrement nref
+          o->c->onode_space._remove(o->oid);
+        }
+      } else if (o->exists && o->cache_private == ONODE_HOT) {
+        // move to front of hot LRU; touching warm_in entries does nothing
+        // so that correlated references don't look like reuse
+        q->_unlink(o);
+        q->_link(o);
+        dout(20) << __func__ << " " << q << " " << o->oid << " touched"
+                 << dendl;
+      }
+    }
+    ocs->lock.unlock();
+  }
+
+  void _evict(list_t& l) {
+    BlueStore::Onode *o = &l.back();
+    l.pop_back();
+    *(o->cache_age_bin) -= 1;
+
+    dout(20) << __func__ << "  rm " << o->oid << " "
+             << o->nref << " " << o->cached << dendl;
+
+    if (o->pin_nref > 1) {
+      // stays cached, will be linked back once unpinned
+      dout(20) << __func__ << " " << this << " " << o->oid << " pinned"
+               << dendl;
+    } else {
+      if (o->cache_private == ONODE_WARM_IN) {
+        _ghost_add(o);
+      }
+      ceph_assert(num);
+      --num;
+      o->clear_cached();
+      o->c->onode_space._remove(o->oid);
+    }
+  }
+
+  void _trim_to(uint64_t new_size) override
+  {
+    if (new_size < hot.size() + warm_in.size()) {
+      uint64_t kin = new_size * cct->_conf->bluestore_2q_cache_kin_ratio;
+      uint64_t khot = new_size - kin;
+      if (hot.size() < khot) {
+        // hot is small, give slack to warm_in
+        kin += khot - hot.size();
+      } else if (warm_in.size() < kin) {
+        // warm_in is small, give slack to hot
+        khot += kin - warm_in.size();
+      }
+
+      uint64_t n = num - new_size; // note: we might run out of unpinned
+                                   // entries before n == 0 and hence be
+                                   // unable to reach new_size target.
+      while (n > 0 && warm_in.size() > kin) {
+        _evict(warm_in);
+        --n;
+      }
+      while (n > 0 && hot.size() > khot) {
+        _evict(hot);
+        --n;
+      }
+    }
+
+    // ghost entries cost a hash each, bound them by the onode count
+    uint64_t kout = new_size * cct->_conf->bluestore_2q_cache_kout_ratio;
+    while (ghost.size() > kout) {
+      _ghost_pop();
+    }
+  }
+  void _move_pinned(OnodeCacheShard *to, BlueStore::Onode *o) override
+  {
+    if (to == this) {
+      return;
+    }
+    _rm(o);
+    ceph_assert(o->nref > 1);
+    // cache_private is retained so the onode keeps its hot/warm status
+    to->_add(o, 0);
+  }
+  void add_stats(uint64_t *onodes, uint64_t *pinned_onodes) override
+  {
+    std::lock_guard l(lock);
+    *onodes += num;
+    *pinned_onodes += num - hot.size() - warm_in.size();
+  }
+#ifdef DEBUG_CACHE
+  void _audit(const char *when) override
+  {
+    for (auto& o : hot) {
+      ceph_assert(o.cache_private == ONODE_HOT);
+    }
+    for (auto& o : warm_in) {
+      ceph_assert(o.cache_private == ONODE_WARM_IN);
+    }
+  }
+#endif
+};
+
 // OnodeCacheShard
 BlueStore::OnodeCacheShard *BlueStore::OnodeCacheShard::create(
     CephContext* cct,
@@ -1198,8 +1444,12 @@ BlueStore::OnodeCacheShard *BlueStore::OnodeCacheShard::create(
     PerfCounters *logger)
 {
   BlueStore::OnodeCacheShard *c = nullptr;
-  // Currently we only implement an LRU cache for onodes
-  c = new LruOnodeCacheShard(cct);
+  if (type == "lru")
+    c = new LruOnodeCacheShard(cct);
+  else if (type == "2q")
+    c = new TwoQOnodeCacheShard(cct);
+  else
+    ceph_abort_msg("unrecognized onode cache type");
   c->logger = logger;
   return c;
 }
@@ -1969,10 +2219,44 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::add_onode(const ghobject_t& oid,
   return o;
 }
 
+bool BlueStore::OnodeSpace::add_onode_if_unchanged(
+  const ghobject_t& oid,
+  OnodeRef& o,
+  const std::atomic<uint64_t>& seq,
+  uint64_t expected)
+{
+  std::lock_guard l(cache->lock);
+  // checked under the cache lock: an onode cannot be trimmed between
+  // the check and the insert
+  if (seq.load(std::memory_order_acquire) != expected) {
+    return false;
+  }
+  if (!onode_map.emplace(oid, o).second) {
+    return false;
+  }
+  ldout(cache->cct, 20) << __func__ << " " << oid << " " << o << dendl;
+  cache->_add(o.get(), 1);
+  cache->_trim();
+  return true;
+}
+
 void BlueStore::OnodeSpace::_remove(const ghobject_t& oid)
 {
   ldout(cache->cct, 20) << __func__ << " " << oid << " " << dendl;
-  onode_map.erase(oid);
+  auto p = onode_map.find(oid);
+  if (p == onode_map.end()) {
+    return;
+  }
+  if (cache->logger) {
+    // account readahead that was evicted before anybody asked for it
+    if (p->second->prefetched) {
+      cache->logger->inc(l_bluestore_onode_prefetch_waste);
+    }
+    if (unsigned n = p->second->extent_map.count_unused_prefetch(); n) {
+      cache->logger->inc(l_bluestore_onode_shard_prefetch_waste, n);
+    }
+  }
+  onode_map.erase(p);
 }
 
 BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
@@ -4186,6 +4470,7 @@ void BlueStore::ExtentMap::init_shards(bool loaded, bool dirty)
     shards[i].shard_info = &s;
     shards[i].loaded = loaded;
     shards[i].dirty = dirty;
+    shards[i].prefetched = false;
     ++i;
   }
 }
@@ -4205,40 +4490,76 @@ void BlueStore::ExtentMap::fault_range(
   auto last = seek_shard(offset + length);
   ceph_assert(last >= start);
   ceph_assert(start >= 0);
+  ceph_assert((size_t)last < shards.size());
+
+  // if this range picks up where the previous one ended the object is
+  // most likely being streamed; load a few of the following shards in
+  // the same kv round trip.
+  auto needed = last;
+  auto cct = onode->c->store->cct;
+  uint64_t prefetch = cct->_conf->bluestore_extent_map_shard_prefetch;
+  if (prefetch && offset && offset == fault_next) {
+    last = std::min<int>(last + prefetch, shards.size() - 1);
+  }
+  fault_next = offset + length;
 
+  auto logger = onode->c->store->logger;
   string key;
-  while (start <= last) {
-    ceph_assert((size_t)start < shards.size());
-    auto p = &shards[start];
-    if (!p->loaded) {
-      dout(30) << __func__ << " opening shard 0x" << std::hex
-	       << p->shard_info->offset << std::dec << dendl;
-      bufferlist v;
-      generate_extent_shard_key_and_apply(
-	onode->key, p->shard_info->offset, &key,
-        [&](const string& final_key) {
-          int r = db->get(PREFIX_OBJ, final_key, &v);
-          if (r < 0) {
-	    derr << __func__ << " missing shard 0x" << std::hex
-		 << p->shard_info->offset << std::dec << " for " << onode->oid
-		 << dendl;
-	    ceph_assert(r >= 0);
-          }
+  std::set<string> keys;
+  std::vector<std::pair<int, string>> wanted;
+  for (auto i = start; i <= last; ++i) {
+    auto p = &shards[i];
+    if (p->loaded) {
+      if (i <= needed) {
+        if (p->prefetched) {
+          p->prefetched = false;
+          logger->inc(l_bluestore_onode_shard_prefetch_hits);
         }
-      );
-      p->extents = decode_some(v);
-      p->loaded = true;
-      dout(20) << __func__ << " open shard 0x" << std::hex
-	       << p->shard_info->offset
-	       << " for range 0x" << offset << "~" << length << std::dec
-	       << " (" << v.length() << " bytes)" << dendl;
-      ceph_assert(p->dirty == false);
-      ceph_assert(v.length() == p->shard_info->bytes);
-      onode->c->store->logger->inc(l_bluestore_onode_shard_misses);
+        logger->inc(l_bluestore_onode_shard_hits);
+      }
+      continue;
+    }
+    generate_extent_shard_key_and_apply(
+      onode->key, p->shard_info->offset, &key,
+      [&](const string& final_key) {
+        keys.insert(final_key);
+        wanted.emplace_back(i, final_key);
+      }
+    );
+  }
+  if (wanted.empty()) {
+    return;
+  }
+
+  std::map<string, bufferlist> values;
+  int r = db->get(PREFIX_OBJ, keys, &values);
+  ceph_assert(r >= 0);
+  for (auto& [i, k] : wanted) {
+    auto p = &shards[i];
+    dout(30) << __func__ << " opening shard 0x" << std::hex
+	     << p->shard_info->offset << std::dec << dendl;
+    auto v = values.find(k);
+    if (v == values.end()) {
+      derr << __func__ << " missing shard 0x" << std::hex
+	   << p->shard_info->offset << std::dec << " for " << onode->oid
+	   << dendl;
+      ceph_abort();
+    }
+    p->extents = decode_some(v->second);
+    p->loaded = true;
+    dout(20) << __func__ << " open shard 0x" << std::hex
+	     << p->shard_info->offset
+	     << " for range 0x" << offset << "~" << length << std::dec
+	     << " (" << v->second.length() << " bytes)"
+	     << (i > needed ? " prefetch" : "") << dendl;
+    ceph_assert(p->dirty == false);
+    ceph_assert(v->second.length() == p->shard_info->bytes);
+    if (i > needed) {
+      p->prefetched = true;
+      logger->inc(l_bluestore_onode_shard_prefetch);
     } else {
-      onode->c->store->logger->inc(l_bluestore_onode_shard_hits);
+      logger->inc(l_bluestore_onode_shard_misses);
     }
-    ++start;
   }
 }
 
@@ -5091,8 +5412,12 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
   }
 
   OnodeRef o = onode_space.lookup(oid);
-  if (o)
+  if (o) {
+    if (o->prefetched && o->prefetched.exchange(false)) {
+      store->logger->inc(l_bluestore_onode_prefetch_hits);
+    }
     return o;
+  }
 
   string key;
   get_object_key(store->cct, oid, &key);
@@ -5118,7 +5443,69 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
   // new object, load onode if available
   on = Onode::create_decode(this, oid, key, v, true);
   o.reset(on);
-  return onode_space.add_onode(oid, o);
+  o = onode_space.add_onode(oid, o);
+  if (v.length()) {
+    maybe_prefetch_onodes(key);
+  }
+  return o;
+}
+
+void BlueStore::Collection::maybe_prefetch_onodes(const string& key)
+{
+  uint64_t max = store->cct->_conf->bluestore_onode_prefetch;
+  spg_t pgid;
+  if (max == 0 || !cid.is_pg(&pgid)) {
+    return;
+  }
+  {
+    std::lock_guard l(prefetch_lock);
+    if (!prefetch_last_key.empty() && key > prefetch_last_key) {
+      ++prefetch_run;
+    } else {
+      prefetch_run = 0;
+    }
+    prefetch_last_key = key;
+    // scrub, backfill and listing sweeps visit objects in key order;
+    // random misses rarely ascend three times in a row.
+    if (prefetch_run < 3) {
+      return;
+    }
+  }
+
+  // We hold (at least) the shared collection lock, so no new write can
+  // start, but txcs queued earlier may still be submitted to the kv store
+  // after the iterator took its snapshot; once such a txc finishes its
+  // onodes may be trimmed, and inserting our older copy would resurrect
+  // stale metadata.  Every submit bumps onode_submit_seq, so only insert
+  // while it still reads what it did before the snapshot: any txc with
+  // newer data is then still pinned in onode_space and wins.
+  uint64_t seq = onode_submit_seq.load(std::memory_order_acquire);
+  unsigned n = 0;
+  KeyValueDB::Iterator it = store->db->get_iterator(PREFIX_OBJ);
+  for (it->upper_bound(key); it->valid() && n < max; it->next()) {
+    string k = it->key();
+    if (is_extent_shard_key(k)) {
+      continue;
+    }
+    ghobject_t oid;
+    if (get_key_object(k, &oid) < 0 ||
+	oid.hobj.pool != (int64_t)pgid.pool() ||
+	oid.shard_id != pgid.shard ||
+	!oid.match(cnode.bits, pgid.ps())) {
+      break;
+    }
+    bufferlist v = it->value();
+    OnodeRef o(Onode::create_decode(this, oid, k, v));
+    o->prefetched = true;
+    if (onode_space.add_onode_if_unchanged(oid, o, onode_submit_seq, seq)) {
+      ++n;
+    } else if (onode_submit_seq.load(std::memory_order_relaxed) != seq) {
+      break;
+    }
+  }
+  ldout(store->cct, 20) << __func__ << " after " << pretty_binary_string(key)
+			<< " loaded " << n << " onodes" << dendl;
+  store->logger->inc(l_bluestore_onode_prefetch, n);
 }
 
 void BlueStore::Collection::split_cache(
@@ -5266,6 +5653,9 @@ void *BlueStore::MempoolThread::entry()
     if (binned_kv_onode_cache != nullptr) {
       pcm->insert("kv_onode", binned_kv_onode_cache, true);
     }
+    if (bluefs_cache->get_block_cache() != nullptr) {
+      pcm->insert("bluefs", bluefs_cache, true);
+    }
   }
 
   utime_t next_balance = ceph_clock_now();
@@ -5307,6 +5697,7 @@ void *BlueStore::MempoolThread::entry()
       }
       meta_cache->import_bins(store->meta_bins);
       data_cache->import_bins(store->data_bins);
+      bluefs_cache->import_bins(store->bluefs_bins);
 
       if (pcm != nullptr) {
         pcm->shift_bins();
@@ -5324,6 +5715,7 @@ void *BlueStore::MempoolThread::entry()
       }
       meta_cache->set_cache_ratio(store->cache_meta_ratio);
       data_cache->set_cache_ratio(store->cache_data_ratio);
+      bluefs_cache->set_cache_ratio(store->cache_bluefs_ratio);
 
       // Log events at 5 instead of 20 when balance happens.
       interval_stats_trim = true;
@@ -5434,6 +5826,19 @@ void BlueStore::MempoolThread::_resize_shards(bool interval_stats)
   for (auto i : store->buffer_cache_shards) {
     i->set_max(max_shard_buffer);
   }
+
+  // the bluefs block cache is sized by its own option unless the priority
+  // cache manager has handed it more than that
+  if (auto c = bluefs_cache->get_block_cache(); c) {
+    uint64_t bluefs_alloc = store->cct->_conf->bluefs_block_cache_size;
+    if (pcm != nullptr) {
+      bluefs_alloc = std::max<uint64_t>(bluefs_alloc,
+                                        bluefs_cache->get_committed_size());
+    }
+    dout(30) << __func__ << " bluefs_alloc: " << bluefs_alloc
+             << " bluefs_used: " << bluefs_cache->_get_used_bytes() << dendl;
+    c->set_max(bluefs_alloc);
+  }
 }
 
 void BlueStore::MempoolThread::_update_cache_settings()
@@ -5467,58 +5872,289 @@ void BlueStore::MempoolThread::_update_cache_settings()
 
 // =======================================================
 
-// OmapIteratorImpl
+// DefragThread
 
 #undef dout_prefix
-#define dout_prefix *_dout << "bluestore.OmapIteratorImpl(" << this << ") "
+#define dout_prefix *_dout << "bluestore.DefragThread(" << this << ") "
 
-BlueStore::OmapIteratorImpl::OmapIteratorImpl(
-  PerfCounters* _logger, CollectionRef c, OnodeRef& o, KeyValueDB::Iterator it)
-  : logger(_logger), c(c), o(o), it(it)
+void *BlueStore::DefragThread::entry()
 {
-  logger->inc(l_bluestore_omap_iterator_count);
-  std::shared_lock l(c->lock);
-  if (o->onode.has_omap()) {
-    o->get_omap_key(string(), &head);
-    o->get_omap_tail(&tail);
-    it->lower_bound(head);
+  std::unique_lock l{lock};
+  while (!stop) {
+    if (requested || store->cct->_conf->bluestore_defrag) {
+      uint64_t budget = store->cct->_conf->bluestore_defrag_bytes_per_sec;
+      l.unlock();
+      bool done = store->_defrag_step(budget);
+      l.lock();
+      if (done) {
+	++passes;
+	requested = false;
+	dout(5) << __func__ << " pass " << passes << " complete, rewrote "
+		<< objects_rewritten << " objects " << byte_u_t(bytes_rewritten)
+		<< " so far" << dendl;
+      }
+      if (stop) {
+	break;
+      }
+    }
+    cond.wait_for(l, std::chrono::seconds(1));
   }
-}
-BlueStore::OmapIteratorImpl::~OmapIteratorImpl()
-{
-  logger->dec(l_bluestore_omap_iterator_count);
+  return nullptr;
 }
 
-string BlueStore::OmapIteratorImpl::_stringify() const
+void BlueStore::DefragThread::dump(Formatter *f)
 {
-  stringstream s;
-  s << " omap_iterator(cid = " << c->cid
-    <<", oid = " << o->oid << ")";
-  return s.str();
+  std::lock_guard l(lock);
+  f->open_object_section("defrag");
+  f->dump_bool("enabled", store->cct->_conf->bluestore_defrag);
+  f->dump_bool("requested", requested);
+  f->dump_bool("in_pass", in_pass);
+  if (in_pass) {
+    f->dump_stream("cursor_collection") << cursor_cid;
+    f->dump_stream("cursor_object") << cursor_oid;
+  }
+  f->dump_unsigned("passes", passes);
+  f->dump_unsigned("objects_scanned", objects_scanned);
+  f->dump_unsigned("objects_rewritten", objects_rewritten);
+  f->dump_unsigned("bytes_rewritten", bytes_rewritten);
+  f->dump_unsigned("blobs_before", blobs_before);
+  f->dump_unsigned("blobs_after", blobs_after);
+  f->dump_float("avg_blobs_removed_per_object",
+		objects_rewritten ?
+		  ((double)blobs_before - (double)blobs_after) /
+		    objects_rewritten : 0);
+  f->close_section();
 }
 
-int BlueStore::OmapIteratorImpl::seek_to_first()
-{
-  std::shared_lock l(c->lock);
-  auto start1 = mono_clock::now();
-  if (o->onode.has_omap()) {
-    it->lower_bound(head);
-  } else {
-    it = KeyValueDB::Iterator();
-  }
-  c->store->log_latency(
-    __func__,
-    l_bluestore_omap_seek_to_first_lat,
-    mono_clock::now() - start1,
-    c->store->cct->_conf->bluestore_log_omap_iterator_age);
+// =======================================================
 
-  return 0;
-}
+// AllocCheckpointThread
 
-int BlueStore::OmapIteratorImpl::upper_bound(const string& after)
+#undef dout_prefix
+#define dout_prefix *_dout << "bluestore.AllocCheckpointThread(" << this << ") "
+
+void *BlueStore::AllocCheckpointThread::entry()
 {
-  std::shared_lock l(c->lock);
-  auto start1 = mono_clock::now();
+  std::unique_lock l{lock};
+  while (!stop) {
+    // the first pass turns the image captured at mount into a checkpoint
+    l.unlock();
+    int r = store->_alloc_checkpoint();
+    l.lock();
+    if (r < 0) {
+      derr << __func__ << " checkpointing disabled until next mount" << dendl;
+      store->_alloc_ckpt_invalidate();
+      break;
+    }
+    if (stop) {
+      break;
+    }
+    cond.wait_for(l, std::chrono::seconds(
+      store->cct->_conf->bluestore_allocator_checkpoint_interval));
+  }
+  return nullptr;
+}
+
+// =======================================================
+
+// SocketHook
+
+#undef dout_prefix
+#define dout_prefix *_dout << "bluestore.SocketHook "
+
+class BlueStore::SocketHook : public AdminSocketHook {
+  BlueStore* store;
+public:
+  static BlueStore::SocketHook* create(BlueStore* store)
+  {
+    BlueStore::SocketHook* hook = nullptr;
+    AdminSocket* admin_socket = store->cct->get_admin_socket();
+    if (admin_socket) {
+      hook = new BlueStore::SocketHook(store);
+      int r = admin_socket->register_command("bluestore defrag status",
+					     hook,
+					     "Show background defragmentation "
+					     "progress and totals.");
+      if (r != 0) {
+	ldout(store->cct, 1) << __func__ << " cannot register SocketHook"
+			     << dendl;
+	delete hook;
+	hook = nullptr;
+      } else {
+	r = admin_socket->register_command("bluestore fsck status",
+					   hook,
+					   "Show progress of a running fsck.");
+	ceph_assert(r == 0);
+	r = admin_socket->register_command("bluestore defrag start",
+					   hook,
+					   "Run one defragmentation pass over "
+					   "all objects, even if bluestore_defrag "
+					   "is off.");
+	ceph_assert(r == 0);
+	r = admin_socket->register_command("bluestore reshard online "
+					   "name=sharding,type=CephString",
+					   hook,
+					   "Change the sharding of one RocksDB "
+					   "column while the OSD keeps running.");
+	ceph_assert(r == 0);
+	r = admin_socket->register_command("bluestore reshard status",
+					   hook,
+					   "Show progress of online resharding.");
+	ceph_assert(r == 0);
+	r = admin_socket->register_command("bluestore kv write histogram",
+					   hook,
+					   "Show batch size and bytes per sync "
+					   "histograms of kv writes.");
+	ceph_assert(r == 0);
+	r = admin_socket->register_command("bluestore bdev latency",
+					   hook,
+					   "Show io latency histograms and tail "
+					   "latency state of the block devices.");
+	ceph_assert(r == 0);
+	r = admin_socket->register_command("bluestore bdev numa",
+					   hook,
+					   "Show NUMA placement of the block "
+					   "devices' threads and buffers.");
+	ceph_assert(r == 0);
+	r = admin_socket->register_command("bluestore bdev discard",
+					   hook,
+					   "Show the async discard queues and "
+					   "throttling of the block devices.");
+	ceph_assert(r == 0);
+      }
+    }
+    return hook;
+  }
+
+  ~SocketHook() {
+    AdminSocket* admin_socket = store->cct->get_admin_socket();
+    admin_socket->unregister_commands(this);
+  }
+private:
+  SocketHook(BlueStore* store) :
+    store(store) {}
+  int call(std::string_view command, const cmdmap_t& cmdmap,
+	   const bufferlist&,
+	   Formatter *f,
+	   std::ostream& errss,
+	   bufferlist& out) override {
+    // The hook is only registered while the store is mounted, or open
+    // for fsck, and unregistering waits for us: db and the block devices
+    // stay valid throughout a call.  Commands that change the store also
+    // need it to be mounted.
+    if (command == "bluestore defrag status") {
+      store->defrag_thread.dump(f);
+    } else if (command == "bluestore fsck status") {
+      store->fsck_progress.dump(f);
+    } else if (command == "bluestore defrag start") {
+      if (!store->mounted) {
+	errss << "store is not mounted" << std::endl;
+	return -EAGAIN;
+      }
+      store->defrag_thread.request();
+      store->defrag_thread.dump(f);
+    } else if (command == "bluestore reshard online" ||
+	       command == "bluestore reshard status") {
+      if (!store->mounted) {
+	errss << "store is not mounted" << std::endl;
+	return -EAGAIN;
+      }
+      if (command == "bluestore reshard online") {
+	std::string sharding;
+	TOPNSPC::common::cmd_getval(cmdmap, "sharding", sharding);
+	int r = store->db->start_online_reshard(sharding);
+	if (r < 0) {
+	  errss << "cannot reshard online: " << cpp_strerror(r) << std::endl;
+	  return r;
+	}
+      }
+      store->db->dump_online_reshard(f);
+    } else if (command == "bluestore kv write histogram") {
+      f->open_object_section("kv_write_histogram");
+      store->db->dump_write_histogram(f);
+      f->close_section();
+    } else if (command == "bluestore bdev latency") {
+      f->open_object_section("bdev_latency");
+      store->_dump_bdev_latency(f);
+      f->close_section();
+    } else if (command == "bluestore bdev numa") {
+      f->open_object_section("bdev_numa");
+      store->_for_each_bdev([&](const char* name, BlockDevice* b) {
+	f->open_object_section(name);
+	b->dump_numa_stats(f);
+	f->close_section();
+      });
+      f->close_section();
+    } else if (command == "bluestore bdev discard") {
+      f->open_object_section("bdev_discard");
+      store->_for_each_bdev([&](const char* name, BlockDevice* b) {
+	f->open_object_section(name);
+	b->dump_discard_stats(f);
+	f->close_section();
+      });
+      f->close_section();
+    } else {
+      errss << "Invalid command" << std::endl;
+      return -ENOSYS;
+    }
+    return 0;
+  }
+};
+
+// =======================================================
+
+// OmapIteratorImpl
+
+#undef dout_prefix
+#define dout_prefix *_dout << "bluestore.OmapIteratorImpl(" << this << ") "
+
+BlueStore::OmapIteratorImpl::OmapIteratorImpl(
+  PerfCounters* _logger, CollectionRef c, OnodeRef& o, KeyValueDB::Iterator it)
+  : logger(_logger), c(c), o(o), it(it)
+{
+  logger->inc(l_bluestore_omap_iterator_count);
+  std::shared_lock l(c->lock);
+  if (o->onode.has_omap()) {
+    o->get_omap_key(string(), &head);
+    o->get_omap_tail(&tail);
+    it->lower_bound(head);
+  }
+}
+BlueStore::OmapIteratorImpl::~OmapIteratorImpl()
+{
+  logger->dec(l_bluestore_omap_iterator_count);
+}
+
+string BlueStore::OmapIteratorImpl::_stringify() const
+{
+  stringstream s;
+  s << " omap_iterator(cid = " << c->cid
+    <<", oid = " << o->oid << ")";
+  return s.str();
+}
+
+int BlueStore::OmapIteratorImpl::seek_to_first()
+{
+  std::shared_lock l(c->lock);
+  auto start1 = mono_clock::now();
+  if (o->onode.has_omap()) {
+    it->lower_bound(head);
+  } else {
+    it = KeyValueDB::Iterator();
+  }
+  c->store->log_latency(
+    __func__,
+    l_bluestore_omap_seek_to_first_lat,
+    mono_clock::now() - start1,
+    c->store->cct->_conf->bluestore_log_omap_iterator_age);
+
+  return 0;
+}
+
+int BlueStore::OmapIteratorImpl::upper_bound(const string& after)
+{
+  std::shared_lock l(c->lock);
+  auto start1 = mono_clock::now();
   if (o->onode.has_omap()) {
     string key;
     o->get_omap_key(after, &key);
@@ -5656,10 +6292,11 @@ BlueStore::BlueStore(CephContext *cct,
     throttle(cct),
     finisher(cct, "commit_finisher", "cfin"),
     kv_sync_thread(this),
-    kv_finalize_thread(this),
     min_alloc_size(_min_alloc_size),
     min_alloc_size_order(std::countr_zero(_min_alloc_size)),
-    mempool_thread(this)
+    mempool_thread(this),
+    defrag_thread(this),
+    alloc_ckpt_thread(this)
 {
   _init_logger();
   cct->_conf.add_observer(this);
@@ -5668,6 +6305,7 @@ BlueStore::BlueStore(CephContext *cct,
 
 BlueStore::~BlueStore()
 {
+  delete asok_hook;
   cct->_conf.remove_observer(this);
   _shutdown_logger();
   ceph_assert(!mounted);
@@ -5702,6 +6340,7 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_prefer_deferred_size",
     "bluestore_prefer_deferred_size_hdd",
     "bluestore_prefer_deferred_size_ssd",
+    "bluestore_prefer_deferred_adaptive",
     "bluestore_deferred_batch_ops",
     "bluestore_deferred_batch_ops_hdd",
     "bluestore_deferred_batch_ops_ssd",
@@ -5729,6 +6368,7 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_warn_on_no_per_pool_omap",
     "bluestore_warn_on_no_per_pg_omap",
     "bluestore_max_defer_interval",
+    "bluestore_defrag",
     NULL
   };
   return KEYS;
@@ -5767,6 +6407,7 @@ void BlueStore::handle_conf_change(const ConfigProxy& conf,
   if (changed.count("bluestore_prefer_deferred_size") ||
       changed.count("bluestore_prefer_deferred_size_hdd") ||
       changed.count("bluestore_prefer_deferred_size_ssd") ||
+      changed.count("bluestore_prefer_deferred_adaptive") ||
       changed.count("bluestore_max_alloc_size") ||
       changed.count("bluestore_deferred_batch_ops") ||
       changed.count("bluestore_deferred_batch_ops_hdd") ||
@@ -5793,6 +6434,9 @@ void BlueStore::handle_conf_change(const ConfigProxy& conf,
       _set_max_defer_interval();
     }
   }
+  if (changed.count("bluestore_defrag")) {
+    defrag_thread.wakeup();
+  }
   if (changed.count("osd_memory_target") ||
       changed.count("osd_memory_base") ||
       changed.count("osd_memory_cache_min") ||
@@ -5939,6 +6583,7 @@ int BlueStore::_set_cache_sizes()
   _set_bin("bluestore_cache_age_bins_kv_onode", &kv_onode_bins);
   _set_bin("bluestore_cache_age_bins_meta", &meta_bins);
   _set_bin("bluestore_cache_age_bins_data", &data_bins);
+  _set_bin("bluestore_cache_age_bins_bluefs", &bluefs_bins);
 
   osd_memory_target = cct->_conf.get_val<Option::size_t>("osd_memory_target");
   osd_memory_base = cct->_conf.get_val<Option::size_t>("osd_memory_base");
@@ -5989,10 +6634,34 @@ int BlueStore::_set_cache_sizes()
     return -EINVAL;
   }
 
+  cache_bluefs_ratio =
+    cct->_conf.get_val<double>("bluestore_cache_bluefs_ratio");
+  if (cache_bluefs_ratio < 0 || cache_bluefs_ratio > 1.0) {
+    derr << __func__ << " bluestore_cache_bluefs_ratio (" << cache_bluefs_ratio
+         << ") must be in range [0,1.0]" << dendl;
+    return -EINVAL;
+  }
+
+  // the bluefs block cache only takes a share of cache_size when it is
+  // enabled and autotuned; otherwise bluefs_block_cache_size sizes it
+  double cache_bluefs_share =
+    (cache_autotune && cct->_conf->bluefs_block_cache_size) ?
+      cache_bluefs_ratio : 0;
+  if (cache_meta_ratio + cache_kv_ratio + cache_kv_onode_ratio +
+      cache_bluefs_share > 1.0) {
+    derr << __func__ << " bluestore_cache_meta_ratio (" << cache_meta_ratio
+         << ") + bluestore_cache_kv_ratio (" << cache_kv_ratio
+         << ") + bluestore_cache_kv_onode_ratio (" << cache_kv_onode_ratio
+         << ") + bluestore_cache_bluefs_ratio (" << cache_bluefs_share
+         << ") must be <= 1.0" << dendl;
+    return -EINVAL;
+  }
+
   cache_data_ratio = (double)1.0 - 
                      (double)cache_meta_ratio - 
                      (double)cache_kv_ratio - 
-                     (double)cache_kv_onode_ratio;
+                     (double)cache_kv_onode_ratio -
+                     cache_bluefs_share;
   if (cache_data_ratio < 0) {
     // deal with floating point imprecision
     cache_data_ratio = 0;
@@ -6002,6 +6671,7 @@ int BlueStore::_set_cache_sizes()
           << " meta " << cache_meta_ratio
 	  << " kv " << cache_kv_ratio
 	  << " kv_onode " << cache_kv_onode_ratio
+	  << " bluefs " << cache_bluefs_share
 	  << " data " << cache_data_ratio
 	  << dendl;
   return 0;
@@ -6164,6 +6834,11 @@ void BlueStore::_init_logger()
   b.add_u64_counter(l_bluestore_reads_with_retries, "reads_with_retries",
                     "Read operations that required at least one retry due to failed checksum validation",
 		    "rd_r", PerfCountersBuilder::PRIO_USEFUL);
+  b.add_u64_counter(l_bluestore_read_crc_primed_bytes, "read_crc_primed_bytes",
+                    "Bytes read from disk whose crc32c was derived from the "
+                    "verified blob checksums",
+		    NULL, PerfCountersBuilder::PRIO_DEBUGONLY,
+		    unit_t(UNIT_BYTES));
   b.add_time_avg(l_bluestore_read_lat, "read_lat",
 		 "Average read latency",
 		 "r_l", PerfCountersBuilder::PRIO_CRITICAL);
@@ -6183,6 +6858,13 @@ void BlueStore::_init_logger()
   b.add_time_avg(l_bluestore_kv_final_lat, "kv_final_lat",
 		 "Average kv_finalize thread latency",
 		 "kfll", PerfCountersBuilder::PRIO_INTERESTING);
+  b.add_u64_avg(l_bluestore_kv_sync_batch_txc, "kv_sync_batch_txc",
+		"Average number of transactions committed per kv_sync cycle");
+  b.add_u64_avg(l_bluestore_kv_final_batch_txc, "kv_final_batch_txc",
+		"Average number of transactions finalized per kv_finalize cycle");
+  b.add_u64_avg(l_bluestore_kv_final_queue_depth, "kv_final_queue_depth",
+		"Average number of transactions pending in a kv_finalize queue "
+		"after a kv_sync cycle hands off its batch");
   //****************************************
 
   // write op stats
@@ -6244,6 +6926,16 @@ void BlueStore::_init_logger()
 		    PerfCountersBuilder::PRIO_DEBUGONLY,
 		    unit_t(UNIT_BYTES));
 
+  b.add_u64(l_bluestore_prefer_deferred_size, "prefer_deferred_size",
+	    "Current size threshold below which writes are deferred",
+	    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_prefer_deferred_size_raised,
+		    "prefer_deferred_size_raised",
+		    "Times the adaptive deferred threshold was raised");
+  b.add_u64_counter(l_bluestore_prefer_deferred_size_lowered,
+		    "prefer_deferred_size_lowered",
+		    "Times the adaptive deferred threshold was lowered");
+
   b.add_u64_counter(l_bluestore_write_big_skipped_blobs,
       "write_big_skipped_blobs",
       "Large aligned writes into fresh blobs skipped due to zero detection (blobs)");
@@ -6293,11 +6985,35 @@ void BlueStore::_init_logger()
   b.add_u64_counter(l_bluestore_onode_misses, "onode_misses",
 		    "Count of onode cache lookup misses",
 		    "o_ms", PerfCountersBuilder::PRIO_USEFUL);
+  b.add_u64_counter(l_bluestore_onode_ghost_hits, "onode_ghost_hits",
+		    "Count of onodes reloaded shortly after eviction "
+		    "(2q onode cache only)");
   b.add_u64_counter(l_bluestore_onode_shard_hits, "onode_shard_hits",
 		    "Count of onode shard cache lookups hits");
   b.add_u64_counter(l_bluestore_onode_shard_misses,
 		    "onode_shard_misses",
 		    "Count of onode shard cache lookups misses");
+  b.add_u64_counter(l_bluestore_onode_prefetch, "onode_prefetch",
+		    "Count of onodes read ahead of a sequential sweep");
+  b.add_u64_counter(l_bluestore_onode_prefetch_hits, "onode_prefetch_hits",
+		    "Count of prefetched onodes later looked up");
+  b.add_u64_counter(l_bluestore_onode_prefetch_waste, "onode_prefetch_waste",
+		    "Count of prefetched onodes evicted before use");
+  b.add_u64_counter(l_bluestore_onode_shard_prefetch, "onode_shard_prefetch",
+		    "Count of extent map shards read ahead of sequential IO");
+  b.add_u64_counter(l_bluestore_onode_shard_prefetch_hits,
+		    "onode_shard_prefetch_hits",
+		    "Count of prefetched extent map shards later used");
+  b.add_u64_counter(l_bluestore_onode_shard_prefetch_waste,
+		    "onode_shard_prefetch_waste",
+		    "Count of prefetched extent map shards evicted before use");
+  b.add_u64_counter(l_bluestore_defrag_objects, "defrag_objects",
+		    "Count of objects rewritten by background defragmentation");
+  b.add_u64_counter(l_bluestore_defrag_bytes, "defrag_bytes",
+		    "Bytes rewritten by background defragmentation",
+		    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_avg(l_bluestore_defrag_blob_reduction, "defrag_blob_reduction",
+		"Average number of blobs removed per defragmented object");
   b.add_u64(l_bluestore_extents, "onode_extents",
 	    "Number of extents in cache");
   b.add_u64(l_bluestore_blobs, "onode_blobs",
@@ -6437,6 +7153,10 @@ void BlueStore::_init_logger()
     "Average bluestore allocator latency",
     "bsal",
     PerfCountersBuilder::PRIO_USEFUL);
+  b.add_time_avg(l_bluestore_alloc_checkpoint_lat, "alloc_checkpoint_lat",
+    "Average time to write an allocator checkpoint");
+  b.add_u64_counter(l_bluestore_alloc_checkpoint_deltas, "alloc_checkpoint_deltas",
+    "Count of transaction allocation deltas folded into checkpoints");
 
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
@@ -6616,6 +7336,11 @@ void BlueStore::_set_alloc_sizes(void)
       prefer_deferred_size = cct->_conf->bluestore_prefer_deferred_size_ssd;
     }
   }
+  // (re)start any adaptation from the configured value
+  prefer_deferred_size_conf = prefer_deferred_size.load();
+  if (logger) {
+    logger->set(l_bluestore_prefer_deferred_size, prefer_deferred_size);
+  }
 
   if (cct->_conf->bluestore_deferred_batch_ops) {
     deferred_batch_ops = cct->_conf->bluestore_deferred_batch_ops;
@@ -6928,6 +7653,8 @@ int BlueStore::_init_alloc(std::map<uint64_t, uint64_t> *zone_adjustments)
     }
     if (restore_allocator(alloc, &num, &bytes) == 0) {
       dout(5) << __func__ << "::NCB::restore_allocator() completed successfully alloc=" << alloc << dendl;
+    } else if (restore_allocator_from_checkpoint(alloc, &num, &bytes) == 0) {
+      dout(1) << __func__ << "::NCB::restored allocator from checkpoint alloc=" << alloc << dendl;
     } else {
       // This must mean that we had an unplanned shutdown and didn't manage to destage the allocator
       dout(0) << __func__ << "::NCB::restore_allocator() failed! Run Full Recovery from ONodes (might take a while) ..." << dendl;
@@ -7421,6 +8148,10 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
   if (r < 0)
     goto out_fm;
 
+  if (fm->is_null_manager() && !read_only && !to_repair) {
+    _alloc_ckpt_capture_base();
+  }
+
   // Re-open in the proper mode(s).
 
   // Can't simply bypass second open for read-only mode as we need to
@@ -7449,6 +8180,18 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
       derr << __func__ << "::NCB::invalidate_allocation_file_on_bluefs() failed!" << dendl;
       goto out_alloc;
     }
+    r = _alloc_ckpt_invalidate();
+    if (r != 0) {
+      derr << __func__ << "::NCB::_alloc_ckpt_invalidate() failed!" << dendl;
+      goto out_alloc;
+    }
+    // Start logging deltas together with the base image: nothing has
+    // allocated or released space since it was captured, and every
+    // change from now on must be logged or a restore could mark in-use
+    // extents free.
+    if (alloc_ckpt_base) {
+      alloc_ckpt_enabled = true;
+    }
   }
 
   // when function is called in repair mode (to_repair=true) we skip db->open()/create()
@@ -7478,6 +8221,8 @@ out_fm:
 
 void BlueStore::_close_db_and_around()
 {
+  alloc_ckpt_enabled = false;
+  alloc_ckpt_base.reset();
   if (db) {
     _close_db();
   }
@@ -7554,6 +8299,8 @@ int BlueStore::_prepare_db_environment(bool create, bool read_only,
   map<string,string> kv_options;
   // force separate wal dir for all new deployments.
   kv_options["separate_wal_dir"] = 1;
+  kv_options["cf_filters"] =
+    cct->_conf.get_val<std::string>("bluestore_rocksdb_cf_filters");
   rocksdb::Env *env = NULL;
   if (do_bluefs) {
     dout(10) << __func__ << " initializing bluefs" << dendl;
@@ -8612,6 +9359,9 @@ int BlueStore::expand_devices(ostream& out)
     ceph_assert(r == 0);
     if (fm && fm->is_null_manager()) {
       // we grow the allocation range, must reflect it in the allocation file
+      // and in an allocator checkpoint, should we not get to write it out
+      r = _alloc_ckpt_log_free(size0, size - size0);
+      ceph_assert(r == 0);
       alloc->init_add_free(size0, size - size0);
       need_to_destage_allocation_file = true;
     }
@@ -8641,8 +9391,9 @@ void BlueStore::set_cache_shards(unsigned num)
   buffer_cache_shards.resize(num);
   for (unsigned i = oold; i < num; ++i) {
     onode_cache_shards[i] = 
-        OnodeCacheShard::create(cct, cct->_conf->bluestore_cache_type,
-                                 logger);
+        OnodeCacheShard::create(cct,
+          cct->_conf.get_val<std::string>("bluestore_onode_cache_type"),
+          logger);
   }
   for (unsigned i = bold; i < num; ++i) {
     buffer_cache_shards[i] = 
@@ -8856,6 +9607,7 @@ int BlueStore::_mount()
   }
 
   mempool_thread.init();
+  defrag_thread.init();
 
   if ((!per_pool_stat_collection || per_pool_omap != OMAP_PER_PG) &&
     cct->_conf->bluestore_fsck_quick_fix_on_mount == true) {
@@ -8869,9 +9621,19 @@ int BlueStore::_mount()
     if (was_per_pool_omap != OMAP_PER_PG) {
       _set_per_pool_omap();
     }
+    // repairs may have changed allocations behind the delta log's back
+    if (alloc_ckpt_enabled) {
+      alloc_ckpt_base.reset();
+      _alloc_ckpt_invalidate();
+    }
+  }
+
+  if (alloc_ckpt_enabled) {
+    alloc_ckpt_thread.init();
   }
 
   mounted = true;
+  asok_hook = SocketHook::create(this);
   return 0;
 }
 
@@ -8879,6 +9641,14 @@ int BlueStore::umount()
 {
   dout(5) << __func__ << dendl;
   ceph_assert(_kv_only || mounted);
+  // waits for a command in flight, none can look at the store after this
+  delete asok_hook;
+  asok_hook = nullptr;
+  if (!_kv_only) {
+    // stop before draining, defrag queues its own transactions
+    defrag_thread.shutdown();
+    alloc_ckpt_thread.shutdown();
+  }
   _osr_drain_all();
 
   mounted = false;
@@ -8909,6 +9679,205 @@ int BlueStore::umount()
   return 0;
 }
 
+bool BlueStore::_defrag_step(uint64_t budget)
+{
+  // bound the onode loads per step as well, most objects are not
+  // fragmented and cost a scan but no rewrite
+  const unsigned max_scan = 1024;
+
+  // walk collections in cid order so that the cursor stays meaningful
+  // while collections come and go between steps
+  vector<CollectionRef> colls;
+  {
+    std::shared_lock l(coll_lock);
+    for (auto& i : coll_map) {
+      colls.push_back(i.second);
+    }
+  }
+  std::sort(colls.begin(), colls.end(),
+	    [](const CollectionRef& a, const CollectionRef& b) {
+	      return a->cid < b->cid;
+	    });
+
+  bool resume;
+  coll_t cursor_cid;
+  ghobject_t cursor_oid;
+  {
+    std::lock_guard l(defrag_thread.lock);
+    resume = defrag_thread.in_pass;
+    cursor_cid = defrag_thread.cursor_cid;
+    cursor_oid = defrag_thread.cursor_oid;
+  }
+  auto p = colls.begin();
+  if (resume) {
+    p = std::lower_bound(colls.begin(), colls.end(), cursor_cid,
+			 [](const CollectionRef& c, const coll_t& cid) {
+			   return c->cid < cid;
+			 });
+  }
+
+  unsigned scanned = 0;
+  uint64_t rewritten = 0;
+  for (; p != colls.end(); ++p) {
+    CollectionRef c = *p;
+    ghobject_t start;
+    if (resume && c->cid == cursor_cid) {
+      start = cursor_oid;
+    }
+    while (c->exists) {
+      vector<ghobject_t> ls;
+      ghobject_t next;
+      int r;
+      {
+	std::shared_lock l(c->lock);
+	r = _collection_list(c.get(), start, ghobject_t::get_max(), 64, false,
+			     &ls, &next);
+      }
+      if (r < 0) {
+	break;
+      }
+      for (auto& oid : ls) {
+	uint64_t before = 0, after = 0;
+	uint64_t bytes = _defrag_onode(c, oid, &before, &after);
+	rewritten += bytes;
+	std::lock_guard l(defrag_thread.lock);
+	++defrag_thread.objects_scanned;
+	if (bytes) {
+	  ++defrag_thread.objects_rewritten;
+	  defrag_thread.bytes_rewritten += bytes;
+	  defrag_thread.blobs_before += before;
+	  defrag_thread.blobs_after += after;
+	  logger->inc(l_bluestore_defrag_objects);
+	  logger->inc(l_bluestore_defrag_bytes, bytes);
+	  // a rewrite may (rarely) need more blobs than it replaced, e.g.
+	  // when allocations come back fragmented
+	  logger->inc(l_bluestore_defrag_blob_reduction,
+		      before > after ? before - after : 0);
+	}
+	if (defrag_thread.stop || rewritten >= budget || ++scanned >= max_scan) {
+	  // oid is looked at again next time; it is no longer fragmented
+	  // if it was just rewritten, so that is cheap
+	  defrag_thread.in_pass = true;
+	  defrag_thread.cursor_cid = c->cid;
+	  defrag_thread.cursor_oid = oid;
+	  return false;
+	}
+      }
+      if (next.is_max()) {
+	break;
+      }
+      start = next;
+    }
+  }
+  std::lock_guard l(defrag_thread.lock);
+  defrag_thread.in_pass = false;
+  return true;
+}
+
+uint64_t BlueStore::_defrag_onode(
+  CollectionRef& c,
+  const ghobject_t& oid,
+  uint64_t *blobs_before,
+  uint64_t *blobs_after)
+{
+  OpSequencer *osr = c->osr.get();
+  std::unique_lock l(c->lock);
+  if (!c->exists) {
+    return 0;
+  }
+  OnodeRef o = c->get_onode(oid, false);
+  if (!o || !o->exists || o->onode.size == 0) {
+    return 0;
+  }
+  o->extent_map.fault_range(db, 0, o->onode.size);
+
+  std::set<Blob*> blobs;
+  interval_set<uint64_t> data;
+  for (auto& e : o->extent_map.extent_map) {
+    auto& b = e.blob->get_blob();
+    if (b.is_compressed() || b.is_shared()) {
+      // compressed blobs are handled by gc, shared ones belong to clones
+      // and rewriting would only unshare them
+      return 0;
+    }
+    blobs.insert(e.blob.get());
+    data.insert(e.logical_offset, e.length);
+  }
+  uint64_t blob_size = max_blob_size.load();
+  uint64_t ideal = 0;
+  for (auto i = data.begin(); i != data.end(); ++i) {
+    ideal += p2roundup<uint64_t>(i.get_len(), blob_size) / blob_size;
+  }
+  uint64_t min_blobs = cct->_conf->bluestore_defrag_min_blobs;
+  if (blobs.size() < std::max(min_blobs, 2 * ideal)) {
+    return 0;
+  }
+  if (alloc->get_free() < bdev->get_size() / 10) {
+    dout(20) << __func__ << " " << oid << " skip, device nearly full" << dendl;
+    return 0;
+  }
+
+  vector<bufferlist> bls;
+  for (auto i = data.begin(); i != data.end(); ++i) {
+    bufferlist bl;
+    int r = _do_read(c.get(), o, i.get_start(), i.get_len(), bl,
+		     CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+    if (r < 0 || bl.length() != i.get_len()) {
+      dout(10) << __func__ << " " << oid << " read 0x" << std::hex
+	       << i.get_start() << "~" << i.get_len() << std::dec
+	       << " failed: " << cpp_strerror(r) << dendl;
+      return 0;
+    }
+    bls.push_back(std::move(bl));
+  }
+
+  // A txc that is queued but still being prepared by the OSD might not
+  // have applied its changes yet; ours would then commit behind it with
+  // a stale view.  Only go ahead on an idle sequencer.
+  TransContext *txc = new TransContext(cct, c.get(), osr, nullptr);
+  txc->t = db->get_transaction();
+  if (!osr->queue_new_if_idle(txc)) {
+    dout(20) << __func__ << " " << oid << " skip, osr busy" << dendl;
+    delete txc;
+    return 0;
+  }
+  dout(10) << __func__ << " " << oid << " " << blobs.size() << " blobs, "
+	   << data << dendl;
+  // without compression: compressed blobs make the object ineligible for
+  // the next pass, and it only wants its layout fixed, not reencoded
+  auto bl = bls.begin();
+  for (auto i = data.begin(); i != data.end(); ++i, ++bl) {
+    int r = _do_write(txc, c, o, i.get_start(), i.get_len(), *bl,
+		      CEPH_OSD_OP_FLAG_FADVISE_DONTNEED, false);
+    ceph_assert(r == 0);
+  }
+  txc->write_onode(o);
+  txc->bytes = data.size();
+  _txc_calc_cost(txc);
+  _txc_write_nodes(txc, txc->t);
+  if (txc->deferred_txn) {
+    txc->deferred_txn->seq = ++deferred_seq;
+    bufferlist dbl;
+    encode(*txc->deferred_txn, dbl);
+    string key;
+    get_deferred_key(txc->deferred_txn->seq, &key);
+    txc->t->set(PREFIX_DEFERRED, key, dbl);
+  }
+  _txc_finalize_kv(txc, txc->t);
+
+  *blobs_before = blobs.size();
+  blobs.clear();
+  for (auto& e : o->extent_map.extent_map) {
+    blobs.insert(e.blob.get());
+  }
+  *blobs_after = blobs.size();
+  l.unlock();
+
+  _txc_throttle(txc, mono_clock::now());
+  _txc_state_proc(txc);
+  return data.size();
+}
+
 int BlueStore::cold_open()
 {
   return _open_db_and_around(true);
@@ -9901,22 +10870,117 @@ void BlueStore::_fsck_check_object_omap(FSCKDepth depth,
   }
 }
 
+int64_t BlueStore::_fsck_deep_read(Collection *c, OnodeRef& o)
+{
+  bufferlist bl;
+  uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
+  uint64_t offset = 0;
+  do {
+    uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
+    int r = _do_read(c, o, offset, l, bl,
+      CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    if (r < 0) {
+      derr << "fsck error: " << o->oid << std::hex
+        << " error during read: "
+        << " " << offset << "~" << l
+        << " " << cpp_strerror(r) << std::dec
+        << dendl;
+      return 1;
+    }
+    fsck_progress.deep_read_bytes += l;
+    offset += l;
+  } while (offset < o->onode.size);
+  return 0;
+}
+
+/// Runs _fsck_deep_read() for queued onodes on a few threads.  The
+/// queue is bounded so that only a handful of onodes are kept alive.
+class BlueStore::FSCKDeepReader {
+  BlueStore *store;
+  ceph::mutex lock = ceph::make_mutex("BlueStore::FSCKDeepReader::lock");
+  ceph::condition_variable cond;
+  std::deque<std::pair<CollectionRef, OnodeRef>> q;
+  size_t max_queued;
+  bool stop = false;
+  std::vector<std::thread> threads;
+  std::atomic<int64_t> errors = {0};
+
+  void worker() {
+    std::unique_lock l(lock);
+    while (true) {
+      cond.wait(l, [this] { return stop || !q.empty(); });
+      if (q.empty()) {
+        break;
+      }
+      auto [c, o] = std::move(q.front());
+      q.pop_front();
+      cond.notify_all();
+      l.unlock();
+      errors += store->_fsck_deep_read(c.get(), o);
+      l.lock();
+    }
+  }
+
+public:
+  FSCKDeepReader(BlueStore *s, size_t n)
+    : store(s), max_queued(n * 4) {
+    for (size_t i = 0; i < n; ++i) {
+      threads.emplace_back(make_named_thread("bstore_fsck_rd",
+                                             &FSCKDeepReader::worker, this));
+    }
+  }
+  ~FSCKDeepReader() {
+    finish();
+  }
+  void queue(const CollectionRef& c, OnodeRef& o) {
+    std::unique_lock l(lock);
+    cond.wait(l, [this] { return q.size() < max_queued; });
+    q.emplace_back(c, o);
+    cond.notify_all();
+  }
+  /// wait for everything queued to be read; returns the error count
+  int64_t finish() {
+    {
+      std::lock_guard l(lock);
+      stop = true;
+      cond.notify_all();
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    threads.clear();
+    return errors.exchange(0);
+  }
+};
+
+void BlueStore::FSCKProgress::dump(Formatter *f) const
+{
+  f->open_object_section("fsck");
+  f->dump_bool("running", running);
+  f->dump_string("depth", depth == FSCK_DEEP ? "deep" :
+                          depth == FSCK_SHALLOW ? "shallow" : "regular");
+  f->dump_unsigned("objects", objects);
+  f->dump_unsigned("deep_read_bytes", deep_read_bytes);
+  if (running) {
+    auto elapsed = ceph::mono_clock::now() - ceph::mono_clock::time_point(
+      ceph::mono_clock::duration(start.load()));
+    f->dump_float("elapsed", ceph::to_seconds<double>(elapsed));
+  }
+  f->close_section();
+}
+
 void BlueStore::_fsck_check_objects(
   FSCKDepth depth,
   BlueStore::FSCK_ObjectCtx& ctx)
 {
-  auto& errors = ctx.errors;
   auto sb_info_lock = ctx.sb_info_lock;
   auto& sb_info = ctx.sb_info;
   auto& sb_ref_counts = ctx.sb_ref_counts;
   auto repairer = ctx.repairer;
 
-  uint64_t_btree_t used_nids;
-
-  size_t processed_myself = 0;
+  std::atomic<size_t> processed_myself = {0};
 
   auto it = db->get_iterator(PREFIX_OBJ, KeyValueDB::ITERATOR_NOCACHE);
-  mempool::bluestore_fsck::list<string> expecting_shards;
   if (it) {
     const size_t thread_count = cct->_conf->bluestore_fsck_quick_fix_threads;
     typedef ShallowFSCKThreadPool::FSCKWorkQueue<256> WQ;
@@ -9938,213 +11002,357 @@ void BlueStore::_fsck_check_objects(
       ceph_assert(sb_info_lock);
       thread_pool.start();
     }
+    // deep fsck time is dominated by reading the data back; do that on
+    // separate threads while this one keeps iterating over the onodes
+    std::unique_ptr<FSCKDeepReader> deep_reader;
+    const int64_t deep_threads = cct->_conf->bluestore_fsck_deep_read_threads;
+    if (depth == FSCK_DEEP && deep_threads > 0) {
+      deep_reader = std::make_unique<FSCKDeepReader>(this, deep_threads);
+    }
+
+    // check the onodes in [start, end) of the object keyspace, an empty
+    // end meaning all the way
+    auto walk = [&](FSCK_ObjectCtx& ctx, uint64_t_btree_t& used_nids,
+                    const string& start, const string& end) {
+      auto& errors = ctx.errors;
+      auto it = db->get_iterator(PREFIX_OBJ, KeyValueDB::ITERATOR_NOCACHE);
+      mempool::bluestore_fsck::list<string> expecting_shards;
+      // fill global if not overriden below
+      CollectionRef c;
+      int64_t pool_id = -1;
+      spg_t pgid;
+      for (it->lower_bound(start);
+           it->valid() && (end.empty() || it->key() < end);
+           it->next()) {
+        dout(30) << __func__ << " key "
+          << pretty_binary_string(it->key()) << dendl;
+        if (is_extent_shard_key(it->key())) {
+          if (depth == FSCK_SHALLOW) {
+            continue;
+          }
+          while (!expecting_shards.empty() &&
+            expecting_shards.front() < it->key()) {
+            derr << "fsck error: missing shard key "
+              << pretty_binary_string(expecting_shards.front())
+              << dendl;
+            ++errors;
+            expecting_shards.pop_front();
+          }
+          if (!expecting_shards.empty() &&
+            expecting_shards.front() == it->key()) {
+            // all good
+            expecting_shards.pop_front();
+            continue;
+          }
 
-    // fill global if not overriden below
-    CollectionRef c;
-    int64_t pool_id = -1;
-    spg_t pgid;
-    for (it->lower_bound(string()); it->valid(); it->next()) {
-      dout(30) << __func__ << " key "
-        << pretty_binary_string(it->key()) << dendl;
-      if (is_extent_shard_key(it->key())) {
-        if (depth == FSCK_SHALLOW) {
-          continue;
-        }
-        while (!expecting_shards.empty() &&
-          expecting_shards.front() < it->key()) {
-          derr << "fsck error: missing shard key "
-            << pretty_binary_string(expecting_shards.front())
-            << dendl;
-          ++errors;
-          expecting_shards.pop_front();
-        }
-        if (!expecting_shards.empty() &&
-          expecting_shards.front() == it->key()) {
-          // all good
-          expecting_shards.pop_front();
+          uint32_t offset;
+          string okey;
+          get_key_extent_shard(it->key(), &okey, &offset);
+          derr << "fsck error: stray shard 0x" << std::hex << offset
+            << std::dec << dendl;
+          if (expecting_shards.empty()) {
+            derr << "fsck error: " << pretty_binary_string(it->key())
+              << " is unexpected" << dendl;
+            ++errors;
+            continue;
+          }
+          while (expecting_shards.front() > it->key()) {
+            derr << "fsck error:   saw " << pretty_binary_string(it->key())
+              << dendl;
+            derr << "fsck error:   exp "
+              << pretty_binary_string(expecting_shards.front()) << dendl;
+            ++errors;
+            expecting_shards.pop_front();
+            if (expecting_shards.empty()) {
+              break;
+            }
+          }
           continue;
         }
 
-        uint32_t offset;
-        string okey;
-        get_key_extent_shard(it->key(), &okey, &offset);
-        derr << "fsck error: stray shard 0x" << std::hex << offset
-          << std::dec << dendl;
-        if (expecting_shards.empty()) {
-          derr << "fsck error: " << pretty_binary_string(it->key())
-            << " is unexpected" << dendl;
+        ghobject_t oid;
+        int r = get_key_object(it->key(), &oid);
+        if (r < 0) {
+          derr << "fsck error: bad object key "
+            << pretty_binary_string(it->key()) << dendl;
           ++errors;
           continue;
         }
-        while (expecting_shards.front() > it->key()) {
-          derr << "fsck error:   saw " << pretty_binary_string(it->key())
-            << dendl;
-          derr << "fsck error:   exp "
-            << pretty_binary_string(expecting_shards.front()) << dendl;
-          ++errors;
-          expecting_shards.pop_front();
-          if (expecting_shards.empty()) {
-            break;
+        ++fsck_progress.objects;
+        if (!c ||
+          oid.shard_id != pgid.shard ||
+          oid.hobj.get_logical_pool() != (int64_t)pgid.pool() ||
+          !c->contains(oid)) {
+          c = nullptr;
+          for (auto& p : coll_map) {
+            if (p.second->contains(oid)) {
+              c = p.second;
+              break;
+            }
+          }
+          if (!c) {
+            derr << "fsck error: stray object " << oid
+              << " not owned by any collection" << dendl;
+            ++errors;
+            continue;
           }
+          pool_id = c->cid.is_pg(&pgid) ? pgid.pool() : META_POOL_ID;
+          dout(20) << __func__ << "  collection " << c->cid << " " << c->cnode
+            << dendl;
         }
-        continue;
-      }
 
-      ghobject_t oid;
-      int r = get_key_object(it->key(), &oid);
-      if (r < 0) {
-        derr << "fsck error: bad object key "
-          << pretty_binary_string(it->key()) << dendl;
-        ++errors;
-        continue;
-      }
-      if (!c ||
-        oid.shard_id != pgid.shard ||
-        oid.hobj.get_logical_pool() != (int64_t)pgid.pool() ||
-        !c->contains(oid)) {
-        c = nullptr;
-        for (auto& p : coll_map) {
-          if (p.second->contains(oid)) {
-            c = p.second;
-            break;
+        if (depth != FSCK_SHALLOW &&
+          !expecting_shards.empty()) {
+          for (auto& k : expecting_shards) {
+            derr << "fsck error: missing shard key "
+              << pretty_binary_string(k) << dendl;
           }
-        }
-        if (!c) {
-          derr << "fsck error: stray object " << oid
-            << " not owned by any collection" << dendl;
           ++errors;
-          continue;
+          expecting_shards.clear();
         }
-        pool_id = c->cid.is_pg(&pgid) ? pgid.pool() : META_POOL_ID;
-        dout(20) << __func__ << "  collection " << c->cid << " " << c->cnode
-          << dendl;
-      }
 
-      if (depth != FSCK_SHALLOW &&
-        !expecting_shards.empty()) {
-        for (auto& k : expecting_shards) {
-          derr << "fsck error: missing shard key "
-            << pretty_binary_string(k) << dendl;
+        bool queued = false;
+        if (depth == FSCK_SHALLOW && thread_count > 0) {
+          queued = wq->queue(
+            pool_id,
+            c,
+            oid,
+            it->key(),
+            it->value());
         }
-        ++errors;
-        expecting_shards.clear();
-      }
-
-      bool queued = false;
-      if (depth == FSCK_SHALLOW && thread_count > 0) {
-        queued = wq->queue(
-          pool_id,
-          c,
-          oid,
-          it->key(),
-          it->value());
-      }
-      OnodeRef o;
-      map<BlobRef, bluestore_blob_t::unused_t> referenced;
-
-      if (!queued) {
-        ++processed_myself;
-         o = fsck_check_objects_shallow(
-          depth,
-          pool_id,
-          c,
-          oid,
-          it->key(),
-          it->value(),
-          &expecting_shards,
-          &referenced,
-          ctx);
-      }
-
-      if (depth != FSCK_SHALLOW) {
-        ceph_assert(o != nullptr);
-        if (o->onode.nid) {
-          if (o->onode.nid > nid_max) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " > nid_max " << nid_max << dendl;
-            ++errors;
-          }
-          if (used_nids.count(o->onode.nid)) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " already in use" << dendl;
-            ++errors;
-            continue; // go for next object
-          }
-          used_nids.insert(o->onode.nid);
+        OnodeRef o;
+        map<BlobRef, bluestore_blob_t::unused_t> referenced;
+
+        if (!queued) {
+          ++processed_myself;
+           o = fsck_check_objects_shallow(
+            depth,
+            pool_id,
+            c,
+            oid,
+            it->key(),
+            it->value(),
+            &expecting_shards,
+            &referenced,
+            ctx);
         }
-        for (auto& i : referenced) {
-          dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
-            << std::dec << " for " << *i.first << dendl;
-          const bluestore_blob_t& blob = i.first->get_blob();
-          if (i.second & blob.unused) {
-            derr << "fsck error: " << oid << " blob claims unused 0x"
-              << std::hex << blob.unused
-              << " but extents reference 0x" << i.second << std::dec
-              << " on blob " << *i.first << dendl;
-            ++errors;
+
+        if (depth != FSCK_SHALLOW) {
+          ceph_assert(o != nullptr);
+          if (o->onode.nid) {
+            if (o->onode.nid > nid_max) {
+              derr << "fsck error: " << oid << " nid " << o->onode.nid
+                << " > nid_max " << nid_max << dendl;
+              ++errors;
+            }
+            if (used_nids.count(o->onode.nid)) {
+              derr << "fsck error: " << oid << " nid " << o->onode.nid
+                << " already in use" << dendl;
+              ++errors;
+              continue; // go for next object
+            }
+            used_nids.insert(o->onode.nid);
           }
-          if (blob.has_csum()) {
-            uint64_t blob_len = blob.get_logical_length();
-            uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
-            unsigned csum_count = blob.get_csum_count();
-            unsigned csum_chunk_size = blob.get_csum_chunk_size();
-            for (unsigned p = 0; p < csum_count; ++p) {
-              unsigned pos = p * csum_chunk_size;
-              unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
-              unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
-              unsigned mask = 1u << firstbit;
-              for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
-                mask |= 1u << b;
-              }
-              if ((blob.unused & mask) == mask) {
-                // this csum chunk region is marked unused
-                if (blob.get_csum_item(p) != 0) {
-                  derr << "fsck error: " << oid
-                    << " blob claims csum chunk 0x" << std::hex << pos
-                    << "~" << csum_chunk_size
-                    << " is unused (mask 0x" << mask << " of unused 0x"
-                    << blob.unused << ") but csum is non-zero 0x"
-                    << blob.get_csum_item(p) << std::dec << " on blob "
-                    << *i.first << dendl;
-                  ++errors;
+          for (auto& i : referenced) {
+            dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
+              << std::dec << " for " << *i.first << dendl;
+            const bluestore_blob_t& blob = i.first->get_blob();
+            if (i.second & blob.unused) {
+              derr << "fsck error: " << oid << " blob claims unused 0x"
+                << std::hex << blob.unused
+                << " but extents reference 0x" << i.second << std::dec
+                << " on blob " << *i.first << dendl;
+              ++errors;
+            }
+            if (blob.has_csum()) {
+              uint64_t blob_len = blob.get_logical_length();
+              uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
+              unsigned csum_count = blob.get_csum_count();
+              unsigned csum_chunk_size = blob.get_csum_chunk_size();
+              for (unsigned p = 0; p < csum_count; ++p) {
+                unsigned pos = p * csum_chunk_size;
+                unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
+                unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
+                unsigned mask = 1u << firstbit;
+                for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
+                  mask |= 1u << b;
+                }
+                if ((blob.unused & mask) == mask) {
+                  // this csum chunk region is marked unused
+                  if (blob.get_csum_item(p) != 0) {
+                    derr << "fsck error: " << oid
+                      << " blob claims csum chunk 0x" << std::hex << pos
+                      << "~" << csum_chunk_size
+                      << " is unused (mask 0x" << mask << " of unused 0x"
+                      << blob.unused << ") but csum is non-zero 0x"
+                      << blob.get_csum_item(p) << std::dec << " on blob "
+                      << *i.first << dendl;
+                    ++errors;
+                  }
                 }
               }
             }
           }
-        }
-        // omap
-        if (o->onode.has_omap()) {
-          ceph_assert(ctx.used_omap_head);
-          if (ctx.used_omap_head->count(o->onode.nid)) {
-            derr << "fsck error: " << o->oid << " omap_head " << o->onode.nid
-                 << " already in use" << dendl;
-            ++errors;
-          } else {
-            ctx.used_omap_head->insert(o->onode.nid);
-          }
-        } // if (o->onode.has_omap())
-        if (depth == FSCK_DEEP) {
-          bufferlist bl;
-          uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
-          uint64_t offset = 0;
-          do {
-            uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
-            int r = _do_read(c.get(), o, offset, l, bl,
-              CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
-            if (r < 0) {
+          // omap
+          if (o->onode.has_omap()) {
+            ceph_assert(ctx.used_omap_head);
+            if (ctx.used_omap_head->count(o->onode.nid)) {
+              derr << "fsck error: " << o->oid << " omap_head " << o->onode.nid
+                   << " already in use" << dendl;
               ++errors;
-              derr << "fsck error: " << oid << std::hex
-                << " error during read: "
-                << " " << offset << "~" << l
-                << " " << cpp_strerror(r) << std::dec
-                << dendl;
-              break;
+            } else {
+              ctx.used_omap_head->insert(o->onode.nid);
             }
-            offset += l;
-          } while (offset < o->onode.size);
-        } // deep
-      } //if (depth != FSCK_SHALLOW)
-    } // for (it->lower_bound(string()); it->valid(); it->next())
+          } // if (o->onode.has_omap())
+          if (depth == FSCK_DEEP) {
+            if (deep_reader) {
+              deep_reader->queue(c, o);
+            } else {
+              errors += _fsck_deep_read(c.get(), o);
+            }
+          } // deep
+        } //if (depth != FSCK_SHALLOW)
+      } // for (it->lower_bound(start); ...; it->next())
+    };
+
+    const int64_t walk_threads =
+      depth == FSCK_SHALLOW || repairer ? 1 :
+      cct->_conf->bluestore_fsck_walk_threads;
+    if (walk_threads <= 1) {
+      uint64_t_btree_t used_nids;
+      walk(ctx, used_nids, string(), string());
+    } else {
+      // split the keyspace at collection boundaries, into a few ranges per
+      // thread so that uneven collections even out
+      std::vector<string> bounds;
+      for (auto& p : coll_map) {
+        ghobject_t temp_start, temp_end, start, end;
+        get_coll_range(p.first, p.second->cnode.bits,
+                       &temp_start, &temp_end, &start, &end, false);
+        bounds.emplace_back();
+        get_object_key(cct, start, &bounds.back());
+      }
+      std::sort(bounds.begin(), bounds.end());
+      bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+      std::vector<std::pair<string, string>> ranges;
+      size_t step = std::max<size_t>(1, bounds.size() / (walk_threads * 4));
+      string prev;
+      for (size_t i = step; i < bounds.size(); i += step) {
+        ranges.emplace_back(prev, bounds[i]);
+        prev = bounds[i];
+      }
+      ranges.emplace_back(prev, string());
+      dout(1) << __func__ << " walking " << ranges.size() << " key ranges on "
+              << walk_threads << " threads" << dendl;
+
+      // each walker accounts into its own context; they only share the
+      // shared blob tracking, which is locked
+      struct walker_t {
+        int64_t errors = 0;
+        int64_t warnings = 0;
+        uint64_t num_objects = 0;
+        uint64_t num_extents = 0;
+        uint64_t num_blobs = 0;
+        uint64_t num_sharded_objects = 0;
+        uint64_t num_spanning_blobs = 0;
+        mempool_dynamic_bitset used_blocks;
+        uint64_t_btree_t used_omap_head;
+        uint64_t_btree_t used_nids;
+        store_statfs_t expected_store_statfs;
+        per_pool_statfs expected_pool_statfs;
+        per_pool_fsck_stats_t per_pool_fsck_stats;
+      };
+      ceph::mutex walk_sb_info_lock =
+        ceph::make_mutex("BlueStore::fsck::walk_sb_info_lock");
+      std::vector<walker_t> walkers(walk_threads);
+      std::atomic<size_t> next_range = {0};
+      std::vector<std::thread> threads;
+      for (auto& w : walkers) {
+        w.used_blocks.resize(ctx.used_blocks->size());
+        threads.emplace_back(make_named_thread("bstore_fsck_walk", [&, wp = &w] {
+          FSCK_ObjectCtx wctx(
+            wp->errors,
+            wp->warnings,
+            wp->num_objects,
+            wp->num_extents,
+            wp->num_blobs,
+            wp->num_sharded_objects,
+            wp->num_spanning_blobs,
+            &wp->used_blocks,
+            &wp->used_omap_head,
+            ctx.zone_refs,
+            sb_info_lock ? sb_info_lock : &walk_sb_info_lock,
+            sb_info,
+            sb_ref_counts,
+            wp->expected_store_statfs,
+            wp->expected_pool_statfs,
+            wp->per_pool_fsck_stats,
+            nullptr);
+          for (size_t i = next_range++; i < ranges.size(); i = next_range++) {
+            walk(wctx, wp->used_nids, ranges[i].first, ranges[i].second);
+          }
+        }));
+      }
+      for (auto& t : threads) {
+        t.join();
+      }
+
+      // merge; whatever two walkers both claimed is only found here
+      auto& used_blocks = *ctx.used_blocks;
+      uint64_t alloc_size = fm->get_alloc_size();
+      uint64_t_btree_t used_nids;
+      for (auto& w : walkers) {
+        ctx.errors += w.errors;
+        ctx.warnings += w.warnings;
+        ctx.num_objects += w.num_objects;
+        ctx.num_extents += w.num_extents;
+        ctx.num_blobs += w.num_blobs;
+        ctx.num_sharded_objects += w.num_sharded_objects;
+        ctx.num_spanning_blobs += w.num_spanning_blobs;
+        ctx.expected_store_statfs.add(w.expected_store_statfs);
+        for (auto& p : w.expected_pool_statfs) {
+          ctx.expected_pool_statfs[p.first].add(p.second);
+        }
+        for (auto& p : w.per_pool_fsck_stats) {
+          ctx.per_pool_fsck_stats[p.first].add(p.second);
+        }
+
+        auto pos = w.used_blocks.find_first();
+        auto last = mempool_dynamic_bitset::npos;
+        for (; pos != mempool_dynamic_bitset::npos;
+             pos = w.used_blocks.find_next(pos)) {
+          if (!used_blocks.test(pos)) {
+            used_blocks.set(pos);
+            continue;
+          }
+          if (last == mempool_dynamic_bitset::npos || pos != last + 1) {
+            derr << "fsck error: extent at 0x" << std::hex << pos * alloc_size
+                 << std::dec << " or a subset is already allocated"
+                 << " (misreferenced)" << dendl;
+            ++ctx.errors;
+          }
+          last = pos;
+        }
+        w.used_blocks.clear();
+
+        for (auto nid : w.used_nids) {
+          if (!used_nids.insert(nid).second) {
+            derr << "fsck error: nid " << nid << " already in use" << dendl;
+            ++ctx.errors;
+          }
+        }
+        for (auto nid : w.used_omap_head) {
+          if (!ctx.used_omap_head->insert(nid).second) {
+            derr << "fsck error: omap_head " << nid << " already in use"
+                 << dendl;
+            ++ctx.errors;
+          }
+        }
+      }
+    }
+    if (deep_reader) {
+      ctx.errors += deep_reader->finish();
+    }
     if (depth == FSCK_SHALLOW && thread_count > 0) {
       wq->finalize(thread_pool, ctx);
       if (processed_myself) {
@@ -10211,6 +11419,17 @@ int BlueStore::_fsck(BlueStore::FSCKDepth depth, bool repair)
   auto close_db = make_scope_guard([&] {
     _close_db_and_around();
   });
+  // for 'bluestore fsck status' while fsck runs on an unmounted store
+  const bool own_asok_hook = !asok_hook;
+  if (own_asok_hook) {
+    asok_hook = SocketHook::create(this);
+  }
+  auto unregister_asok = make_scope_guard([&] {
+    if (own_asok_hook) {
+      delete asok_hook;
+      asok_hook = nullptr;
+    }
+  });
 
   if (!read_only) {
     r = _upgrade_super();
@@ -10262,6 +11481,11 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
   int64_t warnings = 0;
   unsigned repaired = 0;
 
+  fsck_progress.reset(depth);
+  auto fsck_done = make_scope_guard([&] {
+    fsck_progress.running = false;
+  });
+
   uint64_t_btree_t used_omap_head;
   uint64_t_btree_t used_sbids;
 
@@ -11429,7 +12653,8 @@ void BlueStore::_get_statfs_overall(struct store_statfs_t *buf)
   buf->omap_allocated =
     db->estimate_prefix_size(prefix, string());
 
-  uint64_t bfree = alloc->get_free();
+  // space waiting for its discard is as good as free
+  uint64_t bfree = alloc->get_free() + _get_discard_queued_bytes();
 
   if (bluefs) {
     buf->internally_reserved = 0;
@@ -11574,8 +12799,8 @@ BlueStore::CollectionRef BlueStore::_get_collection_by_oid(const ghobject_t& oid
 void BlueStore::_queue_reap_collection(CollectionRef& c)
 {
   dout(10) << __func__ << " " << c << " " << c->cid << dendl;
-  // _reap_collections and this in the same thread,
-  // so no need a lock.
+  // there may be several kv_finalize threads queuing and reaping
+  std::lock_guard l(removed_collections_lock);
   removed_collections.push_back(c);
 }
 
@@ -11584,8 +12809,7 @@ void BlueStore::_reap_collections()
 
   list<CollectionRef> removed_colls;
   {
-    // _queue_reap_collection and this in the same thread.
-    // So no need a lock.
+    std::lock_guard l(removed_collections_lock);
     if (!removed_collections.empty())
       removed_colls.swap(removed_collections);
     else
@@ -11615,6 +12839,7 @@ void BlueStore::_reap_collections()
   if (removed_colls.empty()) {
     dout(10) << __func__ << " all reaped" << dendl;
   } else {
+    std::lock_guard l(removed_collections_lock);
     removed_collections.splice(removed_collections.begin(), removed_colls);
   }
 }
@@ -12017,6 +13242,10 @@ int BlueStore::_generate_read_result_bl(
           *csum_error = true;
           return -EIO;
         }
+        if (cct->_conf->bluestore_read_reuse_csum &&
+            !cct->_conf->bluestore_ignore_data_csum) {
+          _prime_read_crc(bptr->get_blob(), req.r_off, req.bl);
+        }
         if (buffered) {
           bptr->dirty_bc().did_read(bptr->get_cache(),
                                          req.r_off, req.bl);
@@ -12234,6 +13463,40 @@ int BlueStore::_verify_csum(OnodeRef& o,
   return r;
 }
 
+void BlueStore::_prime_read_crc(
+  const bluestore_blob_t& blob,
+  uint64_t blob_xoffset,
+  const bufferlist& bl)
+{
+  // The data has just been verified against the blob's crc32c values,
+  // fold them into the crc of every buffer that is made of whole csum
+  // chunks.  The OSD (full object digest) and the messenger (data crc)
+  // then get a crc cache hit instead of another pass over the data,
+  // both for this read and for later reads served from the buffer cache.
+  if (blob.csum_type != Checksummer::CSUM_CRC32C) {
+    return;
+  }
+  uint32_t chunk_size = blob.get_csum_chunk_size();
+  uint64_t pos = blob_xoffset;
+  uint64_t primed = 0;
+  for (auto& p : bl.buffers()) {
+    if (p.length() && pos % chunk_size == 0 && p.length() % chunk_size == 0) {
+      const uint32_t base = -1;
+      uint32_t crc = base;
+      for (uint64_t i = pos / chunk_size; i < (pos + p.length()) / chunk_size;
+           ++i) {
+        // crc32c(d, s) == crc32c(d, -1) ^ crc32c(zeros, s ^ -1)
+        crc = (uint32_t)blob.get_csum_item(i) ^
+          ceph_crc32c(crc ^ base, nullptr, chunk_size);
+      }
+      p.set_crc32c(base, crc);
+      primed += p.length();
+    }
+    pos += p.length();
+  }
+  logger->inc(l_bluestore_read_crc_primed_bytes, primed);
+}
+
 int BlueStore::_decompress(bufferlist& source, bufferlist* result)
 {
   int r = 0;
@@ -13036,15 +14299,21 @@ int BlueStore::omap_get_values(
     const string& prefix = o->get_omap_prefix();
     o->get_omap_key(string(), &final_key);
     size_t base_key_len = final_key.size();
-    for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
+    // all keys share the object's omap prefix, so the encoded keys sort
+    // like the user keys and we can fetch them in a single batch
+    set<string> db_keys;
+    for (auto& k : keys) {
       final_key.resize(base_key_len); // keep prefix
-      final_key += *p;
-      bufferlist val;
-      if (db->get(prefix, final_key, &val) >= 0) {
-	dout(30) << __func__ << "  got " << pretty_binary_string(final_key)
-		 << " -> " << *p << dendl;
-	out->insert(make_pair(*p, val));
-      }
+      final_key += k;
+      db_keys.emplace_hint(db_keys.end(), final_key);
+    }
+    map<string, bufferlist> vals;
+    db->get(prefix, db_keys, &vals);
+    for (auto& [db_key, val] : vals) {
+      dout(30) << __func__ << "  got " << pretty_binary_string(db_key)
+	       << dendl;
+      out->emplace_hint(out->end(), db_key.substr(base_key_len),
+			std::move(val));
     }
   }
  out:
@@ -13132,18 +14401,18 @@ int BlueStore::omap_check_keys(
     const string& prefix = o->get_omap_prefix();
     o->get_omap_key(string(), &final_key);
     size_t base_key_len = final_key.size();
-    for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
+    set<string> db_keys;
+    for (auto& k : keys) {
       final_key.resize(base_key_len); // keep prefix
-      final_key += *p;
-      bufferlist val;
-      if (db->get(prefix, final_key, &val) >= 0) {
-	dout(30) << __func__ << "  have " << pretty_binary_string(final_key)
-		 << " -> " << *p << dendl;
-	out->insert(*p);
-      } else {
-	dout(30) << __func__ << "  miss " << pretty_binary_string(final_key)
-		 << " -> " << *p << dendl;
-      }
+      final_key += k;
+      db_keys.emplace_hint(db_keys.end(), final_key);
+    }
+    map<string, bufferlist> vals;
+    db->get(prefix, db_keys, &vals);
+    for (auto& [db_key, val] : vals) {
+      dout(30) << __func__ << "  have " << pretty_binary_string(db_key)
+	       << dendl;
+      out->emplace_hint(out->end(), db_key.substr(base_key_len));
     }
   }
  out:
@@ -13527,6 +14796,11 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       {
 	mono_clock::duration lat = throttle.log_state_latency(
 	  *txc, logger, l_bluestore_state_aio_wait_lat);
+	if (txc->had_ios) {
+	  _ewma_update(aio_wait_ewma_us,
+	    std::chrono::duration_cast<std::chrono::microseconds>(lat).count());
+	  aio_wait_samples.fetch_add(1, std::memory_order_relaxed);
+	}
 	if (ceph::to_seconds<double>(lat) >= cct->_conf->bluestore_log_op_age) {
 	  logger->inc(l_bluestore_slow_aio_wait_count);
 	  dout(0) << __func__ << " slow aio_wait, txc = " << txc
@@ -13777,13 +15051,12 @@ void BlueStore::_txc_apply_kv(TransContext *txc, bool sync_submit_transaction)
     }
 #endif
 
+    if (alloc_ckpt_enabled &&
+	(!txc->allocated.empty() || !txc->released.empty())) {
+      _alloc_ckpt_log_delta(txc);
+    }
     int r = cct->_conf->bluestore_debug_omit_kv_commit ? 0 : db->submit_transaction(txc->t);
     ceph_assert(r == 0);
-    txc->set_state(TransContext::STATE_KV_SUBMITTED);
-    if (txc->osr->kv_submitted_waiters) {
-      std::lock_guard l(txc->osr->qlock);
-      txc->osr->qcond.notify_all();
-    }
 
 #if defined(WITH_LTTNG)
     if (txc->tracing) {
@@ -13797,11 +15070,63 @@ void BlueStore::_txc_apply_kv(TransContext *txc, bool sync_submit_transaction)
     }
 #endif
   }
+  _txc_kv_submitted(txc);
+}
+
+// submit the transactions of txcs queued to the kv sync thread as one
+// group, so that the kv store can merge them into fewer writes
+void BlueStore::_txc_apply_kv_group(const std::vector<TransContext*>& txcs)
+{
+#if defined(WITH_LTTNG)
+  auto start = mono_clock::now();
+#endif
+  std::vector<KeyValueDB::Transaction> tl;
+  tl.reserve(txcs.size());
+  for (auto txc : txcs) {
+    ceph_assert(txc->get_state() == TransContext::STATE_KV_QUEUED);
+#ifdef WITH_BLKIN
+    if (txc->trace) {
+      txc->trace.event("db async submit");
+    }
+#endif
+    if (alloc_ckpt_enabled &&
+	(!txc->allocated.empty() || !txc->released.empty())) {
+      _alloc_ckpt_log_delta(txc);
+    }
+    tl.push_back(txc->t);
+  }
+  int r = cct->_conf->bluestore_debug_omit_kv_commit ? 0 : db->submit_transactions(tl);
+  ceph_assert(r == 0);
+  for (auto txc : txcs) {
+#if defined(WITH_LTTNG)
+    if (txc->tracing) {
+      tracepoint(
+	bluestore,
+	transaction_kv_submit_latency,
+	txc->osr->get_sequencer_id(),
+	txc->seq,
+	false,
+	ceph::to_seconds<double>(mono_clock::now() - start));
+    }
+#endif
+    _txc_kv_submitted(txc);
+  }
+}
+
+void BlueStore::_txc_kv_submitted(TransContext *txc)
+{
+  txc->set_state(TransContext::STATE_KV_SUBMITTED);
+  if (txc->osr->kv_submitted_waiters) {
+    std::lock_guard l(txc->osr->qlock);
+    txc->osr->qcond.notify_all();
+  }
 
   for (auto ls : { &txc->onodes, &txc->modified_objects }) {
     for (auto& o : *ls) {
       dout(20) << __func__ << " onode " << o << " had " << o->flushing_count
 	       << dendl;
+      // fences Collection::maybe_prefetch_onodes()
+      o->c->onode_submit_seq.fetch_add(1, std::memory_order_release);
       if (--o->flushing_count == 0 && o->waiting_count.load()) {
         std::lock_guard l(o->flush_lock);
 	o->flush_cond.notify_all();
@@ -13813,6 +15138,9 @@ void BlueStore::_txc_apply_kv(TransContext *txc, bool sync_submit_transaction)
 void BlueStore::_txc_committed_kv(TransContext *txc)
 {
   dout(20) << __func__ << " txc " << txc << dendl;
+  if (debug_kv_finalize_hook) {
+    debug_kv_finalize_hook(txc->ch->cid, txc->seq);
+  }
   throttle.complete_kv(*txc);
   {
     std::lock_guard l(txc->osr->qlock);
@@ -14063,9 +15391,9 @@ void BlueStore::_osr_drain_all()
     std::lock_guard l(kv_lock);
     kv_cond.notify_one();
   }
-  {
-    std::lock_guard l(kv_finalize_lock);
-    kv_finalize_cond.notify_one();
+  for (auto& shard : kv_finalize_shards) {
+    std::lock_guard l(shard->lock);
+    shard->cond.notify_one();
   }
   for (auto osr : s) {
     dout(20) << __func__ << " drain " << osr << dendl;
@@ -14100,7 +15428,14 @@ void BlueStore::_kv_start()
 
   finisher.start();
   kv_sync_thread.create("bstore_kv_sync");
-  kv_finalize_thread.create("bstore_kv_final");
+  auto n = std::max<uint64_t>(
+    1, cct->_conf.get_val<uint64_t>("bluestore_kv_finalize_threads"));
+  ceph_assert(kv_finalize_shards.empty());
+  for (unsigned i = 0; i < n; ++i) {
+    kv_finalize_shards.emplace_back(std::make_unique<KVFinalizeShard>(this, i));
+    kv_finalize_shards.back()->thread.create(
+      n == 1 ? "bstore_kv_final" : ("bstore_kv_fin" + stringify(i)).c_str());
+  }
 }
 
 void BlueStore::_kv_stop()
@@ -14114,25 +15449,25 @@ void BlueStore::_kv_stop()
     kv_stop = true;
     kv_cond.notify_all();
   }
-  {
-    std::unique_lock l{kv_finalize_lock};
-    while (!kv_finalize_started) {
-      kv_finalize_cond.wait(l);
+  kv_sync_thread.join();
+  // the sync thread has drained kv_queue into the finalize shards by now
+  for (auto& shard : kv_finalize_shards) {
+    std::unique_lock l{shard->lock};
+    while (!shard->started) {
+      shard->cond.wait(l);
     }
-    kv_finalize_stop = true;
-    kv_finalize_cond.notify_all();
+    shard->stop = true;
+    shard->cond.notify_all();
   }
-  kv_sync_thread.join();
-  kv_finalize_thread.join();
+  for (auto& shard : kv_finalize_shards) {
+    shard->thread.join();
+  }
+  kv_finalize_shards.clear();
   ceph_assert(removed_collections.empty());
   {
     std::lock_guard l(kv_lock);
     kv_stop = false;
   }
-  {
-    std::lock_guard l(kv_finalize_lock);
-    kv_finalize_stop = false;
-  }
   dout(10) << __func__ << " stopping finishers" << dendl;
   finisher.wait_for_empty();
   finisher.stop();
@@ -14272,12 +15607,12 @@ void BlueStore::_kv_sync_thread()
 	dout(10) << __func__ << " new_blobid_max " << new_blobid_max << dendl;
       }
 
+      std::vector<TransContext*> to_apply;
       for (auto txc : kv_committing) {
 	throttle.log_state_latency(*txc, logger, l_bluestore_state_kv_queued_lat);
 	if (txc->get_state() == TransContext::STATE_KV_QUEUED) {
 	  ++kv_submitted;
-	  _txc_apply_kv(txc, false);
-	  --txc->osr->kv_committing_serially;
+	  to_apply.push_back(txc);
 	} else {
 	  ceph_assert(txc->get_state() == TransContext::STATE_KV_SUBMITTED);
 	}
@@ -14285,6 +15620,13 @@ void BlueStore::_kv_sync_thread()
 	  --txc->osr->txc_with_unstable_io;
 	}
       }
+      if (!to_apply.empty()) {
+	_txc_apply_kv_group(to_apply);
+	// only now may later txcs of these sequencers submit on their own
+	for (auto txc : to_apply) {
+	  --txc->osr->kv_committing_serially;
+	}
+      }
 
       // release throttle *before* we commit.  this allows new ops
       // to be prepared and enter pipeline while we are waiting on
@@ -14342,30 +15684,63 @@ void BlueStore::_kv_sync_thread()
       }
 #endif
 
-      {
-	std::unique_lock m{kv_finalize_lock};
-	if (kv_committing_to_finalize.empty()) {
-	  kv_committing_to_finalize.swap(kv_committing);
+      logger->inc(l_bluestore_kv_sync_batch_txc, committing_size);
+      if (kv_finalize_shards.size() == 1) {
+	auto& shard = *kv_finalize_shards.front();
+	std::unique_lock m{shard.lock};
+	if (shard.kv_committing_to_finalize.empty()) {
+	  shard.kv_committing_to_finalize.swap(kv_committing);
 	} else {
-	  kv_committing_to_finalize.insert(
-	      kv_committing_to_finalize.end(),
+	  shard.kv_committing_to_finalize.insert(
+	      shard.kv_committing_to_finalize.end(),
 	      kv_committing.begin(),
 	      kv_committing.end());
 	  kv_committing.clear();
 	}
-	if (deferred_stable_to_finalize.empty()) {
-	  deferred_stable_to_finalize.swap(deferred_stable);
+	if (shard.deferred_stable_to_finalize.empty()) {
+	  shard.deferred_stable_to_finalize.swap(deferred_stable);
 	} else {
-	  deferred_stable_to_finalize.insert(
-	      deferred_stable_to_finalize.end(),
+	  shard.deferred_stable_to_finalize.insert(
+	      shard.deferred_stable_to_finalize.end(),
 	      deferred_stable.begin(),
 	      deferred_stable.end());
 	  deferred_stable.clear();
 	}
-	if (!kv_finalize_in_progress) {
-	  kv_finalize_in_progress = true;
-	  kv_finalize_cond.notify_one();
+	logger->inc(l_bluestore_kv_final_queue_depth,
+		    shard.kv_committing_to_finalize.size());
+	if (!shard.in_progress) {
+	  shard.in_progress = true;
+	  shard.cond.notify_one();
 	}
+      } else {
+	// fan out by sequencer, keeping the commit order within each one
+	for (auto& sp : kv_finalize_shards) {
+	  auto& shard = *sp;
+	  bool queued = false;
+	  std::unique_lock m{shard.lock};
+	  for (auto txc : kv_committing) {
+	    if (&_get_kv_finalize_shard(txc->osr.get()) == &shard) {
+	      shard.kv_committing_to_finalize.push_back(txc);
+	      queued = true;
+	    }
+	  }
+	  for (auto b : deferred_stable) {
+	    if (&_get_kv_finalize_shard(b->osr) == &shard) {
+	      shard.deferred_stable_to_finalize.push_back(b);
+	      queued = true;
+	    }
+	  }
+	  if (queued) {
+	    logger->inc(l_bluestore_kv_final_queue_depth,
+			shard.kv_committing_to_finalize.size());
+	    if (!shard.in_progress) {
+	      shard.in_progress = true;
+	      shard.cond.notify_one();
+	    }
+	  }
+	}
+	kv_committing.clear();
+	deferred_stable.clear();
       }
 
       if (new_nid_max) {
@@ -14399,6 +15774,11 @@ void BlueStore::_kv_sync_thread()
 	  l_bluestore_kv_sync_lat,
 	  dur,
 	  cct->_conf->bluestore_log_op_age);
+	if (committing_size) {
+	  _ewma_update(kv_commit_ewma_us,
+	    std::chrono::duration_cast<std::chrono::microseconds>(dur_kv).count());
+	}
+	_adapt_prefer_deferred_size(finish);
       }
 
       l.lock();
@@ -14411,34 +15791,37 @@ void BlueStore::_kv_sync_thread()
   kv_sync_started = false;
 }
 
-void BlueStore::_kv_finalize_thread()
+void BlueStore::_kv_finalize_thread(KVFinalizeShard& shard)
 {
   deque<TransContext*> kv_committed;
   deque<DeferredBatch*> deferred_stable;
-  dout(10) << __func__ << " start" << dendl;
-  std::unique_lock l(kv_finalize_lock);
-  ceph_assert(!kv_finalize_started);
-  kv_finalize_started = true;
-  kv_finalize_cond.notify_all();
+  dout(10) << __func__ << " " << shard.id << " start" << dendl;
+  std::unique_lock l(shard.lock);
+  ceph_assert(!shard.started);
+  shard.started = true;
+  shard.cond.notify_all();
   while (true) {
     ceph_assert(kv_committed.empty());
     ceph_assert(deferred_stable.empty());
-    if (kv_committing_to_finalize.empty() &&
-	deferred_stable_to_finalize.empty()) {
-      if (kv_finalize_stop)
+    if (shard.kv_committing_to_finalize.empty() &&
+	shard.deferred_stable_to_finalize.empty()) {
+      if (shard.stop)
 	break;
-      dout(20) << __func__ << " sleep" << dendl;
-      kv_finalize_in_progress = false;
-      kv_finalize_cond.wait(l);
-      dout(20) << __func__ << " wake" << dendl;
+      dout(20) << __func__ << " " << shard.id << " sleep" << dendl;
+      shard.in_progress = false;
+      shard.cond.wait(l);
+      dout(20) << __func__ << " " << shard.id << " wake" << dendl;
     } else {
-      kv_committed.swap(kv_committing_to_finalize);
-      deferred_stable.swap(deferred_stable_to_finalize);
+      kv_committed.swap(shard.kv_committing_to_finalize);
+      deferred_stable.swap(shard.deferred_stable_to_finalize);
       l.unlock();
-      dout(20) << __func__ << " kv_committed " << kv_committed << dendl;
-      dout(20) << __func__ << " deferred_stable " << deferred_stable << dendl;
+      dout(20) << __func__ << " " << shard.id
+	       << " kv_committed " << kv_committed << dendl;
+      dout(20) << __func__ << " " << shard.id
+	       << " deferred_stable " << deferred_stable << dendl;
 
       auto start = mono_clock::now();
+      logger->inc(l_bluestore_kv_final_batch_txc, kv_committed.size());
 
       while (!kv_committed.empty()) {
 	TransContext *txc = kv_committed.front();
@@ -14478,8 +15861,8 @@ void BlueStore::_kv_finalize_thread()
       l.lock();
     }
   }
-  dout(10) << __func__ << " finish" << dendl;
-  kv_finalize_started = false;
+  dout(10) << __func__ << " " << shard.id << " finish" << dendl;
+  shard.started = false;
 }
 
 
@@ -14873,35 +16256,15 @@ int BlueStore::queue_transactions(
 
 #ifdef WITH_BLKIN
   if (txc->trace) {
-    txc->trace.event("txc encode finished");
-  }
-#endif
-
-  if (handle)
-    handle->suspend_tp_timeout();
-
-  auto tstart = mono_clock::now();
-
-  if (!throttle.try_start_transaction(
-	*db,
-	*txc,
-	tstart)) {
-    // ensure we do not block here because of deferred writes
-    dout(10) << __func__ << " failed get throttle_deferred_bytes, aggressive"
-	     << dendl;
-    ++deferred_aggressive;
-    deferred_try_submit();
-    {
-      // wake up any previously finished deferred events
-      std::lock_guard l(kv_lock);
-      if (!kv_sync_in_progress) {
-	kv_sync_in_progress = true;
-	kv_cond.notify_one();
-      }
-    }
-    throttle.finish_start_transaction(*db, *txc, tstart);
-    --deferred_aggressive;
+    txc->trace.event("txc encode finished");
   }
+#endif
+
+  if (handle)
+    handle->suspend_tp_timeout();
+
+  auto tstart = mono_clock::now();
+  _txc_throttle(txc, tstart);
   auto tend = mono_clock::now();
 
   if (handle)
@@ -14941,6 +16304,90 @@ int BlueStore::queue_transactions(
   return 0;
 }
 
+void BlueStore::_txc_throttle(TransContext *txc, mono_clock::time_point tstart)
+{
+  if (!throttle.try_start_transaction(
+	*db,
+	*txc,
+	tstart)) {
+    // ensure we do not block here because of deferred writes
+    dout(10) << __func__ << " failed get throttle_deferred_bytes, aggressive"
+	     << dendl;
+    ++deferred_aggressive;
+    deferred_try_submit();
+    {
+      // wake up any previously finished deferred events
+      std::lock_guard l(kv_lock);
+      if (!kv_sync_in_progress) {
+	kv_sync_in_progress = true;
+	kv_cond.notify_one();
+      }
+    }
+    throttle.finish_start_transaction(*db, *txc, tstart);
+    --deferred_aggressive;
+  }
+}
+
+uint64_t BlueStore::calc_prefer_deferred_size(
+  uint64_t cur, uint64_t min, uint64_t max, uint64_t align,
+  uint64_t aio_us, uint64_t kv_us, double backlog)
+{
+  // Deferring a write costs a kv commit now and a device write later;
+  // writing directly costs a device write now.  Defer more while direct
+  // writes wait much longer than a kv commit, unless the deferred backlog
+  // is already building up; defer less when the kv device is the slow one.
+  uint64_t next = cur;
+  if (backlog > 0.5 || (kv_us > aio_us && aio_us)) {
+    next = cur / 2;
+  } else if (aio_us > kv_us * 2 && backlog < 0.25) {
+    next = std::max(cur * 2, align);
+  }
+  next = p2align(next, align);
+  return std::clamp(next, std::min(min, max), max);
+}
+
+void BlueStore::_adapt_prefer_deferred_size(mono_clock::time_point now)
+{
+  if (!cct->_conf->bluestore_prefer_deferred_adaptive ||
+      now - last_deferred_adapt < std::chrono::milliseconds(100)) {
+    return;
+  }
+  last_deferred_adapt = now;
+
+  // While (nearly) everything is deferred, direct write latency is not
+  // sampled and would pin the threshold at whatever it last said; let
+  // it decay so that the threshold drops and direct writes get measured
+  // again.
+  uint64_t samples = aio_wait_samples.load(std::memory_order_relaxed);
+  if (samples != last_aio_wait_samples) {
+    last_aio_wait_samples = samples;
+    last_aio_wait_sample = now;
+  } else if (now - last_aio_wait_sample >= std::chrono::seconds(1)) {
+    last_aio_wait_sample = now;
+    aio_wait_ewma_us = aio_wait_ewma_us / 2;
+  }
+
+  uint64_t aio_us = aio_wait_ewma_us;
+  uint64_t kv_us = kv_commit_ewma_us;
+  double backlog = throttle.get_deferred_utilization();
+  uint64_t cur = prefer_deferred_size;
+  // never below min_alloc_size: smaller writes into allocated units are
+  // deferred anyway, and 0 would switch deferred writes off for good
+  uint64_t next = calc_prefer_deferred_size(
+    cur, min_alloc_size, prefer_deferred_size_conf, block_size,
+    aio_us, kv_us, backlog);
+  if (next == cur) {
+    return;
+  }
+  dout(10) << __func__ << " 0x" << std::hex << cur << " -> 0x" << next
+	   << std::dec << " aio_wait " << aio_us << "us kv_commit " << kv_us
+	   << "us deferred backlog " << backlog << dendl;
+  prefer_deferred_size = next;
+  logger->set(l_bluestore_prefer_deferred_size, next);
+  logger->inc(next > cur ? l_bluestore_prefer_deferred_size_raised :
+			   l_bluestore_prefer_deferred_size_lowered);
+}
+
 void BlueStore::_txc_aio_submit(TransContext *txc)
 {
   dout(10) << __func__ << " txc " << txc << dendl;
@@ -16304,6 +17751,17 @@ int BlueStore::_do_alloc_write(
   prealloc_left = alloc->allocate(
     need, min_alloc_size, need,
     0, &prealloc);
+  if ((prealloc_left < 0 || prealloc_left < (int64_t)need) &&
+      _release_queued_discards()) {
+    // some of the space was only waiting for its discard
+    if (prealloc.size()) {
+      alloc->release(prealloc);
+      prealloc.clear();
+    }
+    prealloc_left = alloc->allocate(
+      need, min_alloc_size, need,
+      0, &prealloc);
+  }
   log_latency("allocator@_do_alloc_write",
     l_bluestore_allocator_lat,
     mono_clock::now() - start,
@@ -16588,7 +18046,8 @@ void BlueStore::_choose_write_options(
    CollectionRef& c,
    OnodeRef& o,
    uint32_t fadvise_flags,
-   WriteContext *wctx)
+   WriteContext *wctx,
+   bool allow_compress)
 {
   if (fadvise_flags & CEPH_OSD_OP_FLAG_FADVISE_WILLNEED) {
     dout(20) << __func__ << " will do buffered write" << dendl;
@@ -16618,7 +18077,7 @@ void BlueStore::_choose_write_options(
     }
   );
 
-  wctx->compress = (cm != Compressor::COMP_NONE) &&
+  wctx->compress = allow_compress && (cm != Compressor::COMP_NONE) &&
     ((cm == Compressor::COMP_FORCE) ||
      (cm == Compressor::COMP_AGGRESSIVE &&
       (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE) == 0) ||
@@ -16751,7 +18210,8 @@ int BlueStore::_do_write(
   uint64_t offset,
   uint64_t length,
   bufferlist& bl,
-  uint32_t fadvise_flags)
+  uint32_t fadvise_flags,
+  bool allow_compress)
 {
   int r = 0;
 
@@ -16781,7 +18241,7 @@ int BlueStore::_do_write(
   auto dirty_end = end;
 
   WriteContext wctx;
-  _choose_write_options(c, o, fadvise_flags, &wctx);
+  _choose_write_options(c, o, fadvise_flags, &wctx, allow_compress);
   o->extent_map.fault_range(db, offset, length);
   _do_write_data(txc, c, o, offset, length, bl, &wctx);
   r = _do_alloc_write(txc, c, o, &wctx);
@@ -18332,6 +19792,23 @@ void BlueStore::_log_alerts(osd_alert_list_t& alerts)
       "BLUESTORE_NO_PER_POOL_OMAP",
       no_per_pool_omap_alert);
   }
+  string tail_latency;
+  _for_each_bdev([&](const char* name, BlockDevice* b) {
+    string s;
+    if (b->check_io_latency_outliers(&s)) {
+      if (!tail_latency.empty()) {
+	tail_latency += "; ";
+      }
+      tail_latency += name;
+      tail_latency += ": ";
+      tail_latency += s;
+    }
+  });
+  if (!tail_latency.empty()) {
+    alerts.emplace(
+      "BLOCK_DEVICE_TAIL_LATENCY",
+      "tail latency drifted on " + tail_latency);
+  }
   string s0(failed_cmode);
 
   if (!failed_compressors.empty()) {
@@ -18354,6 +19831,55 @@ void BlueStore::_log_alerts(osd_alert_list_t& alerts)
   }
 }
 
+void BlueStore::_for_each_bdev(
+  std::function<void(const char*, BlockDevice*)> fn)
+{
+  if (bdev) {
+    fn("block", bdev);
+  }
+  if (bluefs) {
+    // the shared device is a separate BlockDevice instance in BlueFS
+    static const char* names[] = {"bluefs.wal", "bluefs.db", "bluefs.slow"};
+    for (unsigned id : {BlueFS::BDEV_WAL, BlueFS::BDEV_DB, BlueFS::BDEV_SLOW}) {
+      if (auto b = bluefs->get_block_device(id); b) {
+	fn(names[id], b);
+      }
+    }
+  }
+}
+
+uint64_t BlueStore::_get_discard_queued_bytes()
+{
+  uint64_t r = bdev->get_discard_queued_bytes();
+  if (bluefs && bluefs_layout.shared_bdev == BlueFS::BDEV_SLOW) {
+    if (auto b = bluefs->get_block_device(BlueFS::BDEV_SLOW); b) {
+      r += b->get_discard_queued_bytes();
+    }
+  }
+  return r;
+}
+
+uint64_t BlueStore::_release_queued_discards()
+{
+  uint64_t r = bdev->release_queued_discards();
+  if (bluefs && bluefs_layout.shared_bdev == BlueFS::BDEV_SLOW) {
+    if (auto b = bluefs->get_block_device(BlueFS::BDEV_SLOW); b) {
+      r += b->release_queued_discards();
+    }
+  }
+  dout(10) << __func__ << " 0x" << std::hex << r << std::dec << dendl;
+  return r;
+}
+
+void BlueStore::_dump_bdev_latency(Formatter* f)
+{
+  _for_each_bdev([&](const char* name, BlockDevice* b) {
+    f->open_object_section(name);
+    b->dump_io_latency(f);
+    f->close_section();
+  });
+}
+
 void BlueStore::_collect_allocation_stats(uint64_t need, uint32_t alloc_size,
                                           const PExtentVector& extents)
 {
@@ -19178,10 +20704,28 @@ int BlueStore::store_allocator(Allocator* src_allocator)
   }
 
   // store all extents (except for the bluefs extents we removed) in a single flat file
-  utime_t                 timestamp = ceph_clock_now();
-  uint32_t                crc       = -1;
+  ret = write_allocator_image(p_handle, allocator.get(), ceph_clock_now(), s_serial);
+  bluefs->close_writer(p_handle);
+  if (ret != 0) {
+    return -1;
+  }
+
+  utime_t duration = ceph_clock_now() - start_time;
+  dout(5) <<"WRITE-duration=" << duration << " seconds, serial=" << s_serial << dendl;
+  need_to_destage_allocation_file = false;
+  return 0;
+}
+
+// write header, checksummed extent chunks and trailer of an allocator image
+// to an open bluefs file and make it durable
+//-----------------------------------------------------------------------------------
+int BlueStore::write_allocator_image(BlueFS::FileWriter *p_handle, Allocator* allocator,
+				     utime_t timestamp, uint32_t serial)
+{
+  int      ret = 0;
+  uint32_t crc = -1;
   {
-    allocator_image_header  header(timestamp, s_format_version, s_serial);
+    allocator_image_header  header(timestamp, s_format_version, serial);
     bufferlist              header_bl;
     encode(header, header_bl);
     crc = header_bl.crc32c(crc);
@@ -19218,7 +20762,6 @@ int BlueStore::store_allocator(Allocator* src_allocator)
     derr << "Illegal extent, fail store operation" << dendl;
     derr << "invalidate using bluefs->truncate(p_handle, 0)" << dendl;
     bluefs->truncate(p_handle, 0);
-    bluefs->close_writer(p_handle);
     return -1;
   }
 
@@ -19228,7 +20771,7 @@ int BlueStore::store_allocator(Allocator* src_allocator)
   }
 
   {
-    allocator_image_trailer trailer(timestamp, s_format_version, s_serial, extent_count, allocation_size);
+    allocator_image_trailer trailer(timestamp, s_format_version, serial, extent_count, allocation_size);
     bufferlist trailer_bl;
     encode(trailer, trailer_bl);
     uint32_t crc = -1;
@@ -19241,12 +20784,8 @@ int BlueStore::store_allocator(Allocator* src_allocator)
   bluefs->truncate(p_handle, p_handle->pos);
   bluefs->fsync(p_handle);
 
-  utime_t duration = ceph_clock_now() - start_time;
-  dout(5) <<"WRITE-extent_count=" << extent_count << ", allocation_size=" << allocation_size << ", serial=" << s_serial << dendl;
-  dout(5) <<"p_handle->pos=" << p_handle->pos << " WRITE-duration=" << duration << " seconds" << dendl;
-
-  bluefs->close_writer(p_handle);
-  need_to_destage_allocation_file = false;
+  dout(5) <<"WRITE-extent_count=" << extent_count << ", allocation_size=" << allocation_size << ", serial=" << serial << dendl;
+  dout(5) <<"p_handle->pos=" << p_handle->pos << dendl;
   return 0;
 }
 
@@ -19295,19 +20834,13 @@ int calc_allocator_image_trailer_size()
 }
 
 //-----------------------------------------------------------------------------------
-int BlueStore::__restore_allocator(Allocator* allocator, uint64_t *num, uint64_t *bytes)
+int BlueStore::__restore_allocator(Allocator* allocator, const std::string& file,
+				   uint64_t *num, uint64_t *bytes,
+				   uint32_t *p_serial, utime_t *p_timestamp)
 {
-  if (cct->_conf->bluestore_debug_inject_allocation_from_file_failure > 0) {
-     boost::mt11213b rng(time(NULL));
-    boost::uniform_real<> ur(0, 1);
-    if (ur(rng) < cct->_conf->bluestore_debug_inject_allocation_from_file_failure) {
-      derr << __func__ << " failure injected." << dendl;
-      return -1;
-    }
-  }
   utime_t start_time = ceph_clock_now();
   BlueFS::FileReader *p_temp_handle = nullptr;
-  int ret = bluefs->open_for_read(allocator_dir, allocator_file, &p_temp_handle, false);
+  int ret = bluefs->open_for_read(allocator_dir, file, &p_temp_handle, false);
   if (ret != 0) {
     dout(1) << "Failed open_for_read with error-code " << ret << dendl;
     return -1;
@@ -19354,8 +20887,6 @@ int BlueStore::__restore_allocator(Allocator* allocator, uint64_t *num, uint64_t
       return -1;
     }
 
-    // increment version for next store
-    s_serial = header.serial + 1;
   }
 
   // then read the payload (extents list) using a recycled buffer
@@ -19448,18 +20979,35 @@ int BlueStore::__restore_allocator(Allocator* allocator, uint64_t *num, uint64_t
   dout(5) << "READ duration=" << duration << " seconds, s_serial=" << header.serial << dendl;
   *num   = extent_count;
   *bytes = read_alloc_size;
+  if (p_serial) {
+    *p_serial = header.serial;
+  }
+  if (p_timestamp) {
+    *p_timestamp = header.timestamp;
+  }
   return 0;
 }
 
 //-----------------------------------------------------------------------------------
 int BlueStore::restore_allocator(Allocator* dest_allocator, uint64_t *num, uint64_t *bytes)
 {
+  if (cct->_conf->bluestore_debug_inject_allocation_from_file_failure > 0) {
+     boost::mt11213b rng(time(NULL));
+    boost::uniform_real<> ur(0, 1);
+    if (ur(rng) < cct->_conf->bluestore_debug_inject_allocation_from_file_failure) {
+      derr << __func__ << " failure injected." << dendl;
+      return -1;
+    }
+  }
   utime_t    start = ceph_clock_now();
   auto temp_allocator = unique_ptr<Allocator>(create_bitmap_allocator(bdev->get_size()));
-  int ret = __restore_allocator(temp_allocator.get(), num, bytes);
+  uint32_t serial = 0;
+  int ret = __restore_allocator(temp_allocator.get(), allocator_file, num, bytes, &serial);
   if (ret != 0) {
     return ret;
   }
+  // increment version for next store
+  s_serial = serial + 1;
 
   uint64_t num_entries = 0;
   dout(5) << " calling copy_allocator(bitmap_allocator -> shared_alloc.a)" << dendl;
@@ -19469,6 +21017,360 @@ int BlueStore::restore_allocator(Allocator* dest_allocator, uint64_t *num, uint6
   return ret;
 }
 
+//-----------------------------------------------------------------------------------
+// Allocator checkpoints
+//
+// The allocation file above is valid only after a clean umount. To avoid a
+// full onode scan after every unplanned shutdown each transaction that
+// allocates or releases space also logs those extents under
+// PREFIX_ALLOC_DELTA, in its own kv transaction, so a delta is durable iff
+// the change it describes is. The checkpoint thread periodically loads the
+// current image, applies the deltas logged since, writes the result into
+// the other of two image files and then records the new image and trims
+// the folded deltas in a single kv transaction. Restore loads the current
+// image and replays whatever deltas remain.
+// Delta seqs are handed out before the kv submit, not under it, so
+// concurrent submitters can make a later delta visible before an earlier
+// one. The checkpoint thread therefore folds only the contiguous run of
+// deltas and leaves the rest for the next round; restore skips gaps,
+// which after a crash are transactions that never committed.
+// An image holds the same content as the allocation file: space free from
+// BlueStore's point of view, BlueFS extents included; BlueFS marks its own
+// extents when it is mounted.
+static const std::string alloc_ckpt_files[2] = { "ALLOCATOR_NCB_CKPT_0", "ALLOCATOR_NCB_CKPT_1" };
+static const std::string alloc_ckpt_key = "alloc_checkpoint";
+
+struct alloc_checkpoint_t {
+  uint8_t  slot = 0;   // which of alloc_ckpt_files holds the image
+  uint32_t serial = 0; // must match the image header
+  utime_t  timestamp;  // must match the image header
+  uint64_t seq = 0;    // last delta folded into the image
+
+  DENC(alloc_checkpoint_t, v, p) {
+    DENC_START(1, 1, p);
+    denc(v.slot, p);
+    denc(v.serial, p);
+    denc(v.timestamp.tv.tv_sec, p);
+    denc(v.timestamp.tv.tv_nsec, p);
+    denc(v.seq, p);
+    DENC_FINISH(p);
+  }
+};
+WRITE_CLASS_DENC(alloc_checkpoint_t)
+
+//-----------------------------------------------------------------------------------
+static int read_alloc_checkpoint(KeyValueDB *db, alloc_checkpoint_t *ckpt)
+{
+  bufferlist bl;
+  int ret = db->get(PREFIX_SUPER, alloc_ckpt_key, &bl);
+  if (ret < 0) {
+    return ret;
+  }
+  try {
+    auto p = bl.cbegin();
+    decode(*ckpt, p);
+  } catch (ceph::buffer::error& e) {
+    return -EIO;
+  }
+  return 0;
+}
+
+static void encode_alloc_delta(const interval_set<uint64_t>& allocated,
+			       const interval_set<uint64_t>& released,
+			       bufferlist *bl)
+{
+  encode(allocated, *bl);
+  encode(released, *bl);
+  uint32_t crc = bl->crc32c(-1);
+  encode(crc, *bl);
+}
+
+// called right before txc->t is submitted
+//-----------------------------------------------------------------------------------
+void BlueStore::_alloc_ckpt_log_delta(TransContext *txc)
+{
+  // extents allocated and released by the same transaction never show up
+  // in an image
+  interval_set<uint64_t> tmp_allocated, tmp_released;
+  interval_set<uint64_t> *pallocated = &txc->allocated;
+  interval_set<uint64_t> *preleased = &txc->released;
+  if (!txc->allocated.empty() && !txc->released.empty()) {
+    interval_set<uint64_t> overlap;
+    overlap.intersection_of(txc->allocated, txc->released);
+    if (!overlap.empty()) {
+      tmp_allocated = txc->allocated;
+      tmp_allocated.subtract(overlap);
+      tmp_released = txc->released;
+      tmp_released.subtract(overlap);
+      pallocated = &tmp_allocated;
+      preleased = &tmp_released;
+    }
+  }
+  bufferlist bl;
+  encode_alloc_delta(*pallocated, *preleased, &bl);
+  uint64_t seq;
+  {
+    std::lock_guard l(alloc_ckpt_lock);
+    seq = ++alloc_ckpt_seq;
+  }
+  string key;
+  get_alloc_delta_key(seq, &key);
+  txc->t->set(PREFIX_ALLOC_DELTA, key, bl);
+}
+
+// log space freed outside of any transaction, before handing it to the
+// allocator
+//-----------------------------------------------------------------------------------
+int BlueStore::_alloc_ckpt_log_free(uint64_t offset, uint64_t length)
+{
+  if (!alloc_ckpt_enabled) {
+    return 0;
+  }
+  interval_set<uint64_t> allocated, released;
+  released.insert(offset, length);
+  bufferlist bl;
+  encode_alloc_delta(allocated, released, &bl);
+  uint64_t seq;
+  {
+    std::lock_guard l(alloc_ckpt_lock);
+    seq = ++alloc_ckpt_seq;
+  }
+  string key;
+  get_alloc_delta_key(seq, &key);
+  auto t = db->get_transaction();
+  t->set(PREFIX_ALLOC_DELTA, key, bl);
+  return db->submit_transaction_sync(t);
+}
+
+//-----------------------------------------------------------------------------------
+void BlueStore::_alloc_ckpt_capture_base()
+{
+  alloc_ckpt_base.reset();
+  if (cct->_conf->bluestore_allocator_checkpoint_interval == 0) {
+    return;
+  }
+  // BlueFS has not marked its extents in the shared allocator yet, so the
+  // allocator holds exactly what an image describes
+  unique_ptr<Allocator> base(create_bitmap_allocator(bdev->get_size()));
+  uint64_t num_entries = 0;
+  if (!base || copy_allocator(alloc, base.get(), &num_entries) != 0) {
+    derr << "failed to capture allocator, checkpoints disabled" << dendl;
+    return;
+  }
+  dout(5) << "captured " << num_entries << " free extents" << dendl;
+  alloc_ckpt_base = std::move(base);
+}
+
+// forget the current checkpoint: at mount, since one left behind by an
+// earlier mount stops matching as soon as allocations change, and when
+// checkpointing fails
+//-----------------------------------------------------------------------------------
+int BlueStore::_alloc_ckpt_invalidate()
+{
+  // drop the record before deltas stop being logged, never the other way
+  auto t = db->get_transaction();
+  t->rmkey(PREFIX_SUPER, alloc_ckpt_key);
+  t->rmkeys_by_prefix(PREFIX_ALLOC_DELTA);
+  int r = db->submit_transaction_sync(t);
+  alloc_ckpt_enabled = false;
+  std::lock_guard l(alloc_ckpt_lock);
+  alloc_ckpt_seq = 0;
+  return r;
+}
+
+//-----------------------------------------------------------------------------------
+int BlueStore::replay_allocator_deltas(Allocator* allocator, uint64_t after_seq,
+				       bool stop_at_gap,
+				       uint64_t *last_seq, uint64_t *count)
+{
+  *last_seq = after_seq;
+  *count    = 0;
+  string start;
+  get_alloc_delta_key(after_seq + 1, &start);
+  KeyValueDB::Iterator it = db->get_iterator(PREFIX_ALLOC_DELTA, KeyValueDB::ITERATOR_NOCACHE);
+  for (it->lower_bound(start); it->valid(); it->next()) {
+    uint64_t seq;
+    string key = it->key();
+    _key_decode_u64(key.c_str(), &seq);
+    if (seq != *last_seq + 1) {
+      if (stop_at_gap) {
+	// the missing delta may still be in flight
+	dout(10) << "allocation delta " << *last_seq + 1
+		 << " not visible yet, stopping at " << *last_seq << dendl;
+	break;
+      }
+      dout(1) << "skipping allocation deltas " << *last_seq + 1
+	      << ".." << seq - 1 << " that never committed" << dendl;
+    }
+    interval_set<uint64_t> allocated, released;
+    bufferlist bl = it->value();
+    try {
+      auto p = bl.cbegin();
+      decode(allocated, p);
+      decode(released, p);
+      uint32_t crc_calc = -1, crc;
+      crc_calc = bl.cbegin().crc32c(p.get_off(), crc_calc);
+      decode(crc, p);
+      if (crc != crc_calc) {
+	derr << "allocation delta " << seq << " crc mismatch!!! crc=" << crc
+	     << ", crc_calc=" << crc_calc << dendl;
+	return -1;
+      }
+    } catch (ceph::buffer::error& e) {
+      derr << "failed to decode allocation delta " << seq << ": " << e.what() << dendl;
+      return -1;
+    }
+    for (auto p = allocated.begin(); p != allocated.end(); ++p) {
+      allocator->init_rm_free(p.get_start(), p.get_len());
+    }
+    for (auto p = released.begin(); p != released.end(); ++p) {
+      allocator->init_add_free(p.get_start(), p.get_len());
+    }
+    *last_seq = seq;
+    (*count)++;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------------
+int BlueStore::restore_allocator_from_checkpoint(Allocator* dest_allocator, uint64_t *num, uint64_t *bytes)
+{
+  utime_t            start = ceph_clock_now();
+  alloc_checkpoint_t ckpt;
+  int ret = read_alloc_checkpoint(db, &ckpt);
+  if (ret < 0) {
+    dout(1) << "no allocator checkpoint, ret=" << ret << dendl;
+    return -1;
+  }
+
+  auto temp_allocator = unique_ptr<Allocator>(create_bitmap_allocator(bdev->get_size()));
+  if (!temp_allocator) {
+    return -1;
+  }
+  uint32_t serial = 0;
+  utime_t  timestamp;
+  ret = __restore_allocator(temp_allocator.get(), alloc_ckpt_files[ckpt.slot],
+			    num, bytes, &serial, &timestamp);
+  if (ret != 0) {
+    return ret;
+  }
+  if (serial != ckpt.serial || timestamp != ckpt.timestamp) {
+    derr << "checkpoint image " << alloc_ckpt_files[ckpt.slot] << " serial=" << serial
+	 << " doesn't match record serial=" << ckpt.serial << dendl;
+    return -1;
+  }
+
+  uint64_t last_seq = 0, count = 0;
+  ret = replay_allocator_deltas(temp_allocator.get(), ckpt.seq, false,
+				&last_seq, &count);
+  if (ret != 0) {
+    return ret;
+  }
+
+  uint64_t num_entries = 0;
+  copy_allocator(temp_allocator.get(), dest_allocator, &num_entries);
+  *num   = num_entries;
+  *bytes = temp_allocator->get_free();
+  utime_t duration = ceph_clock_now() - start;
+  dout(1) << "restored checkpoint serial=" << ckpt.serial << " seq=" << ckpt.seq
+	  << " plus " << count << " deltas in " << duration << " seconds" << dendl;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------------
+int BlueStore::_alloc_checkpoint()
+{
+  auto start = mono_clock::now();
+  alloc_checkpoint_t ckpt;
+  unique_ptr<Allocator> image;
+  bool first = false;
+  if (alloc_ckpt_base) {
+    // nothing has been persisted for this mount yet
+    image = std::move(alloc_ckpt_base);
+    first = true;
+  } else {
+    int ret = read_alloc_checkpoint(db, &ckpt);
+    if (ret < 0) {
+      derr << "failed to read checkpoint record, ret=" << ret << dendl;
+      return ret;
+    }
+    image.reset(create_bitmap_allocator(bdev->get_size()));
+    if (!image) {
+      return -ENOMEM;
+    }
+    uint64_t num = 0, bytes = 0;
+    uint32_t serial = 0;
+    utime_t  timestamp;
+    ret = __restore_allocator(image.get(), alloc_ckpt_files[ckpt.slot],
+			      &num, &bytes, &serial, &timestamp);
+    if (ret != 0 || serial != ckpt.serial || timestamp != ckpt.timestamp) {
+      derr << "failed to load checkpoint image " << alloc_ckpt_files[ckpt.slot] << dendl;
+      return -EIO;
+    }
+  }
+
+  uint64_t last_seq = 0, count = 0;
+  int ret = replay_allocator_deltas(image.get(), ckpt.seq, true,
+				    &last_seq, &count);
+  if (ret != 0) {
+    return -EIO;
+  }
+  if (!first && count == 0) {
+    dout(10) << "no new deltas since seq=" << ckpt.seq << dendl;
+    return 0;
+  }
+
+  alloc_checkpoint_t next;
+  next.slot      = ckpt.slot ^ 1;
+  next.serial    = ckpt.serial + 1;
+  next.timestamp = ceph_clock_now();
+  next.seq       = last_seq;
+  const std::string& file = alloc_ckpt_files[next.slot];
+
+  if (!bluefs->dir_exists(allocator_dir)) {
+    ret = bluefs->mkdir(allocator_dir);
+    if (ret != 0) {
+      derr << "Failed mkdir with error-code " << ret << dendl;
+      return ret;
+    }
+  }
+  bool overwrite_file = bluefs->stat(allocator_dir, file, nullptr, nullptr) == 0;
+  BlueFS::FileWriter *p_handle = nullptr;
+  ret = bluefs->open_for_write(allocator_dir, file, &p_handle, overwrite_file);
+  if (ret != 0) {
+    derr << "Failed open_for_write with error-code " << ret << dendl;
+    return ret;
+  }
+  ret = write_allocator_image(p_handle, image.get(), next.timestamp, next.serial);
+  bluefs->close_writer(p_handle);
+  if (ret != 0) {
+    return -EIO;
+  }
+
+  // switch to the new image and drop the deltas it covers; the sync submit
+  // also makes every folded delta durable
+  auto t = db->get_transaction();
+  bufferlist bl;
+  encode(next, bl);
+  t->set(PREFIX_SUPER, alloc_ckpt_key, bl);
+  string end;
+  get_alloc_delta_key(last_seq + 1, &end);
+  t->rm_range_keys(PREFIX_ALLOC_DELTA, string(), end);
+  ret = db->submit_transaction_sync(t);
+  if (ret != 0) {
+    derr << "failed to record checkpoint, ret=" << ret << dendl;
+    return ret;
+  }
+
+  auto lat = mono_clock::now() - start;
+  logger->tinc(l_bluestore_alloc_checkpoint_lat, lat);
+  logger->inc(l_bluestore_alloc_checkpoint_deltas, count);
+  dout(5) << "checkpoint serial=" << next.serial << " seq=" << next.seq
+	  << " folded " << count << " deltas into " << file
+	  << " in " << ceph::to_seconds<double>(lat) << " seconds" << dendl;
+  return 0;
+}
+
 //-----------------------------------------------------------------------------------
 void BlueStore::set_allocation_in_simple_bmap(SimpleBitmap* sbmap, uint64_t offset, uint64_t length)
 {
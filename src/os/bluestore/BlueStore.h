@@ -112,6 +112,7 @@ enum {
   l_bluestore_csum_lat,
   l_bluestore_read_eio,
   l_bluestore_reads_with_retries,
+  l_bluestore_read_crc_primed_bytes,
   l_bluestore_read_lat,
   //****************************************
 
@@ -121,6 +122,9 @@ enum {
   l_bluestore_kv_commit_lat,
   l_bluestore_kv_sync_lat,
   l_bluestore_kv_final_lat,
+  l_bluestore_kv_sync_batch_txc,
+  l_bluestore_kv_final_batch_txc,
+  l_bluestore_kv_final_queue_depth,
   //****************************************
 
   // write op stats
@@ -143,6 +147,9 @@ enum {
   l_bluestore_issued_deferred_write_bytes,
   l_bluestore_submitted_deferred_writes,
   l_bluestore_submitted_deferred_write_bytes,
+  l_bluestore_prefer_deferred_size,
+  l_bluestore_prefer_deferred_size_raised,
+  l_bluestore_prefer_deferred_size_lowered,
 
   l_bluestore_write_big_skipped_blobs,
   l_bluestore_write_big_skipped_bytes,
@@ -167,8 +174,18 @@ enum {
   l_bluestore_pinned_onodes,
   l_bluestore_onode_hits,
   l_bluestore_onode_misses,
+  l_bluestore_onode_ghost_hits,
   l_bluestore_onode_shard_hits,
   l_bluestore_onode_shard_misses,
+  l_bluestore_onode_prefetch,
+  l_bluestore_onode_prefetch_hits,
+  l_bluestore_onode_prefetch_waste,
+  l_bluestore_onode_shard_prefetch,
+  l_bluestore_onode_shard_prefetch_hits,
+  l_bluestore_onode_shard_prefetch_waste,
+  l_bluestore_defrag_objects,
+  l_bluestore_defrag_bytes,
+  l_bluestore_defrag_blob_reduction,
   l_bluestore_extents,
   l_bluestore_blobs,
   //****************************************
@@ -219,6 +236,8 @@ enum {
   //****************************************
   l_bluestore_allocate_hist,
   l_bluestore_allocator_lat,
+  l_bluestore_alloc_checkpoint_lat,
+  l_bluestore_alloc_checkpoint_deltas,
   //****************************************
 
   // slow op counter
@@ -962,6 +981,7 @@ public:
       unsigned extents = 0;  ///< count extents in this shard
       bool loaded = false;   ///< true if shard is loaded
       bool dirty = false;    ///< true if shard is dirty and needs reencoding
+      bool prefetched = false; ///< loaded ahead of use and not touched since
     };
 
     mempool::bluestore_cache_meta::vector<Shard> shards;    ///< shards
@@ -970,6 +990,16 @@ public:
 
     uint32_t needs_reshard_begin = 0;
     uint32_t needs_reshard_end = 0;
+    uint32_t fault_next = 0;  ///< end of the last faulted range
+
+    /// number of prefetched shards that were never used
+    unsigned count_unused_prefetch() const {
+      unsigned n = 0;
+      for (auto& s : shards) {
+        n += s.prefetched;
+      }
+      return n;
+    }
 
     void scan_shared_blobs(uint64_t start, uint64_t length,
 			   std::multimap<uint64_t /*blob_start*/, Blob*>& candidates);
@@ -1327,6 +1357,8 @@ public:
     bool cached;              ///< Onode is logically in the cache
                               /// (it can be pinned and hence physically out
                               /// of it at the moment though)
+    uint16_t cache_private = 0; ///< opaque (to us) value used by Cache impl
+    std::atomic_bool prefetched = {false}; ///< loaded ahead of any lookup
     ExtentMap extent_map;
 
     // track txc's that have not been committed to kv store (and whose
@@ -1598,6 +1630,7 @@ private:
     friend struct Collection; // for split_cache()
     friend struct Onode; // for put()
     friend struct LruOnodeCacheShard;
+    friend struct TwoQOnodeCacheShard;
     void _remove(const ghobject_t& oid);
   public:
     OnodeSpace(OnodeCacheShard *c) : cache(c) {}
@@ -1606,6 +1639,10 @@ private:
     }
 
     OnodeRef add_onode(const ghobject_t& oid, OnodeRef& o);
+    /// add o only if oid is not cached and seq still reads expected
+    bool add_onode_if_unchanged(const ghobject_t& oid, OnodeRef& o,
+				const std::atomic<uint64_t>& seq,
+				uint64_t expected);
     OnodeRef lookup(const ghobject_t& o);
     void rename(OnodeRef& o, const ghobject_t& old_oid,
 		const ghobject_t& new_oid,
@@ -1648,6 +1685,16 @@ private:
     }
     OnodeRef get_onode(const ghobject_t& oid, bool create, bool is_createop=false);
 
+    // onode readahead state; protected by prefetch_lock since get_onode()
+    // may run concurrently under the shared collection lock
+    ceph::mutex prefetch_lock =
+      ceph::make_mutex("BlueStore::Collection::prefetch_lock");
+    std::string prefetch_last_key;  ///< key of the last onode miss
+    unsigned prefetch_run = 0;      ///< ascending misses in a row
+    /// bumped as txcs touching our onodes are submitted to the kv store
+    std::atomic<uint64_t> onode_submit_seq = {0};
+    void maybe_prefetch_onodes(const std::string& key);
+
     // the terminology is confusing here, sorry!
     //
     //  blob_t     shared_blob_t
@@ -2067,6 +2114,11 @@ private:
     bool should_submit_deferred() {
       return throttle_deferred_bytes.past_midpoint();
     }
+    /// fraction of the deferred throttle in use
+    double get_deferred_utilization() const {
+      auto max = throttle_deferred_bytes.get_max();
+      return max ? (double)throttle_deferred_bytes.get_current() / max : 0;
+    }
     void reset_throttle(const ConfigProxy &conf) {
       throttle_bytes.reset_max(conf->bluestore_throttle_bytes);
       throttle_deferred_bytes.reset_max(
@@ -2157,6 +2209,17 @@ private:
       txc->seq = ++last_seq;
       q.push_back(*txc);
     }
+    /// queue txc only if nothing else is in flight.  Used by internal
+    /// writers (defrag) that are not serialized with the OSD's submits.
+    bool queue_new_if_idle(TransContext *txc) {
+      std::lock_guard l(qlock);
+      if (!q.empty()) {
+	return false;
+      }
+      txc->seq = ++last_seq;
+      q.push_back(*txc);
+      return true;
+    }
     void undo_queue(TransContext* txc) {
       std::lock_guard l(qlock);
       ceph_assert(&q.back() == txc);
@@ -2264,14 +2327,32 @@ private:
       return NULL;
     }
   };
+  struct KVFinalizeShard;
   struct KVFinalizeThread : public Thread {
     BlueStore *store;
-    explicit KVFinalizeThread(BlueStore *s) : store(s) {}
+    KVFinalizeShard *shard;
+    KVFinalizeThread(BlueStore *s, KVFinalizeShard *sh) : store(s), shard(sh) {}
     void *entry() override {
-      store->_kv_finalize_thread();
+      store->_kv_finalize_thread(*shard);
       return NULL;
     }
   };
+  /// committed txcs and stable deferred batches of a subset of the
+  /// sequencers, finalized by a dedicated thread.  a sequencer always maps
+  /// to the same shard so per-sequencer ordering is preserved.
+  struct KVFinalizeShard {
+    const unsigned id;
+    KVFinalizeThread thread;
+    ceph::mutex lock = ceph::make_mutex("BlueStore::kv_finalize_lock");
+    ceph::condition_variable cond;
+    std::deque<TransContext*> kv_committing_to_finalize;   ///< pending finalization
+    std::deque<DeferredBatch*> deferred_stable_to_finalize; ///< pending finalization
+    bool in_progress = false;
+    bool started = false;
+    bool stop = false;
+
+    KVFinalizeShard(BlueStore *s, unsigned i) : id(i), thread(s, this) {}
+  };
 
   struct BigDeferredWriteContext {
     uint64_t off = 0;     // original logical offset
@@ -2354,29 +2435,26 @@ private:
   bool _kv_only = false;
   bool kv_sync_started = false;
   bool kv_stop = false;
-  bool kv_finalize_started = false;
-  bool kv_finalize_stop = false;
   std::deque<TransContext*> kv_queue;             ///< ready, already submitted
   std::deque<TransContext*> kv_queue_unsubmitted; ///< ready, need submit by kv thread
   std::deque<TransContext*> kv_committing;        ///< currently syncing
   std::deque<DeferredBatch*> deferred_done_queue;   ///< deferred ios done
   bool kv_sync_in_progress = false;
 
-  KVFinalizeThread kv_finalize_thread;
-  ceph::mutex kv_finalize_lock = ceph::make_mutex("BlueStore::kv_finalize_lock");
-  ceph::condition_variable kv_finalize_cond;
-  std::deque<TransContext*> kv_committing_to_finalize;   ///< pending finalization
-  std::deque<DeferredBatch*> deferred_stable_to_finalize; ///< pending finalization
-  bool kv_finalize_in_progress = false;
+  std::vector<std::unique_ptr<KVFinalizeShard>> kv_finalize_shards;
 
   PerfCounters *logger = nullptr;
 
+  ceph::mutex removed_collections_lock =
+    ceph::make_mutex("BlueStore::removed_collections_lock");
   std::list<CollectionRef> removed_collections;
 
   ceph::shared_mutex debug_read_error_lock =
     ceph::make_shared_mutex("BlueStore::debug_read_error_lock");
   std::set<ghobject_t> debug_data_error_objects;
   std::set<ghobject_t> debug_mdata_error_objects;
+  /// see set_debug_kv_finalize_hook()
+  std::function<void(const coll_t&, uint64_t)> debug_kv_finalize_hook;
 
   std::atomic<int> csum_type = {Checksummer::CSUM_CRC32C};
 
@@ -2408,6 +2486,17 @@ private:
 
   ///< size threshold for forced deferred writes
   std::atomic<uint64_t> prefer_deferred_size = {0};
+  ///< configured prefer_deferred_size, the upper bound when it adapts
+  std::atomic<uint64_t> prefer_deferred_size_conf = {0};
+
+  // live measurements driving the adaptive prefer_deferred_size
+  std::atomic<uint64_t> aio_wait_ewma_us = {0};   ///< direct write latency
+  std::atomic<uint64_t> aio_wait_samples = {0};
+  std::atomic<uint64_t> kv_commit_ewma_us = {0};  ///< kv (WAL) commit latency
+  // kv_sync_thread only
+  ceph::mono_clock::time_point last_deferred_adapt;
+  ceph::mono_clock::time_point last_aio_wait_sample;
+  uint64_t last_aio_wait_samples = 0;
 
   ///< approx cost per io, in bytes
   std::atomic<uint64_t> throttle_cost_per_io = {0};
@@ -2429,6 +2518,7 @@ private:
   double cache_kv_ratio = 0;     ///< cache ratio dedicated to kv (e.g., rocksdb)
   double cache_kv_onode_ratio = 0; ///< cache ratio dedicated to kv onodes (e.g., rocksdb onode CF)
   double cache_data_ratio = 0;   ///< cache ratio dedicated to object data
+  double cache_bluefs_ratio = 0; ///< autotune weight of the bluefs block cache
   bool cache_autotune = false;   ///< cache autotune setting
   double cache_age_bin_interval = 0; ///< time to wait between cache age bin rotations
   double cache_autotune_interval = 0; ///< time to wait between cache rebalancing
@@ -2436,6 +2526,7 @@ private:
   std::vector<uint64_t> kv_onode_bins; ///< kv onode autotune bins
   std::vector<uint64_t> meta_bins; ///< meta autotune bins
   std::vector<uint64_t> data_bins; ///< data autotune bins
+  std::vector<uint64_t> bluefs_bins; ///< bluefs block cache autotune bins
   uint64_t osd_memory_target = 0;   ///< OSD memory target when autotuning cache
   uint64_t osd_memory_base = 0;     ///< OSD base memory when autotuning cache
   double osd_memory_expected_fragmentation = 0; ///< expected memory fragmentation
@@ -2660,11 +2751,46 @@ private:
     };
     std::shared_ptr<DataCache> data_cache;
 
+    struct BlueFSCache : public MempoolCache {
+      BlueFSCache(BlueStore *s) : MempoolCache(s) {};
+
+      BlueFSBlockCache* get_block_cache() const {
+        return store->bluefs ? store->bluefs->get_block_cache() : nullptr;
+      }
+      virtual uint32_t get_bin_count() const {
+        auto c = get_block_cache();
+        return c ? c->get_bin_count() : 0;
+      }
+      virtual void set_bin_count(uint32_t count) {
+        if (auto c = get_block_cache(); c) {
+          c->set_bin_count(count);
+        }
+      }
+      virtual uint64_t _get_used_bytes() const {
+        auto c = get_block_cache();
+        return c ? c->get_bytes() : 0;
+      }
+      virtual void shift_bins() {
+        if (auto c = get_block_cache(); c) {
+          c->shift_bins();
+        }
+      }
+      virtual uint64_t _sum_bins(uint32_t start, uint32_t end) const {
+        auto c = get_block_cache();
+        return c ? c->sum_bins(start, end) : 0;
+      }
+      virtual std::string get_cache_name() const {
+        return "BlueFS Block Cache";
+      }
+    };
+    std::shared_ptr<BlueFSCache> bluefs_cache;
+
   public:
     explicit MempoolThread(BlueStore *s)
       : store(s),
         meta_cache(new MetaCache(s)),
-        data_cache(new DataCache(s)) {}
+        data_cache(new DataCache(s)),
+        bluefs_cache(new BlueFSCache(s)) {}
 
     void *entry() override;
     void init() {
@@ -2684,6 +2810,109 @@ private:
     void _resize_shards(bool interval_stats);
   } mempool_thread;
 
+  struct DefragThread : public Thread {
+    BlueStore *store;
+
+    ceph::condition_variable cond;
+    ceph::mutex lock = ceph::make_mutex("BlueStore::DefragThread::lock");
+    bool stop = false;
+    bool active = false;     ///< mounted read/write, may run
+    bool requested = false;  ///< one pass requested via admin socket
+
+    // where the current pass resumes
+    coll_t cursor_cid;
+    ghobject_t cursor_oid;
+    bool in_pass = false;
+
+    // totals since mount
+    uint64_t passes = 0;
+    uint64_t objects_scanned = 0;
+    uint64_t objects_rewritten = 0;
+    uint64_t bytes_rewritten = 0;
+    uint64_t blobs_before = 0;
+    uint64_t blobs_after = 0;
+
+    explicit DefragThread(BlueStore *s) : store(s) {}
+
+    void *entry() override;
+    /// the thread is only started once there is something to do: when
+    /// bluestore_defrag is (or becomes) set, or a pass is requested
+    void _maybe_start() {
+      if (active && !stop && !is_started() &&
+	  (requested || store->cct->_conf->bluestore_defrag)) {
+	create("bstore_defrag");
+      }
+    }
+    void init() {
+      std::lock_guard l(lock);
+      stop = false;
+      active = true;
+      _maybe_start();
+    }
+    void shutdown() {
+      lock.lock();
+      active = false;
+      stop = true;
+      cond.notify_all();
+      lock.unlock();
+      if (is_started()) {
+	join();
+      }
+    }
+    void wakeup() {
+      std::lock_guard l(lock);
+      _maybe_start();
+      cond.notify_all();
+    }
+    void request() {
+      std::lock_guard l(lock);
+      requested = true;
+      _maybe_start();
+      cond.notify_all();
+    }
+    void dump(ceph::Formatter *f);
+  } defrag_thread;
+
+  // NCB allocator checkpoints: every committed transaction logs its
+  // allocated/released extents under PREFIX_ALLOC_DELTA, and this thread
+  // periodically folds them into an allocator image on BlueFS so that an
+  // unplanned shutdown replays only the deltas since the last image
+  // rather than rebuilding the allocation map from every onode.
+  struct AllocCheckpointThread : public Thread {
+    BlueStore *store;
+
+    ceph::condition_variable cond;
+    ceph::mutex lock = ceph::make_mutex("BlueStore::AllocCheckpointThread::lock");
+    bool stop = false;
+
+    explicit AllocCheckpointThread(BlueStore *s) : store(s) {}
+
+    void *entry() override;
+    void init() {
+      stop = false;
+      create("bstore_alloc_ckpt");
+    }
+    void shutdown() {
+      if (!is_started()) {
+	return;
+      }
+      lock.lock();
+      stop = true;
+      cond.notify_all();
+      lock.unlock();
+      join();
+    }
+  } alloc_ckpt_thread;
+
+  std::atomic_bool alloc_ckpt_enabled = {false};
+  ///< protects alloc_ckpt_seq; never held across a kv submit
+  ceph::mutex alloc_ckpt_lock = ceph::make_mutex("BlueStore::alloc_ckpt_lock");
+  uint64_t alloc_ckpt_seq = 0;               ///< last delta seq handed out
+  std::unique_ptr<Allocator> alloc_ckpt_base; ///< image at mount, until the first checkpoint
+
+  class SocketHook;
+  SocketHook* asok_hook = nullptr;
+
 #ifdef WITH_BLKIN
   ZTracer::Endpoint trace_endpoint {"0.0.0.0", 0, "BlueStore"};
 #endif
@@ -2804,14 +3033,22 @@ private:
   void _txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t);
   void _txc_state_proc(TransContext *txc);
   void _txc_aio_submit(TransContext *txc);
+  void _txc_throttle(TransContext *txc, ceph::mono_clock::time_point tstart);
+  void _adapt_prefer_deferred_size(ceph::mono_clock::time_point now);
 public:
   void txc_aio_finish(void *p) {
     _txc_state_proc(static_cast<TransContext*>(p));
   }
+  /// one step of the adaptive prefer_deferred_size, kept within [min, max]
+  static uint64_t calc_prefer_deferred_size(
+    uint64_t cur, uint64_t min, uint64_t max, uint64_t align,
+    uint64_t aio_wait_us, uint64_t kv_commit_us, double deferred_backlog);
 private:
   void _txc_finish_io(TransContext *txc);
   void _txc_finalize_kv(TransContext *txc, KeyValueDB::Transaction t);
   void _txc_apply_kv(TransContext *txc, bool sync_submit_transaction);
+  void _txc_apply_kv_group(const std::vector<TransContext*>& txcs);
+  void _txc_kv_submitted(TransContext *txc);
   void _txc_committed_kv(TransContext *txc);
   void _txc_finish(TransContext *txc);
   void _txc_release_alloc(TransContext *txc);
@@ -2825,7 +3062,11 @@ private:
   void _kv_start();
   void _kv_stop();
   void _kv_sync_thread();
-  void _kv_finalize_thread();
+  void _kv_finalize_thread(KVFinalizeShard& shard);
+  KVFinalizeShard& _get_kv_finalize_shard(const OpSequencer *osr) {
+    return *kv_finalize_shards[osr->get_sequencer_id() %
+			       kv_finalize_shards.size()];
+  }
 
   bluestore_deferred_op_t *_get_deferred_op(TransContext *txc, uint64_t len);
   void _deferred_queue(TransContext *txc);
@@ -2878,6 +3119,28 @@ public:
   };
 
 private:
+  /// live fsck progress, reported by "bluestore fsck status"
+  struct FSCKProgress {
+    std::atomic_bool running = {false};
+    std::atomic<int> depth = {FSCK_REGULAR};
+    std::atomic<uint64_t> objects = {0};          ///< onodes checked
+    std::atomic<uint64_t> deep_read_bytes = {0};  ///< data read and verified
+    std::atomic<ceph::mono_clock::rep> start = {0};
+
+    void reset(FSCKDepth d) {
+      depth = d;
+      objects = 0;
+      deep_read_bytes = 0;
+      start = ceph::mono_clock::now().time_since_epoch().count();
+      running = true;
+    }
+    void dump(ceph::Formatter *f) const;
+  } fsck_progress;
+
+  class FSCKDeepReader;
+  /// read (and so checksum-verify) all of o's data; returns the error count
+  int64_t _fsck_deep_read(Collection *c, OnodeRef& o);
+
   int _fsck_check_extents(
     std::string_view ctx_descr,
     const PExtentVector& extents,
@@ -2921,6 +3184,14 @@ private:
     Collection *c, const ghobject_t& start, const ghobject_t& end,
     int max, bool legacy, std::vector<ghobject_t> *ls, ghobject_t *next);
 
+  /// scan from the defrag cursor, rewriting fragmented objects until
+  /// budget bytes were rewritten; true once the whole store was visited
+  bool _defrag_step(uint64_t budget);
+  /// rewrite oid into fresh blobs if its extent map is too fragmented;
+  /// returns the number of bytes rewritten
+  uint64_t _defrag_onode(CollectionRef& c, const ghobject_t& oid,
+			 uint64_t *blobs_before, uint64_t *blobs_after);
+
   template <typename T, typename F>
   T select_option(const std::string& opt_name, T val1, F f) {
     //NB: opt_name reserved for future use
@@ -3403,6 +3674,13 @@ public:
 			  std::string_view name,
 			  size_t new_size);
 
+  /// called with (cid, txc seq) by the thread finalizing each txc, as its
+  /// kv commit is processed; only set or clear it while the store is idle
+  void set_debug_kv_finalize_hook(
+    std::function<void(const coll_t&, uint64_t)> f) {
+    debug_kv_finalize_hook = std::move(f);
+  }
+
   void compact() override {
     ceph_assert(db);
     db->compact();
@@ -3471,6 +3749,12 @@ private:
   std::string spurious_read_errors_alert;
 
   void _log_alerts(osd_alert_list_t& alerts);
+  void _for_each_bdev(std::function<void(const char*, BlockDevice*)> fn);
+  void _dump_bdev_latency(ceph::Formatter* f);
+  /// freed space of the main device still queued for discard
+  uint64_t _get_discard_queued_bytes();
+  /// give queued discards of the main device back to the allocator
+  uint64_t _release_queued_discards();
   bool _set_compression_alert(bool cmode, const char* s) {
     std::lock_guard l(qlock);
     if (cmode) {
@@ -3507,6 +3791,10 @@ private:
     uint64_t blob_xoffset,
     const ceph::buffer::list& bl,
     uint64_t logical_offset) const;
+  void _prime_read_crc(
+    const bluestore_blob_t& blob,
+    uint64_t blob_xoffset,
+    const ceph::buffer::list& bl);
   int _decompress(ceph::buffer::list& source, ceph::buffer::list* result);
 
 
@@ -3640,7 +3928,8 @@ private:
   void _choose_write_options(CollectionRef& c,
                              OnodeRef& o,
                              uint32_t fadvise_flags,
-                             WriteContext *wctx);
+                             WriteContext *wctx,
+                             bool allow_compress = true);
 
   int _do_gc(TransContext *txc,
              CollectionRef& c,
@@ -3654,7 +3943,8 @@ private:
 		OnodeRef& o,
 		uint64_t offset, uint64_t length,
 		ceph::buffer::list& bl,
-		uint32_t fadvise_flags);
+		uint32_t fadvise_flags,
+		bool allow_compress = true);
   void _do_write_data(TransContext *txc,
                       CollectionRef& c,
                       OnodeRef& o,
@@ -3948,8 +4238,21 @@ private:
   int  copy_allocator(Allocator* src_alloc, Allocator *dest_alloc, uint64_t* p_num_entries);
   int  store_allocator(Allocator* allocator);
   int  invalidate_allocation_file_on_bluefs();
-  int  __restore_allocator(Allocator* allocator, uint64_t *num, uint64_t *bytes);
+  int  write_allocator_image(BlueFS::FileWriter *p_handle, Allocator* allocator,
+			     utime_t timestamp, uint32_t serial);
+  int  __restore_allocator(Allocator* allocator, const std::string& file,
+			   uint64_t *num, uint64_t *bytes,
+			   uint32_t *p_serial = nullptr, utime_t *p_timestamp = nullptr);
   int  restore_allocator(Allocator* allocator, uint64_t *num, uint64_t *bytes);
+  int  restore_allocator_from_checkpoint(Allocator* allocator, uint64_t *num, uint64_t *bytes);
+  int  replay_allocator_deltas(Allocator* allocator, uint64_t after_seq,
+			       bool stop_at_gap,
+			       uint64_t *last_seq, uint64_t *count);
+  void _alloc_ckpt_log_delta(TransContext *txc);
+  int  _alloc_ckpt_log_free(uint64_t offset, uint64_t length);
+  void _alloc_ckpt_capture_base();
+  int  _alloc_ckpt_invalidate();
+  int  _alloc_checkpoint();
   int  read_allocation_from_drive_on_startup();
   int  reconstruct_allocations(SimpleBitmap *smbmp, read_alloc_stats_t &stats);
   int  read_allocation_from_onodes(SimpleBitmap *smbmp, read_alloc_stats_t& stats);
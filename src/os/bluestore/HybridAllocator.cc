@@ -31,6 +31,8 @@ int64_t HybridAllocator::allocate(
   ceph_assert(std::has_single_bit(unit));
   ceph_assert(want % unit == 0);
 
+  const uint64_t orig_max_alloc_size = max_alloc_size;
+  const size_t first = extents->size();
   if (max_alloc_size == 0) {
     max_alloc_size = want;
   }
@@ -87,7 +89,9 @@ int64_t HybridAllocator::allocate(
       ceph_assert(orig_size == extents->size());
     }
   }
-  return res ? res : -ENOSPC;
+  res = res ? res : -ENOSPC;
+  trace_allocate(want, unit, orig_max_alloc_size, hint, res, *extents, first);
+  return res;
 }
 
 void HybridAllocator::release(const interval_set<uint64_t>& release_set) {
@@ -95,6 +99,7 @@ void HybridAllocator::release(const interval_set<uint64_t>& release_set) {
   // this will attempt to put free ranges into AvlAllocator first and
   // fallback to bitmap one via _try_insert_range call
   _release(release_set);
+  trace_release(release_set);
 }
 
 uint64_t HybridAllocator::get_free()
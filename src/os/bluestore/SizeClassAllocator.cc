@@ -0,0 +1,467 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "SizeClassAllocator.h"
+
+#include <bit>
+#include <limits>
+#include <map>
+
+#include "common/config_proxy.h"
+#include "common/debug.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef  dout_prefix
+#define dout_prefix *_dout << "SizeClassAllocator "
+
+// never reused, unlike addresses, so stale home slots stay harmless
+static std::atomic<uint64_t> next_instance_id = {0};
+
+SizeClassAllocator::SizeClassAllocator(CephContext* cct,
+				       int64_t device_size,
+				       int64_t block_size,
+				       unsigned num_shards,
+				       std::string_view name) :
+  Allocator(name, device_size, block_size),
+  cct(cct),
+  instance_id(next_instance_id++)
+{
+  ceph_assert(block_size > 0);
+  ceph_assert(std::has_single_bit((uint64_t)block_size));
+  num_shards = std::max(num_shards, 1u);
+  // keep shard boundaries aligned for any sane allocation unit, so that
+  // splitting free extents there never costs a unit
+  uint64_t align = std::max<uint64_t>(block_size, 16ull << 20);
+  shard_size = std::max(
+    align, p2roundup<uint64_t>(div_round_up(device_size, num_shards), align));
+  unsigned n = std::max<uint64_t>(1, div_round_up(device_size, shard_size));
+  shards.reserve(n);
+  for (unsigned i = 0; i < n; ++i) {
+    auto s = std::make_unique<shard_t>();
+    s->start = i * shard_size;
+    s->end = std::min<uint64_t>((i + 1) * shard_size, device_size);
+    shards.emplace_back(std::move(s));
+  }
+  ldout(cct, 10) << __func__ << " " << n << " shards of 0x" << std::hex
+		 << shard_size << std::dec << dendl;
+}
+
+SizeClassAllocator::~SizeClassAllocator()
+{
+  shutdown();
+}
+
+unsigned SizeClassAllocator::_get_class(uint64_t len) const
+{
+  uint64_t blocks = len / block_size;
+  if (blocks == 0) {
+    return 0;
+  }
+  return std::min<unsigned>(NUM_CLASSES - 1, std::bit_width(blocks) - 1);
+}
+
+unsigned SizeClassAllocator::_home_shard()
+{
+  // spread threads over the shards, but keep each one where it started
+  // so that its data stays together.  A thread allocates from several
+  // instances (BlueStore's, BlueFS's, ...), each with its own slots.
+  static thread_local std::map<uint64_t, unsigned> slots;
+  auto [p, inserted] = slots.try_emplace(instance_id, 0);
+  if (inserted) {
+    p->second = next_shard++;
+  }
+  return p->second % shards.size();
+}
+
+void SizeClassAllocator::_class_insert(shard_t& s, uint64_t start,
+				       uint64_t end)
+{
+  unsigned cls = _get_class(end - start);
+  s.classes[cls].insert(start);
+  s.class_mask |= 1ull << cls;
+}
+
+void SizeClassAllocator::_class_remove(shard_t& s, uint64_t start,
+				       uint64_t end)
+{
+  unsigned cls = _get_class(end - start);
+  auto erased = s.classes[cls].erase(start);
+  ceph_assert(erased == 1);
+  if (s.classes[cls].empty()) {
+    s.class_mask &= ~(1ull << cls);
+  }
+}
+
+void SizeClassAllocator::_add_free(shard_t& s, uint64_t start, uint64_t end)
+{
+  ceph_assert(start < end);
+  ceph_assert(start >= s.start && end <= s.end);
+  uint64_t prev_start = 0, next_end = 0;
+  bool merge_prev = false, merge_next = false;
+  auto n = s.range_tree.lower_bound(start);
+  if (n != s.range_tree.end()) {
+    ceph_assert(n->first >= end);
+    if (n->first == end) {
+      merge_next = true;
+      next_end = n->second;
+    }
+  }
+  if (n != s.range_tree.begin()) {
+    auto p = std::prev(n);
+    ceph_assert(p->second <= start);
+    if (p->second == start) {
+      merge_prev = true;
+      prev_start = p->first;
+    }
+  }
+
+  uint64_t new_start = start, new_end = end;
+  if (merge_next) {
+    _class_remove(s, end, next_end);
+    s.range_tree.erase(end);
+    new_end = next_end;
+  }
+  if (merge_prev) {
+    _class_remove(s, prev_start, start);
+    s.range_tree.find(prev_start)->second = new_end;
+    new_start = prev_start;
+  } else {
+    s.range_tree.emplace(new_start, new_end);
+  }
+  _class_insert(s, new_start, new_end);
+
+  num_extents += 1;
+  num_extents -= merge_prev + merge_next;
+  s.num_free += end - start;
+  num_free += end - start;
+}
+
+void SizeClassAllocator::_rm_free(shard_t& s, uint64_t start, uint64_t end)
+{
+  ceph_assert(start < end);
+  auto p = s.range_tree.upper_bound(start);
+  ceph_assert(p != s.range_tree.begin());
+  --p;
+  uint64_t rs_start = p->first;
+  uint64_t rs_end = p->second;
+  ceph_assert(rs_start <= start && rs_end >= end);
+
+  _class_remove(s, rs_start, rs_end);
+  if (rs_start < start) {
+    p->second = start;
+    _class_insert(s, rs_start, start);
+  } else {
+    s.range_tree.erase(p);
+    --num_extents;
+  }
+  if (end < rs_end) {
+    s.range_tree.emplace(end, rs_end);
+    _class_insert(s, end, rs_end);
+    ++num_extents;
+  }
+  s.num_free -= end - start;
+  num_free -= end - start;
+}
+
+bool SizeClassAllocator::_pick_from_class(shard_t& s, unsigned cls,
+					  uint64_t size, uint64_t unit,
+					  unsigned max_scan, uint64_t *offset)
+{
+  unsigned scanned = 0;
+  for (auto start : s.classes[cls]) {
+    if (max_scan && scanned++ >= max_scan) {
+      break;
+    }
+    auto p = s.range_tree.find(start);
+    ceph_assert(p != s.range_tree.end());
+    uint64_t aligned = p2roundup(start, unit);
+    if (aligned + size <= p->second) {
+      *offset = aligned;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SizeClassAllocator::_allocate_fit(shard_t& s, uint64_t size,
+				       uint64_t unit, uint64_t *offset)
+{
+  // every member of class 'sure' and above holds the request wherever it
+  // starts; the classes below it might
+  uint64_t need = size + (unit > (uint64_t)block_size ? unit - block_size : 0);
+  uint64_t blocks = div_round_up(need, (uint64_t)block_size);
+  unsigned sure = blocks <= 1 ? 0 : std::bit_width(blocks - 1);
+  for (unsigned cls = _get_class(size); cls < std::min(sure, NUM_CLASSES);
+       ++cls) {
+    if ((s.class_mask & (1ull << cls)) &&
+	_pick_from_class(s, cls, size, unit, MAX_CLASS_SCAN, offset)) {
+      return true;
+    }
+  }
+  if (sure >= NUM_CLASSES) {
+    return false;
+  }
+  uint64_t mask = s.class_mask & (~0ull << sure);
+  if (!mask) {
+    return false;
+  }
+  return _pick_from_class(s, std::countr_zero(mask), size, unit,
+			  MAX_CLASS_SCAN, offset);
+}
+
+bool SizeClassAllocator::_allocate_largest(shard_t& s, uint64_t size,
+					   uint64_t unit, uint64_t *offset,
+					   uint64_t *length)
+{
+  for (int cls = NUM_CLASSES - 1; cls >= 0; --cls) {
+    if (!(s.class_mask & (1ull << cls))) {
+      continue;
+    }
+    for (auto start : s.classes[cls]) {
+      auto p = s.range_tree.find(start);
+      uint64_t aligned = p2roundup(start, unit);
+      uint64_t usable = p->second > aligned ?
+	p2align(p->second - aligned, unit) : 0;
+      if (usable) {
+	*offset = aligned;
+	*length = std::min(size, usable);
+	return true;
+      }
+    }
+  }
+  return false;
+}
+
+int SizeClassAllocator::_allocate(uint64_t size, uint64_t unit, int64_t hint,
+				  uint64_t *offset, uint64_t *length)
+{
+  unsigned n = shards.size();
+  unsigned first = hint > 0 && hint < device_size ?
+    _shard_of(hint) : _home_shard();
+  for (unsigned i = 0; i < n; ++i) {
+    auto& s = *shards[(first + i) % n];
+    std::lock_guard l(s.lock);
+    if (s.num_free >= size && _allocate_fit(s, size, unit, offset)) {
+      *length = size;
+      _rm_free(s, *offset, *offset + *length);
+      return 0;
+    }
+  }
+  // nothing holds it in one piece; hand out the biggest pieces left
+  for (unsigned i = 0; i < n; ++i) {
+    auto& s = *shards[(first + i) % n];
+    std::lock_guard l(s.lock);
+    if (s.num_free >= unit &&
+	_allocate_largest(s, size, unit, offset, length)) {
+      _rm_free(s, *offset, *offset + *length);
+      return 0;
+    }
+  }
+  return -ENOSPC;
+}
+
+int64_t SizeClassAllocator::allocate(
+  uint64_t want,
+  uint64_t unit,
+  uint64_t max_alloc_size,
+  int64_t  hint,
+  PExtentVector* extents)
+{
+  ldout(cct, 10) << __func__ << std::hex
+		 << " want 0x" << want
+		 << " unit 0x" << unit
+		 << " max_alloc_size 0x" << max_alloc_size
+		 << " hint 0x" << hint
+		 << std::dec << dendl;
+  ceph_assert(std::has_single_bit(unit));
+  ceph_assert(want % unit == 0);
+
+  const uint64_t orig_max_alloc_size = max_alloc_size;
+  const int64_t orig_hint = hint;
+  const size_t first = extents->size();
+  if (max_alloc_size == 0) {
+    max_alloc_size = want;
+  }
+  if (constexpr auto cap = std::numeric_limits<decltype(bluestore_pextent_t::length)>::max();
+      max_alloc_size >= cap) {
+    max_alloc_size = p2align(uint64_t(cap), (uint64_t)block_size);
+  }
+  // a single piece never spans shards
+  max_alloc_size = std::max(unit, std::min(max_alloc_size, shard_size));
+
+  uint64_t allocated = 0;
+  while (allocated < want) {
+    uint64_t offset, length;
+    int r = _allocate(std::min(max_alloc_size, want - allocated),
+		      unit, hint, &offset, &length);
+    if (r < 0) {
+      // Allocation failed.
+      break;
+    }
+    if (!extents->empty() && extents->back().end() == offset &&
+	extents->back().length + length <= max_alloc_size) {
+      extents->back().length += length;
+    } else {
+      extents->emplace_back(offset, length);
+    }
+    allocated += length;
+    // continue where the last piece ended
+    hint = offset + length;
+  }
+  int64_t r = allocated ? (int64_t)allocated : -ENOSPC;
+  trace_allocate(want, unit, orig_max_alloc_size, orig_hint, r, *extents,
+		 first);
+  return r;
+}
+
+void SizeClassAllocator::release(const interval_set<uint64_t>& release_set)
+{
+  // before the space can be handed out again, see AllocatorTraceWriter
+  trace_release(release_set);
+  // the set is sorted, so take each shard lock once per run of extents
+  std::unique_lock<std::mutex> l;
+  unsigned locked = std::numeric_limits<unsigned>::max();
+  for (auto p = release_set.begin(); p != release_set.end(); ++p) {
+    uint64_t start = p.get_start();
+    uint64_t end = start + p.get_len();
+    ldout(cct, 10) << __func__ << std::hex
+		   << " offset 0x" << start
+		   << " length 0x" << p.get_len()
+		   << std::dec << dendl;
+    while (start < end) {
+      unsigned sh = _shard_of(start);
+      ceph_assert(sh < shards.size());
+      auto& s = *shards[sh];
+      if (sh != locked) {
+	l = std::unique_lock(s.lock);
+	locked = sh;
+      }
+      uint64_t seg_end = std::min(end, s.end);
+      _add_free(s, start, seg_end);
+      start = seg_end;
+    }
+  }
+}
+
+uint64_t SizeClassAllocator::get_free()
+{
+  return num_free;
+}
+
+double SizeClassAllocator::get_fragmentation()
+{
+  auto free_blocks = p2align(num_free.load(), (uint64_t)block_size) / block_size;
+  if (free_blocks <= 1) {
+    return .0;
+  }
+  // an extent cut in two by a shard boundary is still one extent
+  uint64_t extents = num_extents;
+  bool prev_ends_free = false;
+  for (auto& s : shards) {
+    std::lock_guard l(s->lock);
+    if (prev_ends_free && !s->range_tree.empty() &&
+	s->range_tree.begin()->first == s->start) {
+      --extents;
+    }
+    prev_ends_free = !s->range_tree.empty() &&
+      s->range_tree.rbegin()->second == s->end;
+  }
+  return (static_cast<double>(std::max<uint64_t>(extents, 1) - 1) /
+	  (free_blocks - 1));
+}
+
+void SizeClassAllocator::dump()
+{
+  for (unsigned i = 0; i < shards.size(); ++i) {
+    auto& s = *shards[i];
+    std::lock_guard l(s.lock);
+    ldout(cct, 0) << __func__ << " shard " << i << std::hex
+		  << " 0x" << s.start << "~" << (s.end - s.start)
+		  << " free 0x" << s.num_free << std::dec
+		  << " extents " << s.range_tree.size() << dendl;
+    for (unsigned cls = 0; cls < NUM_CLASSES; ++cls) {
+      if (s.classes[cls].size()) {
+	ldout(cct, 0) << __func__ << "   class " << cls
+		      << " extents " << s.classes[cls].size() << dendl;
+      }
+    }
+    for (auto& rs : s.range_tree) {
+      ldout(cct, 0) << std::hex
+		    << "0x" << rs.first << "~" << (rs.second - rs.first)
+		    << std::dec
+		    << dendl;
+    }
+  }
+}
+
+void SizeClassAllocator::foreach(
+  std::function<void(uint64_t offset, uint64_t length)> notify)
+{
+  // glue back extents that were only split by a shard boundary
+  uint64_t pstart = 0, pend = 0;
+  for (auto& s : shards) {
+    std::lock_guard l(s->lock);
+    for (auto& rs : s->range_tree) {
+      if (pend > pstart && pend == rs.first) {
+	pend = rs.second;
+	continue;
+      }
+      if (pend > pstart) {
+	notify(pstart, pend - pstart);
+      }
+      pstart = rs.first;
+      pend = rs.second;
+    }
+  }
+  if (pend > pstart) {
+    notify(pstart, pend - pstart);
+  }
+}
+
+void SizeClassAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  ldout(cct, 10) << __func__ << std::hex
+		 << " offset 0x" << offset
+		 << " length 0x" << length
+		 << std::dec << dendl;
+  if (!length) {
+    return;
+  }
+  interval_set<uint64_t> s;
+  s.insert(offset, length);
+  release(s);
+}
+
+void SizeClassAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  ldout(cct, 10) << __func__ << std::hex
+		 << " offset 0x" << offset
+		 << " length 0x" << length
+		 << std::dec << dendl;
+  uint64_t end = offset + length;
+  while (offset < end) {
+    unsigned sh = _shard_of(offset);
+    ceph_assert(sh < shards.size());
+    auto& s = *shards[sh];
+    uint64_t seg_end = std::min(end, s.end);
+    std::lock_guard l(s.lock);
+    _rm_free(s, offset, seg_end);
+    offset = seg_end;
+  }
+}
+
+void SizeClassAllocator::shutdown()
+{
+  for (auto& s : shards) {
+    std::lock_guard l(s->lock);
+    s->range_tree.clear();
+    for (auto& c : s->classes) {
+      c.clear();
+    }
+    s->class_mask = 0;
+    s->num_free = 0;
+  }
+  num_free = 0;
+  num_extents = 0;
+}
@@ -0,0 +1,128 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "include/cpp-btree/btree_map.h"
+#include "include/cpp-btree/btree_set.h"
+#include "Allocator.h"
+#include "os/bluestore/bluestore_types.h"
+#include "include/mempool.h"
+
+/**
+ * SizeClassAllocator
+ *
+ * The device is cut into a fixed number of regions ("shards"), each with
+ * its own lock, so that callers starting from different regions (kv_sync,
+ * BlueFS, ...) do not serialize on one mutex.  Free extents never cross a
+ * shard boundary.
+ *
+ * Within a shard free extents sit on segregated free lists, one per power
+ * of two size class (in blocks), each ordered by offset.  A bit mask of the
+ * non-empty classes makes finding the smallest class whose every member
+ * fits a request a single count-trailing-zeros.  The classes below that
+ * sure fit, starting from the request's own, are scanned first (a bounded
+ * number of members each) so that big extents are not broken up when a
+ * smaller one will do; failing that, the lowest offset extent of the sure
+ * fit class is taken.  Only when nothing fits at all does a request get
+ * split over the largest extents left.
+ */
+class SizeClassAllocator : public Allocator {
+public:
+  SizeClassAllocator(CephContext* cct, int64_t device_size, int64_t block_size,
+		     unsigned num_shards, std::string_view name);
+  ~SizeClassAllocator() override;
+
+  const char* get_type() const override
+  {
+    return "sizeclass";
+  }
+  int64_t allocate(
+    uint64_t want,
+    uint64_t unit,
+    uint64_t max_alloc_size,
+    int64_t  hint,
+    PExtentVector *extents) override;
+  void release(const interval_set<uint64_t>& release_set) override;
+  uint64_t get_free() override;
+  double get_fragmentation() override;
+
+  void dump() override;
+  void foreach(
+    std::function<void(uint64_t offset, uint64_t length)> notify) override;
+  void init_add_free(uint64_t offset, uint64_t length) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+  void shutdown() override;
+
+  unsigned get_num_shards() const {
+    return shards.size();
+  }
+
+private:
+  /// lengths in [2^i, 2^(i+1)) blocks go to class i
+  static constexpr unsigned NUM_CLASSES = 64;
+  /// class members looked at when the class below the sure fit is tried
+  static constexpr unsigned MAX_CLASS_SCAN = 32;
+
+  template<class T>
+  using pool_allocator = mempool::bluestore_alloc::pool_allocator<T>;
+  using range_tree_t =
+    btree::btree_map<
+      uint64_t /* start */,
+      uint64_t /* end */,
+      std::less<uint64_t>,
+      pool_allocator<std::pair<const uint64_t, uint64_t>>>;
+  using class_list_t =
+    btree::btree_set<
+      uint64_t /* start */,
+      std::less<uint64_t>,
+      pool_allocator<uint64_t>>;
+
+  struct shard_t {
+    std::mutex lock;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    range_tree_t range_tree;	///< all free extents, by offset
+    class_list_t classes[NUM_CLASSES];
+    uint64_t class_mask = 0;	///< bit i set iff classes[i] is not empty
+    uint64_t num_free = 0;
+  };
+
+  CephContext* cct;
+  uint64_t shard_size = 0;
+  std::vector<std::unique_ptr<shard_t>> shards;
+  std::atomic<uint64_t> num_free = {0};
+  std::atomic<uint64_t> num_extents = {0};
+  std::atomic<unsigned> next_shard = {0};
+  /// tells this allocator's home shards apart from other instances'
+  const uint64_t instance_id;
+
+  unsigned _get_class(uint64_t len) const;
+  unsigned _shard_of(uint64_t offset) const {
+    return offset / shard_size;
+  }
+  /// shard a caller without a hint starts from; stable per thread and
+  /// allocator
+  unsigned _home_shard();
+
+  void _class_insert(shard_t& s, uint64_t start, uint64_t end);
+  void _class_remove(shard_t& s, uint64_t start, uint64_t end);
+  void _add_free(shard_t& s, uint64_t start, uint64_t end);
+  void _rm_free(shard_t& s, uint64_t start, uint64_t end);
+  /// first usable [*offset, *offset + size) of a class, unit aligned
+  bool _pick_from_class(shard_t& s, unsigned cls, uint64_t size,
+			uint64_t unit, unsigned max_scan, uint64_t *offset);
+  /// try to carve size bytes out of a single extent of the shard
+  bool _allocate_fit(shard_t& s, uint64_t size, uint64_t unit,
+		     uint64_t *offset);
+  /// take what the largest extent of the shard can give, at most size
+  bool _allocate_largest(shard_t& s, uint64_t size, uint64_t unit,
+			 uint64_t *offset, uint64_t *length);
+  int _allocate(uint64_t size, uint64_t unit, int64_t hint,
+		uint64_t *offset, uint64_t *length);
+};
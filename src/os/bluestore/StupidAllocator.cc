@@ -178,6 +178,9 @@ int64_t StupidAllocator::allocate(
   uint64_t offset = 0;
   uint32_t length = 0;
   int res = 0;
+  const uint64_t orig_max_alloc_size = max_alloc_size;
+  const int64_t orig_hint = hint;
+  const size_t first = extents->size();
 
   if (max_alloc_size == 0) {
     max_alloc_size = want_size;
@@ -214,10 +217,10 @@ int64_t StupidAllocator::allocate(
     hint = offset + length;
   }
 
-  if (allocated_size == 0) {
-    return -ENOSPC;
-  }
-  return allocated_size;
+  int64_t r = allocated_size ? (int64_t)allocated_size : -ENOSPC;
+  trace_allocate(want_size, alloc_unit, orig_max_alloc_size, orig_hint, r,
+		 *extents, first);
+  return r;
 }
 
 void StupidAllocator::release(
@@ -234,6 +237,7 @@ void StupidAllocator::release(
     _insert_free(offset, length);
     num_free += length;
   }
+  trace_release(release_set);
 }
 
 uint64_t StupidAllocator::get_free()
@@ -257,6 +257,7 @@ OSDService::OSDService(OSD *osd, ceph::async::io_context_pool& poolctx) :
   last_recalibrate(ceph_clock_now()),
   promote_max_objects(0),
   promote_max_bytes(0),
+  mclock_capacity(cct, store->is_rotational()),
   poolctx(poolctx),
   objecter(make_unique<Objecter>(osd->client_messenger->cct,
 				 osd->objecter_messenger,
@@ -6363,6 +6364,16 @@ void OSD::tick_without_osd_lock()
   logger->set(l_osd_cached_crc_adjusted, ceph::buffer::get_cached_crc_adjusted());
   logger->set(l_osd_missed_crc, ceph::buffer::get_missed_crc());
 
+  // the shards' mClock schedulers pick new estimates up on their own
+  if (op_queue_type_t::mClockScheduler == osd_op_queue_type() &&
+      service.mclock_capacity.update(ceph::mono_clock::now())) {
+    double bandwidth = 0, iops = 0;
+    service.mclock_capacity.get_capacity(&bandwidth, &iops);
+    logger->set(l_osd_mclock_capacity_iops, iops);
+    logger->set(l_osd_mclock_capacity_bandwidth, bandwidth);
+    logger->inc(l_osd_mclock_capacity_update);
+  }
+
   // refresh osd stats
   struct store_statfs_t stbuf;
   osd_alert_list_t alerts;
@@ -9694,9 +9705,20 @@ void OSD::enqueue_op(spg_t pg, OpRequestRef&& op, epoch_t epoch)
         unique_ptr<OpSchedulerItem::OpQueueable>(new PGRecoveryMsg(pg, std::move(op))),
         cost, priority, stamp, owner, epoch));
   } else {
+    // the QoS tag is the client's say; who may use a tag's profile
+    // depends on who the client authenticated as
+    std::string qos_entity;
+    if (type == CEPH_MSG_OSD_OP &&
+	!op->get_req<MOSDOp>()->get_qos_tag().empty()) {
+      if (auto session = ceph::ref_cast<Session>(
+	    op->get_req()->get_connection()->get_priv()); session) {
+	qos_entity = session->entity_name.to_str();
+      }
+    }
     op_shardedwq.queue(
       OpSchedulerItem(
-        unique_ptr<OpSchedulerItem::OpQueueable>(new PGOpItem(pg, std::move(op))),
+        unique_ptr<OpSchedulerItem::OpQueueable>(
+	  new PGOpItem(pg, std::move(op), std::move(qos_entity))),
         cost, priority, stamp, owner, epoch));
   }
 }
@@ -9866,6 +9888,7 @@ const char** OSD::get_tracked_conf_keys() const
     "osd_scrub_max_interval",
     "osd_op_thread_timeout",
     "osd_op_thread_suicide_timeout",
+    "osd_op_shard_spin_us",
     NULL
   };
   return KEYS;
@@ -10005,6 +10028,13 @@ void OSD::handle_conf_change(const ConfigProxy& conf,
   if (changed.count("osd_op_thread_suicide_timeout")) {
     op_shardedwq.set_suicide_timeout(g_conf().get_val<int64_t>("osd_op_thread_suicide_timeout"));
   }
+  if (changed.count("osd_op_shard_spin_us")) {
+    uint64_t ns = conf.get_val<uint64_t>("osd_op_shard_spin_us") * 1000;
+    for (auto shard : shards) {
+      shard->spin_max_ns = ns;
+      shard->spin_ns = ns;
+    }
+  }
 }
 
 void OSD::maybe_override_max_osd_capacity_for_qos()
@@ -10830,12 +10860,57 @@ OSDShard::OSDShard(
     shard_lock{make_mutex(shard_lock_name)},
     scheduler(ceph::osd::scheduler::make_scheduler(
       cct, osd->whoami, osd->num_shards, id, osd->store->is_rotational(),
-      osd->store->get_type(), osd_op_queue, osd_op_queue_cut_off, osd->monc)),
+      osd->store->get_type(), osd_op_queue, osd_op_queue_cut_off, osd->monc,
+      &osd->service.mclock_capacity)),
     context_queue(sdata_wait_lock, sdata_cond)
 {
+  spin_max_ns = cct->_conf.get_val<uint64_t>("osd_op_shard_spin_us") * 1000;
+  spin_ns = spin_max_ns.load();
   dout(0) << "using op scheduler " << *scheduler << dendl;
 }
 
+unsigned OSDShard::_drain_ingest()
+{
+  unsigned n = 0;
+  while (auto item = ingest.pop()) {
+    scheduler->enqueue(std::move(*item));
+    ++n;
+  }
+  return n;
+}
+
+void OSDShard::wake_one()
+{
+  std::lock_guard l{sdata_wait_lock};
+  sdata_cond.notify_one();
+}
+
+bool OSDShard::spin_for_work(bool with_context_queue)
+{
+  uint64_t budget = spin_ns.load(std::memory_order_relaxed);
+  uint64_t max = spin_max_ns.load(std::memory_order_relaxed);
+  auto deadline = ceph::mono_clock::now() + std::chrono::nanoseconds(budget);
+  for (unsigned i = 1; ; ++i) {
+    if (!ingest.empty() ||
+	(with_context_queue && !context_queue.empty())) {
+      // spinning paid off, allow longer spins
+      spin_ns.store(std::min(max, budget * 2), std::memory_order_relaxed);
+      return true;
+    }
+    if (i % 64 == 0 && ceph::mono_clock::now() >= deadline) {
+      break;
+    }
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+  // idle for real; back off, but keep polling a little
+  spin_ns.store(std::max(max / 16, budget / 2), std::memory_order_relaxed);
+  return false;
+}
+
 
 // =============================================================
 
@@ -10881,19 +10956,38 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
 
   // peek at spg_t
   sdata->shard_lock.lock();
+  _drain_ingest(sdata);
+  if (sdata->scheduler->empty() &&
+      (!is_smallest_thread_index || sdata->context_queue.empty()) &&
+      sdata->spin_ns.load(std::memory_order_relaxed)) {
+    // ops on fast devices tend to come in bursts; polling for a few
+    // microseconds is cheaper than a sleep and a wakeup
+    sdata->shard_lock.unlock();
+    bool found = sdata->spin_for_work(is_smallest_thread_index);
+    sdata->shard_lock.lock();
+    if (found) {
+      osd->logger->inc(l_osd_op_wq_spin_hit);
+      _drain_ingest(sdata);
+    }
+  }
   if (sdata->scheduler->empty() &&
       (!is_smallest_thread_index || sdata->context_queue.empty())) {
     std::unique_lock wait_lock{sdata->sdata_wait_lock};
-    if (is_smallest_thread_index && !sdata->context_queue.empty()) {
-      // we raced with a context_queue addition, don't wait
+    sdata->_begin_idle();
+    if ((is_smallest_thread_index && !sdata->context_queue.empty()) ||
+	!sdata->ingest.empty()) {
+      // we raced with a context_queue or ingest addition, don't wait
+      sdata->_end_idle();
       wait_lock.unlock();
     } else if (!sdata->stop_waiting) {
       dout(20) << __func__ << " empty q, waiting" << dendl;
       osd->cct->get_heartbeat_map()->clear_timeout(hb);
       sdata->shard_lock.unlock();
       sdata->sdata_cond.wait(wait_lock);
+      sdata->_end_idle();
       wait_lock.unlock();
       sdata->shard_lock.lock();
+      _drain_ingest(sdata);
       if (sdata->scheduler->empty() &&
          !(is_smallest_thread_index && !sdata->context_queue.empty())) {
 	sdata->shard_lock.unlock();
@@ -10904,6 +10998,7 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
         timeout_interval.load(), suicide_interval.load());
     } else {
       dout(20) << __func__ << " need return immediately" << dendl;
+      sdata->_end_idle();
       wait_lock.unlock();
       sdata->shard_lock.unlock();
       return;
@@ -10917,6 +11012,7 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
 
   WorkItem work_item;
   while (!std::get_if<OpSchedulerItem>(&work_item)) {
+    _drain_ingest(sdata);
     if (sdata->scheduler->empty()) {
       if (osd->is_stopping()) {
         sdata->shard_lock.unlock();
@@ -10955,9 +11051,11 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
       // Disable heartbeat timeout until we find a non-future work item to process.
       osd->cct->get_heartbeat_map()->clear_timeout(hb);
       sdata->shard_lock.unlock();
-      ++sdata->waiting_threads;
-      sdata->sdata_cond.wait_until(wait_lock, future_time);
-      --sdata->waiting_threads;
+      sdata->_begin_idle();
+      if (sdata->ingest.empty()) {
+	sdata->sdata_cond.wait_until(wait_lock, future_time);
+      }
+      sdata->_end_idle();
       wait_lock.unlock();
       sdata->shard_lock.lock();
       // Reapply default wq timeouts
@@ -10973,6 +11071,9 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
 
   // Access the stored item
   auto item = std::move(std::get<OpSchedulerItem>(work_item));
+  if (auto stamp = item.take_enqueue_stamp(); stamp != ceph::mono_time()) {
+    osd->logger->tinc(l_osd_op_wq_queue_lat, ceph::mono_clock::now() - stamp);
+  }
   if (osd->is_stopping()) {
     sdata->shard_lock.unlock();
     for (auto c : oncommits) {
@@ -11219,21 +11320,24 @@ void OSD::ShardedOpWQ::_enqueue(OpSchedulerItem&& item) {
 
   dout(20) << fmt::format("{} {}", __func__, item) << dendl;
 
-  bool empty = true;
-  {
-    std::lock_guard l{sdata->shard_lock};
-    empty = sdata->scheduler->empty();
-    sdata->scheduler->enqueue(std::move(item));
+  item.set_enqueue_stamp(ceph::mono_clock::now());
+  sdata->ingest.push(std::move(item));
+  osd->logger->inc(l_osd_op_wq_enqueue);
+  if (sdata->_should_wake()) {
+    osd->logger->inc(l_osd_op_wq_wakeup);
+    sdata->wake_one();
   }
+}
 
-  {
-    std::lock_guard l{sdata->sdata_wait_lock};
-    if (empty) {
-      sdata->sdata_cond.notify_all();
-    } else if (sdata->waiting_threads) {
-      sdata->sdata_cond.notify_one();
-    }
+unsigned OSD::ShardedOpWQ::_drain_ingest(OSDShard* sdata)
+{
+  unsigned n = sdata->_drain_ingest();
+  if (n > 1 && sdata->_should_wake()) {
+    // more than this thread can take on at once; get help
+    osd->logger->inc(l_osd_op_wq_wakeup);
+    sdata->wake_one();
   }
+  return n;
 }
 
 void OSD::ShardedOpWQ::_enqueue_front(OpSchedulerItem&& item)
@@ -11277,6 +11381,7 @@ void OSD::ShardedOpWQ::stop_for_fast_shutdown()
     auto& sdata = osd->shards[shard_index];
     ceph_assert(sdata);
     std::lock_guard l(sdata->shard_lock);
+    while (sdata->ingest.pop()) {}
     while (!sdata->scheduler->empty()) {
       sdata->scheduler->dequeue();
     }
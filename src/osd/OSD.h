@@ -38,7 +38,9 @@
 #include "OpRequest.h"
 #include "Session.h"
 
+#include "osd/scheduler/OpIngestQueue.h"
 #include "osd/scheduler/OpScheduler.h"
+#include "osd/scheduler/mClockCapacityEstimator.h"
 
 #include <atomic>
 #include <map>
@@ -409,6 +411,10 @@ public:
     promote_counter.finish(bytes);
   }
   void promote_throttle_recalibrate();
+
+  /// measures the device for mClock, see osd_mclock_capacity_calibration
+  ceph::osd::scheduler::mClockCapacityEstimator mclock_capacity;
+
   unsigned get_num_shards() const {
     return m_objecter_finishers;
   }
@@ -968,7 +974,37 @@ struct OSDShard {
   std::string sdata_wait_lock_name;
   ceph::mutex sdata_wait_lock;
   ceph::condition_variable sdata_cond;
-  int waiting_threads = 0;
+
+  /// ops from ShardedOpWQ::_enqueue, moved into scheduler by _drain_ingest
+  ceph::osd::scheduler::OpIngestQueue ingest;
+
+  /// threads waiting on sdata_cond, or about to
+  std::atomic<int> idle_threads = {0};
+  /// a worker has been notified and has not woken up yet
+  std::atomic<bool> wake_pending = {false};
+  /// current spin budget of idle workers, see spin_for_work()
+  std::atomic<uint64_t> spin_ns = {0};
+  std::atomic<uint64_t> spin_max_ns = {0};
+
+  /// call with sdata_wait_lock held before waiting on sdata_cond; the
+  /// caller must then look at ingest once more before it waits
+  void _begin_idle() {
+    idle_threads.fetch_add(1);
+    wake_pending.store(false);
+  }
+  void _end_idle() {
+    idle_threads.fetch_sub(1);
+    wake_pending.store(false);
+  }
+  /// true if the caller should notify sdata_cond; a burst of enqueues
+  /// wakes one worker, which takes all of them
+  bool _should_wake() {
+    return idle_threads.load() > 0 &&
+      !wake_pending.exchange(true);
+  }
+  void wake_one();
+  /// poll ingest (and context_queue) for up to spin_ns without locks
+  bool spin_for_work(bool with_context_queue);
 
   ceph::mutex osdmap_lock;  ///< protect shard_osdmap updates vs users w/o shard_lock
   OSDMapRef shard_osdmap;
@@ -1006,6 +1042,9 @@ struct OSDShard {
   /// priority queue
   ceph::osd::scheduler::OpSchedulerRef scheduler;
 
+  /// move everything in ingest into scheduler; returns the number of ops
+  unsigned _drain_ingest();
+
   bool stop_waiting = false;
 
   ContextQueue context_queue;
@@ -1562,6 +1601,9 @@ protected:
     /// try to do some work
     void _process(uint32_t thread_index, ceph::heartbeat_handle_d *hb) override;
 
+    /// OSDShard::_drain_ingest(), waking another worker for a backlog
+    unsigned _drain_ingest(OSDShard *sdata);
+
     void stop_for_fast_shutdown();
 
     /// enqueue a new item
@@ -1599,6 +1641,7 @@ protected:
 
 	std::scoped_lock l{sdata->shard_lock};
 	f->open_object_section(queue_name);
+	f->dump_int("ingest", sdata->ingest.size());
 	sdata->scheduler->dump(*f);
 	f->close_section();
       }
@@ -1609,6 +1652,9 @@ protected:
       auto &&sdata = osd->shards[shard_index];
       ceph_assert(sdata);
       std::lock_guard l(sdata->shard_lock);
+      if (!sdata->ingest.empty()) {
+	return false;
+      }
       if (thread_index < osd->num_shards) {
 	return sdata->scheduler->empty() && sdata->context_queue.empty();
       } else {
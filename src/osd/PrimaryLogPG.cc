@@ -4402,6 +4402,10 @@ void PrimaryLogPG::log_op_stats(const OpRequest& op,
   osd->logger->inc(l_osd_op_inb, inb);
   osd->logger->tinc(l_osd_op_lat, latency);
   osd->logger->tinc(l_osd_op_process_lat, process_latency);
+  osd->mclock_capacity.note_op(
+    inb + outb,
+    ceph::timespan((latency - process_latency).to_nsec()),
+    ceph::timespan(process_latency.to_nsec()));
 
   if (op.may_read() && op.may_write()) {
     osd->logger->inc(l_osd_op_rw);
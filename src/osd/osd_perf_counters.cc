@@ -133,6 +133,30 @@ PerfCounters *build_osd_logger(CephContext *cct) {
   osd_plb.add_time_avg(l_osd_op_before_dequeue_op_lat, "op_before_dequeue_op_lat",
     "Latency of IO before calling dequeue_op(already dequeued and get PG lock)"); // client io before dequeue_op latency
 
+  osd_plb.add_u64_counter(
+    l_osd_op_wq_enqueue, "op_wq_enqueue",
+    "Items queued to the sharded op queue");
+  osd_plb.add_time_avg(
+    l_osd_op_wq_queue_lat, "op_wq_queue_lat",
+    "Time from sharded op queue enqueue to dequeue by a worker");
+  osd_plb.add_u64_counter(
+    l_osd_op_wq_wakeup, "op_wq_wakeup",
+    "Sleeping sharded op queue workers woken for new items");
+  osd_plb.add_u64_counter(
+    l_osd_op_wq_spin_hit, "op_wq_spin_hit",
+    "Idle sharded op queue workers that found work while spinning");
+
+  osd_plb.add_u64(
+    l_osd_mclock_capacity_iops, "mclock_capacity_iops",
+    "Calibrated IOPS capacity mClock schedules with (0 if not calibrating)");
+  osd_plb.add_u64(
+    l_osd_mclock_capacity_bandwidth, "mclock_capacity_bandwidth",
+    "Calibrated bandwidth capacity mClock schedules with", NULL,
+    PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  osd_plb.add_u64_counter(
+    l_osd_mclock_capacity_update, "mclock_capacity_update",
+    "Changes to the calibrated mClock capacity");
+
   osd_plb.add_u64_counter(
     l_osd_sop, "subop", "Suboperations");
   osd_plb.add_u64_counter(
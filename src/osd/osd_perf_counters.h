@@ -43,6 +43,15 @@ enum {
   l_osd_op_before_queue_op_lat,
   l_osd_op_before_dequeue_op_lat,
 
+  l_osd_op_wq_enqueue,
+  l_osd_op_wq_queue_lat,
+  l_osd_op_wq_wakeup,
+  l_osd_op_wq_spin_hit,
+
+  l_osd_mclock_capacity_iops,
+  l_osd_mclock_capacity_bandwidth,
+  l_osd_mclock_capacity_update,
+
   l_osd_sop,
   l_osd_sop_inb,
   l_osd_sop_lat,
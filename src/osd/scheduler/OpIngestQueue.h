@@ -0,0 +1,107 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <optional>
+
+#include "osd/scheduler/OpSchedulerItem.h"
+
+namespace ceph::osd::scheduler {
+
+/**
+ * OpIngestQueue
+ *
+ * Unbounded multi producer, single consumer FIFO through which ops reach an
+ * OSDShard without taking shard_lock.  push() is wait free: one exchange
+ * and one store.  pop() may only be called by one thread at a time (the
+ * OSDShard calls it with shard_lock held) and can come back empty while a
+ * push is half done, i.e. between the exchange and the link; size() already
+ * counts such an op, so callers see it once the link lands.
+ *
+ * Based on Dmitry Vyukov's intrusive MPSC node based queue.
+ */
+class OpIngestQueue {
+  struct node_t {
+    std::atomic<node_t*> next = {nullptr};
+    std::optional<OpSchedulerItem> item;
+
+    node_t() = default;
+    explicit node_t(OpSchedulerItem&& i) : item(std::move(i)) {}
+  };
+
+  alignas(64) std::atomic<node_t*> head;	///< producers
+  alignas(64) std::atomic<int64_t> count = {0};
+  alignas(64) node_t* tail;			///< consumer
+  node_t stub;
+
+  void _link(node_t* n) {
+    n->next.store(nullptr, std::memory_order_relaxed);
+    node_t* prev = head.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+
+public:
+  OpIngestQueue() : head(&stub), tail(&stub) {}
+  ~OpIngestQueue() {
+    while (pop()) {}
+  }
+  OpIngestQueue(const OpIngestQueue&) = delete;
+  OpIngestQueue& operator=(const OpIngestQueue&) = delete;
+
+  void push(OpSchedulerItem&& item) {
+    _link(new node_t(std::move(item)));
+    // sequentially consistent so that a consumer about to sleep either
+    // sees this op or is seen by the producer, see OSDShard::_begin_idle()
+    count.fetch_add(1);
+  }
+
+  std::optional<OpSchedulerItem> pop() {
+    node_t* t = tail;
+    node_t* next = t->next.load(std::memory_order_acquire);
+    if (t == &stub) {
+      if (!next) {
+	return std::nullopt;
+      }
+      tail = t = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (!next) {
+      if (t != head.load(std::memory_order_acquire)) {
+	// a producer is between the exchange and the link
+	return std::nullopt;
+      }
+      // t is the last op; put the stub behind it so that t can go
+      _link(&stub);
+      next = t->next.load(std::memory_order_acquire);
+      if (!next) {
+	return std::nullopt;
+      }
+    }
+    tail = next;
+    std::optional<OpSchedulerItem> ret = std::move(t->item);
+    delete t;
+    count.fetch_sub(1, std::memory_order_relaxed);
+    return ret;
+  }
+
+  /// ops pushed and not yet popped, including those still being linked
+  int64_t size() const {
+    return count.load();
+  }
+  bool empty() const {
+    return size() == 0;
+  }
+};
+
+} // namespace ceph::osd::scheduler
@@ -24,7 +24,8 @@ namespace ceph::osd::scheduler {
 OpSchedulerRef make_scheduler(
   CephContext *cct, int whoami, uint32_t num_shards, int shard_id,
   bool is_rotational, std::string_view osd_objectstore,
-  op_queue_type_t osd_scheduler, unsigned op_queue_cut_off, MonClient *monc)
+  op_queue_type_t osd_scheduler, unsigned op_queue_cut_off, MonClient *monc,
+  mClockCapacityEstimator *capacity_estimator)
 {
   // Force the use of 'wpq' scheduler for filestore OSDs.
   // The 'mclock_scheduler' is not supported for filestore OSDs.
@@ -41,7 +42,7 @@ OpSchedulerRef make_scheduler(
     // default is 'mclock_scheduler'
     return std::make_unique<
       mClockScheduler>(cct, whoami, num_shards, shard_id, is_rotational,
-        op_queue_cut_off, monc);
+        op_queue_cut_off, monc, capacity_estimator);
   } else {
     ceph_assert("Invalid choice of wq" == 0);
   }
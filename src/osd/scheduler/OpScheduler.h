@@ -24,6 +24,8 @@
 
 namespace ceph::osd::scheduler {
 
+class mClockCapacityEstimator;
+
 using client = uint64_t;
 using WorkItem = std::variant<std::monostate, OpSchedulerItem, double>;
 
@@ -68,7 +70,8 @@ using OpSchedulerRef = std::unique_ptr<OpScheduler>;
 OpSchedulerRef make_scheduler(
   CephContext *cct, int whoami, uint32_t num_shards, int shard_id,
   bool is_rotational, std::string_view osd_objectstore,
-  op_queue_type_t osd_scheduler, unsigned op_queue_cut_off, MonClient *monc);
+  op_queue_type_t osd_scheduler, unsigned op_queue_cut_off, MonClient *monc,
+  mClockCapacityEstimator *capacity_estimator = nullptr);
 
 /**
  * Implements OpScheduler in terms of OpQueue
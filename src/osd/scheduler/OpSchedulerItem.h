@@ -15,6 +15,9 @@
 #pragma once
 
 #include <ostream>
+#include <string_view>
+
+#include "dmclock/src/dmclock_recs.h"
 
 #include "include/types.h"
 #include "include/utime_fmt.h"
@@ -78,6 +81,21 @@ public:
     virtual void run(OSD *osd, OSDShard *sdata, PGRef& pg, ThreadPool::TPHandle &handle) = 0;
     virtual op_scheduler_class get_scheduler_class() const = 0;
 
+    /// client QoS tag and dmclock request params, see MOSDOp::set_qos()
+    virtual std::string_view get_qos_tag() const {
+      return {};
+    }
+    /// authenticated entity that sent a tagged op
+    virtual std::string_view get_qos_entity() const {
+      return {};
+    }
+    virtual crimson::dmclock::ReqParams get_qos_params() const {
+      return {};
+    }
+    /// called as mClockScheduler dequeues the item
+    virtual void set_qos_served(uint32_t cost,
+				crimson::dmclock::PhaseType phase) {}
+
     virtual ~OpQueueable() {}
     friend std::ostream& operator<<(std::ostream& out, const OpQueueable& q) {
       return q.print(out);
@@ -102,6 +120,9 @@ private:
    */
   uint32_t qos_cost = 0;
 
+  /// when ShardedOpWQ took the item in; cleared once it is dequeued
+  ceph::mono_time enqueue_stamp;
+
   /// True iff queued via mclock proper, not the high/immediate queues
   bool was_queued_via_mclock() const {
     return qos_cost > 0;
@@ -165,10 +186,30 @@ public:
     return qitem->get_scheduler_class();
   }
 
+  std::string_view get_qos_tag() const {
+    return qitem->get_qos_tag();
+  }
+  std::string_view get_qos_entity() const {
+    return qitem->get_qos_entity();
+  }
+  crimson::dmclock::ReqParams get_qos_params() const {
+    return qitem->get_qos_params();
+  }
+  void set_qos_served(crimson::dmclock::PhaseType phase) {
+    qitem->set_qos_served(qos_cost, phase);
+  }
+
   void set_qos_cost(uint32_t scaled_cost) {
     qos_cost = scaled_cost;
   }
 
+  void set_enqueue_stamp(ceph::mono_time t) {
+    enqueue_stamp = t;
+  }
+  ceph::mono_time take_enqueue_stamp() {
+    return std::exchange(enqueue_stamp, ceph::mono_time());
+  }
+
   friend std::ostream& operator<<(std::ostream& out, const OpSchedulerItem& item) {
     out << "OpSchedulerItem("
         << item.get_ordering_token() << " " << *item.qitem;
@@ -224,9 +265,12 @@ public:
 
 class PGOpItem : public PGOpQueueable {
   OpRequestRef op;
+  std::string qos_entity;
 
 public:
-  PGOpItem(spg_t pg, OpRequestRef op) : PGOpQueueable(pg), op(std::move(op)) {}
+  PGOpItem(spg_t pg, OpRequestRef op, std::string qos_entity = {})
+    : PGOpQueueable(pg), op(std::move(op)),
+      qos_entity(std::move(qos_entity)) {}
 
   std::ostream &print(std::ostream &rhs) const final {
     return rhs << "PGOpItem(op=" << *(op->get_req()) << ")";
@@ -250,6 +294,35 @@ public:
     }
   }
 
+  std::string_view get_qos_tag() const final {
+    if (op->get_req()->get_type() != CEPH_MSG_OSD_OP) {
+      return {};
+    }
+    return op->get_req<MOSDOp>()->get_qos_tag();
+  }
+
+  std::string_view get_qos_entity() const final {
+    return qos_entity;
+  }
+
+  crimson::dmclock::ReqParams get_qos_params() const final {
+    if (op->get_req()->get_type() != CEPH_MSG_OSD_OP) {
+      return {};
+    }
+    auto m = op->get_req<MOSDOp>();
+    // a bad client must not trip dmclock's rho <= delta assert
+    return crimson::dmclock::ReqParams(
+      m->get_qos_delta(), std::min(m->get_qos_rho(), m->get_qos_delta()));
+  }
+
+  void set_qos_served(uint32_t cost,
+		      crimson::dmclock::PhaseType phase) final {
+    if (op->get_req()->get_type() == CEPH_MSG_OSD_OP) {
+      static_cast<MOSDOp*>(op->get_nonconst_req())->set_qos_served(
+	cost, phase == crimson::dmclock::PhaseType::reservation);
+    }
+  }
+
   void run(OSD *osd, OSDShard *sdata, PGRef& pg, ThreadPool::TPHandle &handle) final;
 };
 
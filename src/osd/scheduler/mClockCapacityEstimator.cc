@@ -0,0 +1,243 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <algorithm>
+
+#include "osd/scheduler/mClockCapacityEstimator.h"
+#include "common/debug.h"
+#include "common/Formatter.h"
+#include "include/intarith.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_mclock
+#undef dout_prefix
+#define dout_prefix *_dout << "mClockCapacityEstimator: "
+
+namespace ceph::osd::scheduler {
+
+unsigned mClockCapacityEstimator::bin_of(uint64_t bytes)
+{
+  return std::min<unsigned>(NUM_BINS - 1, cbits(bytes >> 12));
+}
+
+void mClockCapacityEstimator::note_op(
+  uint64_t bytes, ceph::timespan queued, ceph::timespan serviced)
+{
+  auto &bin = bins[bin_of(bytes)];
+  bin.ops.fetch_add(1, std::memory_order_relaxed);
+  bin.bytes.fetch_add(bytes, std::memory_order_relaxed);
+  bin.service_ns.fetch_add(serviced.count(), std::memory_order_relaxed);
+  queued_ns.fetch_add(queued.count(), std::memory_order_relaxed);
+}
+
+void mClockCapacityEstimator::_reset_window(ceph::mono_time now)
+{
+  window_start = now;
+  for (auto &bin : bins) {
+    bin.ops.store(0, std::memory_order_relaxed);
+    bin.bytes.store(0, std::memory_order_relaxed);
+    bin.service_ns.store(0, std::memory_order_relaxed);
+  }
+  queued_ns.store(0, std::memory_order_relaxed);
+  held.store(0, std::memory_order_relaxed);
+  background_ops.store(0, std::memory_order_relaxed);
+  background_bytes.store(0, std::memory_order_relaxed);
+}
+
+bool mClockCapacityEstimator::update(ceph::mono_time now)
+{
+  std::lock_guard l(lock);
+  auto &conf = cct->_conf;
+  if (!conf.get_val<bool>("osd_mclock_capacity_calibration")) {
+    if (enabled) {
+      dout(1) << __func__ << " calibration disabled, back to the configured"
+	      << " capacity" << dendl;
+      enabled = false;
+      generation.fetch_add(1, std::memory_order_release);
+      return true;
+    }
+    return false;
+  }
+
+  double conf_bandwidth = std::max<uint64_t>(1, conf.get_val<Option::size_t>(
+    is_rotational ? "osd_mclock_max_sequential_bandwidth_hdd" :
+		    "osd_mclock_max_sequential_bandwidth_ssd"));
+  double conf_iops = std::max<double>(1.0, conf.get_val<double>(
+    is_rotational ? "osd_mclock_max_capacity_iops_hdd" :
+		    "osd_mclock_max_capacity_iops_ssd"));
+  if (!enabled ||
+      conf_bandwidth != configured_bandwidth ||
+      conf_iops != configured_iops) {
+    // (re)start from the configured capacity
+    enabled = true;
+    configured_bandwidth = bandwidth = conf_bandwidth;
+    configured_iops = conf_iops;
+    cost_per_io = conf_bandwidth / conf_iops;
+    measured_bandwidth = measured_cost_per_io = 0;
+    saturated = false;
+    _reset_window(now);
+    dout(1) << __func__ << " starting from bandwidth " << bandwidth
+	    << " bytes/second, cost_per_io " << cost_per_io << " bytes/io"
+	    << dendl;
+    generation.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  auto interval = conf.get_val<std::chrono::seconds>(
+    "osd_mclock_capacity_calibration_interval");
+  if (now - window_start < interval) {
+    return false;
+  }
+  double secs = ceph::to_seconds<double>(now - window_start);
+
+  // collect the window; ops racing with this land in either window
+  std::array<double, NUM_BINS> ops, sizes, service;
+  double total_ops = 0, total_bytes = 0, total_service = 0;
+  for (unsigned i = 0; i < NUM_BINS; ++i) {
+    ops[i] = bins[i].ops.exchange(0, std::memory_order_relaxed);
+    double bytes = bins[i].bytes.exchange(0, std::memory_order_relaxed);
+    double ns = bins[i].service_ns.exchange(0, std::memory_order_relaxed);
+    total_ops += ops[i];
+    total_bytes += bytes;
+    total_service += ns;
+    if (ops[i]) {
+      sizes[i] = bytes / ops[i];
+      service[i] = ns / ops[i];
+    }
+  }
+  double total_queued = queued_ns.exchange(0, std::memory_order_relaxed);
+  uint64_t total_held = held.exchange(0, std::memory_order_relaxed);
+  double bg_ops = background_ops.exchange(0, std::memory_order_relaxed);
+  double bg_bytes = background_bytes.exchange(0, std::memory_order_relaxed);
+  window_start = now;
+  ++windows;
+
+  // weighted least squares fit of service time against size
+  measured_cost_per_io = 0;
+  double n = 0, mean_size = 0, mean_service = 0;
+  for (unsigned i = 0; i < NUM_BINS; ++i) {
+    if (ops[i] >= MIN_BIN_OPS) {
+      n += ops[i];
+      mean_size += ops[i] * sizes[i];
+      mean_service += ops[i] * service[i];
+    }
+  }
+  if (n > 0) {
+    mean_size /= n;
+    mean_service /= n;
+    double sxx = 0, sxy = 0;
+    for (unsigned i = 0; i < NUM_BINS; ++i) {
+      if (ops[i] >= MIN_BIN_OPS) {
+	sxx += ops[i] * (sizes[i] - mean_size) * (sizes[i] - mean_size);
+	sxy += ops[i] * (sizes[i] - mean_size) * (service[i] - mean_service);
+      }
+    }
+    if (sxx > 0) {
+      double ns_per_byte = sxy / sxx;
+      double ns_per_io = mean_service - ns_per_byte * mean_size;
+      if (ns_per_byte > 0 && ns_per_io > 0) {
+	measured_cost_per_io = ns_per_io / ns_per_byte;
+      }
+    }
+  }
+
+  // throughput, in mClock's cost units
+  measured_bandwidth = 0;
+  saturated = false;
+  if (total_ops >= MIN_WINDOW_OPS) {
+    // the device served the background ops as well
+    measured_bandwidth = (total_bytes + bg_bytes +
+			  (total_ops + bg_ops) * cost_per_io) / secs;
+    // ops waited at least as long as they took: demand exceeded what
+    // was served, unless it was mClock's limits that kept them waiting
+    saturated = total_queued >= total_service && !total_held;
+    if (saturated) {
+      ++saturated_windows;
+    }
+    if (total_held) {
+      ++held_windows;
+    }
+  }
+
+  const double gain = conf.get_val<double>(
+    "osd_mclock_capacity_calibration_gain");
+  const double max_change = conf.get_val<double>(
+    "osd_mclock_capacity_calibration_max_change");
+  const double range = conf.get_val<double>(
+    "osd_mclock_capacity_calibration_range");
+  auto step = [&](double cur, double target, double base) {
+    double next = cur + gain * (target - cur);
+    next = std::clamp(next, cur * (1.0 - max_change), cur * (1.0 + max_change));
+    return std::clamp(next, base / range, base * range);
+  };
+
+  bool changed = false;
+  if (measured_cost_per_io > 0) {
+    double next = step(cost_per_io, measured_cost_per_io,
+		       configured_bandwidth / configured_iops);
+    changed |= next != cost_per_io;
+    cost_per_io = next;
+  }
+  if (measured_bandwidth > 0 &&
+      (saturated || measured_bandwidth > bandwidth)) {
+    double next = step(bandwidth, measured_bandwidth, configured_bandwidth);
+    changed |= next != bandwidth;
+    bandwidth = next;
+  }
+
+  dout(10) << __func__ << " " << total_ops << " ops, " << bg_ops
+	   << " background ops in " << secs << "s"
+	   << (saturated ? " (saturated)" : "")
+	   << (total_held ? " (held by limits)" : "")
+	   << " measured bandwidth " << measured_bandwidth
+	   << " cost_per_io " << measured_cost_per_io
+	   << ", estimated bandwidth " << bandwidth
+	   << " cost_per_io " << cost_per_io << dendl;
+  if (changed) {
+    generation.fetch_add(1, std::memory_order_release);
+  }
+  return changed;
+}
+
+bool mClockCapacityEstimator::get_capacity(
+  double *_bandwidth, double *_iops) const
+{
+  std::lock_guard l(lock);
+  if (!enabled) {
+    return false;
+  }
+  *_bandwidth = bandwidth;
+  *_iops = bandwidth / cost_per_io;
+  return true;
+}
+
+void mClockCapacityEstimator::dump(ceph::Formatter *f) const
+{
+  std::lock_guard l(lock);
+  f->dump_bool("enabled", enabled);
+  if (!enabled) {
+    return;
+  }
+  f->dump_float("configured_bandwidth", configured_bandwidth);
+  f->dump_float("configured_iops", configured_iops);
+  f->dump_float("bandwidth", bandwidth);
+  f->dump_float("iops", bandwidth / cost_per_io);
+  f->dump_float("cost_per_io", cost_per_io);
+  f->dump_float("measured_bandwidth", measured_bandwidth);
+  f->dump_float("measured_cost_per_io", measured_cost_per_io);
+  f->dump_bool("saturated", saturated);
+  f->dump_unsigned("windows", windows);
+  f->dump_unsigned("saturated_windows", saturated_windows);
+  f->dump_unsigned("held_windows", held_windows);
+}
+
+}
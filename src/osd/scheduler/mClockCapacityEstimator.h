@@ -0,0 +1,134 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+
+#include "common/ceph_context.h"
+#include "common/ceph_mutex.h"
+#include "common/ceph_time.h"
+
+namespace ceph { class Formatter; }
+
+namespace ceph::osd::scheduler {
+
+/**
+ * mClockCapacityEstimator
+ *
+ * Re-estimates the capacity mClockScheduler's cost model is built on from
+ * the ops the OSD completes, see osd_mclock_capacity_calibration.
+ *
+ * Completed ops are binned by size.  Every interval, the mean service time
+ * of each bin is fitted against its mean size, t = t0 + s * k: t0 / k is
+ * the cost of a random IO in sequential bytes (osd_bandwidth_cost_per_io),
+ * a ratio that does not depend on how many ops ran concurrently.  The
+ * bandwidth capacity is the cost completed per second, which only says
+ * something about the device while ops were queueing up for it -- or when
+ * it beats the current estimate.  Ops that mClock holds back by their
+ * limit queue up too, but then the device has room to spare, so a window
+ * in which that left a shard idle never counts as saturated.  Recovery,
+ * backfill and scrub share the device with client ops without going
+ * through note_op(), so the scheduler reports what it dequeues for them
+ * and their bytes count towards the throughput; otherwise client ops
+ * queueing behind background work would pass for a slow device.
+ *
+ * Each update moves the estimates a fraction of the way towards what was
+ * measured, by a bounded step, and keeps them within a range around the
+ * configured capacity.
+ *
+ * note_op(), note_background() and note_held() may be called from any
+ * thread; update() is
+ * driven by the OSD tick and the schedulers poll get_generation() to pick
+ * up new estimates.
+ */
+class mClockCapacityEstimator {
+public:
+  mClockCapacityEstimator(CephContext *cct, bool is_rotational)
+    : cct(cct), is_rotational(is_rotational) {}
+
+  /// account a completed op that moved bytes, after waiting queued and
+  /// being serviced for the given times
+  void note_op(uint64_t bytes, ceph::timespan queued, ceph::timespan serviced);
+
+  /// account a background op mClock dequeued, of the given cost in bytes
+  void note_background(uint64_t bytes) {
+    background_ops.fetch_add(1, std::memory_order_relaxed);
+    background_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  /// account a shard going idle while its queued ops are held back by
+  /// their limits
+  void note_held() {
+    held.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// run the control loop; true if the estimates changed
+  bool update(ceph::mono_time now);
+
+  /// bumped whenever get_capacity()'s result changes
+  uint64_t get_generation() const {
+    return generation.load(std::memory_order_acquire);
+  }
+
+  /// false unless calibration is enabled, in which case the estimates
+  /// replace osd_mclock_max_(sequential_bandwidth|capacity_iops)_*
+  bool get_capacity(double *bandwidth, double *iops) const;
+
+  void dump(ceph::Formatter *f) const;
+
+  static constexpr unsigned NUM_BINS = 12;  ///< <4KiB, 4KiB ... >=4MiB
+  static constexpr uint64_t MIN_BIN_OPS = 8;
+  static constexpr uint64_t MIN_WINDOW_OPS = 64;
+
+private:
+  struct bin_t {
+    std::atomic<uint64_t> ops = {0};
+    std::atomic<uint64_t> bytes = {0};
+    std::atomic<uint64_t> service_ns = {0};
+  };
+
+  CephContext *cct;
+  const bool is_rotational;
+
+  // filled by note_op()
+  std::array<bin_t, NUM_BINS> bins;
+  std::atomic<uint64_t> queued_ns = {0};
+  std::atomic<uint64_t> held = {0};
+  // filled by note_background()
+  std::atomic<uint64_t> background_ops = {0};
+  std::atomic<uint64_t> background_bytes = {0};
+
+  std::atomic<uint64_t> generation = {0};
+
+  mutable ceph::mutex lock =
+    ceph::make_mutex("mClockCapacityEstimator::lock");
+  bool enabled = false;
+  ceph::mono_time window_start;
+  double configured_bandwidth = 0;  ///< bytes/second
+  double configured_iops = 0;
+  double bandwidth = 0;             ///< bytes/second
+  double cost_per_io = 0;           ///< bytes/io
+  // the last window's measurements, 0 if there were too few ops
+  double measured_bandwidth = 0;
+  double measured_cost_per_io = 0;
+  bool saturated = false;
+  uint64_t windows = 0;
+  uint64_t saturated_windows = 0;
+  uint64_t held_windows = 0;
+
+  static unsigned bin_of(uint64_t bytes);
+  void _reset_window(ceph::mono_time now);
+};
+
+}
@@ -18,6 +18,8 @@
 
 #include "osd/scheduler/mClockScheduler.h"
 #include "common/dout.h"
+#include "common/strtol.h"
+#include "include/str_list.h"
 
 namespace dmc = crimson::dmclock;
 using namespace std::placeholders;
@@ -36,7 +38,8 @@ mClockScheduler::mClockScheduler(CephContext *cct,
   int shard_id,
   bool is_rotational,
   unsigned cutoff_priority,
-  MonClient *monc)
+  MonClient *monc,
+  mClockCapacityEstimator *capacity_estimator)
   : cct(cct),
     whoami(whoami),
     num_shards(num_shards),
@@ -44,6 +47,7 @@ mClockScheduler::mClockScheduler(CephContext *cct,
     is_rotational(is_rotational),
     cutoff_priority(cutoff_priority),
     monc(monc),
+    capacity_estimator(capacity_estimator),
     scheduler(
       std::bind(&mClockScheduler::ClientRegistry::get_info,
                 &client_registry,
@@ -57,6 +61,26 @@ mClockScheduler::mClockScheduler(CephContext *cct,
   set_config_defaults_from_profile();
   client_registry.update_from_config(
     cct->_conf, osd_bandwidth_capacity_per_shard);
+  client_registry.update_client_profiles(
+    cct, osd_bandwidth_capacity_per_shard);
+}
+
+static double res_from_ratio(double res, double capacity_per_shard)
+{
+  if (res) {
+    return res * capacity_per_shard;
+  } else {
+    return default_min; // min reservation
+  }
+}
+
+static double lim_from_ratio(double lim, double capacity_per_shard)
+{
+  if (lim) {
+    return lim * capacity_per_shard;
+  } else {
+    return default_max; // high limit
+  }
 }
 
 /* ClientRegistry holds the dmclock::ClientInfo configuration parameters
@@ -77,21 +101,11 @@ void mClockScheduler::ClientRegistry::update_from_config(
   const ConfigProxy &conf,
   const double capacity_per_shard)
 {
-
   auto get_res = [&](double res) {
-    if (res) {
-      return res * capacity_per_shard;
-    } else {
-      return default_min; // min reservation
-    }
+    return res_from_ratio(res, capacity_per_shard);
   };
-
   auto get_lim = [&](double lim) {
-    if (lim) {
-      return lim * capacity_per_shard;
-    } else {
-      return default_max; // high limit
-    }
+    return lim_from_ratio(lim, capacity_per_shard);
   };
 
   // Set external client infos
@@ -133,6 +147,72 @@ void mClockScheduler::ClientRegistry::update_from_config(
       get_lim(lim));
 }
 
+/* Each entry of osd_mclock_scheduler_client_qos_profiles reads
+ * <tag>=<res>:<wgt>:<lim>[:<entity>[+<entity>...]], with res and lim as
+ * ratios of the OSD's capacity like osd_mclock_scheduler_client_(res|lim)
+ * and the entities allowed to use the profile.  Tags may contain '=' and
+ * ':' themselves, so the last '=' separates the tag from its parameters.
+ * A tag keeps its profile id across updates for as long as it is listed.
+ */
+void mClockScheduler::ClientRegistry::update_client_profiles(
+  CephContext *cct,
+  const double capacity_per_shard)
+{
+  std::map<std::string, client_profile_t, std::less<>> profiles;
+  auto entries = get_str_list(
+    cct->_conf.get_val<std::string>("osd_mclock_scheduler_client_qos_profiles"),
+    ", \t");
+  for (auto &entry : entries) {
+    auto eq = entry.rfind('=');
+    std::vector<std::string> params;
+    if (eq != std::string::npos && eq > 0) {
+      get_str_vec(std::string_view(entry).substr(eq + 1), ":", params);
+    }
+    std::string err;
+    double res = 0, lim = 0;
+    long long wgt = 0;
+    if (params.size() == 3 || params.size() == 4) {
+      res = strict_strtod(params[0], &err);
+      if (err.empty()) {
+	wgt = strict_strtoll(params[1], 10, &err);
+      }
+      if (err.empty()) {
+	lim = strict_strtod(params[2], &err);
+      }
+    } else {
+      err = "expected <tag>=<res>:<wgt>:<lim>[:<entity>[+<entity>...]]";
+    }
+    if (err.empty() &&
+	(res < 0 || res > 1.0 || lim < 0 || lim > 1.0 || wgt < 1)) {
+      err = "res and lim must be within [0, 1] and wgt at least 1";
+    }
+    if (!err.empty()) {
+      derr << __func__ << " ignoring client profile '" << entry
+	   << "': " << err << dendl;
+      continue;
+    }
+    auto tag = entry.substr(0, eq);
+    auto old = client_profiles.find(tag);
+    client_profile_id_t id(
+      0, old != client_profiles.end() ? old->second.id.profile_id :
+      ++last_profile_id);
+    dmc::ClientInfo info(
+      res_from_ratio(res, capacity_per_shard),
+      wgt,
+      lim_from_ratio(lim, capacity_per_shard));
+    if (auto [p, inserted] = external_client_infos.try_emplace(id, info);
+	!inserted) {
+      p->second.update(info.reservation, info.weight, info.limit);
+    }
+    auto &profile = profiles[std::move(tag)];
+    profile.id = id;
+    if (params.size() == 4) {
+      get_str_vec(params[3], "+", profile.entities);
+    }
+  }
+  client_profiles.swap(profiles);
+}
+
 const dmc::ClientInfo *mClockScheduler::ClientRegistry::get_external_client(
   const client_profile_id_t &client) const
 {
@@ -176,6 +256,14 @@ void mClockScheduler::set_osd_capacity_params_from_config()
     }
   }();
 
+  if (capacity_estimator) {
+    capacity_generation = capacity_estimator->get_generation();
+    double bandwidth;
+    if (capacity_estimator->get_capacity(&bandwidth, &osd_iop_capacity)) {
+      osd_bandwidth_capacity = static_cast<uint64_t>(bandwidth);
+    }
+  }
+
   osd_bandwidth_capacity = std::max<uint64_t>(1, osd_bandwidth_capacity);
   osd_iop_capacity = std::max<double>(1.0, osd_iop_capacity);
 
@@ -365,6 +453,8 @@ void mClockScheduler::dump(ceph::Formatter &f) const
   std::ostringstream out;
   f.open_object_section("mClockClients");
   f.dump_int("client_count", scheduler.client_count());
+  f.dump_int("client_profile_count",
+	     client_registry.get_client_profile_count());
   out << scheduler;
   f.dump_string("clients", out.str());
   f.close_section();
@@ -374,6 +464,17 @@ void mClockScheduler::dump(ceph::Formatter &f) const
   f.dump_string("queues", display_queues());
   f.close_section();
 
+  f.open_object_section("capacity");
+  f.dump_float("osd_bandwidth_cost_per_io", osd_bandwidth_cost_per_io);
+  f.dump_float("osd_bandwidth_capacity_per_shard",
+	       osd_bandwidth_capacity_per_shard);
+  if (capacity_estimator) {
+    f.open_object_section("calibration");
+    capacity_estimator->dump(&f);
+    f.close_section();
+  }
+  f.close_section();
+
   f.open_object_section("HighPriorityQueue");
   for (auto it = high_priority.begin();
        it != high_priority.end(); it++) {
@@ -385,6 +486,17 @@ void mClockScheduler::dump(ceph::Formatter &f) const
 
 void mClockScheduler::enqueue(OpSchedulerItem&& item)
 {
+  if (capacity_estimator &&
+      capacity_estimator->get_generation() != capacity_generation) {
+    set_osd_capacity_params_from_config();
+    client_registry.update_from_config(
+      cct->_conf, osd_bandwidth_capacity_per_shard);
+    client_profiles_changed = true;
+  }
+  if (client_profiles_changed.exchange(false)) {
+    client_registry.update_client_profiles(
+      cct, osd_bandwidth_capacity_per_shard);
+  }
   auto id = get_scheduler_id(item);
   unsigned priority = item.get_priority();
   
@@ -396,15 +508,19 @@ void mClockScheduler::enqueue(OpSchedulerItem&& item)
   } else {
     auto cost = calc_scaled_cost(item.get_cost());
     item.set_qos_cost(cost);
+    auto params = item.get_qos_params();
     dout(20) << __func__ << " " << id
              << " item_cost: " << item.get_cost()
              << " scaled_cost: " << cost
+             << " delta: " << params.delta
+             << " rho: " << params.rho
              << dendl;
 
     // Add item to scheduler queue
     scheduler.add_request(
       std::move(item),
       id,
+      params,
       cost);
   }
 
@@ -465,6 +581,10 @@ WorkItem mClockScheduler::dequeue()
   } else {
     mclock_queue_t::PullReq result = scheduler.pull_request();
     if (result.is_future()) {
+      if (capacity_estimator) {
+	// the shard idles although ops are queued
+	capacity_estimator->note_held();
+      }
       return result.getTime();
     } else if (result.is_none()) {
       ceph_assert(
@@ -474,6 +594,13 @@ WorkItem mClockScheduler::dequeue()
       ceph_assert(result.is_retn());
 
       auto &retn = result.get_retn();
+      retn.request->set_qos_served(retn.phase);
+      if (capacity_estimator &&
+	  retn.request->get_scheduler_class() != op_scheduler_class::client) {
+	// client ops report their service times once they complete
+	capacity_estimator->note_background(
+	  std::max(retn.request->get_cost(), 0));
+      }
       return std::move(*retn.request);
     }
   }
@@ -503,6 +630,7 @@ const char** mClockScheduler::get_tracked_conf_keys() const
     "osd_mclock_max_sequential_bandwidth_hdd",
     "osd_mclock_max_sequential_bandwidth_ssd",
     "osd_mclock_profile",
+    "osd_mclock_scheduler_client_qos_profiles",
     NULL
   };
   return KEYS;
@@ -517,12 +645,17 @@ void mClockScheduler::handle_conf_change(
     set_osd_capacity_params_from_config();
     client_registry.update_from_config(
       conf, osd_bandwidth_capacity_per_shard);
+    client_profiles_changed = true;
   }
   if (changed.count("osd_mclock_max_sequential_bandwidth_hdd") ||
       changed.count("osd_mclock_max_sequential_bandwidth_ssd")) {
     set_osd_capacity_params_from_config();
     client_registry.update_from_config(
       conf, osd_bandwidth_capacity_per_shard);
+    client_profiles_changed = true;
+  }
+  if (changed.count("osd_mclock_scheduler_client_qos_profiles")) {
+    client_profiles_changed = true;
   }
   if (changed.count("osd_mclock_profile")) {
     set_config_defaults_from_profile();
@@ -15,9 +15,12 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <ostream>
 #include <map>
+#include <string_view>
 #include <vector>
 
 #include "boost/variant.hpp"
@@ -25,6 +28,7 @@
 #include "dmclock/src/dmclock_server.h"
 
 #include "osd/scheduler/OpScheduler.h"
+#include "osd/scheduler/mClockCapacityEstimator.h"
 #include "common/config.h"
 #include "common/ceph_context.h"
 #include "osd/scheduler/OpSchedulerItem.h"
@@ -43,14 +47,12 @@ constexpr double default_max = std::numeric_limits<double>::is_iec559 ?
  * client_id - global id (client.####) for client QoS
  * profile_id - id generated by client's QoS profile
  *
- * Currently (Reef and below), both members are set to
- * 0 which ensures that all external clients share the
- * mClock profile allocated reservation and limit
- * bandwidth.
- *
- * Note: Post Reef, both members will be set to non-zero
- * values when the distributed feature of the mClock
- * algorithm is utilized.
+ * client_id is always 0.  profile_id is 0 for ops sharing
+ * the default client profile and otherwise identifies the
+ * entry of osd_mclock_scheduler_client_qos_profiles matching
+ * the op's QoS tag, so that all the clients of a tenant
+ * share its reservation and limit.  Tags are not authenticated,
+ * so an entry only matches ops from the entities it allows.
  */
 struct client_profile_id_t {
   uint64_t client_id = 0;
@@ -113,7 +115,7 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
    * <size> + (osd_bandwidth_cost_per_io * <iops>) bytes.
    *
    * Set in set_osd_capacity_params_from_config in the constructor and upon
-   * config change.
+   * config change or a new capacity estimate.
    *
    * Has units bytes/io.
    */
@@ -132,7 +134,7 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
    * of shards.
    *
    * Set in set_osd_capacity_params_from_config in the constructor and upon
-   * config change.
+   * config change or a new capacity estimate.
    *
    * This value gets passed to ClientRegistry::update_from_config in order
    * to resolve the full reservaiton and limit parameters for mclock from
@@ -142,6 +144,17 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
    */
   double osd_bandwidth_capacity_per_shard;
 
+  /**
+   * capacity_estimator
+   *
+   * Shared by the OSD's shards, may be null.  Once it has estimates they
+   * replace the configured capacity; capacity_generation is the estimator
+   * generation the derived params above were last computed at.  dequeue()
+   * tells it when limits hold the remaining ops back.
+   */
+  mClockCapacityEstimator *capacity_estimator;
+  uint64_t capacity_generation = 0;
+
   class ClientRegistry {
     std::array<
       crimson::dmclock::ClientInfo,
@@ -153,8 +166,33 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
     };
 
     crimson::dmclock::ClientInfo default_external_client_info = {1, 1, 1};
+    /**
+     * external_client_infos
+     *
+     * Entries are never erased: dmclock holds on to the ClientInfo of
+     * every client it has seen, so a profile removed from the config
+     * keeps its last values until the OSD restarts.
+     */
     std::map<client_profile_id_t,
 	     crimson::dmclock::ClientInfo> external_client_infos;
+    struct client_profile_t {
+      client_profile_id_t id;
+      /// entities that may use the profile, "*" for any; if empty, only
+      /// the entity the tag names
+      std::vector<std::string> entities;
+
+      bool allows(std::string_view tag, std::string_view entity) const {
+	if (entities.empty()) {
+	  return entity == tag;
+	}
+	return std::any_of(
+	  entities.begin(), entities.end(),
+	  [entity](const auto &e) { return e == "*" || e == entity; });
+      }
+    };
+    /// QoS tag -> profile, from osd_mclock_scheduler_client_qos_profiles
+    std::map<std::string, client_profile_t, std::less<>> client_profiles;
+    uint64_t last_profile_id = 0;
     const crimson::dmclock::ClientInfo *get_external_client(
       const client_profile_id_t &client) const;
   public:
@@ -168,10 +206,43 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
     void update_from_config(
       const ConfigProxy &conf,
       double capacity_per_shard);
+    /**
+     * update_client_profiles
+     *
+     * Parses osd_mclock_scheduler_client_qos_profiles.  Must not race
+     * with get_info(), see client_profiles_changed.
+     */
+    void update_client_profiles(
+      CephContext *cct,
+      double capacity_per_shard);
+    client_profile_id_t get_client_profile_id(
+      std::string_view tag, std::string_view entity) const {
+      if (tag.empty() || client_profiles.empty()) {
+	return client_profile_id_t();
+      }
+      auto p = client_profiles.find(tag);
+      if (p == client_profiles.end() || !p->second.allows(tag, entity)) {
+	return client_profile_id_t();
+      }
+      return p->second.id;
+    }
+    size_t get_client_profile_count() const {
+      return client_profiles.size();
+    }
     const crimson::dmclock::ClientInfo *get_info(
       const scheduler_id_t &id) const;
   } client_registry;
 
+  /**
+   * client_profiles_changed
+   *
+   * Set by handle_conf_change() when the client profiles or the capacity
+   * change.  The profiles are then rebuilt by the next enqueue(), which
+   * the OSD serializes with dequeue(), rather than under dmclock's feet
+   * from the config observer.
+   */
+  std::atomic<bool> client_profiles_changed = {false};
+
   using mclock_queue_t = crimson::dmclock::PullPriorityQueue<
     scheduler_id_t,
     OpSchedulerItem,
@@ -192,10 +263,14 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
   SubQueue high_priority;
   priority_t immediate_class_priority = std::numeric_limits<priority_t>::max();
 
-  static scheduler_id_t get_scheduler_id(const OpSchedulerItem &item) {
+  scheduler_id_t get_scheduler_id(const OpSchedulerItem &item) const {
+    auto class_id = item.get_scheduler_class();
     return scheduler_id_t{
-      item.get_scheduler_class(),
-      client_profile_id_t()
+      class_id,
+      class_id == op_scheduler_class::client ?
+        client_registry.get_client_profile_id(item.get_qos_tag(),
+					      item.get_qos_entity()) :
+        client_profile_id_t()
     };
   }
 
@@ -206,10 +281,12 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
    * and osd_bandwidth_capacity_per_shard, internally.  These two
    * parameters are derived from config parameters
    * osd_mclock_max_capacity_iops_(hdd|ssd) and
-   * osd_mclock_max_sequential_bandwidth_(hdd|ssd) as well as num_shards.
-   * Invoking set_osd_capacity_params_from_config() resets those derived
-   * params based on the current config and should be invoked any time they
-   * are modified as well as in the constructor.  See handle_conf_change().
+   * osd_mclock_max_sequential_bandwidth_(hdd|ssd) as well as num_shards,
+   * or from capacity_estimator's estimates of the former two when it has
+   * any.  Invoking set_osd_capacity_params_from_config() resets those
+   * derived params based on the current config and should be invoked any
+   * time they are modified as well as in the constructor.  See
+   * handle_conf_change() and enqueue().
    */
   void set_osd_capacity_params_from_config();
 
@@ -219,7 +296,8 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
 public: 
   mClockScheduler(CephContext *cct, int whoami, uint32_t num_shards,
     int shard_id, bool is_rotational, unsigned cutoff_priority,
-    MonClient *monc);
+    MonClient *monc,
+    mClockCapacityEstimator *capacity_estimator = nullptr);
   ~mClockScheduler() override;
 
   /// Calculate scaled cost per item
@@ -58,6 +58,8 @@
 #include "common/async/waiter.h"
 #include "error_code.h"
 
+#include "dmclock/src/dmclock_client.h"
+
 
 using std::list;
 using std::make_pair;
@@ -101,6 +103,27 @@ namespace asio = boost::asio;
 #undef dout_prefix
 #define dout_prefix *_dout << messenger->get_myname() << ".objecter "
 
+// the service each OSD has given us, for dmclock's distributed request
+// params (delta and rho) that go out with every op.  Each tag is its own
+// dmclock client on the OSDs, so each gets its own tracker: the service
+// one tag received says nothing about another's.
+struct Objecter::QosTracker {
+  using tracker_t = crimson::dmclock::ServiceTracker<int>;
+
+  ceph::mutex lock = ceph::make_mutex("Objecter::QosTracker::lock");
+  std::map<std::string, std::unique_ptr<tracker_t>, std::less<>> trackers;
+
+  tracker_t& get(std::string_view tag) {
+    std::lock_guard l(lock);
+    auto p = trackers.find(tag);
+    if (p == trackers.end()) {
+      p = trackers.emplace(std::string(tag),
+			   std::make_unique<tracker_t>()).first;
+    }
+    return *p->second;
+  }
+};
+
 
 enum {
   l_osdc_first = 123200,
@@ -3243,6 +3266,14 @@ Objecter::MOSDOp *Objecter::_prepare_osd_op(Op *op)
      m->otel_trace = jspan_context(*op->otel_trace);
   }
 
+  if (qos_tracker) {
+    const auto& tag = op->qos_tag.empty() ? qos_default_tag : op->qos_tag;
+    auto params = qos_tracker->get(tag).get_req_params(op->target.osd);
+    m->set_qos(tag, params.delta, params.rho);
+  } else if (!op->qos_tag.empty()) {
+    m->set_qos(op->qos_tag, 0, 0);
+  }
+
   logger->inc(l_osdc_op_send);
   ssize_t sum = 0;
   for (unsigned i = 0; i < m->ops.size(); i++) {
@@ -3422,6 +3453,16 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
   Op *op = iter->second;
   op->trace.event("osd op reply");
 
+  if (qos_tracker && m->get_qos_cost()) {
+    // credit the tag the op went out with
+    qos_tracker->get(op->qos_tag.empty() ? qos_default_tag : op->qos_tag)
+      .track_resp(
+	s->osd,
+	m->is_qos_reservation() ? crimson::dmclock::PhaseType::reservation :
+				  crimson::dmclock::PhaseType::priority,
+	m->get_qos_cost());
+  }
+
   if (retry_writes_after_first_reply && op->attempts == 1 &&
       (op->target.flags & CEPH_OSD_FLAG_WRITE)) {
     ldout(cct, 7) << "retrying write after first reply: " << tid << dendl;
@@ -5087,6 +5128,10 @@ Objecter::Objecter(CephContext *cct,
 {
   mon_timeout = cct->_conf.get_val<std::chrono::seconds>("rados_mon_op_timeout");
   osd_timeout = cct->_conf.get_val<std::chrono::seconds>("rados_osd_op_timeout");
+  if (cct->_conf.get_val<bool>("objecter_mclock_qos")) {
+    qos_tracker = std::make_unique<QosTracker>();
+    qos_default_tag = cct->_conf->name.to_str();
+  }
 }
 
 Objecter::~Objecter()
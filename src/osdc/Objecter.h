@@ -2059,6 +2059,7 @@ public:
     osd_reqid_t reqid; // explicitly setting reqid
     ZTracer::Trace trace;
     const jspan_context* otel_trace = nullptr;
+    std::string qos_tag; // selects the OSDs' mClock client profile
 
     static bool has_completion(decltype(onfinish)& f) {
       return std::visit([](auto&& arg) { return bool(arg);}, f);
@@ -2558,6 +2559,11 @@ public:
   ceph::timespan mon_timeout;
   ceph::timespan osd_timeout;
 
+  // per-client mClock QoS, see objecter_mclock_qos
+  struct QosTracker;
+  std::unique_ptr<QosTracker> qos_tracker;
+  std::string qos_default_tag;
+
   MOSDOp *_prepare_osd_op(Op *op);
   void _send_op(Op *op);
   void _send_op_account(Op *op);
@@ -3078,13 +3084,15 @@ public:
 	      ceph::real_time mtime, int flags,
 	      Op::OpComp oncommit,
 	      version_t *objver = NULL, osd_reqid_t reqid = osd_reqid_t(),
-	      ZTracer::Trace *parent_trace = nullptr) {
+	      ZTracer::Trace *parent_trace = nullptr,
+	      std::string qos_tag = {}) {
     Op *o = new Op(oid, oloc, std::move(op.ops), flags | global_op_flags |
 		   CEPH_OSD_FLAG_WRITE, std::move(oncommit), objver,
 		   nullptr, parent_trace);
     o->priority = op.priority;
     o->mtime = mtime;
     o->snapc = snapc;
+    o->qos_tag = std::move(qos_tag);
     o->out_bl.swap(op.out_bl);
     o->out_handler.swap(op.out_handler);
     o->out_rval.swap(op.out_rval);
@@ -3149,13 +3157,15 @@ public:
 	    ObjectOperation&& op, snapid_t snapid, ceph::buffer::list *pbl,
 	    int flags, Op::OpComp onack,
 	    version_t *objver = nullptr, int *data_offset = nullptr,
-	    uint64_t features = 0, ZTracer::Trace *parent_trace = nullptr) {
+	    uint64_t features = 0, ZTracer::Trace *parent_trace = nullptr,
+	    std::string qos_tag = {}) {
     Op *o = new Op(oid, oloc, std::move(op.ops), flags | global_op_flags |
 		   CEPH_OSD_FLAG_READ, std::move(onack), objver,
 		   data_offset, parent_trace);
     o->priority = op.priority;
     o->snapid = snapid;
     o->outbl = pbl;
+    o->qos_tag = std::move(qos_tag);
     // XXX
     if (!o->outbl && op.size() == 1 && op.out_bl[0] && op.out_bl[0]->length()) {
       o->outbl = op.out_bl[0];
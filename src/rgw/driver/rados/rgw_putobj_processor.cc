@@ -131,8 +131,13 @@ void RadosWriter::set_head_obj(const rgw_obj& head)
 
 int RadosWriter::set_stripe_obj(const rgw_raw_obj& raw_obj)
 {
-  return rgw_get_rados_ref(dpp, store->get_rados_handle(), raw_obj,
-			   &stripe_obj);
+  int r = rgw_get_rados_ref(dpp, store->get_rados_handle(), raw_obj,
+			    &stripe_obj);
+  if (r < 0) {
+    return r;
+  }
+  stripe_obj.ioctx.set_qos_tag(get_bucket_qos_tag(store->ctx(), bucket_info.bucket));
+  return 0;
 }
 
 int RadosWriter::process(bufferlist&& bl, uint64_t offset)
@@ -2438,6 +2438,7 @@ int RGWRados::get_obj_head_ioctx(const DoutPrefixProvider *dpp,
   }
 
   ioctx->locator_set_key(key);
+  ioctx->set_qos_tag(get_bucket_qos_tag(cct, obj.bucket));
 
   return 0;
 }
@@ -2460,6 +2461,7 @@ int RGWRados::get_obj_head_ref(const DoutPrefixProvider *dpp,
 		      << raw.pool << "); r=" << r << dendl;
     return r;
   }
+  ref->ioctx.set_qos_tag(get_bucket_qos_tag(cct, obj.bucket));
   return 0;
 }
 
@@ -7275,6 +7277,7 @@ int RGWRados::get_obj_iterate_cb(const DoutPrefixProvider *dpp,
     ldpp_dout(dpp, 4) << "failed to open rados context for " << read_obj << dendl;
     return r;
   }
+  obj.ioctx.set_qos_tag(d->qos_tag);
 
   ldpp_dout(dpp, 20) << "rados->get_obj_iterate_cb oid=" << read_obj.oid << " obj-ofs=" << obj_ofs << " read_ofs=" << read_ofs << " len=" << len << dendl;
   op.read(read_ofs, len, nullptr, nullptr);
@@ -7297,6 +7300,7 @@ int RGWRados::Object::Read::iterate(const DoutPrefixProvider *dpp, int64_t ofs,
 
   auto aio = rgw::make_throttle(window_size, y);
   get_obj_data data(store, cb, &*aio, ofs, y);
+  data.qos_tag = get_bucket_qos_tag(cct, source->get_bucket_info().bucket);
 
   int r = store->iterate_obj(dpp, source->get_ctx(), source->get_bucket_info(), state.obj,
                              ofs, end, chunk_size, _get_obj_iterate_cb, &data, y);
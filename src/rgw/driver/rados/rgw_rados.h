@@ -79,6 +79,17 @@ static inline void prepend_bucket_marker(const rgw_bucket& bucket, const std::st
   }
 }
 
+/// tags a bucket's ops for the OSDs' per-client mClock QoS profiles,
+/// empty unless rgw_mclock_qos_tag is set
+static inline std::string get_bucket_qos_tag(CephContext *cct,
+                                             const rgw_bucket& bucket)
+{
+  if (!cct->_conf.get_val<bool>("rgw_mclock_qos_tag")) {
+    return {};
+  }
+  return "rgw/" + bucket.get_key('/', 0);
+}
+
 static inline void get_obj_bucket_and_oid_loc(const rgw_obj& obj, std::string& oid, std::string& locator)
 {
   const rgw_bucket& bucket = obj.bucket;
@@ -1677,6 +1688,7 @@ struct get_obj_data {
   uint64_t offset; // next offset to write to client
   rgw::AioResultList completed; // completed read results, sorted by offset
   optional_yield yield;
+  std::string qos_tag;
 
   get_obj_data(RGWRados* rgwrados, RGWGetDataCB* cb, rgw::Aio* aio,
                uint64_t offset, optional_yield yield)
@@ -2580,6 +2580,36 @@ TEST(BufferList, crc32c_zeros) {
   }
 }
 
+TEST(BufferList, crc32c_primed) {
+  constexpr unsigned chunk = 4096;
+  constexpr unsigned nchunks = 16;
+  bufferptr p = buffer::create_page_aligned(chunk * nchunks);
+  for (unsigned i = 0; i < p.length(); i++) {
+    p.c_str()[i] = rand();
+  }
+  uint32_t expected = ceph_crc32c(-1, (unsigned char*)p.c_str(), p.length());
+
+  // fold per chunk crcs the way a checksummed reader would
+  uint32_t crc = -1;
+  for (unsigned i = 0; i < nchunks; i++) {
+    uint32_t c = ceph_crc32c(-1, (unsigned char*)p.c_str() + i * chunk, chunk);
+    crc = c ^ ceph_crc32c(crc ^ -1, nullptr, chunk);
+  }
+  ASSERT_EQ(expected, crc);
+
+  // a bogus primed value is what we get back, i.e. the cache is used
+  bufferlist bl;
+  bl.push_back(p);
+  bl.front().set_crc32c(-1, crc + 1);
+  ASSERT_EQ(crc + 1, bl.crc32c(-1));
+  bl.invalidate_crc();
+  ASSERT_EQ(crc, bl.crc32c(-1));
+  // a primed value is adjusted for other seeds
+  bl.front().set_crc32c(-1, crc);
+  ASSERT_EQ(ceph_crc32c(0, (unsigned char*)p.c_str(), p.length()),
+            bl.crc32c(0));
+}
+
 TEST(BufferList, crc32c_append_perf) {
   int len = 256 * 1024 * 1024;
   bufferptr a(len);
@@ -798,6 +798,13 @@ bool IoCtx::get_pool_full_try() {
   return false;
 }
 
+void IoCtx::set_qos_tag(const std::string& tag) {
+}
+
+std::string IoCtx::get_qos_tag() const {
+  return "";
+}
+
 static int save_operation_result(int result, int *pval) {
   if (pval != NULL) {
     *pval = result;
@@ -13,6 +13,7 @@
 #include "include/stringify.h"
 #include "include/Context.h"
 #include "os/bluestore/Allocator.h"
+#include "os/bluestore/AllocatorTrace.h"
 
 using namespace std;
 
@@ -652,7 +653,70 @@ TEST_P(AllocTest, test_init_rm_free_unbound)
   }
 }
 
+TEST_P(AllocTest, test_trace)
+{
+  int64_t block_size = 0x1000;
+  int64_t capacity = block_size * 1024;
+  init_alloc(capacity, block_size);
+  alloc->init_add_free(0, block_size * 16);
+  alloc->init_add_free(block_size * 32, block_size * 64);
+
+  std::string path = "unittest_alloc_trace." + stringify(getpid());
+  ASSERT_EQ(0, alloc->start_trace(g_ceph_context, path, 0));
+  ASSERT_EQ(-EBUSY, alloc->start_trace(g_ceph_context, path, 0));
+  PExtentVector extents;
+  int64_t r = alloc->allocate(block_size * 8, block_size, 0, 0, &extents);
+  ASSERT_EQ(block_size * 8, r);
+  interval_set<uint64_t> release_set;
+  for (auto& e : extents) {
+    release_set.union_insert(e.offset, e.length);
+  }
+  alloc->release(release_set);
+  ASSERT_EQ(0, alloc->stop_trace());
+  // calls after stop are not recorded
+  extents.clear();
+  alloc->allocate(block_size, block_size, 0, 0, &extents);
+
+  alloc_trace_header_t h;
+  std::vector<alloc_trace_record_t> records;
+  std::string err;
+  ASSERT_EQ(0, read_alloc_trace(path,
+    &h,
+    [&](const alloc_trace_record_t& rec) {
+      records.push_back(rec);
+    },
+    &err)) << err;
+  ::unlink(path.c_str());
+
+  EXPECT_EQ((uint64_t)capacity, h.capacity);
+  EXPECT_EQ((uint64_t)block_size, h.block_size);
+  EXPECT_EQ(string(GetParam()), h.alloc_type);
+  uint64_t free = 0;
+  for (auto& [offset, length] : h.free_extents) {
+    free += length;
+  }
+  EXPECT_EQ((uint64_t)block_size * 80, free);
+
+  ASSERT_EQ(2u, records.size());
+  EXPECT_EQ(alloc_trace_record_t::OP_ALLOCATE, records[0].op);
+  EXPECT_EQ((uint64_t)block_size * 8, records[0].want);
+  EXPECT_EQ((uint64_t)block_size, records[0].unit);
+  EXPECT_EQ(r, records[0].result);
+  interval_set<uint64_t> traced;
+  for (auto& [offset, length] : records[0].extents) {
+    traced.union_insert(offset, length);
+  }
+  EXPECT_EQ(release_set, traced);
+  EXPECT_EQ(alloc_trace_record_t::OP_RELEASE, records[1].op);
+  EXPECT_LE(records[0].stamp_ns, records[1].stamp_ns);
+  traced.clear();
+  for (auto& [offset, length] : records[1].extents) {
+    traced.insert(offset, length);
+  }
+  EXPECT_EQ(release_set, traced);
+}
+
 INSTANTIATE_TEST_SUITE_P(
   Allocator,
   AllocTest,
-  ::testing::Values("stupid", "bitmap", "avl", "hybrid", "btree"));
+  ::testing::Values("stupid", "bitmap", "avl", "hybrid", "btree", "sizeclass"));
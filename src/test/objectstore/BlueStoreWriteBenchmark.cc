@@ -0,0 +1,474 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * BlueStore write path micro-benchmark.
+ *
+ * Drives BlueStore::queue_transactions() directly against a file backed
+ * KernelDevice (tmpfs by default, so the device itself is not what gets
+ * measured) and reports the average time a transaction spends in each
+ * state, allocator calls, heap allocations and CPU cycles per op.
+ */
+
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/ceph_argparse.h"
+#include "common/Cycles.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "common/strtol.h"
+#include "global/global_init.h"
+#include "include/Context.h"
+#include "include/scope_guard.h"
+#include "include/str_list.h"
+#include "include/stringify.h"
+#include "os/ObjectStore.h"
+#include "os/bluestore/BlueStore.h"
+
+using namespace std;
+
+// every C++ heap allocation made by the process, those of the store's own
+// threads included
+static std::atomic<uint64_t> heap_allocs = {0};
+
+void* operator new(size_t size)
+{
+  heap_allocs.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+
+static void usage()
+{
+  cout << "usage: ceph_perf_bluestore_write [flags]\n"
+    "	 --path <dir>\n"
+    "	       store directory, created empty (default /dev/shm/bluestore_write_bench)\n"
+    "	 --device-size <bytes>\n"
+    "	       size of the block file (default 10G)\n"
+    "	 --min-alloc-size <bytes>\n"
+    "	       bluestore_min_alloc_size, 0 keeps the default\n"
+    "	 --write-sizes <bytes>[,<bytes>...]\n"
+    "	       write sizes, picked uniformly per op (default 4K)\n"
+    "	 --object-size <bytes>\n"
+    "	       objects never grow past this size (default 4M)\n"
+    "	 --objects <n>\n"
+    "	       number of objects written to (default 64)\n"
+    "	 --ops <n>\n"
+    "	       number of measured write ops (default 10000)\n"
+    "	 --warmup <n>\n"
+    "	       number of unmeasured write ops issued first (default 0)\n"
+    "	 --queue-depth <n>\n"
+    "	       transactions in flight (default 16)\n"
+    "	 --overwrite-ratio <0..1>\n"
+    "	       fraction of ops that overwrite existing data rather than append (default 0.5)\n"
+    "	 --compression <mode>\n"
+    "	       bluestore_compression_mode (default none)\n"
+    "	 --compression-algorithm <name>\n"
+    "	       bluestore_compression_algorithm (default snappy)\n"
+    "	 --csum <type>\n"
+    "	       bluestore_csum_type (default crc32c)\n"
+    "	 --compressible\n"
+    "	       write repetitive rather than random data\n"
+    "	 --seed <n>\n"
+    "	       random seed (default 0)\n"
+    "	 --keep\n"
+    "	       do not remove the store directory on exit\n" << std::endl;
+  generic_client_usage();
+}
+
+struct Config {
+  string path = "/dev/shm/bluestore_write_bench";
+  uint64_t device_size = 10ull << 30;
+  uint64_t min_alloc_size = 0;
+  vector<uint64_t> write_sizes = {4096};
+  uint64_t object_size = 4ull << 20;
+  unsigned objects = 64;
+  uint64_t ops = 10000;
+  uint64_t warmup = 0;
+  unsigned queue_depth = 16;
+  double overwrite_ratio = 0.5;
+  string compression = "none";
+  string compression_algorithm = "snappy";
+  string csum = "crc32c";
+  bool compressible = false;
+  unsigned seed = 0;
+  bool keep = false;
+};
+
+static bool parse_size(const string& val, uint64_t *out)
+{
+  string err;
+  *out = strict_iecstrtoll(val, &err);
+  if (!err.empty()) {
+    cerr << "error parsing '" << val << "': " << err << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// bounds the number of transactions in flight and records commit latency
+struct Inflight {
+  std::mutex lock;
+  std::condition_variable cond;
+  unsigned count = 0;
+  bool record = false;
+  vector<uint64_t> lat_ns;
+
+  void get(unsigned max) {
+    std::unique_lock l(lock);
+    cond.wait(l, [&] { return count < max; });
+    ++count;
+  }
+  void put(uint64_t ns) {
+    std::lock_guard l(lock);
+    if (record) {
+      lat_ns.push_back(ns);
+    }
+    --count;
+    cond.notify_all();
+  }
+  void drain() {
+    std::unique_lock l(lock);
+    cond.wait(l, [&] { return count == 0; });
+  }
+};
+
+class C_Committed : public Context {
+  Inflight *inflight;
+  mono_time start;
+public:
+  C_Committed(Inflight *i) : inflight(i), start(mono_clock::now()) {}
+  void finish(int r) override {
+    ceph_assert(r == 0);
+    inflight->put(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+	mono_clock::now() - start).count());
+  }
+};
+
+static const std::pair<int, const char*> states[] = {
+  { l_bluestore_state_prepare_lat, "prepare" },
+  { l_bluestore_state_aio_wait_lat, "aio_wait" },
+  { l_bluestore_state_io_done_lat, "io_done" },
+  { l_bluestore_state_kv_queued_lat, "kv_queued" },
+  { l_bluestore_state_kv_committing_lat, "kv_committing" },
+  { l_bluestore_state_kv_done_lat, "kv_done" },
+  { l_bluestore_state_finishing_lat, "finishing" },
+  { l_bluestore_state_done_lat, "done" },
+  { l_bluestore_state_deferred_queued_lat, "deferred_queued" },
+  { l_bluestore_state_deferred_aio_wait_lat, "deferred_aio_wait" },
+  { l_bluestore_state_deferred_cleanup_lat, "deferred_cleanup" },
+};
+
+// counters sampled at the start and the end of the measured run
+struct Sample {
+  mono_time wall;
+  uint64_t cpu_ns = 0;
+  uint64_t heap_allocs = 0;
+  std::pair<uint64_t, uint64_t> allocator;  ///< <count, sum ns>
+  vector<std::pair<uint64_t, uint64_t>> states;
+
+  void take(const PerfCounters *logger) {
+    wall = mono_clock::now();
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    cpu_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    heap_allocs = ::heap_allocs.load();
+    allocator = logger->get_tavg_ns(l_bluestore_allocator_lat);
+    states.clear();
+    for (auto& s : ::states) {
+      states.push_back(logger->get_tavg_ns(s.first));
+    }
+  }
+};
+
+struct Workload {
+  const Config& cfg;
+  ObjectStore *store;
+  ObjectStore::CollectionHandle ch;
+  coll_t cid;
+  vector<ghobject_t> oids;
+  vector<uint64_t> written;  ///< high water mark per object
+  vector<bufferptr> data;    ///< one buffer per write size
+  std::mt19937_64 rng;
+  Inflight inflight;
+  uint64_t bytes = 0;
+
+  Workload(const Config& c, ObjectStore *s, coll_t id)
+    : cfg(c), store(s), cid(id), rng(c.seed) {
+    ch = store->open_collection(cid);
+    for (unsigned i = 0; i < cfg.objects; ++i) {
+      oids.emplace_back(hobject_t(sobject_t("bench_" + stringify(i), CEPH_NOSNAP)));
+    }
+    written.resize(cfg.objects, 0);
+    for (auto len : cfg.write_sizes) {
+      bufferptr bp = buffer::create_page_aligned(len);
+      char *p = bp.c_str();
+      for (uint64_t i = 0; i < len; ++i) {
+	p[i] = cfg.compressible ? 'a' + (i / 512) % 4 : (char)rng();
+      }
+      data.push_back(bp);
+    }
+  }
+
+  void issue() {
+    unsigned o = rng() % oids.size();
+    unsigned w = rng() % data.size();
+    uint64_t len = data[w].length();
+    bool overwrite =
+      std::uniform_real_distribution<double>(0, 1)(rng) < cfg.overwrite_ratio;
+    uint64_t offset;
+    if (written[o] + len > cfg.object_size) {
+      overwrite = true;  // full, keep the object bounded
+    }
+    if (overwrite && written[o] >= len) {
+      uint64_t slots = (written[o] - len) / CEPH_PAGE_SIZE + 1;
+      offset = (rng() % slots) * CEPH_PAGE_SIZE;
+    } else {
+      offset = written[o];
+      written[o] += len;
+    }
+
+    bufferlist bl;
+    bl.append(data[w]);
+    ObjectStore::Transaction t;
+    t.write(cid, oids[o], offset, len, bl);
+    t.register_on_commit(new C_Committed(&inflight));
+    inflight.get(cfg.queue_depth);
+    store->queue_transaction(ch, std::move(t));
+    bytes += len;
+  }
+};
+
+static uint64_t percentile(vector<uint64_t>& v, double p)
+{
+  if (v.empty()) {
+    return 0;
+  }
+  size_t n = std::min<size_t>(v.size() - 1, v.size() * p);
+  std::nth_element(v.begin(), v.begin() + n, v.end());
+  return v[n];
+}
+
+static void report(const Config& cfg, Workload& w,
+		   const Sample& a, const Sample& b, uint64_t bytes)
+{
+  double secs = std::chrono::duration<double>(b.wall - a.wall).count();
+  double ops = cfg.ops;
+  double cpu_secs = (b.cpu_ns - a.cpu_ns) / 1e9;
+  auto& lat = w.inflight.lat_ns;
+  uint64_t lat_sum = 0;
+  for (auto l : lat) {
+    lat_sum += l;
+  }
+
+  cout << "ops " << cfg.ops << " in " << secs << " s: "
+       << ops / secs << " ops/s, "
+       << byte_u_t(bytes / secs) << "/s" << std::endl;
+  cout << "commit latency us: avg " << (lat.empty() ? 0 : lat_sum / lat.size() / 1000)
+       << " p50 " << percentile(lat, 0.5) / 1000
+       << " p99 " << percentile(lat, 0.99) / 1000
+       << " max " << percentile(lat, 1.0) / 1000 << std::endl;
+  cout << "per op: cpu " << (uint64_t)(cpu_secs * 1e9 / ops) << " ns, "
+       << (uint64_t)(cpu_secs * Cycles::per_second() / ops) << " cycles, "
+       << (double)(b.heap_allocs - a.heap_allocs) / ops << " heap allocations, "
+       << (double)(b.allocator.first - a.allocator.first) / ops << " allocator calls"
+       << std::endl;
+  cout << "state latency (avg us over transactions that went through it):" << std::endl;
+  for (size_t i = 0; i < std::size(states); ++i) {
+    uint64_t count = b.states[i].first - a.states[i].first;
+    uint64_t sum = b.states[i].second - a.states[i].second;
+    if (!count) {
+      continue;
+    }
+    cout << "  " << states[i].second << ": " << (double)sum / count / 1000
+	 << " (" << count << " txc)" << std::endl;
+  }
+}
+
+int main(int argc, const char **argv)
+{
+  auto args = argv_to_vec(argc, argv);
+  if (ceph_argparse_need_usage(args)) {
+    usage();
+    exit(0);
+  }
+
+  auto cct = global_init(nullptr, args, CEPH_ENTITY_TYPE_OSD,
+			 CODE_ENVIRONMENT_UTILITY,
+			 CINIT_FLAG_NO_DEFAULT_CONFIG_FILE);
+
+  Config cfg;
+  std::string val;
+  for (auto i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_witharg(args, i, &val, "--path", (char*)nullptr)) {
+      cfg.path = val;
+    } else if (ceph_argparse_witharg(args, i, &val, "--device-size", (char*)nullptr)) {
+      if (!parse_size(val, &cfg.device_size))
+	exit(1);
+    } else if (ceph_argparse_witharg(args, i, &val, "--min-alloc-size", (char*)nullptr)) {
+      if (!parse_size(val, &cfg.min_alloc_size))
+	exit(1);
+    } else if (ceph_argparse_witharg(args, i, &val, "--write-sizes", (char*)nullptr)) {
+      cfg.write_sizes.clear();
+      for (auto& s : get_str_list(val, ",")) {
+	uint64_t len;
+	if (!parse_size(s, &len) || len == 0)
+	  exit(1);
+	cfg.write_sizes.push_back(len);
+      }
+    } else if (ceph_argparse_witharg(args, i, &val, "--object-size", (char*)nullptr)) {
+      if (!parse_size(val, &cfg.object_size))
+	exit(1);
+    } else if (ceph_argparse_witharg(args, i, &val, "--objects", (char*)nullptr)) {
+      cfg.objects = std::max(1, atoi(val.c_str()));
+    } else if (ceph_argparse_witharg(args, i, &val, "--ops", (char*)nullptr)) {
+      cfg.ops = std::max(1ll, atoll(val.c_str()));
+    } else if (ceph_argparse_witharg(args, i, &val, "--warmup", (char*)nullptr)) {
+      cfg.warmup = atoll(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--queue-depth", (char*)nullptr)) {
+      cfg.queue_depth = std::max(1, atoi(val.c_str()));
+    } else if (ceph_argparse_witharg(args, i, &val, "--overwrite-ratio", (char*)nullptr)) {
+      cfg.overwrite_ratio = atof(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--compression", (char*)nullptr)) {
+      cfg.compression = val;
+    } else if (ceph_argparse_witharg(args, i, &val, "--compression-algorithm", (char*)nullptr)) {
+      cfg.compression_algorithm = val;
+    } else if (ceph_argparse_witharg(args, i, &val, "--csum", (char*)nullptr)) {
+      cfg.csum = val;
+    } else if (ceph_argparse_flag(args, i, "--compressible", (char*)nullptr)) {
+      cfg.compressible = true;
+    } else if (ceph_argparse_witharg(args, i, &val, "--seed", (char*)nullptr)) {
+      cfg.seed = atoi(val.c_str());
+    } else if (ceph_argparse_flag(args, i, "--keep", (char*)nullptr)) {
+      cfg.keep = true;
+    } else {
+      cerr << "Error: can't understand argument: " << *i << std::endl;
+      exit(1);
+    }
+  }
+  for (auto len : cfg.write_sizes) {
+    if (len > cfg.object_size) {
+      cerr << "write size " << len << " exceeds object size " << cfg.object_size << std::endl;
+      exit(1);
+    }
+  }
+
+  auto& conf = g_ceph_context->_conf;
+  conf.set_val_or_die("bluestore_block_create", "true");
+  conf.set_val_or_die("bluestore_block_size", stringify(cfg.device_size));
+  conf.set_val_or_die("bluestore_fsck_on_mkfs", "false");
+  conf.set_val_or_die("bluestore_fsck_on_mount", "false");
+  conf.set_val_or_die("bluestore_fsck_on_umount", "false");
+  conf.set_val_or_die("bluestore_compression_mode", cfg.compression);
+  conf.set_val_or_die("bluestore_compression_algorithm", cfg.compression_algorithm);
+  conf.set_val_or_die("bluestore_csum_type", cfg.csum);
+  if (cfg.min_alloc_size) {
+    conf.set_val_or_die("bluestore_min_alloc_size", stringify(cfg.min_alloc_size));
+  }
+  conf.apply_changes(nullptr);
+  common_init_finish(g_ceph_context);
+  Cycles::init();
+
+  std::error_code ec;
+  if (std::filesystem::exists(cfg.path, ec) &&
+      !std::filesystem::is_empty(cfg.path, ec)) {
+    cerr << "store directory '" << cfg.path << "' isn't empty, please clean it first" << std::endl;
+    return 1;
+  }
+  std::filesystem::create_directories(cfg.path, ec);
+  if (ec) {
+    cerr << "failed to create '" << cfg.path << "': " << ec.message() << std::endl;
+    return 1;
+  }
+  auto cleanup = make_scope_guard([&] {
+    if (!cfg.keep) {
+      std::error_code ec;
+      std::filesystem::remove_all(cfg.path, ec);
+    }
+  });
+
+  auto store = ObjectStore::create(g_ceph_context, "bluestore", cfg.path);
+  if (!store) {
+    cerr << "failed to create bluestore" << std::endl;
+    return 1;
+  }
+  int r = store->mkfs();
+  if (r < 0) {
+    cerr << "mkfs failed: " << cpp_strerror(r) << std::endl;
+    return 1;
+  }
+  r = store->mount();
+  if (r < 0) {
+    cerr << "mount failed: " << cpp_strerror(r) << std::endl;
+    return 1;
+  }
+
+  spg_t pg;
+  const coll_t cid(pg);
+  {
+    auto ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->queue_transaction(ch, std::move(t));
+    ceph_assert(r == 0);
+  }
+
+  {
+    Workload w(cfg, store.get(), cid);
+    const PerfCounters *logger = store->get_perf_counters();
+    for (uint64_t i = 0; i < cfg.warmup; ++i) {
+      w.issue();
+    }
+    w.inflight.drain();
+
+    Sample before, after;
+    w.inflight.record = true;
+    w.bytes = 0;
+    before.take(logger);
+    for (uint64_t i = 0; i < cfg.ops; ++i) {
+      w.issue();
+    }
+    w.inflight.drain();
+    after.take(logger);
+
+    report(cfg, w, before, after, w.bytes);
+  }
+
+  store->umount();
+  return 0;
+}
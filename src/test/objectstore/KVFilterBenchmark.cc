@@ -0,0 +1,361 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * RocksDB column family filter benchmark.
+ *
+ * Fills a RocksDBStore with onode and per-pg omap keys laid out the way
+ * BlueStore lays them out, then measures onode lookups and omap iteration
+ * twice: once with the per-column filters of bluestore_rocksdb_cf_filters
+ * (or --filters) and once with the same bloom filter on every column.  Read
+ * amplification is reported as SST blocks read per op, from RocksDB's perf
+ * context.
+ */
+
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "rocksdb/perf_context.h"
+
+#include "common/ceph_argparse.h"
+#include "common/ceph_time.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "common/strtol.h"
+#include "global/global_init.h"
+#include "include/scope_guard.h"
+#include "include/stringify.h"
+#include "include/types.h"
+#include "kv/KeyValueDB.h"
+#include "os/kv.h"
+
+using namespace std;
+
+static void usage()
+{
+  cout << "usage: ceph_perf_kv_filters [flags]\n"
+    "	 --path <dir>\n"
+    "	       store directory, created empty (default /dev/shm/kv_filter_bench)\n"
+    "	 --objects <n>\n"
+    "	       number of onodes (default 200000)\n"
+    "	 --omap-ratio <0..1>\n"
+    "	       fraction of objects with omap (default 0.1)\n"
+    "	 --omap-keys <n>\n"
+    "	       omap keys per object with omap (default 32)\n"
+    "	 --ops <n>\n"
+    "	       measured ops per phase (default 50000)\n"
+    "	 --cache-size <bytes>\n"
+    "	       RocksDB block cache size (default 8M)\n"
+    "	 --filters <spec>\n"
+    "	       per column filters to compare against uniform bloom filters\n"
+    "	       (default bluestore_rocksdb_cf_filters)\n"
+    "	 --seed <n>\n"
+    "	       random seed (default 0)\n"
+    "	 --keep\n"
+    "	       do not remove the store directory on exit\n" << std::endl;
+  generic_client_usage();
+}
+
+struct Config {
+  string path = "/dev/shm/kv_filter_bench";
+  unsigned objects = 200000;
+  double omap_ratio = 0.1;
+  unsigned omap_keys = 32;
+  uint64_t ops = 50000;
+  uint64_t cache_size = 8ull << 20;
+  string filters;
+  unsigned seed = 0;
+  bool keep = false;
+};
+
+static bool parse_size(const string& val, uint64_t *out)
+{
+  string err;
+  *out = strict_iecstrtoll(val, &err);
+  if (!err.empty()) {
+    cerr << "error parsing '" << val << "': " << err << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// what BlueStore keys objects by, see get_object_key() and
+// Onode::calc_omap_key()
+struct Object {
+  uint64_t pool;
+  uint32_t hash;
+  uint64_t nid;
+  string name;
+  bool has_omap;
+
+  string onode_key() const {
+    string key;
+    _key_encode_u64(pool, &key);
+    _key_encode_u32(hash, &key);
+    key.append(name);
+    key.push_back('o');
+    return key;
+  }
+  string omap_prefix() const {
+    string key;
+    _key_encode_u64(pool, &key);
+    _key_encode_u32(hash, &key);
+    _key_encode_u64(nid, &key);
+    return key;
+  }
+  string omap_header() const {
+    return omap_prefix() + '-';
+  }
+  string omap_key(const string& k) const {
+    return omap_prefix() + '.' + k;
+  }
+  string omap_tail() const {
+    return omap_prefix() + '~';
+  }
+};
+
+static vector<Object> make_objects(const Config& cfg, unsigned count,
+				   uint64_t first_nid, std::mt19937_64& rng)
+{
+  std::uniform_real_distribution<double> coin(0.0, 1.0);
+  vector<Object> objects;
+  objects.reserve(count);
+  for (unsigned i = 0; i < count; ++i) {
+    Object o;
+    o.pool = 1 + rng() % 4;
+    o.hash = rng();
+    o.nid = first_nid + i;
+    o.name = "rbd_data." + stringify(rng() % 1000) + "." + stringify(rng());
+    o.has_omap = coin(rng) < cfg.omap_ratio;
+    objects.push_back(std::move(o));
+  }
+  return objects;
+}
+
+struct Phase {
+  string name;
+  uint64_t ops = 0;
+  uint64_t items = 0;  ///< keys found or iterated over
+  double seconds = 0;
+  uint64_t blocks = 0;
+  uint64_t filter_negative = 0;
+  uint64_t filter_positive = 0;
+};
+
+template <typename F>
+static Phase run_phase(const string& name, uint64_t ops, F&& op)
+{
+  Phase p;
+  p.name = name;
+  p.ops = ops;
+  rocksdb::get_perf_context()->Reset();
+  auto start = ceph::mono_clock::now();
+  for (uint64_t i = 0; i < ops; ++i) {
+    p.items += op(i);
+  }
+  p.seconds = ceph::to_seconds<double>(ceph::mono_clock::now() - start);
+  auto ctx = rocksdb::get_perf_context();
+  p.blocks = ctx->block_read_count;
+  p.filter_negative = ctx->bloom_sst_miss_count;
+  p.filter_positive = ctx->bloom_sst_hit_count;
+  return p;
+}
+
+static int run(const Config& cfg, const string& filters, vector<Phase>* phases)
+{
+  std::error_code ec;
+  std::filesystem::remove_all(cfg.path, ec);
+  std::filesystem::create_directories(cfg.path, ec);
+  if (ec) {
+    cerr << "failed to create '" << cfg.path << "': " << ec.message() << std::endl;
+    return -EIO;
+  }
+  std::unique_ptr<KeyValueDB> db(
+    KeyValueDB::create(g_ceph_context, "rocksdb", cfg.path,
+		       {{"cf_filters", filters}}));
+  if (!db) {
+    cerr << "failed to create rocksdb" << std::endl;
+    return -EINVAL;
+  }
+  db->set_cache_size(cfg.cache_size);
+  int r = db->init(g_conf()->bluestore_rocksdb_options);
+  if (r < 0) {
+    cerr << "init failed: " << cpp_strerror(r) << std::endl;
+    return r;
+  }
+  std::ostringstream out;
+  r = db->create_and_open(out, "O(3,0-13) p(3,0-12) L");
+  if (r < 0) {
+    cerr << "create_and_open failed: " << cpp_strerror(r) << " " << out.str()
+	 << std::endl;
+    return r;
+  }
+
+  // same objects for every run
+  std::mt19937_64 rng(cfg.seed);
+  auto objects = make_objects(cfg, cfg.objects, 1, rng);
+  auto absent = make_objects(cfg, cfg.objects, cfg.objects + 1, rng);
+  vector<const Object*> with_omap, without_omap;
+  for (auto& o : objects) {
+    (o.has_omap ? with_omap : without_omap).push_back(&o);
+  }
+  if (with_omap.empty() || without_omap.empty()) {
+    cerr << "--omap-ratio leaves no objects with or without omap" << std::endl;
+    return -EINVAL;
+  }
+
+  bufferlist onode_value, omap_value;
+  onode_value.append(string(300, 'o'));
+  omap_value.append(string(100, 'v'));
+  KeyValueDB::Transaction t = db->get_transaction();
+  unsigned n = 0;
+  for (auto& o : objects) {
+    t->set("O", o.onode_key(), onode_value);
+    if (o.has_omap) {
+      t->set("p", o.omap_header(), omap_value);
+      for (unsigned k = 0; k < cfg.omap_keys; ++k) {
+	t->set("p", o.omap_key("key" + stringify(k)), omap_value);
+      }
+    }
+    if (++n % 1000 == 0) {
+      db->submit_transaction(t);
+      t = db->get_transaction();
+    }
+  }
+  db->submit_transaction_sync(t);
+  // measure SST reads, not memtable hits
+  db->compact();
+
+  rocksdb::SetPerfLevel(rocksdb::PerfLevel::kEnableCount);
+  std::uniform_int_distribution<size_t> pick(0, objects.size() - 1);
+  phases->push_back(run_phase("onode get, present", cfg.ops, [&](uint64_t) {
+    bufferlist v;
+    return db->get("O", objects[pick(rng)].onode_key(), &v) == 0;
+  }));
+  phases->push_back(run_phase("onode get, absent", cfg.ops, [&](uint64_t) {
+    bufferlist v;
+    return db->get("O", absent[pick(rng)].onode_key(), &v) == 0;
+  }));
+  auto iterate_omap = [&](const Object& o) {
+    auto it = db->get_iterator("p", 0,
+			       KeyValueDB::IteratorBounds{o.omap_header(),
+							  o.omap_tail()});
+    uint64_t keys = 0;
+    for (it->lower_bound(o.omap_header()); it->valid(); it->next()) {
+      if (it->key() >= o.omap_tail()) {
+	break;
+      }
+      ++keys;
+    }
+    return keys;
+  };
+  phases->push_back(run_phase("omap iterate, with omap", cfg.ops, [&](uint64_t) {
+    return iterate_omap(*with_omap[rng() % with_omap.size()]);
+  }));
+  phases->push_back(run_phase("omap iterate, without omap", cfg.ops, [&](uint64_t) {
+    return iterate_omap(*without_omap[rng() % without_omap.size()]);
+  }));
+  rocksdb::SetPerfLevel(rocksdb::PerfLevel::kDisable);
+  db.reset();
+  return 0;
+}
+
+static void report(const string& title, const vector<Phase>& phases)
+{
+  cout << title << std::endl;
+  for (auto& p : phases) {
+    cout << "  " << std::left << std::setw(28) << p.name << std::right
+	 << std::fixed << std::setprecision(2)
+	 << std::setw(10) << p.seconds * 1000000 / p.ops << " us/op"
+	 << std::setw(10) << (double)p.blocks / p.ops << " blocks/op"
+	 << std::setw(10) << (double)p.filter_negative / p.ops << " filtered/op"
+	 << std::setw(10) << (double)p.filter_positive / p.ops << " passed/op"
+	 << std::setw(10) << (double)p.items / p.ops << " keys/op"
+	 << std::endl;
+  }
+}
+
+int main(int argc, const char **argv)
+{
+  auto args = argv_to_vec(argc, argv);
+  if (ceph_argparse_need_usage(args)) {
+    usage();
+    exit(0);
+  }
+
+  auto cct = global_init(nullptr, args, CEPH_ENTITY_TYPE_OSD,
+			 CODE_ENVIRONMENT_UTILITY,
+			 CINIT_FLAG_NO_DEFAULT_CONFIG_FILE);
+
+  Config cfg;
+  cfg.filters = g_conf().get_val<std::string>("bluestore_rocksdb_cf_filters");
+  std::string val;
+  for (auto i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_witharg(args, i, &val, "--path", (char*)nullptr)) {
+      cfg.path = val;
+    } else if (ceph_argparse_witharg(args, i, &val, "--objects", (char*)nullptr)) {
+      cfg.objects = std::max(1, atoi(val.c_str()));
+    } else if (ceph_argparse_witharg(args, i, &val, "--omap-ratio", (char*)nullptr)) {
+      cfg.omap_ratio = atof(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--omap-keys", (char*)nullptr)) {
+      cfg.omap_keys = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--ops", (char*)nullptr)) {
+      cfg.ops = std::max(1ll, atoll(val.c_str()));
+    } else if (ceph_argparse_witharg(args, i, &val, "--cache-size", (char*)nullptr)) {
+      if (!parse_size(val, &cfg.cache_size))
+	exit(1);
+    } else if (ceph_argparse_witharg(args, i, &val, "--filters", (char*)nullptr)) {
+      cfg.filters = val;
+    } else if (ceph_argparse_witharg(args, i, &val, "--seed", (char*)nullptr)) {
+      cfg.seed = atoi(val.c_str());
+    } else if (ceph_argparse_flag(args, i, "--keep", (char*)nullptr)) {
+      cfg.keep = true;
+    } else {
+      cerr << "Error: can't understand argument: " << *i << std::endl;
+      exit(1);
+    }
+  }
+  common_init_finish(g_ceph_context);
+
+  std::error_code ec;
+  if (std::filesystem::exists(cfg.path, ec) &&
+      !std::filesystem::is_empty(cfg.path, ec)) {
+    cerr << "store directory '" << cfg.path << "' isn't empty, please clean it first" << std::endl;
+    return 1;
+  }
+  auto cleanup = make_scope_guard([&] {
+    if (!cfg.keep) {
+      std::error_code ec;
+      std::filesystem::remove_all(cfg.path, ec);
+    }
+  });
+
+  vector<Phase> uniform, per_column;
+  if (run(cfg, "", &uniform) < 0 ||
+      run(cfg, cfg.filters, &per_column) < 0) {
+    return 1;
+  }
+  cout << "objects " << cfg.objects << ", omap ratio " << cfg.omap_ratio
+       << ", omap keys " << cfg.omap_keys << ", block cache "
+       << byte_u_t(cfg.cache_size) << std::endl;
+  report("uniform bloom filter (rocksdb_bloom_bits_per_key "
+	 + stringify(g_conf().get_val<uint64_t>("rocksdb_bloom_bits_per_key"))
+	 + ")", uniform);
+  report("per column filters (" + cfg.filters + ")", per_column);
+  return 0;
+}
@@ -6,6 +6,7 @@
  */
 #include <iostream>
 #include <vector>
+#include <sstream>
 
 #include "common/ceph_argparse.h"
 #include "common/debug.h"
@@ -27,6 +28,7 @@ void usage(const string &name) {
           "assess_free <alloc_unit>|"
           "try_alloc <count> <want> <alloc_unit>|"
           "replay_alloc <alloc_list_file|"
+          "compare_alloc <alloc_list_file> <alloc_type>[,<alloc_type>...]|"
           "export_binary <out_file>|"
           "free_histogram [<alloc_unit>] [<num_buckets>]"
        << std::endl;
@@ -382,7 +384,8 @@ int replay_free_dump_and_apply_raw(
   command and applies custom method to it
 */
 int replay_free_dump_and_apply(char* fname,
-    std::function<int (Allocator*, const string& aname)> fn)
+    std::function<int (Allocator*, const string& aname)> fn,
+    std::string_view force_type = "")
 {
   unique_ptr<Allocator> alloc;
   auto create_fn = [&](std::string_view alloc_type,
@@ -391,7 +394,9 @@ int replay_free_dump_and_apply(char* fname,
                        std::string_view alloc_name) {
     alloc.reset(
       Allocator::create(
-        g_ceph_context, alloc_type, capacity, alloc_unit, alloc_name));
+        g_ceph_context,
+        force_type.empty() ? alloc_type : force_type,
+        capacity, alloc_unit, alloc_name));
   };
   auto add_fn = [&](uint64_t offset,
                    uint64_t len) {
@@ -739,6 +744,76 @@ int main(int argc, char **argv)
         }
         return 0;
     });
+  } else if (strcmp(argv[2], "compare_alloc") == 0) {
+    if (argc < 5) {
+      std::cerr << "Error: insufficient arguments for \"compare_alloc\" option."
+                << std::endl;
+      usage(argv[0]);
+      return 1;
+    }
+    /* load the same free dump into each allocator type in turn and replay
+     * the same allocation requests against it */
+    std::vector<std::string> alloc_types;
+    {
+      std::stringstream ss(argv[4]);
+      std::string t;
+      while (std::getline(ss, t, ',')) {
+        alloc_types.push_back(t);
+      }
+    }
+    for (auto& alloc_type : alloc_types) {
+      int r = replay_free_dump_and_apply(argv[1],
+        [&](Allocator *a, const string &aname) {
+          ceph_assert(a);
+          FILE *f_alloc_list = fopen(argv[3], "r");
+          if (!f_alloc_list) {
+            std::cerr << "error: unable to open " << argv[3] << std::endl;
+            return -1;
+          }
+          char s[4096];
+          uint64_t requests = 0, failed = 0, fragments = 0;
+          ceph::timespan total = ceph::timespan::zero();
+          ceph::timespan worst = ceph::timespan::zero();
+          while (fgets(s, sizeof(s), f_alloc_list) != nullptr) {
+            uint64_t want = 0, unit = 0, max = 0, hint = 0;
+            if (std::sscanf(s, "%ji %ji %ji %ji", &want, &unit, &max, &hint) < 2) {
+              continue;
+            }
+            PExtentVector extents;
+            auto t0 = ceph::mono_clock::now();
+            auto r = a->allocate(want, unit, max, hint, &extents);
+            ceph::timespan dur = ceph::mono_clock::now() - t0;
+            ++requests;
+            total += dur;
+            worst = std::max(worst, dur);
+            if (r < 0) {
+              ++failed;
+            } else {
+              fragments += extents.size();
+            }
+          }
+          fclose(f_alloc_list);
+          std::cout << "Allocator: " << a->get_type()
+                    << " requests: " << requests
+                    << " failed: " << failed
+                    << " avg (ns): "
+                    << (requests ? total.count() / requests : 0)
+                    << " max (ns): " << worst.count()
+                    << " avg fragments: "
+                    << (requests > failed ?
+                        double(fragments) / (requests - failed) : 0)
+                    << " fragmentation: " << a->get_fragmentation()
+                    << " fragmentation score: " << a->get_fragmentation_score()
+                    << " free: 0x" << std::hex << a->get_free() << std::dec
+                    << std::endl;
+          return 0;
+        },
+        alloc_type);
+      if (r != 0) {
+        return r;
+      }
+    }
+    return 0;
   } else if (strcmp(argv[2], "free_histogram") == 0) {
     uint64_t alloc_unit = 4096;
     auto num_buckets = 8;
@@ -0,0 +1,459 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Allocator trace replay benchmark.
+ *
+ * Replays a trace recorded with "ceph daemon osd.N bluestore allocator
+ * trace <name> start <path>" against one or more allocator types, starting
+ * from the free space the traced allocator had when the trace started.
+ * Reports allocate() and release() latency percentiles, failures and how
+ * fragmentation evolves over the trace.  With --threads the allocation
+ * sizes of the trace are replayed from several threads at once against a
+ * single allocator to show how it behaves under lock contention.
+ */
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/ceph_argparse.h"
+#include "common/ceph_time.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "global/global_init.h"
+#include "include/interval_set.h"
+#include "include/str_list.h"
+#include "os/bluestore/Allocator.h"
+#include "os/bluestore/AllocatorTrace.h"
+
+using namespace std;
+
+static void usage()
+{
+  cout << "usage: ceph_test_alloc_trace_replay <trace> [options]\n"
+       << "  --types <t1,t2,...>  allocator types to replay against (default: traced type)\n"
+       << "  --sample <n>         report fragmentation every n calls (default 100000)\n"
+       << "  --threads <n>        also replay allocation sizes from 1 and n threads\n"
+       << "  --depth <n>          allocations each thread keeps before releasing (default 1024)\n"
+       << "  --ops <n>            calls per thread in threaded mode (default: trace length)\n"
+       << std::endl;
+  generic_client_usage();
+}
+
+struct Config {
+  std::string trace;
+  std::vector<std::string> types;
+  uint64_t sample = 100000;
+  unsigned threads = 0;
+  unsigned depth = 1024;
+  uint64_t ops = 0;
+};
+
+struct latencies_t {
+  std::vector<uint64_t> ns;
+
+  void add(ceph::timespan t) {
+    ns.push_back(t.count());
+  }
+  void merge(const latencies_t& o) {
+    ns.insert(ns.end(), o.ns.begin(), o.ns.end());
+  }
+  void print(const char* what) {
+    if (ns.empty()) {
+      return;
+    }
+    std::sort(ns.begin(), ns.end());
+    auto q = [&](double p) {
+      return ns[std::min<size_t>(ns.size() - 1, ns.size() * p)] / 1000.0;
+    };
+    cout << "  " << what << ": " << ns.size() << " calls, us"
+	 << " p50 " << q(0.5)
+	 << " p99 " << q(0.99)
+	 << " p99.9 " << q(0.999)
+	 << " max " << ns.back() / 1000.0 << std::endl;
+  }
+};
+
+/*
+ * Extents handed out by the traced allocator are not the ones the replay
+ * allocator hands out, so releases have to be translated.  Each piece of
+ * traced space allocated during the trace maps to a piece of replay space,
+ * or to nothing if the replay allocator came up short.  Space allocated
+ * before the trace started is owned by both and maps to itself.
+ */
+class ReplayMap {
+  static constexpr uint64_t LOST = std::numeric_limits<uint64_t>::max();
+  struct seg_t {
+    uint64_t len;
+    uint64_t replay;	///< replay offset, or LOST
+  };
+  std::map<uint64_t, seg_t> segs;	///< by traced offset
+  interval_set<uint64_t> replay_free;	///< to catch doubtful releases
+
+  void _split(uint64_t at) {
+    auto p = segs.upper_bound(at);
+    if (p == segs.begin()) {
+      return;
+    }
+    --p;
+    if (p->first < at && p->first + p->second.len > at) {
+      uint64_t head = at - p->first;
+      seg_t tail{p->second.len - head,
+		 p->second.replay == LOST ? LOST : p->second.replay + head};
+      p->second.len = head;
+      segs.emplace(at, tail);
+    }
+  }
+
+public:
+  uint64_t lost_bytes = 0;
+  uint64_t skipped_bytes = 0;
+
+  void init_free(uint64_t offset, uint64_t length) {
+    replay_free.insert(offset, length);
+  }
+
+  /// map traced to replay extents; replay space beyond what the traced
+  /// call got is nothing the trace will release, it goes to *excess
+  void map_allocate(const std::vector<std::pair<uint64_t, uint64_t>>& traced,
+		    const PExtentVector& replay,
+		    interval_set<uint64_t>* excess) {
+    auto r = replay.begin();
+    uint64_t r_off = 0;
+    for (auto [offset, length] : traced) {
+      while (length) {
+	if (r == replay.end()) {
+	  segs[offset] = seg_t{length, LOST};
+	  lost_bytes += length;
+	  break;
+	}
+	uint64_t l = std::min<uint64_t>(length, r->length - r_off);
+	segs[offset] = seg_t{l, r->offset + r_off};
+	offset += l;
+	length -= l;
+	r_off += l;
+	if (r_off == r->length) {
+	  ++r;
+	  r_off = 0;
+	}
+      }
+    }
+    for (; r != replay.end(); ++r, r_off = 0) {
+      excess->insert(r->offset + r_off, r->length - r_off);
+    }
+    for (auto& e : replay) {
+      replay_free.erase(e.offset, e.length);
+    }
+    replay_free.union_of(*excess);
+  }
+
+  /// translate a traced release into the replay space to release
+  void map_release(const std::vector<std::pair<uint64_t, uint64_t>>& traced,
+		   interval_set<uint64_t>* out) {
+    for (auto [offset, length] : traced) {
+      uint64_t end = offset + length;
+      _split(offset);
+      _split(end);
+      uint64_t pos = offset;
+      auto p = segs.lower_bound(offset);
+      while (pos < end) {
+	uint64_t next = (p == segs.end() || p->first >= end) ? end : p->first;
+	if (pos < next) {
+	  // not allocated during the trace: same space on both sides, as
+	  // long as the replay allocator does not think it free already
+	  interval_set<uint64_t> gap;
+	  gap.insert(pos, next - pos);
+	  interval_set<uint64_t> dup;
+	  dup.intersection_of(gap, replay_free);
+	  skipped_bytes += dup.size();
+	  gap.subtract(dup);
+	  out->union_of(gap);
+	  pos = next;
+	  continue;
+	}
+	if (p->second.replay != LOST) {
+	  out->union_insert(p->second.replay, p->second.len);
+	}
+	pos = p->first + p->second.len;
+	p = segs.erase(p);
+      }
+    }
+    replay_free.union_of(*out);
+  }
+};
+
+static Allocator* create_alloc(const std::string& type,
+			       const alloc_trace_header_t& h)
+{
+  Allocator* a = Allocator::create(g_ceph_context, type, h.capacity,
+				   h.block_size, "replay_" + type);
+  if (!a) {
+    cerr << "unknown allocator type " << type << std::endl;
+    return nullptr;
+  }
+  for (auto [offset, length] : h.free_extents) {
+    a->init_add_free(offset, length);
+  }
+  return a;
+}
+
+static int replay(const Config& cfg, const std::string& type,
+		  const alloc_trace_header_t& h,
+		  const std::vector<alloc_trace_record_t>& records)
+{
+  std::unique_ptr<Allocator> a(create_alloc(type, h));
+  if (!a) {
+    return -EINVAL;
+  }
+  ReplayMap m;
+  for (auto [offset, length] : h.free_extents) {
+    m.init_free(offset, length);
+  }
+  latencies_t alloc_lat, release_lat;
+  uint64_t calls = 0, failed = 0, traced_failed = 0, short_allocs = 0;
+  uint64_t fragments = 0;
+  cout << "allocator " << type << ":" << std::endl;
+  for (auto& rec : records) {
+    if (rec.op == alloc_trace_record_t::OP_ALLOCATE) {
+      PExtentVector extents;
+      auto t0 = ceph::mono_clock::now();
+      int64_t r = a->allocate(rec.want, rec.unit, rec.max_alloc_size,
+			      rec.hint, &extents);
+      alloc_lat.add(ceph::mono_clock::now() - t0);
+      if (r < 0) {
+	++failed;
+      } else {
+	fragments += extents.size();
+	if ((uint64_t)r < rec.want) {
+	  ++short_allocs;
+	}
+      }
+      if (rec.result < 0) {
+	++traced_failed;
+      }
+      interval_set<uint64_t> excess;
+      m.map_allocate(rec.extents, extents, &excess);
+      if (!excess.empty()) {
+	// nothing in the trace will ever release this
+	a->release(excess);
+      }
+    } else if (rec.op == alloc_trace_record_t::OP_RELEASE) {
+      interval_set<uint64_t> release_set;
+      m.map_release(rec.extents, &release_set);
+      if (!release_set.empty()) {
+	auto t0 = ceph::mono_clock::now();
+	a->release(release_set);
+	release_lat.add(ceph::mono_clock::now() - t0);
+      }
+    }
+    if (++calls % cfg.sample == 0) {
+      cout << "  at " << calls << " calls (" << rec.stamp_ns / 1000000000.0
+	   << "s): free 0x" << std::hex << a->get_free() << std::dec
+	   << " fragmentation " << a->get_fragmentation()
+	   << " score " << a->get_fragmentation_score() << std::endl;
+    }
+  }
+  alloc_lat.print("allocate");
+  release_lat.print("release");
+  cout << "  failed " << failed << " (traced " << traced_failed << ")"
+       << " short " << short_allocs
+       << " extents per allocate "
+       << (alloc_lat.ns.size() ? (double)fragments / alloc_lat.ns.size() : 0)
+       << std::endl;
+  cout << "  lost 0x" << std::hex << m.lost_bytes
+       << " skipped 0x" << m.skipped_bytes << std::dec
+       << " final free 0x" << std::hex << a->get_free() << std::dec
+       << " fragmentation " << a->get_fragmentation()
+       << " score " << a->get_fragmentation_score() << std::endl;
+  a->shutdown();
+  return 0;
+}
+
+struct request_t {
+  uint64_t want, unit, max_alloc_size;
+  int64_t hint;
+};
+
+/*
+ * Replay the traced allocation sizes from n threads against one allocator.
+ * Each thread keeps its last cfg.depth allocations and releases the oldest
+ * one once it has more, so the allocator sees a steady mix of both calls.
+ */
+static void replay_threads(const Config& cfg, const std::string& type,
+			   const alloc_trace_header_t& h,
+			   const std::vector<request_t>& reqs,
+			   unsigned n)
+{
+  std::unique_ptr<Allocator> a(create_alloc(type, h));
+  if (!a) {
+    return;
+  }
+  uint64_t ops = cfg.ops ? cfg.ops : reqs.size();
+  std::vector<latencies_t> alloc_lat(n), release_lat(n);
+  std::vector<uint64_t> failed(n);
+  std::vector<std::thread> workers;
+  auto t0 = ceph::mono_clock::now();
+  for (unsigned t = 0; t < n; ++t) {
+    workers.emplace_back([&, t] {
+      std::deque<PExtentVector> held;
+      // threads start at different points of the stream
+      size_t pos = reqs.size() * t / n;
+      for (uint64_t i = 0; i < ops; ++i) {
+	auto& req = reqs[pos];
+	pos = (pos + 1) % reqs.size();
+	PExtentVector extents;
+	auto s = ceph::mono_clock::now();
+	int64_t r = a->allocate(req.want, req.unit, req.max_alloc_size,
+				req.hint, &extents);
+	alloc_lat[t].add(ceph::mono_clock::now() - s);
+	if (r < 0) {
+	  ++failed[t];
+	} else {
+	  held.push_back(std::move(extents));
+	}
+	if (held.size() > cfg.depth || (r < 0 && !held.empty())) {
+	  interval_set<uint64_t> release_set;
+	  for (auto& e : held.front()) {
+	    release_set.insert(e.offset, e.length);
+	  }
+	  held.pop_front();
+	  s = ceph::mono_clock::now();
+	  a->release(release_set);
+	  release_lat[t].add(ceph::mono_clock::now() - s);
+	}
+      }
+      for (auto& extents : held) {
+	interval_set<uint64_t> release_set;
+	for (auto& e : extents) {
+	  release_set.insert(e.offset, e.length);
+	}
+	a->release(release_set);
+      }
+    });
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  double secs = std::chrono::duration<double>(ceph::mono_clock::now() - t0)
+    .count();
+  latencies_t all_alloc, all_release;
+  uint64_t all_failed = 0;
+  for (unsigned t = 0; t < n; ++t) {
+    all_alloc.merge(alloc_lat[t]);
+    all_release.merge(release_lat[t]);
+    all_failed += failed[t];
+  }
+  cout << "allocator " << type << " with " << n << " threads: "
+       << (uint64_t)(all_alloc.ns.size() / secs) << " allocate/s, failed "
+       << all_failed << std::endl;
+  all_alloc.print("allocate");
+  all_release.print("release");
+  a->shutdown();
+}
+
+int main(int argc, const char **argv)
+{
+  auto args = argv_to_vec(argc, argv);
+  if (ceph_argparse_need_usage(args)) {
+    usage();
+    exit(0);
+  }
+
+  auto cct = global_init(nullptr, args, CEPH_ENTITY_TYPE_CLIENT,
+			 CODE_ENVIRONMENT_UTILITY,
+			 CINIT_FLAG_NO_DEFAULT_CONFIG_FILE);
+  common_init_finish(g_ceph_context);
+
+  Config cfg;
+  std::string val;
+  for (auto i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_witharg(args, i, &val, "--types", (char*)nullptr)) {
+      cfg.types = get_str_vec(val, ",");
+    } else if (ceph_argparse_witharg(args, i, &val, "--sample", (char*)nullptr)) {
+      cfg.sample = std::max(1ll, atoll(val.c_str()));
+    } else if (ceph_argparse_witharg(args, i, &val, "--threads", (char*)nullptr)) {
+      cfg.threads = std::max(1, atoi(val.c_str()));
+    } else if (ceph_argparse_witharg(args, i, &val, "--depth", (char*)nullptr)) {
+      cfg.depth = std::max(1, atoi(val.c_str()));
+    } else if (ceph_argparse_witharg(args, i, &val, "--ops", (char*)nullptr)) {
+      cfg.ops = std::max(1ll, atoll(val.c_str()));
+    } else if (cfg.trace.empty() && **i != '-') {
+      cfg.trace = *i;
+      i = args.erase(i);
+    } else {
+      cerr << "Error: can't understand argument: " << *i << std::endl;
+      exit(1);
+    }
+  }
+  if (cfg.trace.empty()) {
+    usage();
+    exit(1);
+  }
+
+  alloc_trace_header_t h;
+  std::vector<alloc_trace_record_t> records;
+  std::string err;
+  int r = read_alloc_trace(cfg.trace, &h,
+    [&](const alloc_trace_record_t& rec) {
+      records.push_back(rec);
+    }, &err);
+  if (r < 0 && records.empty()) {
+    cerr << "failed to read " << cfg.trace << ": " << err << std::endl;
+    exit(1);
+  } else if (r < 0) {
+    cerr << "warning: " << err << ", replaying the first " << records.size()
+	 << " records" << std::endl;
+  }
+  cout << "trace of " << h.alloc_type << " allocator " << h.alloc_name
+       << " from " << h.start << ": capacity 0x" << std::hex << h.capacity
+       << " block 0x" << h.block_size << std::dec << ", "
+       << h.free_extents.size() << " free extents, " << records.size()
+       << " calls" << std::endl;
+  if (cfg.types.empty()) {
+    cfg.types.push_back(h.alloc_type);
+  }
+
+  for (auto& type : cfg.types) {
+    if (replay(cfg, type, h, records) < 0) {
+      exit(1);
+    }
+  }
+
+  if (cfg.threads) {
+    std::vector<request_t> reqs;
+    for (auto& rec : records) {
+      if (rec.op == alloc_trace_record_t::OP_ALLOCATE) {
+	reqs.push_back(request_t{rec.want, rec.unit, rec.max_alloc_size,
+				 rec.hint});
+      }
+    }
+    if (reqs.empty()) {
+      cerr << "no allocations in trace" << std::endl;
+      exit(1);
+    }
+    for (auto& type : cfg.types) {
+      replay_threads(cfg, type, h, reqs, 1);
+      if (cfg.threads > 1) {
+	replay_threads(cfg, type, h, reqs, cfg.threads);
+      }
+    }
+  }
+  return 0;
+}
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <iostream>
 #include <memory>
+#include <thread>
 #include <time.h>
 #include <sys/mount.h>
 #include <boost/random/mersenne_twister.hpp>
@@ -2434,6 +2435,98 @@ TEST_P(StoreTest, MultiSmallWriteSameBlock) {
   }
 }
 
+TEST_P(StoreTestDeferredSetup, KVFinalizeThreadsSequencerOrder) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  SetVal(g_conf(), "bluestore_kv_finalize_threads", "4");
+  DeferredSetup();
+  BlueStore* bstore = dynamic_cast<BlueStore*>(store.get());
+  ASSERT_TRUE(bstore);
+
+  // the sequencers are spread over the finalize threads; each must be
+  // finalized by a single thread, in submission order
+  const unsigned num_colls = 8;
+  const unsigned num_txcs = 200;
+  struct seq_t {
+    coll_t cid;
+    ObjectStore::CollectionHandle ch;
+    std::vector<uint64_t> finalized;            ///< txc seqs
+    std::set<std::thread::id> threads;
+  };
+  std::vector<seq_t> seqs(num_colls);
+  for (unsigned c = 0; c < num_colls; ++c) {
+    seqs[c].cid = coll_t(spg_t(pg_t(c, 1)));
+    seqs[c].ch = store->create_new_collection(seqs[c].cid);
+    ObjectStore::Transaction t;
+    t.create_collection(seqs[c].cid, 0);
+    ASSERT_EQ(queue_transaction(store, seqs[c].ch, std::move(t)), 0);
+  }
+
+  ceph::mutex lock = ceph::make_mutex("KVFinalizeThreads::lock");
+  bstore->set_debug_kv_finalize_hook(
+    [&](const coll_t& cid, uint64_t seq) {
+      std::lock_guard l(lock);
+      for (auto &s : seqs) {
+	if (s.cid == cid) {
+	  s.finalized.push_back(seq);
+	  s.threads.insert(std::this_thread::get_id());
+	}
+      }
+    });
+
+  // a txc is finalized before its commit callback is queued
+  C_SaferCond all_done;
+  std::atomic<unsigned> pending = {num_colls * num_txcs};
+  bufferlist bl;
+  bl.append(std::string(4096, 'x'));
+  for (unsigned i = 0; i < num_txcs; ++i) {
+    for (auto &s : seqs) {
+      ghobject_t hoid(hobject_t(sobject_t("obj" + stringify(i % 16),
+					  CEPH_NOSNAP)));
+      ObjectStore::Transaction t;
+      // mix small (deferred) and large (direct) writes
+      t.write(s.cid, hoid, (i % 4) * 4096, bl.length(), bl);
+      if (i % 5 == 0) {
+	bufferlist big;
+	big.append(std::string(0x20000, 'y'));
+	t.write(s.cid, hoid, 0x40000, big.length(), big);
+      }
+      t.register_on_commit(new LambdaContext([&](int) {
+	if (--pending == 0) {
+	  all_done.complete(0);
+	}
+      }));
+      store->queue_transaction(s.ch, std::move(t));
+    }
+  }
+  int r = all_done.wait();
+  bstore->set_debug_kv_finalize_hook(nullptr);
+  ASSERT_EQ(r, 0);
+
+  std::set<std::thread::id> all_threads;
+  for (auto &s : seqs) {
+    ASSERT_EQ(num_txcs, s.finalized.size());
+    for (unsigned i = 1; i < num_txcs; ++i) {
+      ASSERT_LT(s.finalized[i - 1], s.finalized[i]);
+    }
+    ASSERT_EQ(1u, s.threads.size());
+    all_threads.insert(*s.threads.begin());
+  }
+  // consecutive sequencer ids cover every finalize thread
+  ASSERT_LT(1u, all_threads.size());
+
+  for (auto &s : seqs) {
+    ObjectStore::Transaction t;
+    for (unsigned o = 0; o < 16; ++o) {
+      t.remove(s.cid, ghobject_t(hobject_t(sobject_t("obj" + stringify(o),
+						     CEPH_NOSNAP))));
+    }
+    t.remove_collection(s.cid);
+    ASSERT_EQ(queue_transaction(store, s.ch, std::move(t)), 0);
+    s.ch.reset();
+  }
+}
+
 TEST_P(StoreTest, SmallSkipFront) {
   int r;
   coll_t cid;
@@ -5395,6 +5488,304 @@ TEST_P(StoreTestSpecificAUSize, ZipperPatternSharded) {
   }
 }
 
+TEST_P(StoreTestSpecificAUSize, ExtentMapShardPrefetch) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  SetVal(g_conf(), "bluestore_extent_map_shard_min_size", "60");
+  SetVal(g_conf(), "bluestore_extent_map_shard_max_size", "300");
+  SetVal(g_conf(), "bluestore_extent_map_shard_target_size", "150");
+  SetVal(g_conf(), "bluestore_extent_map_shard_prefetch", "4");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(4096);
+
+  int r;
+  coll_t cid;
+  ghobject_t a(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // every other 4k block, so that no two extents can be merged and the
+  // extent map spans many shards
+  const unsigned len = 4096, count = 512;
+  for (unsigned i = 0; i < count; ++i) {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(string(len, 'a' + i % 26));
+    t.write(cid, a, i * 2 * len, len, bl, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.truncate(cid, a, count * 2 * len);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // drop the cached onode and its shards
+  ch.reset();
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  ch = store->open_collection(cid);
+  const PerfCounters* logger = store->get_perf_counters();
+  auto prefetched = logger->get(l_bluestore_onode_shard_prefetch);
+  auto hits = logger->get(l_bluestore_onode_shard_prefetch_hits);
+  auto misses = logger->get(l_bluestore_onode_shard_misses);
+
+  // stream the object back, each read starting where the last one ended
+  const unsigned chunk = 8 * len;
+  for (unsigned off = 0; off < count * 2 * len; off += chunk) {
+    bufferlist bl;
+    r = store->read(ch, a, off, chunk, bl);
+    ASSERT_EQ((int)chunk, r);
+    for (unsigned b = 0; b < chunk / len; ++b) {
+      unsigned i = (off + b * len) / (2 * len);
+      char expected = (off + b * len) % (2 * len) ? 0 : 'a' + i % 26;
+      bufferlist sub;
+      sub.substr_of(bl, b * len, len);
+      ASSERT_TRUE(sub.contents_equal(string(len, expected).c_str(), len))
+	<< " at 0x" << std::hex << off + b * len;
+    }
+  }
+  ASSERT_GT(logger->get(l_bluestore_onode_shard_prefetch), prefetched);
+  ASSERT_GT(logger->get(l_bluestore_onode_shard_prefetch_hits), hits);
+  // most shards were read ahead rather than faulted on demand
+  ASSERT_GT(logger->get(l_bluestore_onode_shard_prefetch_hits) - hits,
+	    logger->get(l_bluestore_onode_shard_misses) - misses);
+
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, a);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->mount());
+}
+
+TEST_P(StoreTestSpecificAUSize, OnodePrefetchRacingWrites) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  SetVal(g_conf(), "bluestore_onode_prefetch", "16");
+  // a small cache, so that written onodes are trimmed soon after the
+  // txc finishes
+  SetVal(g_conf(), "bluestore_cache_autotune", "false");
+  SetVal(g_conf(), "bluestore_cache_size", "4194304");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(4096);
+
+  int r;
+  const int64_t poolid = 11;
+  coll_t cid(spg_t(pg_t(0, poolid), shard_id_t::NO_SHARD));
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const unsigned count = 256;
+  vector<ghobject_t> objs;
+  for (unsigned i = 0; i < count; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "obj%05u", i);
+    objs.emplace_back(hobject_t(name, "", CEPH_NOSNAP, 0, poolid, ""));
+  }
+  // object i, version v is v + 1 blocks of ('a' + v)
+  auto version = [](unsigned v) {
+    bufferlist bl;
+    bl.append(string(4096 * (v + 1), 'a' + v));
+    return bl;
+  };
+  {
+    ObjectStore::Transaction t;
+    for (auto& o : objs) {
+      bufferlist bl = version(0);
+      t.write(cid, o, 0, bl.length(), bl);
+    }
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  ch = store->open_collection(cid);
+
+  // a cold sweep in key order reads ahead
+  const PerfCounters* logger = store->get_perf_counters();
+  auto prefetched = logger->get(l_bluestore_onode_prefetch);
+  for (auto& o : objs) {
+    struct stat st;
+    ASSERT_EQ(0, store->stat(ch, o, &st));
+    ASSERT_EQ(4096, st.st_size);
+  }
+  ASSERT_GT(logger->get(l_bluestore_onode_prefetch), prefetched);
+
+  // sweep again and again while every object is rewritten
+  std::atomic<bool> stop = false;
+  std::vector<std::thread> sweepers;
+  for (unsigned n = 0; n < 2; ++n) {
+    sweepers.emplace_back([&] {
+      while (!stop) {
+	for (auto& o : objs) {
+	  struct stat st;
+	  store->stat(ch, o, &st);
+	}
+      }
+    });
+  }
+  const unsigned versions = 4;
+  for (unsigned v = 1; v < versions; ++v) {
+    for (unsigned i = 0; i < count; ++i) {
+      ObjectStore::Transaction t;
+      bufferlist bl = version(v);
+      t.write(cid, objs[i], 0, bl.length(), bl);
+      r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+  ch->flush();
+  stop = true;
+  for (auto& t : sweepers) {
+    t.join();
+  }
+
+  // no sweep may have cached a version older than the last write
+  bufferlist expected = version(versions - 1);
+  for (auto& o : objs) {
+    struct stat st;
+    ASSERT_EQ(0, store->stat(ch, o, &st));
+    ASSERT_EQ(expected.length(), st.st_size) << o;
+    bufferlist bl;
+    r = store->read(ch, o, 0, expected.length(), bl);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(bl_eq(expected, bl)) << o;
+  }
+
+  {
+    ObjectStore::Transaction t;
+    for (auto& o : objs) {
+      t.remove(cid, o);
+    }
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->mount());
+}
+
+TEST_P(StoreTestSpecificAUSize, DefragFragmentedObject) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  SetVal(g_conf(), "bluestore_max_blob_size", "65536");
+  SetVal(g_conf(), "bluestore_prefer_deferred_size", "0");
+  SetVal(g_conf(), "bluestore_compression_mode", "none");
+  SetVal(g_conf(), "bluestore_defrag_min_blobs", "16");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(4096);
+
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // even blocks first, then the odd ones in between: every 4k block
+  // ends up in a blob of its own
+  const unsigned len = 4096, count = 128;
+  bufferlist expected;
+  for (unsigned i = 0; i < count; ++i) {
+    expected.append(string(len, 'a' + i % 26));
+  }
+  for (unsigned pass = 0; pass < 2; ++pass) {
+    for (unsigned i = pass; i < count; i += 2) {
+      ObjectStore::Transaction t;
+      bufferlist bl;
+      bl.substr_of(expected, i * len, len);
+      t.write(cid, hoid, i * len, len, bl);
+      r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+  ch->flush();
+
+  auto count_extents = [&]() {
+    JSONFormatter f(true);
+    EXPECT_EQ(0, store->dump_onode(ch, hoid, "onode", &f));
+    stringstream ss;
+    f.flush(ss);
+    string s = ss.str();
+    unsigned n = 0;
+    for (auto p = s.find("\"logical_offset\""); p != string::npos;
+	 p = s.find("\"logical_offset\"", p + 1)) {
+      ++n;
+    }
+    return n;
+  };
+  unsigned before = count_extents();
+  ASSERT_GE(before, 32u);
+
+  const PerfCounters* logger = store->get_perf_counters();
+  auto objects = logger->get(l_bluestore_defrag_objects);
+  auto bytes = logger->get(l_bluestore_defrag_bytes);
+  auto reduction = logger->get(l_bluestore_defrag_blob_reduction);
+  SetVal(g_conf(), "bluestore_defrag", "true");
+  g_conf().apply_changes(nullptr);
+  for (unsigned i = 0; i < 600 &&
+	 logger->get(l_bluestore_defrag_objects) == objects; ++i) {
+    usleep(100000);
+  }
+  SetVal(g_conf(), "bluestore_defrag", "false");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(objects + 1, logger->get(l_bluestore_defrag_objects));
+  ASSERT_EQ(bytes + count * len, logger->get(l_bluestore_defrag_bytes));
+  ch->flush();
+
+  // one max_blob_size blob per 64k
+  unsigned after = count_extents();
+  ASSERT_EQ(count * len / 65536, after);
+  ASSERT_GT(logger->get(l_bluestore_defrag_blob_reduction), reduction);
+  {
+    bufferlist bl;
+    r = store->read(ch, hoid, 0, count * len, bl);
+    ASSERT_EQ((int)(count * len), r);
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+
+  ch.reset();
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->fsck(true));
+  ASSERT_EQ(0, store->mount());
+  ch = store->open_collection(cid);
+  {
+    bufferlist bl;
+    r = store->read(ch, hoid, 0, count * len, bl);
+    ASSERT_EQ((int)(count * len), r);
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTestSpecificAUSize, SyntheticMatrixCsumAlgorithm) {
   if (string(GetParam()) != "bluestore")
     return;
@@ -9529,6 +9920,195 @@ TEST_P(StoreTestSpecificAUSize, fsckOnUnalignedDevice2) {
   store->mount();
 }
 
+TEST_P(StoreTestSpecificAUSize, BluestoreAllocCheckpointRestore) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_allocator_checkpoint_interval", "1");
+  SetVal(g_conf(), "bluestore_fsck_on_mount", "false");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "false");
+  StartDeferred(0x10000);
+  const PerfCounters* logger = store->get_perf_counters();
+
+  int r;
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  auto write_obj = [&](unsigned i) {
+    ghobject_t hoid(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+    bufferlist bl;
+    bl.append(std::string(0x30000, 'a' + (i % 26)));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, bl.length(), bl);
+    return queue_transaction(store, ch, std::move(t));
+  };
+  auto remove_obj = [&](unsigned i) {
+    ghobject_t hoid(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    return queue_transaction(store, ch, std::move(t));
+  };
+
+  for (unsigned i = 0; i < 32; ++i) {
+    ASSERT_EQ(write_obj(i), 0);
+  }
+  // let the checkpoint thread fold these deltas
+  for (unsigned i = 0; i < 10 && logger->get(l_bluestore_alloc_checkpoint_deltas) == 0; ++i) {
+    sleep(1);
+  }
+  ASSERT_GT(logger->get(l_bluestore_alloc_checkpoint_deltas), 0u);
+  // and leave some behind
+  for (unsigned i = 0; i < 32; i += 2) {
+    ASSERT_EQ(remove_obj(i), 0);
+  }
+  for (unsigned i = 32; i < 48; ++i) {
+    ASSERT_EQ(write_obj(i), 0);
+  }
+  ch.reset();
+  store->umount();
+
+  // pretend the allocation file was never written so that mount goes
+  // through the checkpoint
+  SetVal(g_conf(), "bluestore_debug_inject_allocation_from_file_failure", "1");
+  ASSERT_EQ(store->mount(), 0);
+  SetVal(g_conf(), "bluestore_debug_inject_allocation_from_file_failure", "0");
+  ch = store->open_collection(cid);
+
+  // new allocations must not land on live objects
+  for (unsigned i = 48; i < 80; ++i) {
+    ASSERT_EQ(write_obj(i), 0);
+  }
+  for (unsigned i = 1; i < 80; ++i) {
+    if (i < 32 && (i % 2) == 0) {
+      continue;
+    }
+    ghobject_t hoid(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+    bufferlist bl, expected;
+    expected.append(std::string(0x30000, 'a' + (i % 26)));
+    r = store->read(ch, hoid, 0, expected.length(), bl);
+    ASSERT_EQ(r, (int)expected.length());
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+  ch.reset();
+  store->umount();
+  ASSERT_EQ(store->fsck(false), 0);
+  store->mount();
+}
+
+TEST_P(StoreTestSpecificAUSize, BluestoreAllocCheckpointEarlyAllocations) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_allocator_checkpoint_interval", "1");
+  SetVal(g_conf(), "bluestore_fsck_on_mount", "false");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "false");
+  SetVal(g_conf(), "bluestore_max_blob_size", "65536");
+  SetVal(g_conf(), "bluestore_prefer_deferred_size", "0");
+  SetVal(g_conf(), "bluestore_compression_mode", "none");
+  SetVal(g_conf(), "bluestore_defrag_min_blobs", "16");
+  StartDeferred(0x1000);
+  const PerfCounters* logger = store->get_perf_counters();
+
+  int r;
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // a fragmented object, for the defrag thread to rewrite right at mount
+  ghobject_t frag(hobject_t(sobject_t("frag", CEPH_NOSNAP)));
+  const unsigned len = 0x1000, count = 128;
+  bufferlist frag_data;
+  for (unsigned i = 0; i < count; ++i) {
+    frag_data.append(std::string(len, 'a' + i % 26));
+  }
+  for (unsigned pass = 0; pass < 2; ++pass) {
+    for (unsigned i = pass; i < count; i += 2) {
+      ObjectStore::Transaction t;
+      bufferlist bl;
+      bl.substr_of(frag_data, i * len, len);
+      t.write(cid, frag, i * len, len, bl);
+      r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+  auto write_obj = [&](unsigned i) {
+    ghobject_t hoid(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+    bufferlist bl;
+    bl.append(std::string(0x30000, 'a' + (i % 26)));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, bl.length(), bl);
+    return queue_transaction(store, ch, std::move(t));
+  };
+  auto verify = [&]() {
+    bufferlist bl;
+    ASSERT_EQ((int)(count * len), store->read(ch, frag, 0, count * len, bl));
+    ASSERT_TRUE(bl_eq(frag_data, bl));
+    for (unsigned i = 0; i < 48; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+      bufferlist bl, expected;
+      expected.append(std::string(0x30000, 'a' + (i % 26)));
+      ASSERT_EQ((int)expected.length(), store->read(ch, hoid, 0, expected.length(), bl));
+      ASSERT_TRUE(bl_eq(expected, bl));
+    }
+  };
+  ch.reset();
+  store->umount();
+
+  // the defrag thread reallocates the object as soon as the store is
+  // mounted, before the first checkpoint is taken
+  auto defragged = logger->get(l_bluestore_defrag_objects);
+  SetVal(g_conf(), "bluestore_defrag", "true");
+  ASSERT_EQ(store->mount(), 0);
+  for (unsigned i = 0; i < 100 &&
+	 logger->get(l_bluestore_defrag_objects) == defragged; ++i) {
+    usleep(100000);
+  }
+  SetVal(g_conf(), "bluestore_defrag", "false");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(defragged + 1, logger->get(l_bluestore_defrag_objects));
+  ch = store->open_collection(cid);
+  for (unsigned i = 0; i < 16; ++i) {
+    ASSERT_EQ(write_obj(i), 0);
+  }
+  auto deltas = logger->get(l_bluestore_alloc_checkpoint_deltas);
+  for (unsigned i = 0; i < 10 &&
+	 logger->get(l_bluestore_alloc_checkpoint_deltas) == deltas; ++i) {
+    sleep(1);
+  }
+  ASSERT_GT(logger->get(l_bluestore_alloc_checkpoint_deltas), deltas);
+  for (unsigned i = 16; i < 24; ++i) {
+    ASSERT_EQ(write_obj(i), 0);
+  }
+  ch.reset();
+  store->umount();
+
+  // crash: restore from the checkpoint and its deltas
+  SetVal(g_conf(), "bluestore_debug_inject_allocation_from_file_failure", "1");
+  ASSERT_EQ(store->mount(), 0);
+  SetVal(g_conf(), "bluestore_debug_inject_allocation_from_file_failure", "0");
+  ch = store->open_collection(cid);
+  // space the rewrite took must not be handed out again
+  for (unsigned i = 24; i < 48; ++i) {
+    ASSERT_EQ(write_obj(i), 0);
+  }
+  verify();
+  ch.reset();
+  store->umount();
+  ASSERT_EQ(store->fsck(true), 0);
+  store->mount();
+  ch = store->open_collection(cid);
+  verify();
+}
+
 namespace {
   ghobject_t make_object(const char* name, int64_t pool) {
     sobject_t soid{name, CEPH_NOSNAP};
@@ -10414,6 +10994,132 @@ TEST_P(StoreTest, SpuriousReadErrorTest) {
   }
 }
 
+TEST_P(StoreTest, FsckDeepReadThreads) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  int r;
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const int count = 64;
+  for (int i = 0; i < count; ++i) {
+    ObjectStore::Transaction t;
+    ghobject_t hoid(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+    bufferlist bl;
+    bl.append(string(0x1000 * (1 + i % 8), 'a' + i % 26));
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch.reset();
+  ASSERT_EQ(0, store->umount());
+
+  auto deep_fsck = [&](const char *threads, bool repair) {
+    SetVal(g_conf(), "bluestore_fsck_deep_read_threads", threads);
+    g_conf().apply_changes(nullptr);
+    return repair ? store->repair(true) : store->fsck(true);
+  };
+  ASSERT_EQ(0, deep_fsck("0", false));
+  ASSERT_EQ(0, deep_fsck("4", false));
+
+  // every data read now fails its checksum: one error per object, no
+  // matter which thread read it
+  SetVal(g_conf(), "bluestore_retry_disk_reads", "0");
+  SetVal(g_conf(), "bluestore_debug_inject_csum_err_probability", "1");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(count, deep_fsck("0", false));
+  ASSERT_EQ(count, deep_fsck("4", false));
+  ASSERT_EQ(count, deep_fsck("1", false));
+  int serial = deep_fsck("0", true);
+  ASSERT_GT(serial, 0);
+  ASSERT_EQ(serial, deep_fsck("4", true));
+
+  SetVal(g_conf(), "bluestore_debug_inject_csum_err_probability", "0");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(0, deep_fsck("4", false));
+  ASSERT_EQ(0, deep_fsck("4", true));
+  ASSERT_EQ(0, store->mount());
+  ch = store->open_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    for (int i = 0; i < count; ++i) {
+      t.remove(cid,
+	       ghobject_t(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP))));
+    }
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, FsckWalkThreads) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  int r;
+  const int pools = 8;
+  const int count = 16;
+  vector<coll_t> cids;
+  for (int p = 1; p <= pools; ++p) {
+    coll_t cid(spg_t(pg_t(0, p), shard_id_t::NO_SHARD));
+    auto ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (int i = 0; i < count; ++i) {
+      bufferlist bl;
+      bl.append(string(0x1000, 'a' + i % 26));
+      t.write(cid, make_object(("obj" + stringify(i)).c_str(), p),
+	      0, bl.length(), bl);
+    }
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    cids.push_back(cid);
+  }
+  bstore->umount();
+
+  auto fsck = [&](const char *threads, bool deep) {
+    SetVal(g_conf(), "bluestore_fsck_walk_threads", threads);
+    g_conf().apply_changes(nullptr);
+    return bstore->fsck(deep);
+  };
+  ASSERT_EQ(0, fsck("1", false));
+  ASSERT_EQ(0, fsck("4", false));
+  ASSERT_EQ(0, fsck("4", true));
+
+  // the same extent claimed from two pools: with several walkers the
+  // conflict is usually only found when their bitmaps are merged, and it
+  // must count the same as in a single pass
+  bstore->mount();
+  bstore->inject_misreference(cids.front(), make_object("obj0", 1),
+			      cids.back(), make_object("obj0", pools), 0);
+  bstore->umount();
+  int serial = fsck("1", false);
+  ASSERT_GT(serial, 0);
+  ASSERT_EQ(serial, fsck("4", false));
+  ASSERT_EQ(serial, fsck("64", false));
+  ASSERT_EQ(0, bstore->repair(false));
+  ASSERT_EQ(0, fsck("4", false));
+
+  bstore->mount();
+  for (int p = 1; p <= pools; ++p) {
+    auto ch = store->open_collection(cids[p - 1]);
+    ObjectStore::Transaction t;
+    for (int i = 0; i < count; ++i) {
+      t.remove(cids[p - 1], make_object(("obj" + stringify(i)).c_str(), p));
+    }
+    t.remove_collection(cids[p - 1]);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, mergeRegionTest) {
   if (string(GetParam()) != "bluestore")
     return;
@@ -9,10 +9,13 @@
 #include "global/global_context.h"
 #include "common/ceph_context.h"
 #include "common/ceph_argparse.h"
+#include "include/scope_guard.h"
 #include "include/stringify.h"
 #include "common/errno.h"
+#include "common/buffer_instrumentation.h"
 
 #include "blk/BlockDevice.h"
+#include "blk/kernel/DiscardThrottle.h"
 
 using namespace std;
 
@@ -91,6 +94,348 @@ TEST(KernelDevice, Ticket45337) {
   b->close();
 }
 
+TEST(KernelDevice, IoringRegisteredBuffers) {
+  // falls back to libaio where io_uring is not available; the data must
+  // round trip either way
+  g_ceph_context->_conf.set_val("bdev_ioring", "true");
+  g_ceph_context->_conf.set_val("bdev_ioring_fixed_buffers", "4");
+  g_ceph_context->_conf.set_val("bdev_ioring_fixed_buffer_size", "65536");
+  g_ceph_context->_conf.set_val("bdev_ioring_sync_io", "true");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  // also on the early return and failed assertions below
+  auto reset_conf = make_scope_guard([] {
+    g_ceph_context->_conf.rm_val("bdev_ioring");
+    g_ceph_context->_conf.rm_val("bdev_ioring_fixed_buffers");
+    g_ceph_context->_conf.rm_val("bdev_ioring_fixed_buffer_size");
+    g_ceph_context->_conf.rm_val("bdev_ioring_sync_io");
+    g_ceph_context->_conf.apply_changes(nullptr);
+  });
+
+  uint64_t size = 1048576ull * 64;
+  TempBdev bdev{ size };
+
+  std::unique_ptr<BlockDevice> b(
+    BlockDevice::create(g_ceph_context, bdev.path, NULL, NULL,
+      [](void* handle, void* aio) {}, NULL));
+  {
+    int r = b->open(bdev.path);
+    if (r < 0) {
+      std::cerr << "open " << bdev.path << " failed" << std::endl;
+      return;
+    }
+  }
+
+  // more ios in flight than there are registered buffers
+  const uint64_t io_size = 0x10000;
+  const unsigned n = 16;
+  bufferlist expected;
+  {
+    IOContext ioc(g_ceph_context, NULL);
+    for (unsigned i = 0; i < n; i++) {
+      bufferlist bl;
+      bl.append_zero(io_size);
+      memset(bl.c_str(), 'a' + i, io_size);
+      expected.append(bl);
+      ASSERT_EQ(0, b->aio_write(i * io_size, bl, &ioc, false));
+    }
+    b->aio_submit(&ioc);
+    ioc.aio_wait();
+    ASSERT_EQ(0, b->flush());
+  }
+  {
+    IOContext ioc(g_ceph_context, NULL);
+    std::vector<bufferlist> bls(n);
+    for (unsigned i = 0; i < n; i++) {
+      ASSERT_EQ(0, b->aio_read(i * io_size, io_size, &bls[i], &ioc));
+    }
+    if (ioc.has_pending_aios()) {
+      b->aio_submit(&ioc);
+      ioc.aio_wait();
+    }
+    ASSERT_EQ(0, ioc.get_return_value());
+    bufferlist got;
+    for (auto& bl : bls) {
+      got.claim_append(bl);
+    }
+    ASSERT_TRUE(got.contents_equal(expected));
+  }
+  {
+    IOContext ioc(g_ceph_context, NULL);
+    bufferlist bl;
+    ASSERT_EQ(0, b->read(io_size, io_size * 2, &bl, &ioc, false));
+    bufferlist e;
+    e.substr_of(expected, io_size, io_size * 2);
+    ASSERT_TRUE(bl.contents_equal(e));
+  }
+  {
+    bufferptr p = ceph::buffer::create_small_page_aligned(io_size);
+    ASSERT_EQ(0, b->read_random(io_size * 3, io_size, p.c_str(), false));
+    ASSERT_EQ(0, memcmp(p.c_str(), expected.c_str() + io_size * 3, io_size));
+  }
+  b->close();
+}
+
+TEST(KernelDevice, NumaAffinity) {
+  // a temp file has no numa node of its own; force node 0
+  g_ceph_context->_conf.set_val("bdev_numa_affinity", "true");
+  g_ceph_context->_conf.set_val("bdev_numa_node", "0");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  TempBdev bdev{ 1048576ull * 16 };
+  std::unique_ptr<BlockDevice> b(
+    BlockDevice::create(g_ceph_context, bdev.path, NULL, NULL,
+      [](void* handle, void* aio) {}, NULL));
+  ASSERT_EQ(0, b->open(bdev.path));
+
+  bufferlist bl;
+  bl.append(std::string(0x10000, 'n'));
+  ASSERT_EQ(0, b->write(0, bl, false));
+  IOContext ioc(g_ceph_context, NULL);
+  bufferlist out;
+  ASSERT_EQ(0, b->aio_read(0, 0x10000, &out, &ioc));
+  if (ioc.has_pending_aios()) {
+    b->aio_submit(&ioc);
+    ioc.aio_wait();
+  }
+  ASSERT_TRUE(out.contents_equal(bl));
+
+  std::unique_ptr<Formatter> f(Formatter::create("json"));
+  f->open_object_section("numa");
+  b->dump_numa_stats(f.get());
+  f->close_section();
+  std::stringstream ss;
+  f->flush(ss);
+  std::cout << ss.str() << std::endl;
+  // node 0 exists wherever there is sysfs numa information at all
+  if (access("/sys/devices/system/node/node0/cpulist", R_OK) == 0) {
+    ASSERT_NE(std::string::npos, ss.str().find("\"numa_node\":0"));
+  }
+  // without mbind() there is no pool
+  if (ss.str().find("\"read_buffers\"") != std::string::npos) {
+    // read into the pool, which was bound to the node up front
+    const auto& ibp =
+      static_cast<const ceph::buffer_instrumentation::instrumented_bptr&>(
+	static_cast<const bufferptr&>(out.front()));
+    ASSERT_TRUE(ibp.is_raw_marked<BlockDevice::numa_raw_marker_t>());
+    ASSERT_TRUE(ioc.flags & IOContext::FLAG_DONT_CACHE);
+    ASSERT_NE(std::string::npos, ss.str().find("\"pool_reads\":1"));
+  }
+  b->close();
+  // a buffer outlives the device, and its pool
+  out.clear();
+
+  g_ceph_context->_conf.rm_val("bdev_numa_affinity");
+  g_ceph_context->_conf.rm_val("bdev_numa_node");
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
+TEST(KernelDevice, DiscardQueue) {
+  g_ceph_context->_conf.set_val("bdev_enable_discard", "true");
+  g_ceph_context->_conf.set_val("bdev_async_discard_threads", "1");
+  g_ceph_context->_conf.set_val("bdev_discard_batch_delay", "10");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  interval_set<uint64_t> released;
+  TempBdev bdev{ 1048576ull * 16 };
+  std::unique_ptr<BlockDevice> b(
+    BlockDevice::create(g_ceph_context, bdev.path, NULL, NULL,
+      [](void* handle, void* r) {
+	static_cast<interval_set<uint64_t>*>(handle)->insert(
+	  *static_cast<interval_set<uint64_t>*>(r));
+      }, &released));
+  ASSERT_EQ(0, b->open(bdev.path));
+
+  interval_set<uint64_t> to_release;
+  to_release.insert(0, 0x10000);
+  to_release.insert(0x10000, 0x10000);
+  to_release.insert(0x40000, 0x10000);
+  if (b->try_discard(to_release)) {
+    // the batch delay keeps them queued, and coalesced
+    ASSERT_EQ(0x30000u, b->get_discard_queued_bytes());
+    ASSERT_EQ(0x30000u, b->release_queued_discards());
+    ASSERT_EQ(0u, b->get_discard_queued_bytes());
+    ASSERT_EQ(2u, released.num_intervals());
+    ASSERT_EQ(0x30000u, released.size());
+  } else {
+    // a temp file does not support discard; nothing may linger
+    ASSERT_EQ(0u, b->get_discard_queued_bytes());
+    ASSERT_EQ(0u, b->release_queued_discards());
+  }
+  b->discard_drain();
+  b->close();
+
+  g_ceph_context->_conf.rm_val("bdev_enable_discard");
+  g_ceph_context->_conf.rm_val("bdev_async_discard_threads");
+  g_ceph_context->_conf.rm_val("bdev_discard_batch_delay");
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
+TEST(DiscardThrottle, BatchDelay) {
+  DiscardThrottle t;
+  DiscardThrottle::conf_t conf;
+  conf.batch_delay = std::chrono::milliseconds(100);
+  ceph::mono_time start = ceph::mono_clock::zero() + std::chrono::seconds(10);
+
+  ASSERT_EQ(std::chrono::milliseconds(100),
+	    t.hold_back(conf, start, start, false));
+  ASSERT_EQ(std::chrono::milliseconds(40),
+	    t.hold_back(conf, start + std::chrono::milliseconds(60), start,
+			false));
+  ASSERT_EQ(ceph::timespan::zero(),
+	    t.hold_back(conf, start + std::chrono::milliseconds(100), start,
+			false));
+
+  // no caps: the whole queue goes in one round, coalesced
+  interval_set<uint64_t> queued, out;
+  queued.insert(0, 0x10000);
+  queued.insert(0x10000, 0x10000);
+  queued.insert(0x40000, 0x10000);
+  t.take(conf, &queued, &out);
+  ASSERT_TRUE(queued.empty());
+  ASSERT_EQ(2u, out.num_intervals());
+  ASSERT_EQ(0x30000u, out.size());
+  ASSERT_EQ(0u, t.throttled);
+}
+
+TEST(DiscardThrottle, TokenBuckets) {
+  DiscardThrottle t;
+  DiscardThrottle::conf_t conf;
+  conf.max_bytes_per_sec = 0x10000;
+  conf.max_ops_per_sec = 2;
+  ceph::mono_time now = ceph::mono_clock::zero() + std::chrono::seconds(10);
+
+  // the first round gets a full second of budget, not more
+  ASSERT_EQ(ceph::timespan::zero(), t.hold_back(conf, now, now, false));
+  interval_set<uint64_t> queued, out;
+  queued.insert(0, 0x18000);
+  queued.insert(0x100000, 0x1000);
+  t.take(conf, &queued, &out);
+  // the large extent is split at the byte budget
+  ASSERT_EQ(1u, out.num_intervals());
+  ASSERT_EQ(0x10000u, out.size());
+  ASSERT_EQ(0x9000u, queued.size());
+
+  // out of bytes: wait for one block worth of them
+  ASSERT_EQ(ceph::make_timespan(4096.0 / 0x10000),
+	    t.hold_back(conf, now, now, false));
+  ASSERT_EQ(1u, t.throttled);
+
+  // a second later the op bucket limits the round to two extents
+  now += std::chrono::seconds(1);
+  queued.insert(0x200000, 0x1000);
+  out.clear();
+  ASSERT_EQ(ceph::timespan::zero(), t.hold_back(conf, now, now, false));
+  t.take(conf, &queued, &out);
+  ASSERT_EQ(2u, out.num_intervals());
+  ASSERT_EQ(0x9000u, out.size());
+  ASSERT_EQ(1u, queued.num_intervals());
+  ASSERT_EQ(ceph::make_timespan(0.5), t.hold_back(conf, now, now, false));
+  ASSERT_EQ(2u, t.throttled);
+}
+
+TEST(DiscardThrottle, LatencyPauseIsBounded) {
+  DiscardThrottle t;
+  DiscardThrottle::conf_t conf;
+  conf.max_pause = std::chrono::seconds(1);
+  ceph::mono_time start = ceph::mono_clock::zero() + std::chrono::seconds(10);
+
+  // held back while the foreground is busy...
+  ceph::mono_time now = start;
+  for (; now < start + std::chrono::seconds(1);
+       now += std::chrono::milliseconds(100)) {
+    ASSERT_LT(ceph::timespan::zero(), t.hold_back(conf, now, start, true));
+  }
+  ASSERT_EQ(10u, t.latency_pauses);
+  // ...but not for longer than max_pause at a time
+  ASSERT_EQ(ceph::timespan::zero(), t.hold_back(conf, now, start, true));
+  ASSERT_EQ(1u, t.forced_rounds);
+  ASSERT_LT(ceph::timespan::zero(),
+	    t.hold_back(conf, now + std::chrono::milliseconds(10), start, true));
+  ASSERT_EQ(ceph::timespan::zero(),
+	    t.hold_back(conf, now + std::chrono::seconds(1), start, true));
+  ASSERT_EQ(2u, t.forced_rounds);
+
+  // a quiet foreground lets discards through right away
+  now += std::chrono::seconds(2);
+  ASSERT_EQ(ceph::timespan::zero(), t.hold_back(conf, now, start, false));
+  ASSERT_LT(ceph::timespan::zero(),
+	    t.hold_back(conf, now + std::chrono::milliseconds(10), start,
+			true));
+
+  // max_pause 0 holds back for as long as the foreground is busy
+  conf.max_pause = ceph::timespan::zero();
+  ASSERT_LT(ceph::timespan::zero(),
+	    t.hold_back(conf, now + std::chrono::hours(1), start, true));
+  ASSERT_EQ(2u, t.forced_rounds);
+}
+
+TEST(BlockDeviceLatency, Buckets) {
+  ASSERT_EQ(0u, BlockDeviceLatency::get_size_class(512));
+  ASSERT_EQ(0u, BlockDeviceLatency::get_size_class(4096));
+  ASSERT_EQ(1u, BlockDeviceLatency::get_size_class(4097));
+  ASSERT_EQ(1u, BlockDeviceLatency::get_size_class(16384));
+  ASSERT_EQ(2u, BlockDeviceLatency::get_size_class(65536));
+  ASSERT_EQ(4u, BlockDeviceLatency::get_size_class(1048576));
+  ASSERT_EQ(5u, BlockDeviceLatency::get_size_class(1048577));
+  ASSERT_EQ(5u, BlockDeviceLatency::get_size_class(1ull << 30));
+
+  ASSERT_EQ(0u, BlockDeviceLatency::get_bucket(std::chrono::nanoseconds(999)));
+  ASSERT_EQ(1u, BlockDeviceLatency::get_bucket(std::chrono::microseconds(1)));
+  ASSERT_EQ(7u, BlockDeviceLatency::get_bucket(std::chrono::microseconds(100)));
+  ASSERT_EQ(BlockDeviceLatency::BUCKETS - 1,
+	    BlockDeviceLatency::get_bucket(std::chrono::seconds(1000)));
+
+  std::array<uint64_t, BlockDeviceLatency::BUCKETS> h = {};
+  ASSERT_EQ(0, BlockDeviceLatency::get_quantile(h, 0.999));
+  h[7] = 999;   // [64, 128) us
+  h[14] = 1;    // [8192, 16384) us
+  ASSERT_GE(BlockDeviceLatency::get_quantile(h, 0.5), 64);
+  ASSERT_LT(BlockDeviceLatency::get_quantile(h, 0.5), 128);
+  ASSERT_LE(BlockDeviceLatency::get_quantile(h, 0.999), 128);
+  ASSERT_GE(BlockDeviceLatency::get_quantile(h, 1.0), 8192);
+}
+
+TEST(BlockDeviceLatency, Outliers) {
+  BlockDeviceLatency l;
+  BlockDeviceLatency::detector_conf_t conf;
+  conf.ratio = 4;
+  conf.min_ios = 1000;
+  conf.min_latency_us = 1000;
+  conf.window = ceph::make_timespan(60);
+  conf.warmup_windows = 3;
+
+  auto now = ceph::mono_clock::now();
+  auto run_window = [&](ceph::timespan lat, unsigned slow) {
+    for (unsigned i = 0; i < 2000; ++i) {
+      l.record(BlockDeviceLatency::OP_READ, 4096,
+	       i < slow ? lat * 100 : lat);
+    }
+    now += conf.window;
+    std::string s;
+    return l.check_outliers(now, conf, &s);
+  };
+
+  ASSERT_EQ(0u, l.check_outliers(now, conf, nullptr));
+  // healthy windows build the baseline
+  for (unsigned i = 0; i < 5; ++i) {
+    ASSERT_EQ(0u, run_window(std::chrono::microseconds(500), 0));
+  }
+  // too few ios: the window stays open and nothing is judged
+  l.record(BlockDeviceLatency::OP_READ, 4096, std::chrono::milliseconds(500));
+  now += conf.window;
+  ASSERT_EQ(0u, l.check_outliers(now, conf, nullptr));
+  // a tail of very slow ios
+  std::string s;
+  ASSERT_EQ(1u, run_window(std::chrono::microseconds(500), 20));
+  ASSERT_EQ(1u, l.check_outliers(now, conf, &s));
+  ASSERT_NE(std::string::npos, s.find("read/4K"));
+  // the outlier did not move the baseline, and recovery clears the flag
+  ASSERT_EQ(0u, run_window(std::chrono::microseconds(500), 0));
+  // and a disabled detector flags nothing
+  conf.ratio = 0;
+  ASSERT_EQ(0u, run_window(std::chrono::microseconds(500), 20));
+}
+
 int main(int argc, char **argv) {
   auto args = argv_to_vec(argc, argv);
   map<string,string> defaults = {
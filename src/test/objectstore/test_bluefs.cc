@@ -818,6 +818,76 @@ TEST(BlueFS, test_replay_growth) {
   fs.umount();
 }
 
+TEST(BlueFS, test_replay_pipeline) {
+  uint64_t size = 1048576 * 128;
+  TempBdev bdev{size};
+
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_alloc_size", "4096");
+  conf.SetVal("bluefs_shared_alloc_size", "4096");
+  conf.SetVal("bluefs_compact_log_sync", "false");
+  conf.SetVal("bluefs_replay_pipeline_depth", "0");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("dir"));
+
+  char data[3000] = {'x'};
+  for (size_t i = 0; i < 200; i++) {
+    BlueFS::FileWriter *h;
+    string name = "file." + stringify(i);
+    ASSERT_EQ(0, fs.open_for_write("dir", name, &h, false));
+    for (size_t j = 0; j <= i % 7; j++) {
+      h->append(data, sizeof(data));
+      fs.fsync(h);
+    }
+    fs.close_writer(h);
+    if (i % 3 == 0) {
+      ASSERT_EQ(0, fs.unlink("dir", name));
+    }
+  }
+  fs.umount(true); //keep the whole history in the log
+
+  auto check = [&] {
+    size_t found = 0;
+    for (size_t i = 0; i < 200; i++) {
+      uint64_t file_size;
+      utime_t mtime;
+      int r = fs.stat("dir", "file." + stringify(i), &file_size, &mtime);
+      if (i % 3 == 0) {
+	ASSERT_EQ(-ENOENT, r);
+      } else {
+	ASSERT_EQ(0, r);
+	ASSERT_EQ(sizeof(data) * (i % 7 + 1), file_size);
+	++found;
+      }
+    }
+    ASSERT_EQ(133u, found);
+  };
+
+  ASSERT_EQ(0, fs.mount());
+  uint64_t txns = fs.get_mount_stats().txns;
+  uint64_t log_bytes = fs.get_mount_stats().log_bytes;
+  ASSERT_GT(txns, 200u);
+  check();
+  fs.umount(true);
+
+  // the pipelined replay must arrive at exactly the same state
+  for (auto depth : {"1", "4", "256"}) {
+    conf.SetVal("bluefs_replay_pipeline_depth", depth);
+    conf.ApplyChanges();
+    ASSERT_EQ(0, fs.mount());
+    ASSERT_EQ(txns, fs.get_mount_stats().txns);
+    ASSERT_EQ(log_bytes, fs.get_mount_stats().log_bytes);
+    check();
+    fs.umount(true);
+  }
+}
+
 TEST(BlueFS, test_tracker_50965) {
   uint64_t size_wal = 1048576 * 64;
   TempBdev bdev_wal{size_wal};
@@ -969,6 +1039,75 @@ TEST(BlueFS, test_truncate_stable_53129) {
   fs.umount();
 }
 
+TEST(BlueFS, block_cache) {
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_block_cache_size", "1048576");
+  conf.SetVal("bluefs_block_cache_block_size", "4096");
+  conf.SetVal("bluefs_block_cache_admit_threshold", "2");
+  conf.ApplyChanges();
+
+  uint64_t size = 1048576 * 128;
+  TempBdev bdev{size};
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_NE(nullptr, fs.get_block_cache());
+  ASSERT_EQ(0, fs.mkdir("dir"));
+
+  const size_t len = 65536;
+  auto write_file = [&](const char* data) {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "file", &h, false));
+    h->append(data, len);
+    fs.fsync(h);
+    fs.close_writer(h);
+  };
+  std::unique_ptr<char[]> buf1 = gen_buffer(len);
+  std::unique_ptr<char[]> buf2 = gen_buffer(len);
+  write_file(buf1.get());
+
+  auto counters = fs.get_perf_counters();
+  char out[100];
+  {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "file", &h, true));
+    // first miss only warms the block up, the second one admits it
+    for (int i = 0; i < 2; i++) {
+      ASSERT_EQ(100, fs.read_random(h, 8200, 100, out));
+      ASSERT_EQ(0, memcmp(out, buf1.get() + 8200, 100));
+    }
+    ASSERT_EQ(0u, counters->get(l_bluefs_read_random_cache_count));
+    ASSERT_EQ(1u, counters->get(l_bluefs_read_random_cache_admit_count));
+    ASSERT_EQ(4096u, fs.get_block_cache()->get_bytes());
+
+    ASSERT_EQ(100, fs.read_random(h, 8300, 100, out));
+    ASSERT_EQ(0, memcmp(out, buf1.get() + 8300, 100));
+    ASSERT_EQ(1u, counters->get(l_bluefs_read_random_cache_count));
+
+    // shrinking the cache evicts right away
+    fs.get_block_cache()->set_max(0);
+    ASSERT_EQ(0u, fs.get_block_cache()->get_bytes());
+    fs.get_block_cache()->set_max(1048576);
+    delete h;
+  }
+
+  // rewriting the file must not serve stale blocks
+  write_file(buf2.get());
+  ASSERT_EQ(0u, fs.get_block_cache()->get_bytes());
+  {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "file", &h, true));
+    ASSERT_EQ(100, fs.read_random(h, 8300, 100, out));
+    ASSERT_EQ(0, memcmp(out, buf2.get() + 8300, 100));
+    delete h;
+  }
+  ASSERT_EQ(0, fs.unlink("dir", "file"));
+  ASSERT_EQ(0u, fs.get_block_cache()->get_bytes());
+  fs.umount();
+}
+
 TEST(BlueFS, test_update_ino1_delta_after_replay) {
   uint64_t size = 1048576LL * (2 * 1024 + 128);
   TempBdev bdev{size};
@@ -1272,6 +1411,87 @@ TEST(BlueFS, test_shared_alloc_sparse) {
   }
 }
 
+TEST(BlueFS, test_tier_migrate) {
+  uint64_t size_db = 1048576 * 32;
+  TempBdev bdev_db{size_db};
+  uint64_t size_slow = 1048576 * 128;
+  TempBdev bdev_slow{size_slow};
+
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_tier_enable", "true");
+  conf.SetVal("bluefs_tier_interval", "3600"); // we drive it by hand
+  conf.SetVal("bluefs_tier_min_heat", "1048576");
+  conf.SetVal("bluefs_tier_max_bytes_per_sec", "0");
+  conf.SetVal("bluefs_tier_min_free_ratio", "0.1");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev_db.path, false));
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_SLOW, bdev_slow.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("db"));
+
+  const size_t chunk = 1048576;
+  std::unique_ptr<char[]> buf = gen_buffer(chunk);
+  {
+    // fill up the DB device so that the next file spills over
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db", "fill", &h, false));
+    while (fs.get_free(BlueFS::BDEV_DB) > 2 * chunk) {
+      h->append(buf.get(), chunk);
+      fs.fsync(h);
+    }
+    fs.close_writer(h);
+  }
+  uint64_t slow_used = fs.get_used(BlueFS::BDEV_SLOW);
+  const size_t hot_len = 4 * chunk;
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db", "hot", &h, false));
+    for (size_t i = 0; i < hot_len / chunk; i++) {
+      h->append(buf.get(), chunk);
+    }
+    fs.fsync(h);
+    fs.close_writer(h);
+  }
+  ASSERT_GE(fs.get_used(BlueFS::BDEV_SLOW), slow_used + hot_len);
+
+  // make room again; nothing is read yet, so nothing moves
+  ASSERT_EQ(0, fs.unlink("db", "fill"));
+  fs.sync_metadata(false);
+  ASSERT_EQ(0u, fs.debug_tier_migrate());
+
+  auto read_all = [&] {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("db", "hot", &h, true));
+    char out[65536];
+    for (size_t off = 0; off < hot_len; off += sizeof(out)) {
+      ASSERT_EQ((int64_t)sizeof(out), fs.read_random(h, off, sizeof(out), out));
+      ASSERT_EQ(0, memcmp(out, buf.get() + off % chunk, sizeof(out)));
+    }
+    delete h;
+  };
+  read_all();
+  slow_used = fs.get_used(BlueFS::BDEV_SLOW);
+  ASSERT_EQ(1u, fs.debug_tier_migrate());
+  ASSERT_LE(fs.get_used(BlueFS::BDEV_SLOW), slow_used - hot_len);
+  slow_used = fs.get_used(BlueFS::BDEV_SLOW);
+  auto counters = fs.get_perf_counters();
+  ASSERT_EQ(1u, counters->get(l_bluefs_tier_migrate_count));
+  ASSERT_EQ(hot_len, counters->get(l_bluefs_tier_migrate_bytes));
+  read_all();
+  // already moved, so reads no longer heat it up
+  ASSERT_EQ(0u, fs.debug_tier_migrate());
+  fs.umount();
+
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_LE(fs.get_used(BlueFS::BDEV_SLOW), slow_used);
+  read_all();
+  fs.umount();
+}
+
 TEST(BlueFS, test_4k_shared_alloc) {
   uint64_t size = 1048576 * 128 * 2;
   uint64_t main_unit = 4096;
@@ -2837,6 +2837,112 @@ TEST(bluestore_blob_use_tracker_t, mempool_stats_test)
   }
 }
 
+TEST(OnodeCacheShard, two_q_scan_resistance)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  BlueStore::OnodeCacheShard *oc = BlueStore::OnodeCacheShard::create(
+    g_ceph_context, "2q", NULL);
+  BlueStore::BufferCacheShard *bc = BlueStore::BufferCacheShard::create(
+    g_ceph_context, "2q", NULL);
+  auto coll = ceph::make_ref<BlueStore::Collection>(&store, oc, bc, coll_t());
+  oc->set_max(10);
+
+  auto oid_of = [](const string& name) {
+    return ghobject_t(hobject_t(sobject_t(name, CEPH_NOSNAP)));
+  };
+  auto cached = [&](const string& name) {
+    auto oid = oid_of(name);
+    return coll->onode_space.map_any([&](BlueStore::Onode* o) {
+      return o->oid == oid;
+    });
+  };
+  // returns true on cache hit, loads a fresh onode otherwise
+  auto access = [&](const string& name) {
+    auto oid = oid_of(name);
+    BlueStore::OnodeRef r;
+    coll->onode_space.map_any([&](BlueStore::Onode* o) {
+      if (o->oid == oid) {
+        r = o;
+        return true;
+      }
+      return false;
+    });
+    if (r) {
+      return true;
+    }
+    BlueStore::OnodeRef o(new BlueStore::Onode(coll.get(), oid, name));
+    o->exists = true;
+    coll->onode_space.add_onode(oid, o);
+    return false;
+  };
+
+  for (int i = 0; i < 4; i++) {
+    ASSERT_FALSE(access("hot" + stringify(i)));
+  }
+  // the first sweep pushes the hot set out of warm_in into the ghost list
+  for (int i = 0; i < 11; i++) {
+    ASSERT_FALSE(access("scan" + stringify(i)));
+  }
+  for (int i = 0; i < 4; i++) {
+    ASSERT_FALSE(cached("hot" + stringify(i)));
+  }
+  // reloading shortly after eviction promotes to the hot list
+  for (int i = 0; i < 4; i++) {
+    ASSERT_FALSE(access("hot" + stringify(i)));
+  }
+  // ... where it survives a long sweep
+  for (int i = 0; i < 100; i++) {
+    ASSERT_FALSE(access("sweep" + stringify(i)));
+  }
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(access("hot" + stringify(i)));
+  }
+  oc->trim();
+  uint64_t onodes = 0, pinned = 0;
+  oc->add_stats(&onodes, &pinned);
+  ASSERT_EQ(10u, onodes);
+  ASSERT_EQ(0u, pinned);
+}
+
+TEST(BlueStore, calc_prefer_deferred_size)
+{
+  const uint64_t min = 0x1000, max = 0x10000, align = 0x1000;
+  // kv commits slower than direct writes: back off, but not below min
+  uint64_t cur = max;
+  for (int i = 0; i < 20; i++) {
+    cur = BlueStore::calc_prefer_deferred_size(cur, min, max, align,
+					       500, 1000, 0);
+  }
+  ASSERT_EQ(min, cur);
+  // a growing deferred backlog backs off even with slow direct writes
+  ASSERT_EQ(0x8000u, BlueStore::calc_prefer_deferred_size(
+	      max, min, max, align, 10000, 100, 0.75));
+  ASSERT_EQ(min, BlueStore::calc_prefer_deferred_size(
+	      min, min, max, align, 10000, 100, 0.75));
+  // slow direct writes and no backlog: defer more, up to max
+  for (int i = 0; i < 20; i++) {
+    cur = BlueStore::calc_prefer_deferred_size(cur, min, max, align,
+					       10000, 100, 0);
+  }
+  ASSERT_EQ(max, cur);
+  // comparable latencies, or nothing measured yet: hold
+  ASSERT_EQ(0x8000u, BlueStore::calc_prefer_deferred_size(
+	      0x8000, min, max, align, 1000, 800, 0.3));
+  ASSERT_EQ(0x8000u, BlueStore::calc_prefer_deferred_size(
+	      0x8000, min, max, align, 0, 0, 0));
+  // as the stale direct write latency decays the threshold drops
+  uint64_t aio_us = 10000;
+  cur = max;
+  for (int i = 0; i < 20; i++, aio_us /= 2) {
+    cur = BlueStore::calc_prefer_deferred_size(cur, min, max, align,
+					       aio_us, 1000, 0);
+  }
+  ASSERT_EQ(min, cur);
+  // a floor above the configured value pins it there
+  ASSERT_EQ(0x8000u, BlueStore::calc_prefer_deferred_size(
+	      0x8000, 0x10000, 0x8000, align, 500, 1000, 0));
+}
+
 int main(int argc, char **argv) {
   auto args = argv_to_vec(argc, argv);
   auto cct = global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT,
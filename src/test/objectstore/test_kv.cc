@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#include <stack>
 #include <time.h>
 #include <sys/mount.h>
 #include "kv/KeyValueDB.h"
@@ -29,6 +30,31 @@
 
 using namespace std;
 
+class ConfSaver {
+  std::stack<std::pair<std::string, std::string>> saved_settings;
+  ConfigProxy& conf;
+public:
+  ConfSaver(ConfigProxy& conf) : conf(conf) {}
+  ~ConfSaver() {
+    while (saved_settings.size() > 0) {
+      auto& e = saved_settings.top();
+      conf.set_val_or_die(e.first, e.second);
+      saved_settings.pop();
+    }
+    conf.apply_changes(nullptr);
+  }
+  void SetVal(const char* key, const char* val) {
+    std::string skey(key);
+    std::string prev_val;
+    conf.get_val(skey, &prev_val);
+    conf.set_val_or_die(skey, val);
+    saved_settings.emplace(skey, prev_val);
+  }
+  void ApplyChanges() {
+    conf.apply_changes(nullptr);
+  }
+};
+
 std::string gen_random_string(size_t size) {
   std::string s;
   for (size_t i = 0; i < size; i++) {
@@ -359,6 +385,101 @@ TEST_P(KVTest, ShardingRMRange) {
 }
 
 
+TEST_P(KVTest, MultiGet) {
+  std::string cfs;
+  if (string(GetParam()) == "rocksdb")
+    cfs = "O(3)";
+  ASSERT_EQ(0, db->create_and_open(cout, cfs));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (size_t i = 0; i < 100; i += 2) {
+      bufferlist value;
+      value.append(stringify(i));
+      t->set("O", "key" + stringify(1000 + i), value);
+      t->set("prefix", "key" + stringify(1000 + i), value);
+    }
+    db->submit_transaction_sync(t);
+  }
+  for (auto prefix : {"O", "prefix"}) {
+    std::set<std::string> keys;
+    for (size_t i = 0; i < 100; ++i) {
+      keys.insert("key" + stringify(1000 + i));
+    }
+    std::map<std::string, bufferlist> out;
+    ASSERT_EQ(0, db->get(prefix, keys, &out));
+    ASSERT_EQ(50u, out.size());
+    for (auto& [k, v] : out) {
+      size_t i = std::stoul(k.substr(3)) - 1000;
+      ASSERT_EQ(0u, i % 2);
+      ASSERT_EQ(stringify(i), v.to_str());
+    }
+  }
+  fini();
+}
+
+TEST_P(KVTest, SubmitTransactions) {
+  std::string cfs;
+  if (string(GetParam()) == "rocksdb")
+    cfs = "O(3)";
+  ConfSaver conf(g_ceph_context->_conf);
+  // small enough that the group is split over several batches
+  conf.SetVal("rocksdb_write_coalesce_max_bytes", "2048");
+  conf.SetVal("rocksdb_write_coalesce_min_bytes", "1024");
+  // rm_range_keys() only sees keys already in the store; make it a
+  // DeleteRange, which also covers the puts of earlier transactions
+  conf.SetVal("rocksdb_delete_range_threshold", "1");
+  conf.ApplyChanges();
+  ASSERT_EQ(0, db->create_and_open(cout, cfs));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist value;
+    value.append("old");
+    t->set("O", "deleted", value);
+    t->set("O", "single", value);
+    t->set("prefix", "key1000", value);
+    db->submit_transaction_sync(t);
+  }
+  std::vector<KeyValueDB::Transaction> tl;
+  for (size_t i = 0; i < 50; ++i) {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (auto prefix : {"O", "prefix"}) {
+      bufferlist value;
+      value.append(stringify(i));
+      // every transaction overwrites the same keys
+      t->set(prefix, "overwritten", value);
+      t->set(prefix, "key" + stringify(1000 + i), value);
+    }
+    if (i == 10) {
+      t->rmkey("O", "deleted");
+    } else if (i == 20) {
+      t->rm_single_key("O", "single");
+    } else if (i == 30) {
+      t->rm_range_keys("prefix", "key1000", "key1010");
+    }
+    tl.push_back(t);
+  }
+  ASSERT_EQ(0, db->submit_transactions(tl));
+  for (auto prefix : {"O", "prefix"}) {
+    bufferlist v;
+    ASSERT_EQ(0, db->get(prefix, "overwritten", &v));
+    ASSERT_EQ("49", v.to_str());
+    for (size_t i = 0; i < 50; ++i) {
+      bufferlist v;
+      int r = db->get(prefix, "key" + stringify(1000 + i), &v);
+      if (string(prefix) == "prefix" && i < 10) {
+	ASSERT_EQ(-ENOENT, r);
+      } else {
+	ASSERT_EQ(0, r);
+	ASSERT_EQ(stringify(i), v.to_str());
+      }
+    }
+  }
+  bufferlist v;
+  ASSERT_EQ(-ENOENT, db->get("O", "deleted", &v));
+  ASSERT_EQ(-ENOENT, db->get("O", "single", &v));
+  fini();
+}
+
 TEST_P(KVTest, RocksDBColumnFamilyTest) {
   if(string(GetParam()) != "rocksdb")
     return;
@@ -503,6 +624,64 @@ TEST_P(KVTest, RocksDBShardingIteratorTest) {
   fini();
 }
 
+TEST_P(KVTest, RocksDBColumnFilters) {
+  if(string(GetParam()) != "rocksdb")
+    return;
+
+  // prefix filters must not change what an iterator sees
+  db.reset(KeyValueDB::create(
+    g_ceph_context, "rocksdb", "kv_test_temp_dir",
+    {{"cf_filters", "A={type=bloom;prefix_len=2};B={type=ribbon;whole_key=true}"}}));
+  ASSERT_EQ(0, db->init(g_conf()->bluestore_rocksdb_options));
+  ASSERT_EQ(0, db->create_and_open(cout, "A(3) B C=filter={type=none}"));
+  for (int round = 0; round < 2; round++) {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int v = 100 + round; v <= 999; v += 2) {
+      bufferlist val;
+      val.append(to_string(v));
+      for (auto prefix : {"A", "B", "C"}) {
+	t->set(prefix, to_string(v), val);
+      }
+    }
+    ASSERT_EQ(0, db->submit_transaction_sync(t));
+    // half of the keys in SSTs, half in the memtable
+    if (round == 0) {
+      db->compact();
+    }
+  }
+  for (auto prefix : {"A", "B", "C"}) {
+    bufferlist v;
+    ASSERT_EQ(0, db->get(prefix, "555", &v));
+    ASSERT_EQ("555", v.to_str());
+    ASSERT_EQ(-ENOENT, db->get(prefix, "55", &v));
+    // crosses key prefixes, with and without an upper bound
+    KeyValueDB::Iterator it = db->get_iterator(prefix);
+    ASSERT_EQ(0, it->lower_bound("289"));
+    for (int pos = 289; pos <= 999; pos++) {
+      ASSERT_TRUE(it->valid());
+      ASSERT_EQ(to_string(pos), it->key());
+      it->next();
+    }
+    ASSERT_FALSE(it->valid());
+    it = db->get_iterator(prefix, 0, KeyValueDB::IteratorBounds{"31", "32"});
+    ASSERT_EQ(0, it->lower_bound("31"));
+    for (int pos = 310; pos <= 319; pos++) {
+      ASSERT_TRUE(it->valid());
+      ASSERT_EQ(to_string(pos), it->key());
+      it->next();
+    }
+    ASSERT_TRUE(!it->valid() || it->key() >= "32");
+  }
+  fini();
+
+  db.reset(KeyValueDB::create(
+    g_ceph_context, "rocksdb", "kv_test_temp_dir",
+    {{"cf_filters", "A={type=cuckoo}"}}));
+  ASSERT_EQ(0, db->init(g_conf()->bluestore_rocksdb_options));
+  ASSERT_NE(0, db->open(cout));
+  fini();
+}
+
 TEST_P(KVTest, RocksDBCFMerge) {
   if(string(GetParam()) != "rocksdb")
     return;
@@ -1284,6 +1463,77 @@ TEST_F(RocksDBResharding, change_reshard) {
   }
 }
 
+TEST_F(RocksDBResharding, online) {
+  ASSERT_EQ(0, db->create_and_open(cout, "Evade(2)"));
+  generate_data();
+  data_to_db();
+  // only one column may change
+  ASSERT_EQ(db->start_online_reshard("Evade(3) D(2)"), -EINVAL);
+  ASSERT_EQ(db->start_online_reshard("Evade(2)"), -EINVAL);
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("rocksdb_online_reshard_bytes_per_sec", "0");
+  conf.ApplyChanges();
+  ASSERT_EQ(db->start_online_reshard("Evade(5)"), 0);
+  // overwrite while keys move
+  for (auto& d : data) {
+    string prefix;
+    string key;
+    RocksDBStore::split_key(d.first, &prefix, &key);
+    if (prefix == "Evade") {
+      d.second += "x";
+    }
+  }
+  data_to_db();
+  check_db();
+  for (int i = 0; i < 600 && db->is_online_resharding(); i++) {
+    usleep(100000);
+  }
+  ASSERT_FALSE(db->is_online_resharding());
+  check_db();
+  std::string sharding;
+  ASSERT_TRUE(db->get_sharding(sharding));
+  ASSERT_EQ(sharding, "Evade(5)");
+  db->close();
+  ASSERT_EQ(db->open(cout), 0);
+  check_db();
+  db->close();
+}
+
+TEST_F(RocksDBResharding, online_interrupted) {
+  ASSERT_EQ(0, db->create_and_open(cout, "Evade(4)"));
+  generate_data();
+  data_to_db();
+  // slow enough for close() to catch it half way
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("rocksdb_online_reshard_bytes_per_sec", "1024");
+  conf.SetVal("rocksdb_online_reshard_keys_per_batch", "16");
+  conf.ApplyChanges();
+  ASSERT_EQ(db->start_online_reshard("Evade(1)"), 0);
+  usleep(200000);
+  ASSERT_TRUE(db->is_online_resharding());
+  check_db();
+  db->close();
+  // offline resharding has to wait for it
+  ASSERT_EQ(db->reshard("Evade(2)"), -EBUSY);
+
+  conf.SetVal("rocksdb_online_reshard_bytes_per_sec", "0");
+  conf.SetVal("rocksdb_online_reshard_keys_per_batch", "256");
+  conf.ApplyChanges();
+  ASSERT_EQ(db->open(cout), 0);
+  check_db();
+  clear_db();
+  generate_data();
+  data_to_db();
+  for (int i = 0; i < 600 && db->is_online_resharding(); i++) {
+    usleep(100000);
+  }
+  ASSERT_FALSE(db->is_online_resharding());
+  check_db();
+  db->close();
+  ASSERT_EQ(db->open(cout), 0);
+  check_db();
+  db->close();
+}
 
 INSTANTIATE_TEST_SUITE_P(
   KeyValueDB,
@@ -7,6 +7,7 @@
 #include "global/global_context.h"
 #include "global/global_init.h"
 #include "common/common_init.h"
+#include "common/Formatter.h"
 
 #include "osd/scheduler/mClockScheduler.h"
 #include "osd/scheduler/OpSchedulerItem.h"
@@ -55,10 +56,16 @@ public:
 
   struct MockDmclockItem : public PGOpQueueable {
     op_scheduler_class scheduler_class;
+    std::string qos_tag;
+    std::string qos_entity;
 
-    MockDmclockItem(op_scheduler_class _scheduler_class) :
+    MockDmclockItem(op_scheduler_class _scheduler_class,
+		    std::string _qos_tag = std::string(),
+		    std::string _qos_entity = std::string()) :
       PGOpQueueable(spg_t()),
-      scheduler_class(_scheduler_class) {}
+      scheduler_class(_scheduler_class),
+      qos_tag(std::move(_qos_tag)),
+      qos_entity(std::move(_qos_entity)) {}
 
     MockDmclockItem()
       : MockDmclockItem(op_scheduler_class::background_best_effort) {}
@@ -77,6 +84,14 @@ public:
       return scheduler_class;
     }
 
+    std::string_view get_qos_tag() const final {
+      return qos_tag;
+    }
+
+    std::string_view get_qos_entity() const final {
+      return qos_entity;
+    }
+
     void run(OSD *osd, OSDShard *sdata, PGRef& pg, ThreadPool::TPHandle &handle) final {}
   };
 };
@@ -261,3 +276,290 @@ TEST_F(mClockSchedulerTest, TestAllQueuesEnqueueDequeue) {
 
   ASSERT_TRUE(q.empty());
 }
+
+TEST_F(mClockSchedulerTest, TestClientProfiles) {
+  ASSERT_TRUE(q.empty());
+  auto &conf = g_ceph_context->_conf;
+  conf.set_val_or_die("osd_mclock_scheduler_client_qos_profiles",
+		      "light=0:1:0:client.a, heavy=0:4:0:client.a+client.b "
+		      "client.c=0:2:0 bogus=1:2");
+  conf.apply_changes(nullptr);
+
+  auto dump = [this] {
+    JSONFormatter f;
+    f.open_object_section("queue");
+    q.dump(f);
+    f.close_section();
+    std::ostringstream out;
+    f.flush(out);
+    return out.str();
+  };
+
+  // ops tagged heavy get four times the share of those tagged light
+  const unsigned NUM = 10;
+  for (unsigned i = 0; i < NUM; ++i) {
+    q.enqueue(create_item(i, client1, op_scheduler_class::client, "light",
+			  "client.a"));
+    q.enqueue(create_item(i, client2, op_scheduler_class::client, "heavy",
+			  "client.b"));
+    std::this_thread::sleep_for(std::chrono::microseconds(1));
+  }
+
+  auto out = dump();
+  ASSERT_NE(std::string::npos, out.find("\"client_profile_count\":3"));
+  ASSERT_NE(std::string::npos, out.find("\"client_count\":2"));
+
+  unsigned heavy = 0;
+  for (unsigned i = 0; i < 5; ++i) {
+    auto r = get_item(q.dequeue());
+    if (r.get_owner() == client2) {
+      ++heavy;
+    }
+  }
+  ASSERT_GE(heavy, 3u);
+
+  // each tag still sees its own ops in order
+  std::map<uint64_t, epoch_t> next = {{client1, 0}, {client2, 0}};
+  while (!q.empty()) {
+    auto r = get_item(q.dequeue());
+    ASSERT_LE(next[r.get_owner()], r.get_map_epoch());
+    next[r.get_owner()] = r.get_map_epoch();
+  }
+
+  // a tag is only honoured for the entities its profile allows, or for
+  // the entity it names: anyone else gets the default client profile
+  q.enqueue(create_item(0, client3, op_scheduler_class::client, "light",
+			"client.b"));
+  ASSERT_NE(std::string::npos, dump().find("\"client_count\":3"));
+  q.enqueue(create_item(1, client3, op_scheduler_class::client, "client.c",
+			"client.d"));
+  ASSERT_NE(std::string::npos, dump().find("\"client_count\":3"));
+  q.enqueue(create_item(2, client3, op_scheduler_class::client, "client.c",
+			"client.c"));
+  ASSERT_NE(std::string::npos, dump().find("\"client_count\":4"));
+  while (!q.empty()) {
+    q.dequeue();
+  }
+
+  conf.set_val_or_die("osd_mclock_scheduler_client_qos_profiles", "");
+  conf.apply_changes(nullptr);
+}
+
+// ops against a device that takes 20us plus 0.5ns per byte, i.e. a random
+// IO costs as much as 40000 sequential bytes
+static void feed_device(mClockCapacityEstimator &est, unsigned ops_per_size,
+			bool saturated)
+{
+  for (uint64_t size : {4096, 65536, 1048576}) {
+    auto serviced = ceph::timespan(20000 + size / 2);
+    auto queued = saturated ? 2 * serviced : ceph::timespan::zero();
+    for (unsigned i = 0; i < ops_per_size; ++i) {
+      est.note_op(size, queued, serviced);
+    }
+  }
+}
+
+TEST(mClockCapacityEstimator, Calibrate) {
+  auto &conf = g_ceph_context->_conf;
+  mClockCapacityEstimator est(g_ceph_context, false);
+  double bandwidth = 0, iops = 0;
+  auto now = ceph::mono_clock::now();
+  ASSERT_FALSE(est.update(now));
+  ASSERT_FALSE(est.get_capacity(&bandwidth, &iops));
+
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "true");
+  conf.set_val_or_die("osd_mclock_capacity_calibration_interval", "1");
+  conf.apply_changes(nullptr);
+  auto generation = est.get_generation();
+  ASSERT_TRUE(est.update(now));
+  ASSERT_NE(generation, est.get_generation());
+  ASSERT_TRUE(est.get_capacity(&bandwidth, &iops));
+  const double configured_bandwidth = bandwidth;
+  const double configured_cost_per_io = bandwidth / iops;
+  ASSERT_NEAR(21500, iops, 0.01);
+
+  // nothing happens before the interval is up
+  feed_device(est, 1000, true);
+  ASSERT_FALSE(est.update(now + std::chrono::milliseconds(500)));
+
+  // the estimates move part of the way, by bounded steps
+  now += std::chrono::seconds(1);
+  ASSERT_TRUE(est.update(now));
+  ASSERT_TRUE(est.get_capacity(&bandwidth, &iops));
+  ASSERT_NEAR(configured_cost_per_io - 0.25 * (configured_cost_per_io - 40000),
+	      bandwidth / iops, 1);
+  ASSERT_LE(bandwidth, 1.1 * configured_bandwidth);
+
+  for (unsigned i = 0; i < 60; ++i) {
+    feed_device(est, 1000, true);
+    now += std::chrono::seconds(1);
+    est.update(now);
+  }
+  ASSERT_TRUE(est.get_capacity(&bandwidth, &iops));
+  ASSERT_NEAR(40000, bandwidth / iops, 400);
+  const double expected_bandwidth =
+    1000 * (4096 + 65536 + 1048576) + 3000 * 40000;
+  ASSERT_NEAR(expected_bandwidth, bandwidth, 0.01 * expected_bandwidth);
+
+  // an idle device says nothing about its bandwidth
+  const double saturated_bandwidth = bandwidth;
+  feed_device(est, 100, false);
+  now += std::chrono::seconds(1);
+  est.update(now);
+  ASSERT_TRUE(est.get_capacity(&bandwidth, &iops));
+  ASSERT_EQ(saturated_bandwidth, bandwidth);
+
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "false");
+  conf.rm_val("osd_mclock_capacity_calibration_interval");
+  conf.apply_changes(nullptr);
+  ASSERT_TRUE(est.update(now));
+  ASSERT_FALSE(est.get_capacity(&bandwidth, &iops));
+}
+
+TEST(mClockCapacityEstimator, HeldByLimit) {
+  auto &conf = g_ceph_context->_conf;
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "true");
+  conf.set_val_or_die("osd_mclock_capacity_calibration_interval", "1");
+  conf.apply_changes(nullptr);
+
+  // a client limited to far less than the device can do, its ops queueing
+  // up at mClock as if the device were saturated
+  mClockCapacityEstimator est(g_ceph_context, false), held(g_ceph_context, false);
+  auto now = ceph::mono_clock::now();
+  ASSERT_TRUE(est.update(now));
+  ASSERT_TRUE(held.update(now));
+  double bandwidth = 0, iops = 0;
+  ASSERT_TRUE(held.get_capacity(&bandwidth, &iops));
+  const double configured_bandwidth = bandwidth;
+  for (unsigned i = 0; i < 10; ++i) {
+    feed_device(est, 30, true);
+    feed_device(held, 30, true);
+    held.note_held();
+    now += std::chrono::seconds(1);
+    est.update(now);
+    held.update(now);
+  }
+
+  // taken at face value, the limit becomes the capacity
+  ASSERT_TRUE(est.get_capacity(&bandwidth, &iops));
+  ASSERT_LT(bandwidth, 0.5 * configured_bandwidth);
+  // but not once mClock says it held the ops back
+  ASSERT_TRUE(held.get_capacity(&bandwidth, &iops));
+  ASSERT_EQ(configured_bandwidth, bandwidth);
+
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "false");
+  conf.rm_val("osd_mclock_capacity_calibration_interval");
+  conf.apply_changes(nullptr);
+}
+
+TEST(mClockCapacityEstimator, Background) {
+  auto &conf = g_ceph_context->_conf;
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "true");
+  conf.set_val_or_die("osd_mclock_capacity_calibration_interval", "1");
+  conf.apply_changes(nullptr);
+
+  // a few client ops queueing behind recovery that keeps the device busy
+  mClockCapacityEstimator est(g_ceph_context, false), bg(g_ceph_context, false);
+  auto now = ceph::mono_clock::now();
+  ASSERT_TRUE(est.update(now));
+  ASSERT_TRUE(bg.update(now));
+  double bandwidth = 0, iops = 0;
+  ASSERT_TRUE(bg.get_capacity(&bandwidth, &iops));
+  const double configured_bandwidth = bandwidth;
+  for (unsigned i = 0; i < 10; ++i) {
+    feed_device(est, 30, true);
+    feed_device(bg, 30, true);
+    for (unsigned j = 0; j < 1200; ++j) {
+      bg.note_background(1048576);
+    }
+    now += std::chrono::seconds(1);
+    est.update(now);
+    bg.update(now);
+  }
+
+  // the client ops alone look like a slow device
+  ASSERT_TRUE(est.get_capacity(&bandwidth, &iops));
+  ASSERT_LT(bandwidth, 0.5 * configured_bandwidth);
+  // but the device served the recovery too
+  ASSERT_TRUE(bg.get_capacity(&bandwidth, &iops));
+  ASSERT_GE(bandwidth, configured_bandwidth);
+
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "false");
+  conf.rm_val("osd_mclock_capacity_calibration_interval");
+  conf.apply_changes(nullptr);
+}
+
+TEST_F(mClockSchedulerTest, TestCapacityCalibration) {
+  auto &conf = g_ceph_context->_conf;
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "true");
+  conf.set_val_or_die("osd_mclock_capacity_calibration_interval", "1");
+  conf.apply_changes(nullptr);
+
+  mClockCapacityEstimator est(g_ceph_context, is_rotational);
+  mClockScheduler cq(g_ceph_context, whoami, num_shards, shard_id,
+		     is_rotational, cutoff_priority, monc, &est);
+  const auto configured_cost_per_io = cq.calc_scaled_cost(1);
+
+  auto now = ceph::mono_clock::now();
+  est.update(now);
+  for (unsigned i = 0; i < 10; ++i) {
+    feed_device(est, 1000, true);
+    now += std::chrono::seconds(1);
+    est.update(now);
+  }
+
+  // the scheduler picks the new cost model up with its next op
+  ASSERT_EQ(configured_cost_per_io, cq.calc_scaled_cost(1));
+  cq.enqueue(create_item(1, client1, op_scheduler_class::client));
+  double bandwidth, iops;
+  ASSERT_TRUE(est.get_capacity(&bandwidth, &iops));
+  ASSERT_EQ(static_cast<uint32_t>(
+	      static_cast<double>(static_cast<uint64_t>(bandwidth)) / iops),
+	    cq.calc_scaled_cost(1));
+  ASSERT_LT(cq.calc_scaled_cost(1), configured_cost_per_io);
+  get_item(cq.dequeue());
+  ASSERT_TRUE(cq.empty());
+
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "false");
+  conf.rm_val("osd_mclock_capacity_calibration_interval");
+  conf.apply_changes(nullptr);
+}
+
+TEST_F(mClockSchedulerTest, TestCapacityHeldByLimit) {
+  auto &conf = g_ceph_context->_conf;
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "true");
+  conf.set_val_or_die("osd_mclock_capacity_calibration_interval", "1");
+  conf.set_val_or_die("osd_mclock_scheduler_client_qos_profiles",
+		      "limited=0:1:0.01:*");
+  conf.apply_changes(nullptr);
+
+  mClockCapacityEstimator est(g_ceph_context, is_rotational);
+  mClockScheduler cq(g_ceph_context, whoami, num_shards, shard_id,
+		     is_rotational, cutoff_priority, monc, &est);
+  auto now = ceph::mono_clock::now();
+  est.update(now);
+  double bandwidth, iops;
+  ASSERT_TRUE(est.get_capacity(&bandwidth, &iops));
+  const double configured_bandwidth = bandwidth;
+
+  // the limit holds all but the first op back
+  for (unsigned i = 0; i < 10; ++i) {
+    cq.enqueue(create_item(i, client1, op_scheduler_class::client, "limited",
+			   "client.a"));
+  }
+  get_item(cq.dequeue());
+  ASSERT_TRUE(std::holds_alternative<double>(cq.dequeue()));
+
+  // and the ops it completes, however long they queued, do not shrink
+  // the estimate
+  feed_device(est, 30, true);
+  now += std::chrono::seconds(1);
+  est.update(now);
+  ASSERT_TRUE(est.get_capacity(&bandwidth, &iops));
+  ASSERT_EQ(configured_bandwidth, bandwidth);
+
+  conf.set_val_or_die("osd_mclock_capacity_calibration", "false");
+  conf.rm_val("osd_mclock_capacity_calibration_interval");
+  conf.set_val_or_die("osd_mclock_scheduler_client_qos_profiles", "");
+  conf.apply_changes(nullptr);
+}
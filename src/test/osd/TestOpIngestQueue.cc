@@ -0,0 +1,103 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "osd/scheduler/OpIngestQueue.h"
+#include "osd/scheduler/OpSchedulerItem.h"
+
+using namespace ceph::osd::scheduler;
+
+struct MockItem : public PGOpQueueable {
+  MockItem() : PGOpQueueable(spg_t()) {}
+
+  ostream &print(ostream &rhs) const final { return rhs; }
+
+  std::string print() const final {
+    return std::string();
+  }
+
+  std::optional<OpRequestRef> maybe_get_op() const final {
+    return std::nullopt;
+  }
+
+  op_scheduler_class get_scheduler_class() const final {
+    return op_scheduler_class::client;
+  }
+
+  void run(OSD *osd, OSDShard *sdata, PGRef& pg, ThreadPool::TPHandle &handle) final {}
+};
+
+// owner and epoch carry the producer and sequence number
+static OpSchedulerItem create_item(uint64_t owner, epoch_t e)
+{
+  return OpSchedulerItem(std::make_unique<MockItem>(), 12, 12, utime_t(),
+			 owner, e);
+}
+
+TEST(OpIngestQueue, Empty) {
+  OpIngestQueue q;
+  ASSERT_TRUE(q.empty());
+  ASSERT_FALSE(q.pop());
+
+  q.push(create_item(1, 1));
+  ASSERT_FALSE(q.empty());
+  ASSERT_EQ(1, q.size());
+  auto item = q.pop();
+  ASSERT_TRUE(item);
+  ASSERT_EQ(1u, item->get_map_epoch());
+  ASSERT_TRUE(q.empty());
+  ASSERT_FALSE(q.pop());
+}
+
+TEST(OpIngestQueue, Fifo) {
+  OpIngestQueue q;
+  for (unsigned round = 0; round < 3; ++round) {
+    for (epoch_t e = 1; e <= 10; ++e) {
+      q.push(create_item(1, e));
+    }
+    for (epoch_t e = 1; e <= 10; ++e) {
+      auto item = q.pop();
+      ASSERT_TRUE(item);
+      ASSERT_EQ(e, item->get_map_epoch());
+    }
+    ASSERT_TRUE(q.empty());
+  }
+  // whatever is left is freed with the queue
+  q.push(create_item(1, 1));
+}
+
+TEST(OpIngestQueue, Producers) {
+  OpIngestQueue q;
+  const unsigned producers = 4;
+  const epoch_t per_producer = 100000;
+  std::vector<std::thread> threads;
+  for (unsigned p = 0; p < producers; ++p) {
+    threads.emplace_back([&q, p] {
+      for (epoch_t e = 1; e <= per_producer; ++e) {
+	q.push(create_item(p, e));
+      }
+    });
+  }
+  // each producer's ops come out in the order it pushed them
+  std::vector<epoch_t> last(producers, 0);
+  uint64_t popped = 0;
+  while (popped < producers * per_producer) {
+    auto item = q.pop();
+    if (!item) {
+      continue;
+    }
+    auto p = item->get_owner();
+    ASSERT_LT(p, producers);
+    ASSERT_EQ(last[p] + 1, item->get_map_epoch());
+    last[p] = item->get_map_epoch();
+    ++popped;
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_TRUE(q.empty());
+  ASSERT_FALSE(q.pop());
+}